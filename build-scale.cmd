@@ -0,0 +1,7 @@
+@echo off
+if not exist "precompiled-headers/pch.h.gch" (
+  echo Compiling headers
+  gcc -o precompiled-headers/pch.h.gch src/pch.h
+)
+echo Compiling scalability harness...
+gcc -O3 -Wall -Wfatal-errors -I precompiled-headers -o scale.exe src/scale.c -lm && scale.exe %*
\ No newline at end of file
@@ -0,0 +1,8 @@
+start:
+  print a, '\n'
+  inc a
+  cmp a, 3
+  jge done
+  call start
+done:
+  end
@@ -0,0 +1,36 @@
+; Same as fib.asm, but fib_iter saves the registers it uses
+; with a single 'enter'/'leave' pair instead of four push/pop.
+mov b, 20
+mov i, 1
+loop:
+  mov a, i
+  call fib_iter
+  print 'fib(', i, ') = ', z, '\n'
+  inc i
+  cmp i, b
+  jle loop
+
+end
+
+fib_iter:
+  enter i, r ; saves i, j, k, l, m, n, o, p, q, r
+
+  mov i, a
+  mov n, 0
+  mov r, 1
+
+fib_iter_loop:
+  cmp i, 0
+  jle fib_iter_end
+  dec i
+
+  mov l, r
+  add r, n
+  mov n, l
+  jmp fib_iter_loop
+
+fib_iter_end:
+  mov z, r
+
+  leave i, r
+  ret
\ No newline at end of file
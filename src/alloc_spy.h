@@ -1,122 +1,340 @@
 #ifndef __ALLOC_SPY_H__
 #define __ALLOC_SPY_H__
 
+// Allocation profiler, built in with -DALLOC_SPY (or the #define below).
+// pch.h includes this first, so it sees the allocations of everything.
+//
+// malloc, calloc, realloc and free become wrappers that count, for each
+// call site (file:line) and for each phase (PERF_START/PERF_STOP, see
+// pch.h): the allocations, reallocs and frees, the bytes allocated, the
+// bytes still live and the most that were live at once. The report goes
+// to stderr at exit (or when alloc_spy_report is called).
+//
+// Each block gets a header in front with its size, its site and its phase,
+// so free knows what to take back without looking anything up. Blocks that
+// don't have it (from libc, e.g. open_memstream) are passed through as they
+// are. Stretchy buffers grow through the realloc wrapper too, counted at
+// the sb_push/sb_add that made them grow.
+//
+// Sites are found with a hash of file:line. Phases are a stack, an
+// allocation goes to the innermost one.
+
 //#define ALLOC_SPY
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
 #include "stretchy_buffer.h"
 
 #ifdef ALLOC_SPY
 
-typedef struct allocation {
-  const char* size_expr;
-  size_t size;
+typedef struct alloc_spy_stats {
+  uint64_t allocs;
+  uint64_t reallocs;
+  uint64_t frees;
+  uint64_t bytes; // allocated, a realloc adds its new size
+  uint64_t live;
+  uint64_t peak; // of live
+} alloc_spy_stats;
+
+typedef struct alloc_spy_site {
+  const char* file;
   int line;
-  int count;
-  enum type {
-    ALLOC_TYPE_MALLOC,
-    ALLOC_TYPE_CALLOC
-  } type;
-} allocation;
-
-typedef struct allocation_file {
-  const char* name;
-  size_t total;
-  allocation** allocations;
-} allocation_file;
-
-static allocation_file** allocation_files = NULL;
-static size_t total_allocated = 0;
-
-static allocation_file* get_allocation_file(const char* name) {
-  // TODO: hash lookup
-  for (int i = 0, n = sb_count(allocation_files); i < n; i++) {
-    allocation_file* f = allocation_files[i];
-    if (f->name == name) {
-      return f;
-    }
+  const char* expr; // e.g. "malloc(sizeof(token))"
+  alloc_spy_stats stats;
+} alloc_spy_site;
+
+// In front of each block, 16 bytes so the block keeps malloc's alignment
+typedef struct alloc_spy_header {
+  uint64_t size;
+  uint32_t site;
+  uint16_t phase;
+  uint16_t magic;
+} alloc_spy_header;
+
+#define ALLOC_SPY_MAGIC 0xa11c
+#define ALLOC_SPY_MAX_PHASES 32
+#define ALLOC_SPY_MAX_DEPTH 16
+
+typedef struct alloc_spy_state {
+  alloc_spy_site* sites;
+  uint32_t num_sites;
+  uint32_t cap_sites;
+  // Open addressing, site index + 1 (0 = empty)
+  uint32_t* slots;
+  uint32_t num_slots;
+
+  // Phase 0 is everything outside of them
+  const char* phase_names[ALLOC_SPY_MAX_PHASES];
+  alloc_spy_stats phases[ALLOC_SPY_MAX_PHASES];
+  int num_phases;
+  int stack[ALLOC_SPY_MAX_DEPTH];
+  int depth;
+
+  alloc_spy_stats total;
+  bool reported;
+} alloc_spy_state;
+
+static alloc_spy_state alloc_spy = { .phase_names = { "(none)" }, .num_phases = 1 };
+
+void alloc_spy_report();
+
+static void alloc_spy_report_at_exit(void) {
+  if (!alloc_spy.reported) alloc_spy_report();
+}
+
+static inline uint32_t alloc_spy_hash(const char* file, int line) {
+  uint64_t h = ((uint64_t) (uintptr_t) file ^ ((uint64_t) line << 32)) * 0x9e3779b97f4a7c15ull;
+  return (uint32_t) (h >> 32);
+}
+
+static void alloc_spy_rehash(uint32_t num_slots) {
+  uint32_t* slots = (uint32_t*) calloc(num_slots, sizeof(uint32_t));
+  if (!slots) {
+    printf("failed to alloc memory for the alloc spy\n");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < alloc_spy.num_sites; i++) {
+    alloc_spy_site* site = &alloc_spy.sites[i];
+    uint32_t slot = alloc_spy_hash(site->file, site->line) & (num_slots - 1);
+    while (slots[slot]) slot = (slot + 1) & (num_slots - 1);
+    slots[slot] = i + 1;
   }
-  return NULL;
+  free(alloc_spy.slots);
+  alloc_spy.slots = slots;
+  alloc_spy.num_slots = num_slots;
 }
 
-// This will not work if the same line contains more than one malloc
-static allocation* get_allocation_by_line(allocation_file* af, int line) {
-  // TODO: hash lookup
-  for (int i = 0, n = sb_count(af->allocations); i < n; i++) {
-    allocation* al = af->allocations[i];
-    if (al->line == line) {
-      return al;
+// The site of file:line, added the first time. 'file' is __FILE__, the
+// same pointer for all the calls from a file.
+static uint32_t alloc_spy_site_of(const char* file, int line, const char* expr) {
+  if (alloc_spy.num_slots) {
+    uint32_t slot = alloc_spy_hash(file, line) & (alloc_spy.num_slots - 1);
+    for (uint32_t i; (i = alloc_spy.slots[slot]) != 0; slot = (slot + 1) & (alloc_spy.num_slots - 1)) {
+      alloc_spy_site* site = &alloc_spy.sites[i - 1];
+      if (site->line == line && (site->file == file || strcmp(site->file, file) == 0)) return i - 1;
     }
+  } else {
+    atexit(alloc_spy_report_at_exit);
   }
-  return NULL;
-}
 
-void alloc_spy_report() {
-  printf("## AllocSpy Report (total: %I64d) {\n", total_allocated);
-  for (int i = 0, n = sb_count(allocation_files); i < n; i++) {
-    allocation_file* af = allocation_files[i];
-    printf("  %s (total: %I64d) {\n", af->name, af->total);
-    for (int j = 0, n2 = sb_count(af->allocations); j < n2; j++) {
-      allocation* al = af->allocations[j];
-      printf("   line %4d: malloc(%s) | size=%I64d | count=%d | total %I64d bytes\n",
-        al->line, al->size_expr, al->size, al->count, al->size * al->count);
+  if (alloc_spy.num_sites == alloc_spy.cap_sites) {
+    uint32_t cap = alloc_spy.cap_sites ? alloc_spy.cap_sites * 2 : 256;
+    alloc_spy_site* sites = (alloc_spy_site*) realloc(alloc_spy.sites, cap * sizeof(alloc_spy_site));
+    if (!sites) {
+      printf("failed to alloc memory for the alloc spy\n");
+      exit(1);
     }
-    printf("  }\n");
+    alloc_spy.sites = sites;
+    alloc_spy.cap_sites = cap;
   }
-  printf("}\n");
+  uint32_t index = alloc_spy.num_sites++;
+  alloc_spy_site* site = &alloc_spy.sites[index];
+  memset(site, 0, sizeof(*site));
+  site->file = file;
+  site->line = line;
+  site->expr = expr;
+
+  // At most half full
+  if (alloc_spy.num_sites * 2 > alloc_spy.num_slots) {
+    alloc_spy_rehash(alloc_spy.num_slots ? alloc_spy.num_slots * 2 : 1024);
+  } else {
+    uint32_t slot = alloc_spy_hash(file, line) & (alloc_spy.num_slots - 1);
+    while (alloc_spy.slots[slot]) slot = (slot + 1) & (alloc_spy.num_slots - 1);
+    alloc_spy.slots[slot] = index + 1;
+  }
+  return index;
 }
 
-void freeWrapper(void* ptr, const char* file, int line) {
-  printf("[%s:%d] free(%p)\n", file, line, ptr);
-  free(ptr);
+static inline void alloc_spy_stats_add(alloc_spy_stats* s, uint64_t size, bool is_realloc) {
+  if (is_realloc) s->reallocs++;
+  else s->allocs++;
+  s->bytes += size;
+  s->live += size;
+  if (s->live > s->peak) s->peak = s->live;
 }
 
-void* mallocWrapper(size_t sz, const char* file, int line, const char* sz_expr)  {
-  {
-    allocation_file* af = get_allocation_file(file);
-    if (af == NULL) {
-      af = (allocation_file*) malloc(sizeof(allocation_file));
-      af->name = file;
-      af->total = 0;
-      af->allocations = NULL;
-      sb_push(allocation_files, af);
-    }
+// Starts counting the block of 'h', allocated at 'site' in the current phase
+static void* alloc_spy_track(alloc_spy_header* h, uint64_t size, uint32_t site, bool is_realloc) {
+  h->size = size;
+  h->site = site;
+  h->phase = (uint16_t) (alloc_spy.depth ? alloc_spy.stack[alloc_spy.depth - 1] : 0);
+  h->magic = ALLOC_SPY_MAGIC;
+  alloc_spy_stats_add(&alloc_spy.sites[site].stats, size, is_realloc);
+  alloc_spy_stats_add(&alloc_spy.phases[h->phase], size, is_realloc);
+  alloc_spy_stats_add(&alloc_spy.total, size, is_realloc);
+  return h + 1;
+}
+
+// Stops counting the block of 'h', freed (or moved by realloc)
+static void alloc_spy_untrack(alloc_spy_header* h, bool is_free) {
+  alloc_spy_stats* stats[] = { &alloc_spy.sites[h->site].stats, &alloc_spy.phases[h->phase], &alloc_spy.total };
+  for (int i = 0; i < 3; i++) {
+    stats[i]->live -= h->size;
+    if (is_free) stats[i]->frees++;
+  }
+  h->magic = 0;
+}
 
-    allocation* al = get_allocation_by_line(af, line);
-    if (al == NULL) {
-      al = (allocation*) malloc(sizeof(allocation));
-      al->line = line;
-      al->count = 0;
-      al->size = sz;
-      al->size_expr = sz_expr;
-      al->type = ALLOC_TYPE_MALLOC;
+// The header of 'ptr', NULL if it's not one of ours
+static inline alloc_spy_header* alloc_spy_header_of(void* ptr) {
+  alloc_spy_header* h = (alloc_spy_header*) ptr - 1;
+  return ptr && h->magic == ALLOC_SPY_MAGIC ? h : NULL;
+}
+
+void* alloc_spy_malloc(size_t size, const char* file, int line, const char* expr) {
+  alloc_spy_header* h = (alloc_spy_header*) malloc(sizeof(alloc_spy_header) + size);
+  if (!h) return NULL;
+  return alloc_spy_track(h, size, alloc_spy_site_of(file, line, expr), false);
+}
 
-      sb_push(af->allocations, al);
+void* alloc_spy_calloc(size_t num, size_t size, const char* file, int line, const char* expr) {
+  if (size && num > (SIZE_MAX - sizeof(alloc_spy_header)) / size) return NULL;
+  alloc_spy_header* h = (alloc_spy_header*) calloc(1, sizeof(alloc_spy_header) + num * size);
+  if (!h) return NULL;
+  return alloc_spy_track(h, num * size, alloc_spy_site_of(file, line, expr), false);
+}
+
+void alloc_spy_free(void* ptr) {
+  alloc_spy_header* h = alloc_spy_header_of(ptr);
+  if (!h) {
+    free(ptr);
+    return;
+  }
+  alloc_spy_untrack(h, true);
+  free(h);
+}
+
+void* alloc_spy_realloc(void* ptr, size_t size, const char* file, int line, const char* expr) {
+  if (!ptr) return alloc_spy_malloc(size, file, line, expr);
+  alloc_spy_header* h = alloc_spy_header_of(ptr);
+  if (!h) return realloc(ptr, size);
+  if (size == 0) {
+    alloc_spy_free(ptr);
+    return NULL;
+  }
+
+  alloc_spy_header old = *h;
+  alloc_spy_untrack(h, false);
+  alloc_spy_header* moved = (alloc_spy_header*) realloc(h, sizeof(alloc_spy_header) + size);
+  if (!moved) {
+    // Still there as it was
+    *h = old;
+    alloc_spy_stats* stats[] = { &alloc_spy.sites[h->site].stats, &alloc_spy.phases[h->phase], &alloc_spy.total };
+    for (int i = 0; i < 3; i++) stats[i]->live += h->size;
+    return NULL;
+  }
+  return alloc_spy_track(moved, size, alloc_spy_site_of(file, line, expr), true);
+}
+
+// stb__sbgrowf with the realloc counted at the caller of sb_push/sb_add
+static void* alloc_spy_sbgrowf(void* arr, int increment, int itemsize, const char* file, int line) {
+  (void) stb__sbgrowf; // replaced by this one
+  int dbl_cur = arr ? 2 * stb__sbm(arr) : 0;
+  int min_needed = stb_sb_count(arr) + increment;
+  int m = dbl_cur > min_needed ? dbl_cur : min_needed;
+  int* p = (int*) alloc_spy_realloc(arr ? stb__sbraw(arr) : 0, itemsize * m + sizeof(int) * 2, file, line, "stretchy buffer");
+  if (!p) return (void*) (2 * sizeof(int)); // as stb__sbgrowf
+  if (!arr) p[1] = 0;
+  p[0] = m;
+  return p + 2;
+}
+
+// PERF_START(name), see pch.h
+void alloc_spy_phase_begin(const char* name) {
+  int phase = 1;
+  while (phase < alloc_spy.num_phases && strcmp(alloc_spy.phase_names[phase], name) != 0) phase++;
+  if (phase == alloc_spy.num_phases) {
+    if (phase == ALLOC_SPY_MAX_PHASES) phase = 0; // too many, they go to (none)
+    else alloc_spy.phase_names[alloc_spy.num_phases++] = name;
+  }
+  if (alloc_spy.depth < ALLOC_SPY_MAX_DEPTH) alloc_spy.stack[alloc_spy.depth] = phase;
+  alloc_spy.depth++;
+}
+
+// PERF_STOP(name). Closes the phases started after it too, in case they
+// weren't (e.g. an early return between PERF_START and PERF_STOP).
+void alloc_spy_phase_end(const char* name) {
+  for (int d = alloc_spy.depth - 1; d >= 0; d--) {
+    if (d < ALLOC_SPY_MAX_DEPTH && strcmp(alloc_spy.phase_names[alloc_spy.stack[d]], name) == 0) {
+      alloc_spy.depth = d;
+      return;
     }
-    al->count += 1;
-    af->total += sz;
-    total_allocated += sz;
   }
+}
 
-  void* data = malloc(sz);
-  //printf("[%s:%d] Allocated %I64d bytes: malloc(%s)\n", file, line, sz, sz_expr);
-  return data;
+static void alloc_spy_print_stats(FILE* out, alloc_spy_stats* s) {
+  fprintf(out, " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64,
+    s->allocs, s->reallocs, s->frees, s->bytes, s->peak, s->live);
 }
 
-void* callocWrapper(size_t num, size_t sz, const char* file, int line,
-                    const char* num_expr, const char* sz_expr)  {
-  void* data = calloc(num, sz);
-  printf("TODO [%s:%d] Allocated %I64d bytes: calloc(%s)\n", file, line, sz, sz_expr);
-  return data;
+// Most bytes live at once first
+static int alloc_spy_site_cmp(const void* a, const void* b) {
+  const alloc_spy_stats* sa = &alloc_spy.sites[*(const uint32_t*) a].stats;
+  const alloc_spy_stats* sb = &alloc_spy.sites[*(const uint32_t*) b].stats;
+  if (sa->peak != sb->peak) return sa->peak < sb->peak ? 1 : -1;
+  if (sa->bytes != sb->bytes) return sa->bytes < sb->bytes ? 1 : -1;
+  return 0;
 }
 
-#define free(ptr) freeWrapper(ptr, __FILE__, __LINE__)
-#define malloc(size) (mallocWrapper(size, __FILE__, __LINE__, #size))
-#define calloc(num, size) (callocWrapper(num, size, __FILE__, __LINE__, #num, #size))
+void alloc_spy_report() {
+  FILE* out = stderr;
+  alloc_spy_state* spy = &alloc_spy;
+  spy->reported = true;
+
+  fprintf(out, "## AllocSpy report (bytes; live = not freed yet, peak = most live at once)\n");
+  fprintf(out, "%-32s %10s %10s %10s %14s %14s %14s\n", "", "allocs", "reallocs", "frees", "allocated", "peak", "live");
+  fprintf(out, "%-32s", "total");
+  alloc_spy_print_stats(out, &spy->total);
+  fprintf(out, "\n\nBy phase:\n");
+  for (int i = 0; i < spy->num_phases; i++) {
+    if (spy->phases[i].allocs == 0 && spy->phases[i].reallocs == 0) continue;
+    fprintf(out, "%-32s", spy->phase_names[i]);
+    alloc_spy_print_stats(out, &spy->phases[i]);
+    fprintf(out, "\n");
+  }
+
+  fprintf(out, "\nBy site:\n");
+  uint32_t* order = (uint32_t*) malloc((spy->num_sites + 1) * sizeof(uint32_t));
+  if (!order) return;
+  for (uint32_t i = 0; i < spy->num_sites; i++) order[i] = i;
+  qsort(order, spy->num_sites, sizeof(uint32_t), alloc_spy_site_cmp);
+  for (uint32_t i = 0; i < spy->num_sites; i++) {
+    alloc_spy_site* site = &spy->sites[order[i]];
+    // Just the file name, __FILE__ may have a path
+    const char* name = site->file;
+    for (const char* c = site->file; *c; c++) {
+      if (*c == '/' || *c == '\\') name = c + 1;
+    }
+    char where[64];
+    snprintf(where, sizeof(where), "%s:%d", name, site->line);
+    fprintf(out, "%-32s", where);
+    alloc_spy_print_stats(out, &site->stats);
+    fprintf(out, "  %s\n", site->expr);
+  }
+  free(order);
+}
+
+#define ALLOC_SPY_PHASE_BEGIN(name) alloc_spy_phase_begin(name)
+#define ALLOC_SPY_PHASE_END(name) alloc_spy_phase_end(name)
+
+#undef stb__sbgrow
+#define stb__sbgrow(a,n) (*((void **)&(a)) = alloc_spy_sbgrowf((a), (n), sizeof(*(a)), __FILE__, __LINE__))
+
+#define free(ptr) alloc_spy_free(ptr)
+#define malloc(size) alloc_spy_malloc(size, __FILE__, __LINE__, "malloc(" #size ")")
+#define calloc(num, size) alloc_spy_calloc(num, size, __FILE__, __LINE__, "calloc(" #num ", " #size ")")
+#define realloc(ptr, size) alloc_spy_realloc(ptr, size, __FILE__, __LINE__, "realloc(" #ptr ", " #size ")")
 #else
+#define ALLOC_SPY_PHASE_BEGIN(name) ((void) 0)
+#define ALLOC_SPY_PHASE_END(name) ((void) 0)
+
 void alloc_spy_report() {
   // Do nothing
 }
 #endif // ALLOC_SPY
 
-#endif // __ALLOC_SPY_H__
\ No newline at end of file
+#endif // __ALLOC_SPY_H__
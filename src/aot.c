@@ -0,0 +1,286 @@
+#include "interp.h"
+
+// Ahead of time compilation (--aot). Needs genc.c.
+//
+// The program is translated with gen_c_shared, built into a shared object
+// by the system C compiler and loaded with dlopen. genc_run then runs on a
+// vm_state like the interpreter: the guest heap, stack and output buffers
+// are ours, and runtime errors are reported with vm_report_runtime_error.
+//
+// Objects are cached by a hash of the generated C and of the compiler
+// command, so a program is only compiled the first time it runs (or after
+// the generator, $CC or the flags change). The C file is kept next to its
+// object and compared before the object is reused.
+//
+// When anything goes wrong (no compiler, no cache dir, dlopen fails...) we
+// say so on stderr and run the program in the interpreter instead.
+
+#ifndef INC_WINDOWS
+  #include <dlfcn.h>
+  #include <errno.h>
+  #include <stdarg.h>
+  #include <sys/stat.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+#endif
+
+typedef int (*genc_run_fn)(genc_runtime* runtime);
+
+#define AOT_CFLAGS "-O2 -shared -fPIC"
+#define AOT_DIR_SIZE 1024
+// The dir, '/', the name (16 hex digits) and the longest suffix (".<pid>.so")
+#define AOT_PATH_SIZE (AOT_DIR_SIZE + 64)
+
+typedef struct aot_context {
+  program* prog;
+  vm_state* vm;
+} aot_context;
+
+static int64_t aot_malloc(void* ctx, int64_t size) {
+  return guest_heap_alloc(&((aot_context*) ctx)->vm->heap, size);
+}
+
+static int aot_free(void* ctx, int64_t addr) {
+  return guest_heap_free(&((aot_context*) ctx)->vm->heap, addr);
+}
+
+static void aot_print(void* ctx, const char* data, uint64_t len) {
+  output_write(&((aot_context*) ctx)->vm->out, data, len);
+}
+
+static void aot_msg(void* ctx, const char* data, uint64_t len) {
+  output_buffer* msg = &((aot_context*) ctx)->vm->msg;
+  msg->len = 0;
+  output_write(msg, data, len);
+}
+
+static void aot_error(void* ctx, int insn_index, int error, int64_t value) {
+  aot_context* aot = (aot_context*) ctx;
+  vm_report_runtime_error(aot->prog, aot->vm, insn_index, (runtime_error) error, value);
+}
+
+#ifndef INC_WINDOWS
+
+#define AOT_HASH_INIT 14695981039346656037ull
+
+// FNV-1a of 'data', continuing from 'h' (AOT_HASH_INIT to start).
+// 64 bits since it names files that live across runs.
+static uint64_t aot_hash(uint64_t h, const char* data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t) data[i]) * 1099511628211ull;
+  }
+  return h;
+}
+
+static bool aot_mkdir(const char* path) {
+  return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+// snprintf that says if it all fit
+static bool aot_format(char* buf, size_t size, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf, size, format, args);
+  va_end(args);
+  return n >= 0 && (size_t) n < size;
+}
+
+static const char* aot_cc(void) {
+  const char* cc = getenv("CC");
+  return cc == NULL || *cc == '\0' ? "cc" : cc;
+}
+
+// $INTERP_AOT_CACHE, $XDG_CACHE_HOME/interp-aot, ~/.cache/interp-aot
+// or /tmp/interp-aot-<uid>. Created if needed.
+static bool aot_cache_dir(char* buf, size_t size) {
+  const char* env;
+  bool fits;
+  if ((env = getenv("INTERP_AOT_CACHE")) != NULL && *env) {
+    fits = aot_format(buf, size, "%s", env);
+  } else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env) {
+    fits = aot_format(buf, size, "%s/interp-aot", env);
+  } else if ((env = getenv("HOME")) != NULL && *env) {
+    fits = aot_format(buf, size, "%s/.cache", env);
+    if (fits && !aot_mkdir(buf)) return false;
+    fits = fits && aot_format(buf, size, "%s/.cache/interp-aot", env);
+  } else {
+    fits = aot_format(buf, size, "/tmp/interp-aot-%d", (int) getuid());
+  }
+  if (!fits) {
+    fprintf(stderr, "aot: cache path too long\n");
+    return false;
+  }
+  // The paths end up in a shell command
+  if (strchr(buf, '\'') != NULL) return false;
+  return aot_mkdir(buf);
+}
+
+static bool aot_file_equals(const char* path, const char* data, size_t len) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) return false;
+
+  bool equals = true;
+  char buf[4096];
+  size_t pos = 0, n;
+  while (equals && (n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    equals = pos + n <= len && memcmp(buf, data + pos, n) == 0;
+    pos += n;
+  }
+  fclose(fp);
+  return equals && pos == len;
+}
+
+static bool aot_write_file(const char* path, const char* data, size_t len) {
+  FILE* fp = fopen(path, "wb");
+  if (!fp) return false;
+  bool ok = fwrite(data, 1, len, fp) == len;
+  return fclose(fp) == 0 && ok;
+}
+
+// Builds 'src' into '<dir>/<hash>.so'. Everything is done on temporary
+// files first, so concurrent runs never see a half written object.
+static bool aot_compile(const char* src, size_t src_len, const char* dir, const char* name) {
+  char c_path[AOT_PATH_SIZE], so_path[AOT_PATH_SIZE], tmp_c_path[AOT_PATH_SIZE], tmp_so_path[AOT_PATH_SIZE];
+  char log_path[AOT_PATH_SIZE];
+  int pid = (int) getpid();
+  if (!aot_format(c_path, sizeof(c_path), "%s/%s.c", dir, name)
+      || !aot_format(so_path, sizeof(so_path), "%s/%s.so", dir, name)
+      || !aot_format(tmp_c_path, sizeof(tmp_c_path), "%s/%s.%d.c", dir, name, pid)
+      || !aot_format(tmp_so_path, sizeof(tmp_so_path), "%s/%s.%d.so", dir, name, pid)
+      || !aot_format(log_path, sizeof(log_path), "%s/%s.log", dir, name)) {
+    fprintf(stderr, "aot: cache path too long\n");
+    return false;
+  }
+
+  const char* cc = aot_cc();
+  char cmd[4 * AOT_PATH_SIZE + 256];
+  if (!aot_format(cmd, sizeof(cmd), "%s " AOT_CFLAGS " -o '%s' '%s' > '%s' 2>&1",
+      cc, tmp_so_path, tmp_c_path, log_path)) {
+    fprintf(stderr, "aot: compiler command too long\n");
+    return false;
+  }
+
+  if (!aot_write_file(tmp_c_path, src, src_len)) {
+    fprintf(stderr, "aot: failed to write %s\n", tmp_c_path);
+    return false;
+  }
+
+  int status = system(cmd);
+  if (status != 0) {
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+      fprintf(stderr, "aot: C compiler '%s' not found\n", cc);
+    } else {
+      fprintf(stderr, "aot: '%s' failed, see %s\n", cc, log_path);
+    }
+    unlink(tmp_c_path);
+    unlink(tmp_so_path);
+    return false;
+  }
+
+  // The object first: a .c without its .so is just compiled again
+  if (rename(tmp_so_path, so_path) != 0 || rename(tmp_c_path, c_path) != 0) {
+    fprintf(stderr, "aot: failed to move the compiled program to %s\n", dir);
+    unlink(tmp_c_path);
+    unlink(tmp_so_path);
+    return false;
+  }
+  unlink(log_path);
+  return true;
+}
+
+// Returns genc_run for 'p', compiling it if it's not in the cache, or NULL.
+static genc_run_fn aot_load(program* p) {
+  char dir[AOT_DIR_SIZE];
+  if (!aot_cache_dir(dir, sizeof(dir))) {
+    fprintf(stderr, "aot: no usable cache directory\n");
+    return NULL;
+  }
+
+  char* src = NULL;
+  size_t src_len = 0;
+  FILE* mem = open_memstream(&src, &src_len);
+  if (!mem) return NULL;
+  gen_c_shared(p, mem);
+  fclose(mem);
+
+  // The same C built by another compiler, or with other flags, is another object
+  const char* cc = aot_cc();
+  uint64_t hash = aot_hash(AOT_HASH_INIT, src, src_len);
+  hash = aot_hash(hash, cc, strlen(cc) + 1);
+  hash = aot_hash(hash, AOT_CFLAGS, sizeof(AOT_CFLAGS));
+
+  char name[32];
+  snprintf(name, sizeof(name), "%016" PRIx64, hash);
+
+  char c_path[AOT_PATH_SIZE], so_path[AOT_PATH_SIZE];
+  if (!aot_format(c_path, sizeof(c_path), "%s/%s.c", dir, name)
+      || !aot_format(so_path, sizeof(so_path), "%s/%s.so", dir, name)) {
+    fprintf(stderr, "aot: cache path too long\n");
+    free(src);
+    return NULL;
+  }
+
+  bool cached = access(so_path, R_OK) == 0 && aot_file_equals(c_path, src, src_len);
+  bool ok = cached || aot_compile(src, src_len, dir, name);
+  free(src);
+  if (!ok) return NULL;
+
+  void* lib = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+  if (!lib) {
+    fprintf(stderr, "aot: %s\n", dlerror());
+    return NULL;
+  }
+  genc_run_fn run = (genc_run_fn) dlsym(lib, "genc_run");
+  if (!run) {
+    fprintf(stderr, "aot: %s\n", dlerror());
+    dlclose(lib);
+  }
+  return run;
+}
+
+#else
+
+static genc_run_fn aot_load(program* p) {
+  (void) p;
+  fprintf(stderr, "aot: not supported on this platform\n");
+  return NULL;
+}
+
+#endif // INC_WINDOWS
+
+// Runs 'run', the result of aot_load(p)
+static char* aot_run(program* p, genc_run_fn run) {
+  vm_state* vm = vm_create(p);
+  aot_context ctx = { p, vm };
+
+  // The compiled code checks the stack bounds itself
+  genc_runtime runtime;
+  runtime.ctx = &ctx;
+  runtime.stack = (int64_t*) vm->stack.base;
+  runtime.stack_size = (int64_t*) vm->stack.limit - (int64_t*) vm->stack.base;
+  runtime.heap_base = vm->heap.base;
+  runtime.heap_limit = guest_heap_access_limit(&vm->heap);
+  runtime.malloc_fn = aot_malloc;
+  runtime.free_fn = aot_free;
+  runtime.print_fn = aot_print;
+  runtime.msg_fn = aot_msg;
+  runtime.error_fn = aot_error;
+
+  PERF_START(program_run);
+  run(&runtime);
+  PERF_STOP(program_run);
+  return vm_destroy(vm);
+}
+
+// Like program_run, but runs the compiled program when possible.
+char* program_run_aot(program* p) {
+  // Generating, compiling (if not cached) and loading
+  PERF_START(aot_load);
+  genc_run_fn run = aot_load(p);
+  PERF_STOP(aot_load);
+  if (!run) {
+    fprintf(stderr, "aot: running in the interpreter\n");
+    return program_run(p);
+  }
+  return aot_run(p, run);
+}
@@ -0,0 +1,576 @@
+// Benchmark suite (build-bench.cmd).
+//
+// Runs every program in codes/ (or the files and directories given) plus a
+// few generated stress programs under each engine, 'runs' times each, and
+// prints the median and p95 run time and the guest instructions per second.
+// A program is loaded (lexed, parsed, built, checked and optimized) once per
+// engine, that time is shown apart since it doesn't depend on the runs.
+//
+// Instructions per second count the instructions of the program as written
+// (one -O0 run with the profiler), so the engines are compared on the same
+// work even though -O1 runs fewer of them.
+//
+// --save=<file> writes the results as JSON, one object per line:
+//
+//   {"name":"codes/fib.asm","engine":"O1","runs":5,"median_ns":...,...}
+//
+// and --baseline=<file> compares the medians with a file like that. A median
+// more than --threshold percent (default: 10) slower is a regression, and
+// the exit code is 1 if there's any.
+//
+// --counters adds the hardware counters of the runs (see perfctr.h), per
+// run, to the results.
+//
+// The guest's stdout goes to the null device while it runs.
+
+#include "pch.h"
+
+#include "lexer.h"
+#include "parser.h"
+#include "interp.h"
+#include "genc.c"
+#include "aot.c"
+
+#include <dirent.h>
+#include <fcntl.h>
+#ifdef INC_WINDOWS
+  #include <io.h>
+  #define BENCH_NULL_DEVICE "NUL"
+#else
+  #include <unistd.h>
+  #define BENCH_NULL_DEVICE "/dev/null"
+#endif
+
+#define BENCH_DEFAULT_RUNS 5
+#define BENCH_DEFAULT_THRESHOLD 10.0
+#define BENCH_MAX_RUNS 1000
+
+typedef enum bench_engine {
+  BENCH_O0,
+  BENCH_O1,
+  BENCH_AOT,
+  BENCH_NUM_ENGINES,
+} bench_engine;
+
+static const char* bench_engine_names[] = { "O0", "O1", "aot" };
+
+typedef struct bench_program {
+  char* name;
+  char* code;
+} bench_program;
+
+typedef struct bench_result {
+  const char* name;
+  const char* engine;
+  int runs;
+  uint64_t median_ns;
+  uint64_t p95_ns;
+  uint64_t load_ns;
+  uint64_t insns; // of the program as written, 0 if unknown
+  perfctr_values counters; // per run, with --counters
+} bench_result;
+
+// Errors reported while loading or running (the programs in codes/ include
+// some that fail on purpose)
+static int bench_errors;
+
+static void bench_on_error(error_handler* err_handler, char* msg, src_pos* pos) {
+  (void) err_handler;
+  (void) msg;
+  (void) pos;
+  bench_errors++;
+}
+
+static void* bench_alloc(size_t size) {
+  void* mem = malloc(size);
+  if (!mem) {
+    printf("failed to alloc memory for the benchmark\n");
+    exit(1);
+  }
+  return mem;
+}
+
+static char* bench_strdup(const char* str) {
+  char* copy = (char*) bench_alloc(strlen(str) + 1);
+  strcpy(copy, str);
+  return copy;
+}
+
+static char* bench_read_file(const char* path) {
+  FILE* fp = fopen(path, "rb");
+  if (!fp) return NULL;
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  rewind(fp);
+  char* data = (char*) bench_alloc(len + 1);
+  len = (long) fread(data, 1, len, fp);
+  data[len] = '\0';
+  fclose(fp);
+  return data;
+}
+
+// Appends to a growing string, printf style
+static void bench_appendf(char** str, size_t* len, size_t* cap, const char* fmt, ...) {
+  va_list args;
+  for (;;) {
+    va_start(args, fmt);
+    int n = vsnprintf(*str ? *str + *len : NULL, *str ? *cap - *len : 0, fmt, args);
+    va_end(args);
+    if (*str && *len + n < *cap) {
+      *len += n;
+      return;
+    }
+    *cap = (*cap + n + 1) * 2;
+    *str = (char*) realloc(*str, *cap);
+    if (!*str) {
+      printf("failed to alloc memory for the benchmark\n");
+      exit(1);
+    }
+  }
+}
+
+// Stress programs, each about a second or less per run at -O0
+
+static char* bench_gen_recursion(void) {
+  char* s = NULL;
+  size_t len = 0, cap = 0;
+  bench_appendf(&s, &len, &cap,
+    "  mov k, 20\n"
+    "outer:\n"
+    "  mov n, 500000\n"
+    "  call down\n"
+    "  dec k\n"
+    "  cmp k, 0\n"
+    "  jne outer\n"
+    "  end\n"
+    "down:\n"
+    "  dec n\n"
+    "  cmp n, 0\n"
+    "  je bottom\n"
+    "  call down\n"
+    "bottom:\n"
+    "  ret\n");
+  return s;
+}
+
+static char* bench_gen_loop(void) {
+  char* s = NULL;
+  size_t len = 0, cap = 0;
+  bench_appendf(&s, &len, &cap,
+    "  mov i, 0\n"
+    "  mov s, 0\n"
+    "loop:\n"
+    "  add s, i\n"
+    "  inc i\n"
+    "  cmp i, 20000000\n"
+    "  jl loop\n"
+    "  msg s\n"
+    "  end\n");
+  return s;
+}
+
+// A chain of labels, each jumping to the next one
+static char* bench_gen_labels(int num_labels) {
+  char* s = NULL;
+  size_t len = 0, cap = 0;
+  bench_appendf(&s, &len, &cap, "  mov k, 200\nouter:\n  mov a, 0\n");
+  for (int i = 0; i < num_labels; i++) {
+    bench_appendf(&s, &len, &cap, "label_%d:\n  inc a\n  jmp label_%d\n", i, i + 1);
+  }
+  bench_appendf(&s, &len, &cap,
+    "label_%d:\n"
+    "  dec k\n"
+    "  cmp k, 0\n"
+    "  jne outer\n"
+    "  msg a\n"
+    "  end\n", num_labels);
+  return s;
+}
+
+static char* bench_gen_output(void) {
+  char* s = NULL;
+  size_t len = 0, cap = 0;
+  bench_appendf(&s, &len, &cap,
+    "  mov i, 0\n"
+    "loop:\n"
+    "  print 'line ', i, ': the quick brown fox jumps over the lazy dog\\n'\n"
+    "  inc i\n"
+    "  cmp i, 1000000\n"
+    "  jl loop\n"
+    "  end\n");
+  return s;
+}
+
+static void bench_add(bench_program** programs, int* num, const char* name, char* code) {
+  *programs = (bench_program*) realloc(*programs, (*num + 1) * sizeof(bench_program));
+  if (!*programs) {
+    printf("failed to alloc memory for the benchmark\n");
+    exit(1);
+  }
+  (*programs)[*num].name = bench_strdup(name);
+  (*programs)[*num].code = code;
+  (*num)++;
+}
+
+static int bench_compare_names(const void* a, const void* b) {
+  return strcmp(((const bench_program*) a)->name, ((const bench_program*) b)->name);
+}
+
+// Adds 'path', or the .asm files in it when it's a directory
+static void bench_add_path(bench_program** programs, int* num, const char* path) {
+  DIR* dir = opendir(path);
+  if (!dir) {
+    char* code = bench_read_file(path);
+    if (!code) {
+      printf("failed to open file %s\n", path);
+      exit(2);
+    }
+    bench_add(programs, num, path, code);
+    return;
+  }
+
+  int first = *num;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    size_t len = strlen(entry->d_name);
+    if (len < 4 || strcmp(entry->d_name + len - 4, ".asm") != 0) continue;
+
+    char* file = (char*) bench_alloc(strlen(path) + len + 2);
+    sprintf(file, "%s/%s", path, entry->d_name);
+    char* code = bench_read_file(file);
+    if (code) bench_add(programs, num, file, code);
+    free(file);
+  }
+  closedir(dir);
+  qsort(*programs + first, *num - first, sizeof(bench_program), bench_compare_names);
+}
+
+// Builds, checks and optimizes 'code'. False if it has errors.
+static bool bench_load(const char* code, run_options* opts, program* prog) {
+  parser p;
+  parser_init(&p, code);
+  p.error_handler->handler_fn = bench_on_error;
+  bench_errors = 0;
+
+  top_level_node* n = parser_parse(&p);
+  if (bench_errors) return false;
+
+  prog->error_handler = p.error_handler;
+  program_build(prog, n);
+  prog->options = *opts;
+  program_check(prog);
+  if (opts->opt_level > 0 && !bench_errors) program_optimize(prog);
+  return bench_errors == 0;
+}
+
+// The guest's output goes to the null device between these
+static int bench_saved_stdout = -1;
+
+static void bench_mute_stdout(void) {
+  fflush(stdout);
+  int null_fd = open(BENCH_NULL_DEVICE, O_WRONLY);
+  if (null_fd < 0) return;
+  bench_saved_stdout = dup(1);
+  dup2(null_fd, 1);
+  close(null_fd);
+}
+
+static void bench_unmute_stdout(void) {
+  fflush(stdout);
+  if (bench_saved_stdout < 0) return;
+  dup2(bench_saved_stdout, 1);
+  close(bench_saved_stdout);
+  bench_saved_stdout = -1;
+}
+
+static int bench_compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*) a;
+  uint64_t y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+// Instructions the program runs as written, 0 if it doesn't load
+static uint64_t bench_count_insns(const char* code) {
+  run_options opts;
+  run_options_init(&opts);
+  opts.opt_level = 0;
+  opts.profile = PROFILE_COUNTS;
+
+  program prog;
+  if (!bench_load(code, &opts, &prog)) return 0;
+  bench_mute_stdout();
+  program_run(&prog);
+  bench_unmute_stdout();
+  return prog.profile->executed;
+}
+
+// False if the engine can't run the program
+static bool bench_run(bench_program* bp, bench_engine engine, int runs, bench_result* result) {
+  run_options opts;
+  run_options_init(&opts);
+  opts.opt_level = engine == BENCH_O0 ? 0 : 1;
+
+  program prog;
+  uint64_t start = timing_now_ns();
+  if (!bench_load(bp->code, &opts, &prog)) return false;
+  genc_run_fn aot_fn = NULL;
+  if (engine == BENCH_AOT) {
+    aot_fn = aot_load(&prog);
+    if (!aot_fn) return false;
+  }
+  result->load_ns = timing_now_ns() - start;
+
+  uint64_t times[BENCH_MAX_RUNS];
+  memset(&result->counters, 0, sizeof(result->counters));
+  bench_mute_stdout();
+  for (int i = 0; i < runs; i++) {
+    perfctr_values counters = perfctr_read();
+    start = timing_now_ns();
+    if (aot_fn) {
+      aot_run(&prog, aot_fn);
+    } else {
+      program_run(&prog);
+    }
+    times[i] = timing_now_ns() - start;
+    perfctr_add(&result->counters, perfctr_diff(perfctr_read(), counters));
+  }
+  bench_unmute_stdout();
+  for (int c = 0; c < PERFCTR_NUM; c++) result->counters.v[c] /= runs;
+
+  qsort(times, runs, sizeof(uint64_t), bench_compare_u64);
+  int p95 = (runs * 95 + 99) / 100 - 1;
+  result->name = bp->name;
+  result->engine = bench_engine_names[engine];
+  result->runs = runs;
+  result->median_ns = runs % 2 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+  result->p95_ns = times[p95 < 0 ? 0 : p95];
+  return true;
+}
+
+// Value of "key":<number> or "key":"<string>" in a line of JSON, false if
+// it isn't there. Only what bench_save writes needs to be understood.
+static bool bench_json_u64(const char* line, const char* key, uint64_t* out) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  const char* at = strstr(line, pattern);
+  if (!at) return false;
+  *out = strtoull(at + strlen(pattern), NULL, 10);
+  return true;
+}
+
+static bool bench_json_string(const char* line, const char* key, char* out, size_t size) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+  const char* at = strstr(line, pattern);
+  if (!at) return false;
+  at += strlen(pattern);
+  size_t len = 0;
+  while (*at && *at != '"' && len + 1 < size) {
+    if (*at == '\\' && at[1]) at++;
+    out[len++] = *at++;
+  }
+  out[len] = '\0';
+  return true;
+}
+
+// Median of 'name' under 'engine' in the baseline, 0 if it's not there
+static uint64_t bench_baseline_median(const char* baseline, const char* name, const char* engine) {
+  if (!baseline) return 0;
+  const char* line = baseline;
+  while (*line) {
+    const char* end = strchr(line, '\n');
+    size_t len = end ? (size_t) (end - line) : strlen(line);
+    char buf[1024];
+    if (len < sizeof(buf)) {
+      memcpy(buf, line, len);
+      buf[len] = '\0';
+
+      char line_name[512], line_engine[16];
+      uint64_t median;
+      if (bench_json_string(buf, "name", line_name, sizeof(line_name)) &&
+          bench_json_string(buf, "engine", line_engine, sizeof(line_engine)) &&
+          bench_json_u64(buf, "median_ns", &median) &&
+          strcmp(line_name, name) == 0 && strcmp(line_engine, engine) == 0) {
+        return median;
+      }
+    }
+    line += len;
+    if (*line == '\n') line++;
+  }
+  return 0;
+}
+
+static void bench_save(const char* path, bench_result* results, int num_results) {
+  FILE* out = fopen(path, "w");
+  if (!out) {
+    printf("failed to open file %s\n", path);
+    exit(2);
+  }
+  for (int i = 0; i < num_results; i++) {
+    bench_result* r = &results[i];
+    fprintf(out, "{\"name\":");
+    timing_write_json_string(out, r->name);
+    fprintf(out, ",\"engine\":\"%s\",\"runs\":%d,\"median_ns\":%llu,\"p95_ns\":%llu,\"load_ns\":%llu,\"insns\":%llu",
+      r->engine, r->runs, (unsigned long long) r->median_ns, (unsigned long long) r->p95_ns,
+      (unsigned long long) r->load_ns, (unsigned long long) r->insns);
+    for (int c = 0; perfctr.open && c < PERFCTR_NUM; c++) {
+      if (perfctr_has((perfctr_kind) c)) fprintf(out, ",\"%s\":%llu", perfctr_names[c], (unsigned long long) r->counters.v[c]);
+    }
+    fprintf(out, "}\n");
+  }
+  fclose(out);
+}
+
+static void print_usage() {
+  printf("usage: bench [options] [<file or directory>...]  (default: codes)\n");
+  printf("options:\n");
+  printf("  --runs=<n>              runs of each program under each engine (default: %d)\n", BENCH_DEFAULT_RUNS);
+  printf("  --engines=<list>        comma separated, of O0, O1 and aot (default: all)\n");
+  printf("  --only=<text>           only the programs with <text> in their name\n");
+  printf("  --no-generated          skip the generated stress programs\n");
+  printf("  --baseline=<file>       compare with the results saved in <file>\n");
+  printf("  --threshold=<percent>   slower than the baseline by more is a regression\n");
+  printf("                          (default: %g)\n", BENCH_DEFAULT_THRESHOLD);
+  printf("  --save=<file>           write the results to <file> as JSON\n");
+  printf("  --counters              add the hardware counters of the runs (Linux only)\n");
+}
+
+static const char* option_value(const char* arg, const char* name) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+  return NULL;
+}
+
+int main(int argc, const char** argv) {
+  int runs = BENCH_DEFAULT_RUNS;
+  bool engines[BENCH_NUM_ENGINES] = { true, true, true };
+  const char* only = NULL;
+  bool generated = true;
+  const char* baseline_path = NULL;
+  const char* save_path = NULL;
+  double threshold = BENCH_DEFAULT_THRESHOLD;
+  bool counters = false;
+
+  bench_program* programs = NULL;
+  int num_programs = 0;
+  bool any_path = false;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value;
+
+    if ((value = option_value(arg, "--runs")) != NULL) {
+      runs = atoi(value);
+      if (runs < 1 || runs > BENCH_MAX_RUNS) {
+        printf("invalid number of runs '%s'\n", value);
+        return 1;
+      }
+    } else if ((value = option_value(arg, "--engines")) != NULL) {
+      for (int e = 0; e < BENCH_NUM_ENGINES; e++) engines[e] = false;
+      while (*value) {
+        size_t len = strcspn(value, ",");
+        int e = 0;
+        while (e < BENCH_NUM_ENGINES &&
+          (strlen(bench_engine_names[e]) != len || strncmp(value, bench_engine_names[e], len) != 0)) e++;
+        if (e == BENCH_NUM_ENGINES) {
+          printf("invalid engine '%.*s', use O0, O1 or aot\n", (int) len, value);
+          return 1;
+        }
+        engines[e] = true;
+        value += len;
+        if (*value == ',') value++;
+      }
+    } else if ((value = option_value(arg, "--only")) != NULL) {
+      only = value;
+    } else if (strcmp(arg, "--no-generated") == 0) {
+      generated = false;
+    } else if ((value = option_value(arg, "--baseline")) != NULL) {
+      baseline_path = value;
+    } else if ((value = option_value(arg, "--threshold")) != NULL) {
+      threshold = atof(value);
+    } else if ((value = option_value(arg, "--save")) != NULL) {
+      save_path = value;
+    } else if (strcmp(arg, "--counters") == 0) {
+      counters = true;
+    } else if (arg[0] == '-' && arg[1] == '-') {
+      printf("unknown option '%s'\n", arg);
+      print_usage();
+      return 1;
+    } else {
+      bench_add_path(&programs, &num_programs, arg);
+      any_path = true;
+    }
+  }
+
+  if (!any_path) bench_add_path(&programs, &num_programs, "codes");
+  if (generated) {
+    bench_add(&programs, &num_programs, "gen:recursion", bench_gen_recursion());
+    bench_add(&programs, &num_programs, "gen:loop", bench_gen_loop());
+    bench_add(&programs, &num_programs, "gen:labels", bench_gen_labels(10000));
+    bench_add(&programs, &num_programs, "gen:output", bench_gen_output());
+  }
+
+  if (counters) perfctr_open();
+
+  // Read before --save can overwrite it
+  char* baseline = NULL;
+  if (baseline_path) {
+    baseline = bench_read_file(baseline_path);
+    if (!baseline) {
+      printf("failed to open file %s\n", baseline_path);
+      return 2;
+    }
+  }
+
+  bench_result* results = (bench_result*) bench_alloc((num_programs * BENCH_NUM_ENGINES + 1) * sizeof(bench_result));
+  int num_results = 0;
+  int regressions = 0;
+
+  printf("%-28s %-6s %10s %10s %10s %12s%s\n", "program", "engine", "median ms", "p95 ms", "load ms", "M insns/s",
+    baseline ? "   vs baseline" : "");
+  for (int i = 0; i < num_programs; i++) {
+    bench_program* bp = &programs[i];
+    if (only && !strstr(bp->name, only)) continue;
+
+    uint64_t insns = bench_count_insns(bp->code);
+    for (int e = 0; e < BENCH_NUM_ENGINES; e++) {
+      if (!engines[e]) continue;
+
+      bench_result* r = &results[num_results];
+      if (!bench_run(bp, (bench_engine) e, runs, r)) {
+        printf("%-28s %-6s %10s\n", bp->name, bench_engine_names[e], e == BENCH_AOT ? "n/a" : "error");
+        continue;
+      }
+      r->insns = insns;
+      num_results++;
+
+      printf("%-28s %-6s %10.3f %10.3f %10.3f", r->name, r->engine, r->median_ns / 1e6, r->p95_ns / 1e6, r->load_ns / 1e6);
+      if (insns && r->median_ns) {
+        printf(" %12.1f", insns * 1e3 / r->median_ns);
+      } else {
+        printf(" %12s", "-");
+      }
+
+      uint64_t base = bench_baseline_median(baseline, r->name, r->engine);
+      if (base) {
+        double change = 100.0 * ((double) r->median_ns - (double) base) / (double) base;
+        bool regressed = change > threshold;
+        if (regressed) regressions++;
+        printf("   %+7.1f%%%s", change, regressed ? "  REGRESSION" : "");
+      } else if (baseline) {
+        printf("   %8s", "new");
+      }
+      if (perfctr.open) {
+        printf("   ");
+        perfctr_print_summary(stdout, &r->counters);
+      }
+      printf("\n");
+    }
+  }
+
+  if (save_path) bench_save(save_path, results, num_results);
+  if (baseline) {
+    printf("\n%d regression%s (threshold: %g%%)\n", regressions, regressions == 1 ? "" : "s", threshold);
+  }
+  return regressions ? 1 : 0;
+}
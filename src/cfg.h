@@ -0,0 +1,628 @@
+#ifndef __CFG_H__
+#define __CFG_H__
+
+// Control flow analysis over a checked program.
+//
+// cfg_build splits the instructions in basic blocks. A block starts at the
+// first instruction, at labels and branch/call targets, and after every
+// jmp/jcc, call, ret and end. Edges stay inside a procedure: a call block
+// falls through to the instruction after the call (where the callee returns
+// to), the callee is recorded in the call graph instead. ret and end blocks
+// have no successors.
+//
+// Procedures are the program entry (instruction 0) and every call target,
+// each one owns the blocks reachable from its entry.
+//
+// cfg_find_loops computes the dominator tree and the natural loops: a back
+// edge is an edge to a block that dominates its source, the loop is its
+// target (the header) plus every block that reaches the source without
+// going through the header. Back edges to the same header make one loop.
+//
+// cfg_compute_liveness computes which registers (and the cmp flag) are live
+// at the start/end of each block. Registers are global, so it looks through
+// calls: a call reads whatever is live at the callee entry (and the callee may
+// leave any register untouched), a ret reads whatever is live after any call.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "interp.h"
+
+// Liveness sets: bit N = register N, plus the flag set by cmp
+typedef uint32_t reg_set;
+#define CFG_FLAGS_BIT (1u << NUM_REGISTERS)
+#define CFG_ALL_REGS ((1u << NUM_REGISTERS) - 1)
+
+typedef struct basic_block {
+  int start; // first instruction
+  int end;   // one past the last instruction
+
+  int succs[2];
+  int num_succs;
+  int* preds; // points into cfg.pred_list
+  int num_preds;
+
+  int proc; // owning procedure, -1 if unreachable
+  int callee_block; // entry of the called procedure if the block ends with a call, else -1
+  bool is_return_site; // follows a call
+
+  reg_set use;      // read before being written in the block
+  reg_set def;      // written in the block
+  reg_set live_in;
+  reg_set live_out; // for a call block, before the call (includes what the callee reads)
+} basic_block;
+
+typedef struct procedure {
+  int entry_block;
+  const char* name; // label of the entry, NULL for the program entry
+
+  int* callees; // procedure indices, no duplicates
+  int num_callees;
+} procedure;
+
+typedef struct loop {
+  int header;
+  bool* contains; // by block index
+  int* blocks;    // the header first
+  int num_blocks;
+  // The only predecessor of the header outside the loop, if it falls through
+  // to the header (nothing else gets there), else -1. Code inserted right
+  // before the header runs once, when the loop is entered.
+  int preheader;
+  bool has_calls; // calls or returns, that can change any register
+} loop;
+
+typedef struct cfg {
+  program* prog;
+
+  basic_block* blocks;
+  int num_blocks;
+  int* block_of; // instruction index -> block index
+
+  int* pred_list;
+
+  procedure* procs;
+  int num_procs;
+
+  // Set by cfg_find_loops
+  int* idom; // immediate dominator of each block, -1 for procedure entries and unreachable blocks
+  loop* loops;
+  int num_loops;
+} cfg;
+
+// Registers read and written by a single instruction.
+// call/ret depend on the other procedures, see cfg_compute_liveness.
+static void cfg_insn_use_def(instruction* in, reg_set* use, reg_set* def) {
+  reg_set u = 0, d = 0;
+  operand* ops = in->operands;
+
+  #define REG_BIT(op) (1u << (op).reg_index)
+  // Register/memory read as a value
+  #define USE_VALUE(op) \
+    if ((op).type == OPERAND_REG || (op).type == OPERAND_MEM_ADDRESS) u |= REG_BIT(op)
+
+  switch (in->opcode) {
+    case OPCODE_MOV:
+      USE_VALUE(ops[1]);
+      if (ops[0].type == OPERAND_REG) d |= REG_BIT(ops[0]);
+      else u |= REG_BIT(ops[0]); // the address
+      break;
+    case OPCODE_ADD: case OPCODE_SUB: case OPCODE_MUL: case OPCODE_DIV: case OPCODE_DIV_NC:
+      USE_VALUE(ops[1]);
+      u |= REG_BIT(ops[0]);
+      if (ops[0].type == OPERAND_REG) d |= REG_BIT(ops[0]);
+      break;
+    case OPCODE_INC: case OPCODE_DEC:
+      u |= REG_BIT(ops[0]);
+      d |= REG_BIT(ops[0]);
+      break;
+    case OPCODE_CMP:
+      USE_VALUE(ops[0]);
+      USE_VALUE(ops[1]);
+      d |= CFG_FLAGS_BIT;
+      break;
+    case OPCODE_JNE: case OPCODE_JE: case OPCODE_JGE:
+    case OPCODE_JG: case OPCODE_JLE: case OPCODE_JL:
+      u |= CFG_FLAGS_BIT;
+      break;
+    case OPCODE_DEC_JNE: case OPCODE_DEC_JG:
+      u |= REG_BIT(ops[1]);
+      d |= REG_BIT(ops[1]) | CFG_FLAGS_BIT;
+      break;
+    case OPCODE_PUSH: case OPCODE_MFREE:
+      u |= REG_BIT(ops[0]);
+      break;
+    case OPCODE_POP:
+      d |= REG_BIT(ops[0]);
+      break;
+    case OPCODE_MALLOC:
+      u |= REG_BIT(ops[0]);
+      d |= REG_BIT(ops[1]);
+      break;
+    case OPCODE_ENTER: case OPCODE_LEAVE: {
+      reg_set range = 0;
+      for (int r = ops[0].reg_index; r <= ops[1].reg_index; r++) range |= 1u << r;
+      if (in->opcode == OPCODE_ENTER) u |= range; else d |= range;
+      break;
+    }
+    case OPCODE_PRINT: case OPCODE_MSG:
+      // Memory operands are not read (see vm_exec)
+      for (int i = 0; i < in->num_operands; i++) {
+        if (ops[i].type == OPERAND_REG) u |= REG_BIT(ops[i]);
+      }
+      break;
+    default:
+      break;
+  }
+
+  #undef REG_BIT
+  #undef USE_VALUE
+
+  *use = u;
+  *def = d;
+}
+
+static bool cfg_is_branch(opcode opc) {
+  return (opc >= OPCODE_JMP && opc <= OPCODE_JL) || opc == OPCODE_DEC_JNE || opc == OPCODE_DEC_JG;
+}
+
+// Ends a block: branches, call, ret, end
+static bool cfg_ends_block(opcode opc) {
+  return cfg_is_branch(opc) || opc == OPCODE_CALL || opc == OPCODE_RET || opc == OPCODE_END;
+}
+
+static void* cfg_alloc(size_t size) {
+  void* mem = calloc(1, size ? size : 1);
+  if (!mem) {
+    printf("failed to alloc memory for the cfg\n");
+    exit(1);
+  }
+  return mem;
+}
+
+static void cfg_add_edge(cfg* g, int from, int to) {
+  basic_block* b = &g->blocks[from];
+  for (int i = 0; i < b->num_succs; i++) {
+    if (b->succs[i] == to) return; // e.g. 'je next' right before 'next'
+  }
+  b->succs[b->num_succs++] = to;
+}
+
+// Gives every block reachable from 'entry' (without following calls) to 'proc'
+static void cfg_assign_procedure(cfg* g, int entry, int proc, int* worklist) {
+  int n = 0;
+  if (g->blocks[entry].proc != -1) return;
+  g->blocks[entry].proc = proc;
+  worklist[n++] = entry;
+
+  while (n > 0) {
+    basic_block* b = &g->blocks[worklist[--n]];
+    for (int i = 0; i < b->num_succs; i++) {
+      int s = b->succs[i];
+      if (g->blocks[s].proc == -1) {
+        g->blocks[s].proc = proc;
+        worklist[n++] = s;
+      }
+    }
+  }
+}
+
+void cfg_build(cfg* g, program* p) {
+  int n = p->num_instructions;
+  g->prog = p;
+  g->idom = NULL;
+  g->loops = NULL;
+  g->num_loops = 0;
+
+  // Leaders
+  bool* is_leader = (bool*) cfg_alloc((n + 1) * sizeof(bool));
+  bool* is_proc_entry = (bool*) cfg_alloc((n + 1) * sizeof(bool));
+  is_leader[0] = true;
+  is_proc_entry[0] = true;
+  for (int i = 0; i < p->num_resolved_labels; i++) {
+    is_leader[p->resolved_labels[i].instruction_index] = true;
+  }
+  for (int i = 0; i < n; i++) {
+    instruction* in = &p->instructions[i];
+    if (cfg_is_branch(in->opcode) || in->opcode == OPCODE_CALL) {
+      is_leader[in->operands[0].branch_index] = true;
+    }
+    if (in->opcode == OPCODE_CALL) {
+      is_proc_entry[in->operands[0].branch_index] = true;
+    }
+    if (cfg_ends_block(in->opcode)) {
+      is_leader[i + 1] = true;
+    }
+  }
+
+  // Blocks
+  g->num_blocks = 0;
+  for (int i = 0; i < n; i++) {
+    if (is_leader[i]) g->num_blocks++;
+  }
+  g->blocks = (basic_block*) cfg_alloc(g->num_blocks * sizeof(basic_block));
+  g->block_of = (int*) cfg_alloc((n + 1) * sizeof(int));
+
+  int cur = -1;
+  for (int i = 0; i < n; i++) {
+    if (is_leader[i]) {
+      cur++;
+      g->blocks[cur].start = i;
+      g->blocks[cur].proc = -1;
+      g->blocks[cur].callee_block = -1;
+    }
+    g->blocks[cur].end = i + 1;
+    g->block_of[i] = cur;
+  }
+  // Branching to the end of the program is like 'end'
+  g->block_of[n] = -1;
+
+  // Edges
+  int num_edges = 0;
+  for (int b = 0; b < g->num_blocks; b++) {
+    basic_block* block = &g->blocks[b];
+    instruction* last = &p->instructions[block->end - 1];
+    bool falls_through = last->opcode != OPCODE_JMP
+      && last->opcode != OPCODE_RET
+      && last->opcode != OPCODE_END;
+
+    if (cfg_is_branch(last->opcode)) {
+      int target = g->block_of[last->operands[0].branch_index];
+      if (target != -1) cfg_add_edge(g, b, target);
+    }
+    if (last->opcode == OPCODE_CALL) {
+      block->callee_block = g->block_of[last->operands[0].branch_index];
+      if (block->end < n) g->blocks[g->block_of[block->end]].is_return_site = true;
+    }
+    if (falls_through && block->end < n) {
+      cfg_add_edge(g, b, g->block_of[block->end]);
+    }
+    num_edges += block->num_succs;
+  }
+
+  // Count the predecessors first, then every block gets a slice of pred_list
+  for (int b = 0; b < g->num_blocks; b++) {
+    basic_block* block = &g->blocks[b];
+    for (int i = 0; i < block->num_succs; i++) g->blocks[block->succs[i]].num_preds++;
+  }
+  g->pred_list = (int*) cfg_alloc(num_edges * sizeof(int));
+  int* pred = g->pred_list;
+  for (int b = 0; b < g->num_blocks; b++) {
+    g->blocks[b].preds = pred;
+    pred += g->blocks[b].num_preds;
+    g->blocks[b].num_preds = 0;
+  }
+  for (int b = 0; b < g->num_blocks; b++) {
+    basic_block* block = &g->blocks[b];
+    for (int i = 0; i < block->num_succs; i++) {
+      basic_block* succ = &g->blocks[block->succs[i]];
+      succ->preds[succ->num_preds++] = b;
+    }
+  }
+
+  // Procedures
+  g->num_procs = 0;
+  for (int i = 0; i < n; i++) {
+    if (is_proc_entry[i]) g->num_procs++;
+  }
+  g->procs = (procedure*) cfg_alloc(g->num_procs * sizeof(procedure));
+
+  int* worklist = (int*) cfg_alloc(g->num_blocks * sizeof(int));
+  int* proc_of_insn = (int*) cfg_alloc((n + 1) * sizeof(int));
+  for (int i = 0; i <= n; i++) proc_of_insn[i] = -1; // -1: calls the end of the program
+  int proc = 0;
+  for (int i = 0; i < n; i++) {
+    if (!is_proc_entry[i]) continue;
+    procedure* pr = &g->procs[proc];
+    pr->entry_block = g->block_of[i];
+    pr->name = i == 0 ? NULL : program_get_label_by_index(p, i);
+    proc_of_insn[i] = proc;
+    proc++;
+  }
+  // Entry first, so code shared with a callee goes to the caller
+  for (int i = 0; i < g->num_procs; i++) {
+    cfg_assign_procedure(g, g->procs[i].entry_block, i, worklist);
+  }
+
+  // Call graph
+  bool* seen = (bool*) cfg_alloc(g->num_procs * sizeof(bool));
+  for (int i = 0; i < g->num_procs; i++) {
+    procedure* pr = &g->procs[i];
+    memset(seen, 0, g->num_procs * sizeof(bool));
+    pr->callees = (int*) cfg_alloc(g->num_procs * sizeof(int));
+
+    for (int b = 0; b < g->num_blocks; b++) {
+      basic_block* block = &g->blocks[b];
+      instruction* last = &p->instructions[block->end - 1];
+      if (block->proc != i || last->opcode != OPCODE_CALL) continue;
+
+      int callee = proc_of_insn[last->operands[0].branch_index];
+      if (callee != -1 && !seen[callee]) {
+        seen[callee] = true;
+        pr->callees[pr->num_callees++] = callee;
+      }
+    }
+  }
+
+  free(seen);
+  free(proc_of_insn);
+  free(worklist);
+  free(is_proc_entry);
+  free(is_leader);
+}
+
+void cfg_compute_liveness(cfg* g) {
+  program* p = g->prog;
+
+  for (int b = 0; b < g->num_blocks; b++) {
+    basic_block* block = &g->blocks[b];
+    block->use = 0;
+    block->def = 0;
+    for (int i = block->start; i < block->end; i++) {
+      reg_set use, def;
+      cfg_insn_use_def(&p->instructions[i], &use, &def);
+      block->use |= use & ~block->def;
+      block->def |= def;
+    }
+    block->live_in = block->use;
+    block->live_out = 0;
+  }
+
+  // Backwards, until nothing changes
+  bool changed = true;
+  while (changed) {
+    changed = false;
+
+    // Where a ret can go. Not tracked per procedure, so this is only precise
+    // enough for programs with a few procedures... good enough for now.
+    reg_set live_after_calls = 0;
+    for (int b = 0; b < g->num_blocks; b++) {
+      if (g->blocks[b].is_return_site) live_after_calls |= g->blocks[b].live_in;
+    }
+
+    for (int b = g->num_blocks - 1; b >= 0; b--) {
+      basic_block* block = &g->blocks[b];
+      opcode last = p->instructions[block->end - 1].opcode;
+      reg_set out = 0;
+      for (int i = 0; i < block->num_succs; i++) {
+        out |= g->blocks[block->succs[i]].live_in;
+      }
+      if (block->callee_block != -1) out |= g->blocks[block->callee_block].live_in;
+      if (last == OPCODE_RET) out |= live_after_calls;
+
+      reg_set in = block->use | (out & ~block->def);
+      if (out != block->live_out || in != block->live_in) {
+        block->live_out = out;
+        block->live_in = in;
+        changed = true;
+      }
+    }
+  }
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+// Every procedure entry hangs from a virtual root (index num_blocks).
+static void cfg_compute_dominators(cfg* g) {
+  int nb = g->num_blocks, root = nb;
+  int* idom = (int*) cfg_alloc((nb + 1) * sizeof(int));
+  int* postorder = (int*) cfg_alloc((nb + 1) * sizeof(int)); // number of each block
+  int* rpo = (int*) cfg_alloc((nb + 1) * sizeof(int));       // blocks, reverse postorder
+  bool* is_entry = (bool*) cfg_alloc((nb + 1) * sizeof(bool));
+  for (int i = 0; i < g->num_procs; i++) is_entry[g->procs[i].entry_block] = true;
+
+  // Iterative DFS, stack of (block, next child)
+  int* stack = (int*) cfg_alloc(2 * (nb + 1) * sizeof(int));
+  for (int b = 0; b <= nb; b++) postorder[b] = -1;
+  int num_visited = 0, sp = 0;
+  bool* visited = (bool*) cfg_alloc((nb + 1) * sizeof(bool));
+  visited[root] = true;
+  stack[sp++] = root;
+  stack[sp++] = 0;
+  while (sp > 0) {
+    int b = stack[sp - 2], child = stack[sp - 1]++;
+    int num_children = b == root ? g->num_procs : g->blocks[b].num_succs;
+    if (child < num_children) {
+      int s = b == root ? g->procs[child].entry_block : g->blocks[b].succs[child];
+      if (!visited[s]) {
+        visited[s] = true;
+        stack[sp++] = s;
+        stack[sp++] = 0;
+      }
+      continue;
+    }
+    sp -= 2;
+    postorder[b] = num_visited;
+    rpo[nb - num_visited] = b; // filled from the end
+    num_visited++;
+  }
+  int first = nb + 1 - num_visited; // rpo[first] == root
+
+  for (int b = 0; b <= nb; b++) idom[b] = -1;
+  idom[root] = root;
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int k = first + 1; k <= nb; k++) {
+      int b = rpo[k];
+      int new_idom = is_entry[b] ? root : -1;
+      for (int i = 0; i < g->blocks[b].num_preds; i++) {
+        int p = g->blocks[b].preds[i];
+        if (idom[p] == -1) continue;
+        if (new_idom == -1) {
+          new_idom = p;
+          continue;
+        }
+        // Intersect
+        int f1 = p, f2 = new_idom;
+        while (f1 != f2) {
+          while (postorder[f1] < postorder[f2]) f1 = idom[f1];
+          while (postorder[f2] < postorder[f1]) f2 = idom[f2];
+        }
+        new_idom = f1;
+      }
+      if (idom[b] != new_idom) {
+        idom[b] = new_idom;
+        changed = true;
+      }
+    }
+  }
+
+  for (int b = 0; b < nb; b++) {
+    if (idom[b] == root) idom[b] = -1;
+  }
+  g->idom = idom;
+
+  free(visited);
+  free(stack);
+  free(is_entry);
+  free(rpo);
+  free(postorder);
+}
+
+// Whether every path from the procedure entry to 'b' goes through 'a'
+bool cfg_dominates(cfg* g, int a, int b) {
+  for (; b != -1; b = g->idom[b]) {
+    if (b == a) return true;
+  }
+  return false;
+}
+
+void cfg_find_loops(cfg* g) {
+  program* p = g->prog;
+  int nb = g->num_blocks;
+  cfg_compute_dominators(g);
+
+  int* loop_of_header = (int*) cfg_alloc(nb * sizeof(int));
+  for (int b = 0; b < nb; b++) loop_of_header[b] = -1;
+  g->loops = (loop*) cfg_alloc(nb * sizeof(loop));
+  int* worklist = (int*) cfg_alloc(nb * sizeof(int));
+
+  for (int b = 0; b < nb; b++) {
+    basic_block* block = &g->blocks[b];
+    for (int i = 0; i < block->num_succs; i++) {
+      int h = block->succs[i];
+      if (!cfg_dominates(g, h, b)) continue;
+
+      // Back edge b -> h
+      if (loop_of_header[h] == -1) {
+        loop* l = &g->loops[g->num_loops];
+        loop_of_header[h] = g->num_loops++;
+        l->header = h;
+        l->contains = (bool*) cfg_alloc(nb * sizeof(bool));
+        l->blocks = (int*) cfg_alloc(nb * sizeof(int));
+        l->contains[h] = true;
+        l->blocks[l->num_blocks++] = h;
+      }
+      loop* l = &g->loops[loop_of_header[h]];
+
+      int n = 0;
+      if (!l->contains[b]) {
+        l->contains[b] = true;
+        l->blocks[l->num_blocks++] = b;
+        worklist[n++] = b;
+      }
+      while (n > 0) {
+        basic_block* x = &g->blocks[worklist[--n]];
+        for (int j = 0; j < x->num_preds; j++) {
+          int pred = x->preds[j];
+          // Not dominated by the header = unreachable
+          if (!l->contains[pred] && cfg_dominates(g, h, pred)) {
+            l->contains[pred] = true;
+            l->blocks[l->num_blocks++] = pred;
+            worklist[n++] = pred;
+          }
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < g->num_loops; i++) {
+    loop* l = &g->loops[i];
+    basic_block* header = &g->blocks[l->header];
+
+    l->preheader = -1;
+    int num_outside = 0;
+    for (int j = 0; j < header->num_preds; j++) {
+      int pred = header->preds[j];
+      if (l->contains[pred]) continue;
+      num_outside++;
+      opcode last = p->instructions[g->blocks[pred].end - 1].opcode;
+      bool falls_through = last != OPCODE_JMP && last != OPCODE_RET
+        && last != OPCODE_END && last != OPCODE_CALL && !cfg_is_branch(last);
+      if (falls_through && g->blocks[pred].end == header->start) l->preheader = pred;
+    }
+    // Called or reached from elsewhere
+    bool is_entry = false;
+    for (int j = 0; j < g->num_procs; j++) is_entry |= g->procs[j].entry_block == l->header;
+    if (num_outside != 1 || is_entry) l->preheader = -1;
+
+    for (int j = 0; j < l->num_blocks; j++) {
+      opcode last = p->instructions[g->blocks[l->blocks[j]].end - 1].opcode;
+      l->has_calls |= last == OPCODE_CALL || last == OPCODE_RET;
+    }
+  }
+
+  free(worklist);
+  free(loop_of_header);
+}
+
+void cfg_destroy(cfg* g) {
+  for (int i = 0; i < g->num_loops; i++) {
+    free(g->loops[i].contains);
+    free(g->loops[i].blocks);
+  }
+  free(g->loops);
+  free(g->idom);
+  for (int i = 0; i < g->num_procs; i++) {
+    free(g->procs[i].callees);
+  }
+  free(g->procs);
+  free(g->pred_list);
+  free(g->block_of);
+  free(g->blocks);
+}
+
+static void cfg_dump_reg_set(FILE* out, reg_set set) {
+  fputc('{', out);
+  for (int r = 0; r < NUM_REGISTERS; r++) {
+    if (set & (1u << r)) fputc('a' + r, out);
+  }
+  if (set & CFG_FLAGS_BIT) fputs(set & CFG_ALL_REGS ? " cmp" : "cmp", out);
+  fputc('}', out);
+}
+
+void cfg_dump(cfg* g, FILE* out) {
+  for (int i = 0; i < g->num_procs; i++) {
+    procedure* pr = &g->procs[i];
+    fprintf(out, "proc %d (%s): entry B%d, calls", i, pr->name ? pr->name : "<entry>", pr->entry_block);
+    for (int j = 0; j < pr->num_callees; j++) fprintf(out, " %d", pr->callees[j]);
+    fprintf(out, "\n");
+  }
+
+  for (int b = 0; b < g->num_blocks; b++) {
+    basic_block* block = &g->blocks[b];
+    fprintf(out, "B%d [%d, %d) proc %d preds", b, block->start, block->end, block->proc);
+    for (int i = 0; i < block->num_preds; i++) fprintf(out, " B%d", block->preds[i]);
+    fprintf(out, " succs");
+    for (int i = 0; i < block->num_succs; i++) fprintf(out, " B%d", block->succs[i]);
+    fprintf(out, "\n  live in ");
+    cfg_dump_reg_set(out, block->live_in);
+    fprintf(out, " out ");
+    cfg_dump_reg_set(out, block->live_out);
+    fprintf(out, "\n");
+  }
+
+  for (int i = 0; i < g->num_loops; i++) {
+    loop* l = &g->loops[i];
+    fprintf(out, "loop %d: header B%d, preheader ", i, l->header);
+    if (l->preheader == -1) fprintf(out, "none"); else fprintf(out, "B%d", l->preheader);
+    fprintf(out, ", blocks");
+    for (int b = 0; b < g->num_blocks; b++) {
+      if (l->contains[b]) fprintf(out, " B%d", b);
+    }
+    fprintf(out, "%s\n", l->has_calls ? ", has calls" : "");
+  }
+}
+
+#endif // __CFG_H__
@@ -1,231 +1,914 @@
 #include "interp.h"
 
+// C backend.
+//
+// gen_c turns a checked program into a C file that behaves like program_run:
+// same output, same runtime errors (with the same source locations) and the
+// same guest heap. The code is GNU C (computed gotos, statement expressions)
+// and compiles without warnings with -Wall -Wextra.
+//
+// The program becomes a single function, genc_run, that gets everything it
+// needs from whoever calls it through a genc_runtime (the guest stack and
+// heap, where the output goes, how errors are reported). gen_c adds a small
+// runtime and a main to it, so the file can be compiled on its own.
+//
+// Registers are locals and only the instructions that are jumped to get a
+// label. 'call' pushes the index of the next instruction on the stack, like
+// the interpreter does, and 'ret' jumps back through a table that has the
+// address of every return site (program_mark_return_sites). Returning
+// anywhere else (e.g. after an unbalanced push) is reported as an invalid
+// return address, like the interpreter does.
+
+// The interface between genc_run and the host. The same text ends up in the
+// generated file, so both sides always agree on the layout.
+//
+//   stack/stack_size   the guest stack, 'stack_size' int64 entries
+//   heap_base          the guest heap, addresses are offsets into it
+//   heap_limit         see guest_heap_access_limit
+//   malloc_fn/free_fn  'malloc'/'mfree', free_fn returns 0 for invalid addresses
+//   print_fn           output of 'print'
+//   msg_fn             the last 'msg', called when the program ends
+//   error_fn           a runtime_error while running the given instruction
+#define GENC_INTERFACE(...) \
+  __VA_ARGS__               \
+  static const char* genc_interface_src = #__VA_ARGS__;
+
+GENC_INTERFACE(
+typedef struct genc_runtime {
+  void* ctx;
+  int64_t* stack;
+  int64_t stack_size;
+  char* heap_base;
+  uint64_t heap_limit;
+  int64_t (*malloc_fn)(void* ctx, int64_t size);
+  int (*free_fn)(void* ctx, int64_t addr);
+  void (*print_fn)(void* ctx, const char* data, uint64_t len);
+  void (*msg_fn)(void* ctx, const char* data, uint64_t len);
+  void (*error_fn)(void* ctx, int insn_index, int error, int64_t value);
+} genc_runtime;
+)
+
+// Names of the runtime errors in the generated code (GENC_ERROR_*)
+static const char* gen_runtime_error_names[NUM_RUNTIME_ERRORS] = {
+  "DIV_BY_ZERO",
+  "INVALID_MEMORY_ACCESS",
+  "STACK_OVERFLOW",
+  "STACK_UNDERFLOW",
+  "CALLSTACK_OVERFLOW",
+  "CALLSTACK_UNDERFLOW",
+  "INVALID_FREE",
+  "INVALID_RETURN",
+  "INVALID_FRAME",
+};
+
+// Helpers used by genc_run
+static const char* gen_runtime_common =
+  "// Output of 'print' (flushed through the runtime) and 'msg' (kept in memory)\n"
+  "typedef struct genc_buffer {\n"
+  "  char* data;\n"
+  "  uint64_t len;\n"
+  "  uint64_t cap;\n"
+  "  genc_runtime* flush_to; // NULL = grow instead of flushing\n"
+  "} genc_buffer;\n"
+  "\n"
+  "static inline void genc_flush(genc_buffer* b) {\n"
+  "  if (b->flush_to && b->len > 0) {\n"
+  "    b->flush_to->print_fn(b->flush_to->ctx, b->data, b->len);\n"
+  "  }\n"
+  "  b->len = 0;\n"
+  "}\n"
+  "\n"
+  "static void genc_make_room(genc_buffer* b, uint64_t len) {\n"
+  "  if (b->flush_to) {\n"
+  "    genc_flush(b);\n"
+  "    return;\n"
+  "  }\n"
+  "  uint64_t cap = b->cap ? b->cap * 2 : 256;\n"
+  "  while (cap < b->len + len) cap *= 2;\n"
+  "  char* data = (char*) realloc(b->data, cap);\n"
+  "  if (!data) {\n"
+  "    printf(\"failed to alloc memory for the output buffer\\n\");\n"
+  "    exit(1);\n"
+  "  }\n"
+  "  b->data = data;\n"
+  "  b->cap = cap;\n"
+  "}\n"
+  "\n"
+  "static inline void genc_write(genc_buffer* b, const char* data, uint64_t len) {\n"
+  "  if (b->cap - b->len < len) {\n"
+  "    genc_make_room(b, len);\n"
+  "    if (b->flush_to && len > b->cap) {\n"
+  "      b->flush_to->print_fn(b->flush_to->ctx, data, len);\n"
+  "      return;\n"
+  "    }\n"
+  "  }\n"
+  "  if (len > 0) memcpy(b->data + b->len, data, len);\n"
+  "  b->len += len;\n"
+  "}\n"
+  "\n"
+  "static inline void genc_write_int(genc_buffer* b, int64_t value) {\n"
+  "  char buf[24];\n"
+  "  char* end = buf + sizeof(buf);\n"
+  "  char* p = end;\n"
+  "  uint64_t v = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;\n"
+  "  do {\n"
+  "    *--p = (char) ('0' + v % 10);\n"
+  "    v /= 10;\n"
+  "  } while (v != 0);\n"
+  "  if (value < 0) *--p = '-';\n"
+  "  genc_write(b, p, (uint64_t) (end - p));\n"
+  "}\n"
+  "\n"
+  "#define GENC_ERROR(insn_, error_, value_) do { \\\n"
+  "    err_insn = insn_;                           \\\n"
+  "    err = error_;                               \\\n"
+  "    err_value = value_;                         \\\n"
+  "    goto error;                                 \\\n"
+  "  } while (0)\n"
+  "\n"
+  "// Address of a memory operand, like the interpreter (see heap.h)\n"
+  "#define GENC_MEM(insn, base, offset) ({                          \\\n"
+  "    uint64_t addr_ = (uint64_t) (base) + (uint64_t) (offset);    \\\n"
+  "    if (addr_ - GENC_HEAP_NULL_SIZE > heap_limit) {              \\\n"
+  "      GENC_ERROR(insn, GENC_ERROR_INVALID_MEMORY_ACCESS, 0);     \\\n"
+  "    }                                                            \\\n"
+  "    (int64_t*) (heap_base + addr_);                              \\\n"
+  "  })\n"
+  "\n"
+  "#define GENC_ADD(x, y) ((int64_t) ((uint64_t) (x) + (uint64_t) (y)))\n"
+  "#define GENC_SUB(x, y) ((int64_t) ((uint64_t) (x) - (uint64_t) (y)))\n"
+  "#define GENC_MUL(x, y) ((int64_t) ((uint64_t) (x) * (uint64_t) (y)))\n"
+  "// INT64_MIN / -1 traps on x86, so x / -1 is done as a (wrapping) negation\n"
+  "#define GENC_DIV(x, y) ((y) == -1 ? GENC_SUB(0, x) : (x) / (y))\n";
+
+// main and the runtime for standalone files
+static const char* gen_runtime_standalone =
+  "// Guest heap, same layout and allocator as the interpreter (see heap.h)\n"
+  "#define GENC_HEAP_HEADER_SIZE 16\n"
+  "#define GENC_HEAP_MIN_BLOCK 32\n"
+  "#define GENC_HEAP_NUM_CLASSES 16\n"
+  "#define GENC_HEAP_LARGE_CLASS 0xffffffffu\n"
+  "#define GENC_HEAP_MAGIC_USED 0x55534544u\n"
+  "#define GENC_HEAP_MAGIC_FREE 0x46524545u\n"
+  "\n"
+  "typedef struct genc_heap_header {\n"
+  "  uint64_t size;\n"
+  "  uint32_t size_class;\n"
+  "  uint32_t magic;\n"
+  "} genc_heap_header;\n"
+  "\n"
+  "static char* heap;\n"
+  "static uint64_t heap_top = GENC_HEAP_NULL_SIZE;\n"
+  "static uint64_t heap_free_lists[GENC_HEAP_NUM_CLASSES];\n"
+  "static uint64_t heap_large_free_list;\n"
+  "\n"
+  "static int genc_heap_is_block(uint64_t block) {\n"
+  "  return block >= GENC_HEAP_NULL_SIZE\n"
+  "      && block <= heap_top - GENC_HEAP_MIN_BLOCK\n"
+  "      && (block % GENC_HEAP_HEADER_SIZE) == 0;\n"
+  "}\n"
+  "\n"
+  "static uint64_t* genc_heap_next(uint64_t block) {\n"
+  "  return (uint64_t*) (heap + block + GENC_HEAP_HEADER_SIZE);\n"
+  "}\n"
+  "\n"
+  "static uint64_t genc_heap_bump(uint64_t block_size) {\n"
+  "  if (block_size > GENC_HEAP_SIZE - heap_top) return 0;\n"
+  "  uint64_t block = heap_top;\n"
+  "  heap_top += block_size;\n"
+  "  return block;\n"
+  "}\n"
+  "\n"
+  "static uint64_t genc_heap_pop_free(uint64_t* list) {\n"
+  "  uint64_t block = *list;\n"
+  "  if (block == 0) return 0;\n"
+  "  if (!genc_heap_is_block(block)) {\n"
+  "    *list = 0;\n"
+  "    return 0;\n"
+  "  }\n"
+  "  *list = *genc_heap_next(block);\n"
+  "  return block;\n"
+  "}\n"
+  "\n"
+  "static uint64_t genc_heap_alloc_large(uint64_t block_size) {\n"
+  "  uint64_t* link = &heap_large_free_list;\n"
+  "  while (*link != 0) {\n"
+  "    uint64_t block = *link;\n"
+  "    if (!genc_heap_is_block(block)) {\n"
+  "      *link = 0;\n"
+  "      break;\n"
+  "    }\n"
+  "    if (((genc_heap_header*) (heap + block))->size >= block_size) {\n"
+  "      *link = *genc_heap_next(block);\n"
+  "      return block;\n"
+  "    }\n"
+  "    link = genc_heap_next(block);\n"
+  "  }\n"
+  "  uint64_t block = genc_heap_bump(block_size);\n"
+  "  if (block != 0) ((genc_heap_header*) (heap + block))->size = block_size;\n"
+  "  return block;\n"
+  "}\n"
+  "\n"
+  "static int64_t genc_malloc(void* ctx, int64_t size) {\n"
+  "  (void) ctx;\n"
+  "  if (size < 0 || (uint64_t) size > GENC_HEAP_SIZE) return 0;\n"
+  "\n"
+  "  uint64_t needed = (uint64_t) size + GENC_HEAP_HEADER_SIZE;\n"
+  "  uint32_t size_class;\n"
+  "  uint64_t block;\n"
+  "  if (needed <= ((uint64_t) GENC_HEAP_MIN_BLOCK << (GENC_HEAP_NUM_CLASSES - 1))) {\n"
+  "    size_class = needed <= GENC_HEAP_MIN_BLOCK\n"
+  "      ? 0\n"
+  "      : (uint32_t) (64 - __builtin_clzll(needed - 1)) - 5;\n"
+  "    uint64_t block_size = (uint64_t) GENC_HEAP_MIN_BLOCK << size_class;\n"
+  "    block = genc_heap_pop_free(&heap_free_lists[size_class]);\n"
+  "    if (block == 0) block = genc_heap_bump(block_size);\n"
+  "    if (block == 0) return 0;\n"
+  "    ((genc_heap_header*) (heap + block))->size = block_size;\n"
+  "  } else {\n"
+  "    size_class = GENC_HEAP_LARGE_CLASS;\n"
+  "    block = genc_heap_alloc_large((needed + GENC_PAGE_SIZE - 1) & ~(uint64_t) (GENC_PAGE_SIZE - 1));\n"
+  "    if (block == 0) return 0;\n"
+  "  }\n"
+  "\n"
+  "  genc_heap_header* header = (genc_heap_header*) (heap + block);\n"
+  "  header->size_class = size_class;\n"
+  "  header->magic = GENC_HEAP_MAGIC_USED;\n"
+  "  return (int64_t) (block + GENC_HEAP_HEADER_SIZE);\n"
+  "}\n"
+  "\n"
+  "static int genc_free(void* ctx, int64_t addr) {\n"
+  "  (void) ctx;\n"
+  "  if (addr == 0) return 1;\n"
+  "\n"
+  "  uint64_t block = (uint64_t) addr - GENC_HEAP_HEADER_SIZE;\n"
+  "  if (!genc_heap_is_block(block)) return 0;\n"
+  "\n"
+  "  genc_heap_header* header = (genc_heap_header*) (heap + block);\n"
+  "  if (header->magic != GENC_HEAP_MAGIC_USED) return 0;\n"
+  "\n"
+  "  uint64_t* list;\n"
+  "  if (header->size_class == GENC_HEAP_LARGE_CLASS) {\n"
+  "    list = &heap_large_free_list;\n"
+  "  } else if (header->size_class < GENC_HEAP_NUM_CLASSES) {\n"
+  "    list = &heap_free_lists[header->size_class];\n"
+  "  } else {\n"
+  "    return 0;\n"
+  "  }\n"
+  "  header->magic = GENC_HEAP_MAGIC_FREE;\n"
+  "  *genc_heap_next(block) = *list;\n"
+  "  *list = block;\n"
+  "  return 1;\n"
+  "}\n"
+  "\n"
+  "static void genc_print(void* ctx, const char* data, uint64_t len) {\n"
+  "  (void) ctx;\n"
+  "  fwrite(data, 1, len, stdout);\n"
+  "  fflush(stdout);\n"
+  "}\n"
+  "\n"
+  "static char* genc_result = NULL;\n"
+  "\n"
+  "static void genc_msg(void* ctx, const char* data, uint64_t len) {\n"
+  "  (void) ctx;\n"
+  "  genc_result = (char*) malloc(len + 1);\n"
+  "  if (!genc_result) {\n"
+  "    printf(\"failed to alloc memory for the output buffer\\n\");\n"
+  "    exit(1);\n"
+  "  }\n"
+  "  memcpy(genc_result, data, len);\n"
+  "  genc_result[len] = '\\0';\n"
+  "}\n"
+  "\n"
+  "// Same output as the interpreter's error handler (see error.h)\n"
+  "static void genc_error(void* ctx, int insn, int error, int64_t value) {\n"
+  "  (void) ctx;\n"
+  "  const genc_location* loc = &genc_locations[insn];\n"
+  "  printf(\"Error: \");\n"
+  "  printf(genc_error_formats[error], value);\n"
+  "  printf(\" (line: %d column: %d)\\n\", loc->line_number, loc->col_start);\n"
+  "\n"
+  "  if (loc->line == NULL) {\n"
+  "    printf(\"(source not available)\\n\");\n"
+  "    exit(1);\n"
+  "  }\n"
+  "  int line_size = (int) strlen(loc->line);\n"
+  "  int col_size = loc->col_end - loc->col_start;\n"
+  "  printf(\"> %.*s\", loc->col_start, loc->line);\n"
+  "  printf(\"%.*s\", col_size, loc->line + loc->col_start);\n"
+  "  printf(\"%.*s\\n\", line_size - loc->col_end, loc->line + loc->col_start + col_size);\n"
+  "  printf(\"%*s\", 2 + loc->col_start, \" \");\n"
+  "  printf(\"%.*s\", col_size, \"^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^...\");\n"
+  "  printf(\"\\n\");\n"
+  "  exit(1);\n"
+  "}\n"
+  "\n"
+  "int main(void) {\n"
+  "  genc_runtime rt;\n"
+  "  rt.ctx = NULL;\n"
+  "  rt.stack = (int64_t*) calloc(GENC_STACK_SIZE, sizeof(int64_t));\n"
+  "  rt.stack_size = GENC_STACK_SIZE;\n"
+  "  heap = (char*) calloc(GENC_HEAP_SIZE, 1);\n"
+  "  rt.heap_base = heap;\n"
+  "  rt.heap_limit = GENC_HEAP_SIZE - GENC_HEAP_NULL_SIZE - sizeof(int64_t);\n"
+  "  rt.malloc_fn = genc_malloc;\n"
+  "  rt.free_fn = genc_free;\n"
+  "  rt.print_fn = genc_print;\n"
+  "  rt.msg_fn = genc_msg;\n"
+  "  rt.error_fn = genc_error;\n"
+  "  if (!rt.stack || !heap) {\n"
+  "    printf(\"failed to alloc memory for the guest heap/stack\\n\");\n"
+  "    return 1;\n"
+  "  }\n"
+  "\n"
+  "  genc_run(&rt);\n"
+  "  printf(\"Result: '%s'\\n\", genc_result);\n"
+  "  return 0;\n"
+  "}\n";
+
 typedef struct gen_state {
   program* prog;
-  int ret_label_counter;
   FILE* out;
+
+  // Indexed by instruction, with one extra entry for the end of the program
+  char** label_names;
+  bool* is_branch_target;
+  bool* is_return_site; // the program's, see program_mark_return_sites
+
+  uint32_t registers_used; // bit N = register N
+  bool has_ret;
+  bool has_cmp;
+  bool uses_stack;
+  bool uses_frame;
+  bool uses_heap;
+  bool may_fault;
 } gen_state;
 
-void gen_instruction(gen_state* gen, instruction* insn) {
-  FILE* out = gen->out;
-  operand* ops = insn->operands;
+static void gen_state_init(gen_state* gen, program* p, FILE* out) {
+  memset(gen, 0, sizeof(gen_state));
+  gen->prog = p;
+  gen->out = out;
+
+  int n = p->num_instructions + 1;
+  gen->label_names = (char**) calloc(n, sizeof(char*));
+  gen->is_branch_target = (bool*) calloc(n, sizeof(bool));
+  gen->is_return_site = p->is_return_site;
+  if (!gen->label_names || !gen->is_branch_target) {
+    printf("failed to alloc memory for gen_c\n");
+    exit(1);
+  }
 
-  #define EMIT_LINE fprintf(out, "%s", "\n")
-  #define EMIT(str) fprintf(out, "%s", str)
-  #define EMIT_INDENTED(str) fprintf(out, "  %s", str)
-  #define EMITF(fmt, ...) fprintf(out, fmt, __VA_ARGS__)
-  #define EMITF_INDENTED(fmt, ...) fprintf(out, "  "fmt, __VA_ARGS__)
+  for (int i = 0; i < p->num_resolved_labels; i++) {
+    resolved_label* l = &p->resolved_labels[i];
+    if (gen->label_names[l->instruction_index] == NULL) {
+      gen->label_names[l->instruction_index] = l->name;
+    }
+  }
 
-  #define EMIT_REG(op) EMITF("r%c", 'a' + op.reg_index)
+  for (int i = 0; i < p->num_instructions; i++) {
+    instruction* in = &p->instructions[i];
+
+    for (int j = 0; j < in->num_operands; j++) {
+      operand* op = &in->operands[j];
+      switch (op->type) {
+        case OPERAND_REG:
+          gen->registers_used |= 1u << op->reg_index;
+          break;
+        case OPERAND_MEM_ADDRESS:
+          // print/msg don't read memory operands (see OPCODE_PRINT)
+          if (in->opcode == OPCODE_PRINT || in->opcode == OPCODE_MSG) break;
+          gen->registers_used |= 1u << op->reg_index;
+          gen->uses_heap = true;
+          gen->may_fault = true;
+          break;
+        case OPERAND_BRANCH:
+          gen->is_branch_target[op->branch_index] = true;
+          break;
+        default:
+          break;
+      }
+    }
 
-  #define EMIT_REG_OR_INT(op) (op.type == OPERAND_REG  \
-    ? EMIT_REG(op) \
-    : EMITF("%I64d", op.int_value))
-  #define EMIT_REG_IDENT(op) EMIT("  "); EMIT_REG(op);
+    switch (in->opcode) {
+      case OPCODE_CALL: case OPCODE_PUSH: case OPCODE_POP:
+        gen->uses_stack = true;
+        gen->may_fault |= !(in->flags & INSN_NO_STACK_CHECK);
+        break;
+      case OPCODE_RET:
+        gen->has_ret = true;
+        gen->uses_stack = true;
+        gen->may_fault = true;
+        break;
+      case OPCODE_ENTER: case OPCODE_LEAVE:
+        for (int r = in->operands[0].reg_index; r <= in->operands[1].reg_index; r++) {
+          gen->registers_used |= 1u << r;
+        }
+        gen->uses_stack = true;
+        gen->uses_frame = true;
+        gen->may_fault |= in->opcode == OPCODE_LEAVE || !(in->flags & INSN_NO_STACK_CHECK);
+        break;
+      // Jumps may read the flag without a cmp (it starts at zero)
+      case OPCODE_CMP: case OPCODE_DEC_JNE: case OPCODE_DEC_JG:
+      case OPCODE_JNE: case OPCODE_JE: case OPCODE_JGE:
+      case OPCODE_JG: case OPCODE_JLE: case OPCODE_JL:
+        gen->has_cmp = true;
+        break;
+      case OPCODE_DIV: case OPCODE_MFREE:
+        gen->may_fault = true;
+        break;
+      default:
+        break;
+    }
+  }
+}
 
-  #define OP0 ops[0]
-  #define OP1 ops[1]
-  #define LABEL(op) program_get_label_by_index(gen->prog, op.branch_index)
+static void gen_state_destroy(gen_state* gen) {
+  free(gen->label_names);
+  free(gen->is_branch_target);
+}
 
-  EMITF("  /* %5s */", opcode_names[insn->opcode]);
+// Strings are decoded by program_build, so escape them again
+static void gen_c_string_literal(FILE* out, const char* data, int len) {
+  fputc('"', out);
+  for (int i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) data[i];
+    switch (c) {
+      case '\n': fputs("\\n", out); break;
+      case '\t': fputs("\\t", out); break;
+      case '\r': fputs("\\r", out); break;
+      case '"':  fputs("\\\"", out); break;
+      case '\\': fputs("\\\\", out); break;
+      case '?':  fputs("\\?", out); break; // trigraphs
+      default:
+        if (isprint(c)) fputc(c, out);
+        else fprintf(out, "\\%03o", c);
+        break;
+    }
+  }
+  fputc('"', out);
+}
+
+static void gen_int_literal(FILE* out, int64_t value) {
+  if (value == INT64_MIN) {
+    fprintf(out, "INT64_MIN");
+  } else if (value >= INT32_MIN && value <= INT32_MAX) {
+    fprintf(out, "%" PRId64, value);
+  } else {
+    fprintf(out, "INT64_C(%" PRId64 ")", value);
+  }
+}
 
-  switch (insn->opcode) {
-    case OPCODE_MOV:
-      EMIT_REG_IDENT(OP0);
-      EMIT(" = ");
-      EMIT_REG_OR_INT(OP1);
-      EMIT(";");
-      EMIT_LINE;
+#define EMIT(str) fputs(str, out)
+#define EMITF(fmt, ...) fprintf(out, fmt, __VA_ARGS__)
+#define EMIT_REG(reg_index) EMITF("r%c", 'a' + (reg_index))
+
+// The value of a register, integer or memory operand
+static void gen_operand_value(gen_state* gen, int insn_index, operand* op) {
+  FILE* out = gen->out;
+  switch (op->type) {
+    case OPERAND_REG: EMIT_REG(op->reg_index); break;
+    case OPERAND_INT: gen_int_literal(out, op->int_value); break;
+    case OPERAND_MEM_ADDRESS:
+      EMITF("(*GENC_MEM(%d, ", insn_index);
+      EMIT_REG(op->reg_index);
+      EMIT(", ");
+      gen_int_literal(out, op->extra);
+      EMIT("))");
       break;
+    default: assert(0 && "not a value"); break;
+  }
+}
+
+// 'dst = expr', where expr is built by 'fmt' from the current value of the
+// destination (%s) and the source operand.
+static void gen_assignment(gen_state* gen, int insn_index, instruction* in, const char* fmt) {
+  FILE* out = gen->out;
+  operand* dst = &in->operands[0];
+  const char* dst_value = "*t";
+
+  if (dst->type == OPERAND_REG) {
+    EMIT("  ");
+    EMIT_REG(dst->reg_index);
+    EMIT(" = ");
+    dst_value = NULL;
+  } else {
+    EMITF("  { int64_t* t = GENC_MEM(%d, ", insn_index);
+    EMIT_REG(dst->reg_index);
+    EMIT(", ");
+    gen_int_literal(out, dst->extra);
+    EMIT("); *t = ");
+  }
+
+  for (const char* c = fmt; *c; c++) {
+    if (c[0] == '%' && c[1] == 'd') {        // destination
+      if (dst_value) EMIT(dst_value); else EMIT_REG(dst->reg_index);
+      c++;
+    } else if (c[0] == '%' && c[1] == 's') { // source
+      gen_operand_value(gen, insn_index, &in->operands[1]);
+      c++;
+    } else {
+      fputc(*c, out);
+    }
+  }
+
+  EMIT(dst_value ? "; }\n" : ";\n");
+}
+
+static void gen_error_if(gen_state* gen, int insn_index, const char* cond, runtime_error error, const char* value) {
+  fprintf(gen->out, "  if (%s) GENC_ERROR(%d, GENC_ERROR_%s, %s);\n",
+    cond, insn_index, gen_runtime_error_names[error], value);
+}
 
-    case OPCODE_INC: EMIT_REG_IDENT(OP0); EMIT("++;"); EMIT_LINE; break;
-    case OPCODE_DEC: EMIT_REG_IDENT(OP0); EMIT("--;"); EMIT_LINE; break;
+// Bounds check of push/pop/call/ret/enter, unless the optimizer proved it can't fail
+static void gen_stack_check(gen_state* gen, int insn_index, const char* cond, runtime_error error) {
+  if (gen->prog->instructions[insn_index].flags & INSN_NO_STACK_CHECK) return;
+  gen_error_if(gen, insn_index, cond, error, "0");
+}
 
-    #define EMIT_MATH_OP(op) \
-      EMIT_REG_IDENT(OP0);  \
-      EMIT(" "op" "); \
-      EMIT_REG_OR_INT(OP1); \
-      EMIT(";"); \
-      EMIT_LINE;
-    case OPCODE_ADD: EMIT_MATH_OP("+="); break;
-    case OPCODE_SUB: EMIT_MATH_OP("-="); break;
-    case OPCODE_MUL: EMIT_MATH_OP("*="); break;
-    case OPCODE_DIV: EMIT_MATH_OP("/="); break; // TODO: check divbyzero
+static void gen_instruction(gen_state* gen, int insn_index) {
+  FILE* out = gen->out;
+  instruction* in = &gen->prog->instructions[insn_index];
+  operand* ops = in->operands;
+  int i = insn_index;
 
-    case OPCODE_JMP: EMITF_INDENTED("goto %s;", LABEL(OP0)); EMIT_LINE; break;
+  #define OP0 ops[0]
+  #define OP1 ops[1]
+
+  EMITF("  // %s (line %d)\n", opcode_names[in->opcode], in->opcode_pos.line_number);
+
+  switch (in->opcode) {
+    case OPCODE_MOV: gen_assignment(gen, i, in, "%s"); break;
+    case OPCODE_ADD: gen_assignment(gen, i, in, "GENC_ADD(%d, %s)"); break;
+    case OPCODE_SUB: gen_assignment(gen, i, in, "GENC_SUB(%d, %s)"); break;
+    case OPCODE_MUL: gen_assignment(gen, i, in, "GENC_MUL(%d, %s)"); break;
+    case OPCODE_DIV:
+      EMIT("  {\n");
+      EMIT("  int64_t d = ");
+      gen_operand_value(gen, i, &OP1);
+      EMIT(";\n");
+      gen_error_if(gen, i, "d == 0", RUNTIME_ERROR_DIV_BY_ZERO, "0");
+      gen_assignment(gen, i, in, "GENC_DIV(%d, d)");
+      EMIT("  }\n");
+      break;
+    case OPCODE_DIV_NC:
+      EMIT("  {\n");
+      EMIT("  int64_t d = ");
+      gen_operand_value(gen, i, &OP1);
+      EMIT(";\n");
+      gen_assignment(gen, i, in, "GENC_DIV(%d, d)");
+      EMIT("  }\n");
+      break;
+
+    case OPCODE_INC: EMIT("  "); EMIT_REG(OP0.reg_index); EMIT(" = GENC_ADD("); EMIT_REG(OP0.reg_index); EMIT(", 1);\n"); break;
+    case OPCODE_DEC: EMIT("  "); EMIT_REG(OP0.reg_index); EMIT(" = GENC_SUB("); EMIT_REG(OP0.reg_index); EMIT(", 1);\n"); break;
 
     #define EMIT_BRANCH_IF(cond) \
-      EMITF_INDENTED("if (%s) goto %s;", #cond, LABEL(OP0)); EMIT_LINE; break;
-    case OPCODE_JNE: EMIT_BRANCH_IF(cmp != 0);
-    case OPCODE_JE:  EMIT_BRANCH_IF(cmp == 0);
-    case OPCODE_JGE: EMIT_BRANCH_IF(cmp >= 0);
-    case OPCODE_JG:  EMIT_BRANCH_IF(cmp > 0);
-    case OPCODE_JLE: EMIT_BRANCH_IF(cmp <= 0);
-    case OPCODE_JL:  EMIT_BRANCH_IF(cmp < 0);
-
-    // TODO: add explanation
+      EMITF("  if (%s) goto i_%d;\n", cond, OP0.branch_index); break;
+    case OPCODE_JMP: EMITF("  goto i_%d;\n", OP0.branch_index); break;
+    case OPCODE_JNE: EMIT_BRANCH_IF("cmp != 0");
+    case OPCODE_JE:  EMIT_BRANCH_IF("cmp == 0");
+    case OPCODE_JGE: EMIT_BRANCH_IF("cmp >= 0");
+    case OPCODE_JG:  EMIT_BRANCH_IF("cmp > 0");
+    case OPCODE_JLE: EMIT_BRANCH_IF("cmp <= 0");
+    case OPCODE_JL:  EMIT_BRANCH_IF("cmp < 0");
+
+    case OPCODE_DEC_JNE:
+    case OPCODE_DEC_JG:
+      EMIT("  cmp = ");
+      EMIT_REG(OP1.reg_index);
+      EMIT(" = GENC_SUB(");
+      EMIT_REG(OP1.reg_index);
+      EMIT(", 1);\n");
+      EMITF("  if (cmp %s 0) goto i_%d;\n", in->opcode == OPCODE_DEC_JNE ? "!=" : ">", OP0.branch_index);
+      break;
+
     case OPCODE_CALL:
-      EMITF_INDENTED("cs[csp++] = &&__ret_%d; goto %s; __ret_%d:",
-          gen->ret_label_counter,
-          LABEL(OP0),
-          gen->ret_label_counter);
-      EMIT_LINE;
-      gen->ret_label_counter++;
+      gen_stack_check(gen, i, "sp >= stack_size", RUNTIME_ERROR_CALLSTACK_OVERFLOW);
+      EMITF("  stack[sp++] = %d;\n", i + 1);
+      EMITF("  goto i_%d;\n", OP0.branch_index);
       break;
 
     case OPCODE_RET:
-      EMIT_INDENTED("goto *cs[--csp];");
-      EMIT_LINE;
+      gen_stack_check(gen, i, "sp <= 0", RUNTIME_ERROR_CALLSTACK_UNDERFLOW);
+      EMIT("  ret_addr = stack[--sp];\n");
+      EMITF("  if ((uint64_t) ret_addr > %d || !ret_table[ret_addr]) "
+            "GENC_ERROR(%d, GENC_ERROR_INVALID_RETURN, ret_addr);\n",
+            gen->prog->num_instructions, i);
+      EMIT("  goto *ret_table[ret_addr];\n");
       break;
 
     case OPCODE_CMP:
-      EMIT_INDENTED("cmp = ");
-      EMIT_REG_OR_INT(OP0);
-      EMIT(" - ");
-      EMIT_REG_OR_INT(OP1);
-      EMIT(";");
-      EMIT_LINE;
-      break;
-
-    case OPCODE_PRINT:
-    case OPCODE_MSG: {
-      if (insn->opcode == OPCODE_MSG)
-        EMIT_INDENTED("snprintf(msg, 1000, ");
-      else
-        EMIT_INDENTED("printf(");
-
-      // Emit format
-      EMIT("\"");
-      for (int i = 0; i < insn->num_operands; i++) {
-          operand op = insn->operands[i];
-          switch (op.type) {
-            case OPERAND_STR: EMIT("%s"); break;
-            case OPERAND_INT:
-            case OPERAND_REG: EMIT("%d"); break;
-            default: assert(0); break;
-          }
+      EMIT("  cmp = GENC_SUB(");
+      gen_operand_value(gen, i, &OP0);
+      EMIT(", ");
+      gen_operand_value(gen, i, &OP1);
+      EMIT(");\n");
+      break;
+
+    case OPCODE_PUSH:
+      gen_stack_check(gen, i, "sp >= stack_size", RUNTIME_ERROR_STACK_OVERFLOW);
+      EMIT("  stack[sp++] = ");
+      EMIT_REG(OP0.reg_index);
+      EMIT(";\n");
+      break;
+
+    case OPCODE_POP:
+      gen_stack_check(gen, i, "sp <= 0", RUNTIME_ERROR_STACK_UNDERFLOW);
+      EMIT("  ");
+      EMIT_REG(OP0.reg_index);
+      EMIT(" = stack[--sp];\n");
+      break;
+
+    // Same frame layout as the interpreter:
+    //   [saved frame pointer][lo .. hi] <- fp
+    case OPCODE_ENTER: {
+      int lo = OP0.reg_index, n = OP1.reg_index - OP0.reg_index + 1;
+      char cond[64];
+      snprintf(cond, sizeof(cond), "sp + %d > stack_size", n + 1);
+      gen_stack_check(gen, i, cond, RUNTIME_ERROR_STACK_OVERFLOW);
+      EMIT("  stack[sp] = fp;\n");
+      for (int r = 0; r < n; r++) {
+        EMITF("  stack[sp + %d] = ", r + 1);
+        EMIT_REG(lo + r);
+        EMIT(";\n");
       }
-      EMIT("\", ");
-      // Emit values
-      for (int i = 0; i < insn->num_operands; i++) {
-          operand op = insn->operands[i];
-          switch (op.type) {
-            case OPERAND_STR: EMITF("\"%s\"", op.str); break;
-            case OPERAND_INT:
-            case OPERAND_REG: EMIT_REG_OR_INT(op); break;
-            default: assert(0); break;
-          }
-          if (i < insn->num_operands - 1) {
-            EMIT(", ");
-          }
+      EMITF("  sp += %d;\n", n + 1);
+      EMIT("  fp = sp;\n");
+      break;
+    }
+    case OPCODE_LEAVE: {
+      int lo = OP0.reg_index, n = OP1.reg_index - OP0.reg_index + 1;
+      EMITF("  sp = fp - %d;\n", n + 1);
+      gen_error_if(gen, i, "sp < 0", RUNTIME_ERROR_STACK_UNDERFLOW, "0");
+      for (int r = 0; r < n; r++) {
+        EMIT("  ");
+        EMIT_REG(lo + r);
+        EMITF(" = stack[sp + %d];\n", r + 1);
       }
-      EMIT(");");
-      EMIT_LINE;
+      gen_error_if(gen, i, "(uint64_t) stack[sp] > (uint64_t) sp", RUNTIME_ERROR_INVALID_FRAME, "stack[sp]");
+      EMIT("  fp = stack[sp];\n");
       break;
     }
 
-    case OPCODE_PUSH: {
-      EMIT_INDENTED("stack[sp++] = ");
-      EMIT_REG(OP0);
-      EMIT(";");
-      EMIT_LINE;
+    case OPCODE_MSG:
+    case OPCODE_PRINT: {
+      const char* buf = in->opcode == OPCODE_MSG ? "&msg" : "&out";
+      if (in->opcode == OPCODE_MSG) EMIT("  msg.len = 0;\n");
+
+      for (int j = 0; j < in->num_operands; j++) {
+        operand* op = &in->operands[j];
+        switch (op->type) {
+          case OPERAND_STR:
+            EMITF("  genc_write(%s, str_%d, sizeof(str_%d) - 1);\n", buf, (int) op->extra, (int) op->extra);
+            break;
+          case OPERAND_INT:
+          case OPERAND_REG:
+            EMITF("  genc_write_int(%s, ", buf);
+            gen_operand_value(gen, i, op);
+            EMIT(");\n");
+            break;
+          default: {
+            // Same as the interpreter
+            char str[64];
+            int len = snprintf(str, sizeof(str), "<unhandled operand type %d>", op->type);
+            EMITF("  genc_write(%s, ", buf);
+            gen_c_string_literal(out, str, len);
+            EMITF(", %d);\n", len);
+            break;
+          }
+        }
+      }
       break;
     }
 
-    case OPCODE_POP: {
-      EMIT_REG(OP0);
-      EMIT_INDENTED("= stack[--sp];");
-      EMIT_LINE;
+    case OPCODE_MALLOC:
+      EMIT("  ");
+      EMIT_REG(OP1.reg_index);
+      EMIT(" = runtime->malloc_fn(runtime->ctx, ");
+      EMIT_REG(OP0.reg_index);
+      EMIT(");\n");
+      break;
+
+    case OPCODE_MFREE: {
+      char cond[64], value[8];
+      snprintf(cond, sizeof(cond), "!runtime->free_fn(runtime->ctx, r%c)", 'a' + OP0.reg_index);
+      snprintf(value, sizeof(value), "r%c", 'a' + OP0.reg_index);
+      gen_error_if(gen, i, cond, RUNTIME_ERROR_INVALID_FREE, value);
       break;
     }
 
     case OPCODE_END:
-      EMIT_INDENTED("goto __end;");
-      EMIT_LINE;
+      EMIT("  goto done;\n");
+      break;
+
+    case OPCODE_NOP:
       break;
 
     default:
-      printf("opcode not implemented: %s\n", opcode_names[insn->opcode]);
+      assert(0 && "should not reach here");
       break;
   }
+
+  #undef OP0
+  #undef OP1
 }
 
-void gen_insns(gen_state* gen, instruction* instructions, int num_instructions) {
-  for (int i = 0; i < num_instructions; i++) {
-    char* label;
-    if ((label = program_get_label_by_index(gen->prog, i)) != NULL) {
-      fprintf(gen->out, "%s:\n", label);
-    }
-    gen_instruction(gen, &instructions[i]);
-  }
-}
-
-const char* start = "\
-#include <stdio.h>            \n\
-#include <stdint.h>           \n\
-int main(void) {              \n\
-  char msg[1000] = {0};       \n\
-  void* cs[1000] = {0};       \n\
-  uint16_t csp = 0;           \n\
-  int64_t cmp = 0;            \n\
-  uint64_t stack[1000] = {0}; \n\
-  uint16_t sp = 0;            \n\
-";
-
-const char* end = "\
-  __end:    \n\
-  printf(\"%s\\n\", msg); \n\
-  return 0; \n\
-} \n\
-";
-
-void gen_declaration_for_used_registers(gen_state* gen) {
+static void gen_labels(gen_state* gen, int insn_index) {
+  FILE* out = gen->out;
+  if (gen->label_names[insn_index]) {
+    EMITF("  // %s:\n", gen->label_names[insn_index]);
+  }
+  // The end of the program is 'done' in ret_table
+  bool is_ret_target = gen->has_ret && insn_index < gen->prog->num_instructions
+    && gen->is_return_site[insn_index];
+  if (gen->is_branch_target[insn_index] || is_ret_target) {
+    EMITF("i_%d:\n", insn_index);
+  }
+}
+
+// The string constants of the program, 'print' and 'msg' refer to them as str_N
+static void gen_string_constants(gen_state* gen) {
   program* p = gen->prog;
+  for (int i = 0; i < p->num_strings; i++) {
+    fprintf(gen->out, "static const char str_%d[] = ", i);
+    gen_c_string_literal(gen->out, p->strings[i].data, p->strings[i].len);
+    fprintf(gen->out, ";\n");
+  }
+}
 
-  // use each bit (0-25) to mark that a register
-  // was seen in the operands...
-  int registers_used = 0;
+static void gen_run_function(gen_state* gen) {
+  FILE* out = gen->out;
+  program* p = gen->prog;
 
-  // Mark used registers
-  for (int i = 0; i < p->num_instructions; i++) {
-    instruction in = p->instructions[i];
-    for (int j = 0; j < in.num_operands; j++) {
-      operand op = in.operands[j];
-      if (op.type == OPERAND_REG) {
-        registers_used |= 1 << op.reg_index;
+  EMIT("int genc_run(genc_runtime* runtime) {\n");
+
+  if (gen->registers_used) {
+    EMIT("  int64_t ");
+    bool is_first = true;
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+      if (gen->registers_used & (1u << r)) {
+        if (!is_first) EMIT(", ");
+        is_first = false;
+        EMITF("r%c = 0", 'a' + r);
       }
     }
+    EMIT(";\n");
+    // Registers that are only written would be a warning
+    EMIT(" ");
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+      if (gen->registers_used & (1u << r)) EMITF(" (void) r%c;", 'a' + r);
+    }
+    EMIT("\n");
+  }
+
+  if (gen->has_cmp) EMIT("  int64_t cmp = 0;\n");
+  if (gen->uses_stack) {
+    EMIT("  int64_t* const stack = runtime->stack;\n");
+    EMIT("  const int64_t stack_size = runtime->stack_size;\n");
+    EMIT("  int64_t sp = 0;\n");
+    EMIT("  (void) stack_size;\n");
+  }
+  if (gen->uses_frame) EMIT("  int64_t fp = 0;\n");
+  if (gen->has_ret) {
+    EMIT("  int64_t ret_addr;\n");
+    EMITF("  static void* const ret_table[%d] = {\n", p->num_instructions + 1);
+    for (int i = 0; i < p->num_instructions; i++) {
+      if (gen->is_return_site[i]) EMITF("    [%d] = &&i_%d,\n", i, i);
+    }
+    EMITF("    [%d] = &&done,\n", p->num_instructions);
+    EMIT("  };\n");
+  }
+  if (gen->uses_heap) {
+    EMIT("  char* const heap_base = runtime->heap_base;\n");
+    EMIT("  const uint64_t heap_limit = runtime->heap_limit;\n");
+  }
+  if (gen->may_fault) {
+    EMIT("  int err_insn = 0, err = 0;\n");
+    EMIT("  int64_t err_value = 0;\n");
   }
 
-  if (!registers_used) return;
+  EMIT("  char out_data[GENC_OUTPUT_BUFFER_SIZE];\n");
+  EMIT("  genc_buffer out = { out_data, 0, sizeof(out_data), runtime };\n");
+  EMIT("  genc_buffer msg = { NULL, 0, 0, NULL };\n");
+  EMIT("\n");
 
-  // Gen declaration (and initialize with zero).
-  // Like: int ra=0, rb=0, rc=0;
-  fprintf(gen->out, "  int64_t ");
-  bool is_first = true;
-  for (int i = 0; i < 26; i++) {
-    if ((registers_used & (1 << i)) != 0) {
-      if (!is_first) {
-        fprintf(gen->out, ", ");
-      }
-      is_first = false;
-      fprintf(gen->out, "r%c=0", 'a' + i);
+  for (int i = 0; i < p->num_instructions; i++) {
+    gen_labels(gen, i);
+    gen_instruction(gen, i);
+  }
+  gen_labels(gen, p->num_instructions);
+
+  EMIT("  goto done;\n");
+  EMIT("done:\n");
+  EMIT("  genc_flush(&out);\n");
+  EMIT("  runtime->msg_fn(runtime->ctx, msg.data ? msg.data : \"\", msg.len);\n");
+  EMIT("  free(msg.data);\n");
+  EMIT("  return 0;\n");
+
+  if (gen->may_fault) {
+    EMIT("\n");
+    EMIT("error:\n");
+    EMIT("  genc_flush(&out);\n");
+    EMIT("  free(msg.data);\n");
+    EMIT("  runtime->error_fn(runtime->ctx, err_insn, err, err_value);\n");
+    EMIT("  return 1;\n");
+  }
+  EMIT("}\n");
+}
+
+// Where each instruction is in the source, for the standalone error handler
+static void gen_locations(gen_state* gen) {
+  FILE* out = gen->out;
+  program* p = gen->prog;
+  const char* src_code = p->error_handler ? p->error_handler->src_code : NULL;
+
+  EMIT("typedef struct genc_location {\n");
+  EMIT("  int line_number, col_start, col_end;\n");
+  EMIT("  const char* line; // NULL if not available\n");
+  EMIT("} genc_location;\n\n");
+
+  EMITF("static const genc_location genc_locations[%d] = {\n", p->num_instructions + 1);
+  for (int i = 0; i < p->num_instructions; i++) {
+    src_pos* pos = &p->instructions[i].opcode_pos;
+    EMITF("  { %d, %d, %d, ", pos->line_number, pos->col_start, pos->col_end);
+
+    int line_start, line_end;
+    if (src_code && pos->line_number != 0 &&
+        get_line_range(src_code, pos->line_number, &line_start, &line_end)) {
+      gen_c_string_literal(out, src_code + line_start, line_end - line_start);
+    } else {
+      EMIT("NULL");
     }
+    EMIT(" },\n");
+  }
+  EMIT("};\n\n");
+
+  EMIT("static const char* genc_error_formats[] = {\n");
+  for (int i = 0; i < NUM_RUNTIME_ERRORS; i++) {
+    EMIT("  ");
+    gen_c_string_literal(out, runtime_error_formats[i], (int) strlen(runtime_error_formats[i]));
+    EMIT(",\n");
   }
-  fprintf(gen->out, ";");
+  EMIT("};\n");
 }
 
+// Same rounding as guest_heap_init
+static uint64_t gen_heap_size(program* p) {
+  uint64_t size = vmem_round_to_page(p->options.heap_size);
+  if (size < 2 * GUEST_HEAP_NULL_SIZE) size = 2 * GUEST_HEAP_NULL_SIZE;
+  return size;
+}
+
+static void gen_c_file(program* p, FILE* out, bool standalone) {
+  gen_state gen;
+  gen_state_init(&gen, p, out);
+
+  EMIT("// Generated by interp\n");
+  EMIT("#include <stdio.h>\n");
+  EMIT("#include <stdlib.h>\n");
+  EMIT("#include <stdint.h>\n");
+  EMIT("#include <inttypes.h>\n");
+  EMIT("#include <string.h>\n\n");
+
+  if (standalone) {
+    EMITF("#define GENC_STACK_SIZE %" PRIu64 "\n", p->options.stack_size);
+    EMITF("#define GENC_HEAP_SIZE ((uint64_t) %" PRIu64 ")\n", gen_heap_size(p));
+    EMITF("#define GENC_PAGE_SIZE %d\n", (int) vmem_page_size());
+  }
+  EMITF("#define GENC_HEAP_NULL_SIZE %d\n", GUEST_HEAP_NULL_SIZE);
+  EMITF("#define GENC_OUTPUT_BUFFER_SIZE %d\n", OUTPUT_BUFFER_SIZE);
+  for (int i = 0; i < NUM_RUNTIME_ERRORS; i++) {
+    EMITF("#define GENC_ERROR_%s %d\n", gen_runtime_error_names[i], i);
+  }
+  EMIT("\n");
+
+  EMITF("%s\n\n", genc_interface_src);
+  EMITF("%s\n", gen_runtime_common);
+  gen_string_constants(&gen);
+  EMIT("\n");
+  if (standalone) {
+    gen_locations(&gen);
+    EMIT("\n");
+  }
+  gen_run_function(&gen);
+  if (standalone) {
+    EMIT("\n");
+    EMITF("%s", gen_runtime_standalone);
+  }
+
+  gen_state_destroy(&gen);
+}
+
+// A complete program, with its own main (see --emit-c)
 void gen_c(program* p, FILE* out) {
-  gen_state gen_state = {
-    .prog = p,
-    .ret_label_counter = 0,
-    .out = out
-  };
-
-  fprintf(out, "%s", start);
-  gen_declaration_for_used_registers(&gen_state);
-  fprintf(out, "\n  // Instructions\n");
-
-  gen_insns(&gen_state, p->instructions, p->num_instructions);
-  fprintf(out, "%s", end);
-}
\ No newline at end of file
+  gen_c_file(p, out, true);
+}
+
+// Only genc_run, to be loaded by the host (see aot.c)
+void gen_c_shared(program* p, FILE* out) {
+  gen_c_file(p, out, false);
+}
+
+#undef EMIT
+#undef EMITF
+#undef EMIT_REG
@@ -0,0 +1,201 @@
+#ifndef __HEAP_H__
+#define __HEAP_H__
+
+// Guest heap.
+//
+// Each program_run gets its own region (see vmem.h) and the guest only ever
+// sees offsets into it, never host pointers. So 'malloc a, b' gives back an
+// offset and '[b]' / '8[b]' are resolved as 'base + offset' after a single
+// bounds check against the region.
+//
+// Memory layout:
+//
+//   0 .. GUEST_HEAP_NULL_SIZE   never handed out, so 0 can be used as "null"
+//   ... blocks ...              bump allocated, recycled through free lists
+//   top .. size                 never touched (and not backed by memory)
+//
+// Small blocks are grouped in power of two size classes with one free list
+// per class. Bigger blocks are page sized and recycled first fit.
+// Destroying the heap is a single vmem_free.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vmem.h"
+
+#define GUEST_HEAP_DEFAULT_SIZE ((uint64_t) 64 * 1024 * 1024)
+#define GUEST_HEAP_NULL_SIZE 4096
+
+// Every block starts with a header. Payloads are 16 byte aligned.
+#define GUEST_HEAP_HEADER_SIZE 16
+#define GUEST_HEAP_MIN_BLOCK 32
+// Size classes: 32, 64, 128 ... 1M (header included)
+#define GUEST_HEAP_NUM_CLASSES 16
+#define GUEST_HEAP_LARGE_CLASS 0xffffffffu
+
+#define GUEST_HEAP_MAGIC_USED 0x55534544u /* USED */
+#define GUEST_HEAP_MAGIC_FREE 0x46524545u /* FREE */
+
+typedef struct guest_heap_header {
+  uint64_t size; // size of the whole block
+  uint32_t size_class;
+  uint32_t magic;
+} guest_heap_header;
+
+typedef struct guest_heap {
+  char* base;
+  uint64_t size;
+  uint64_t top;
+
+  // Offsets of the first free block for each class (0 = empty).
+  // The offset of the next free block is stored in the block payload.
+  uint64_t free_lists[GUEST_HEAP_NUM_CLASSES];
+  uint64_t large_free_list;
+} guest_heap;
+
+// Highest offset (relative to GUEST_HEAP_NULL_SIZE) that can be used to
+// read or write a int64 without going past the end of the region.
+// Used to check guest memory accesses with a single unsigned compare:
+//   (uint64_t) (addr - GUEST_HEAP_NULL_SIZE) <= guest_heap_access_limit(h)
+static inline uint64_t guest_heap_access_limit(guest_heap* h) {
+  return h->size - GUEST_HEAP_NULL_SIZE - sizeof(int64_t);
+}
+
+bool guest_heap_init(guest_heap* h, uint64_t size) {
+  size = vmem_round_to_page(size);
+  if (size < 2 * GUEST_HEAP_NULL_SIZE) size = 2 * GUEST_HEAP_NULL_SIZE;
+
+  h->base = (char*) vmem_alloc(size);
+  h->size = size;
+  h->top = GUEST_HEAP_NULL_SIZE;
+  h->large_free_list = 0;
+  for (int i = 0; i < GUEST_HEAP_NUM_CLASSES; i++) {
+    h->free_lists[i] = 0;
+  }
+  return h->base != NULL;
+}
+
+void guest_heap_destroy(guest_heap* h) {
+  vmem_free(h->base, h->size);
+  h->base = NULL;
+}
+
+static inline guest_heap_header* guest_heap_header_at(guest_heap* h, uint64_t block) {
+  return (guest_heap_header*) (h->base + block);
+}
+
+// The guest can write anywhere in its own heap, including our headers and
+// the free list links. So everything we read back from the region is
+// validated before being used as an offset.
+static inline bool guest_heap_is_block(guest_heap* h, uint64_t block) {
+  return block >= GUEST_HEAP_NULL_SIZE
+      && block <= h->top - GUEST_HEAP_MIN_BLOCK
+      && (block % GUEST_HEAP_HEADER_SIZE) == 0;
+}
+
+static uint64_t guest_heap_pop_free(guest_heap* h, uint64_t* list) {
+  uint64_t block = *list;
+  if (block == 0) return 0;
+  if (!guest_heap_is_block(h, block)) {
+    // Corrupted by the guest. Just forget about the list.
+    *list = 0;
+    return 0;
+  }
+  *list = *(uint64_t*) (h->base + block + GUEST_HEAP_HEADER_SIZE);
+  return block;
+}
+
+static uint64_t guest_heap_bump(guest_heap* h, uint64_t block_size) {
+  if (block_size > h->size - h->top) {
+    return 0; // out of memory
+  }
+  uint64_t block = h->top;
+  h->top += block_size;
+  return block;
+}
+
+static uint64_t guest_heap_alloc_large(guest_heap* h, uint64_t block_size) {
+  // First fit
+  uint64_t* link = &h->large_free_list;
+  while (*link != 0) {
+    uint64_t block = *link;
+    if (!guest_heap_is_block(h, block)) {
+      *link = 0;
+      break;
+    }
+    guest_heap_header* header = guest_heap_header_at(h, block);
+    uint64_t* next = (uint64_t*) (h->base + block + GUEST_HEAP_HEADER_SIZE);
+    if (header->size >= block_size) {
+      *link = *next;
+      return block;
+    }
+    link = next;
+  }
+
+  uint64_t block = guest_heap_bump(h, block_size);
+  if (block != 0) {
+    guest_heap_header_at(h, block)->size = block_size;
+  }
+  return block;
+}
+
+// Returns the offset of the allocated payload, or 0 if there's no memory left.
+int64_t guest_heap_alloc(guest_heap* h, int64_t size) {
+  if (size < 0 || (uint64_t) size > h->size) return 0;
+
+  uint64_t needed = (uint64_t) size + GUEST_HEAP_HEADER_SIZE;
+  uint64_t block;
+  uint32_t size_class;
+
+  if (needed <= ((uint64_t) GUEST_HEAP_MIN_BLOCK << (GUEST_HEAP_NUM_CLASSES - 1))) {
+    // ceil(log2(needed)) - log2(GUEST_HEAP_MIN_BLOCK)
+    size_class = needed <= GUEST_HEAP_MIN_BLOCK
+      ? 0
+      : (uint32_t) (64 - __builtin_clzll(needed - 1)) - 5;
+
+    uint64_t block_size = (uint64_t) GUEST_HEAP_MIN_BLOCK << size_class;
+    block = guest_heap_pop_free(h, &h->free_lists[size_class]);
+    if (block == 0) {
+      block = guest_heap_bump(h, block_size);
+    }
+    if (block == 0) return 0;
+    guest_heap_header_at(h, block)->size = block_size;
+  } else {
+    size_class = GUEST_HEAP_LARGE_CLASS;
+    block = guest_heap_alloc_large(h, vmem_round_to_page(needed));
+    if (block == 0) return 0;
+  }
+
+  guest_heap_header* header = guest_heap_header_at(h, block);
+  header->size_class = size_class;
+  header->magic = GUEST_HEAP_MAGIC_USED;
+  return (int64_t) (block + GUEST_HEAP_HEADER_SIZE);
+}
+
+// Returns false if 'addr' is not a live block (double free, random number...).
+// Freeing 0 is allowed and does nothing.
+bool guest_heap_free(guest_heap* h, int64_t addr) {
+  if (addr == 0) return true;
+
+  uint64_t block = (uint64_t) addr - GUEST_HEAP_HEADER_SIZE;
+  if (!guest_heap_is_block(h, block)) return false;
+
+  guest_heap_header* header = guest_heap_header_at(h, block);
+  if (header->magic != GUEST_HEAP_MAGIC_USED) return false;
+
+  uint64_t* list;
+  if (header->size_class == GUEST_HEAP_LARGE_CLASS) {
+    list = &h->large_free_list;
+  } else if (header->size_class < GUEST_HEAP_NUM_CLASSES) {
+    list = &h->free_lists[header->size_class];
+  } else {
+    return false;
+  }
+
+  header->magic = GUEST_HEAP_MAGIC_FREE;
+  *(uint64_t*) (h->base + (uint64_t) addr) = *list;
+  *list = block;
+  return true;
+}
+
+#endif // __HEAP_H__
@@ -2,10 +2,18 @@
 #define __INTERP_H__
 
 #include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h> // __rdtsc
+#endif
 
 #include "pch.h"
 #include "lexer.h"
 #include "parser.h"
+#include "heap.h"
+#include "stack.h"
+#include "output.h"
+#include "trace.h"
+#include "replay.h"
 
 const int INVALID_REGISTER_INDEX = -1;
 
@@ -40,9 +48,27 @@ typedef enum opcode {
   // TODO: we could use CALL to call an extern routine...?
   // (malloc, free)
   OPCODE_MALLOC,
-  OPCODE_MFREE
+  OPCODE_MFREE,
+
+  // enter lo, hi / leave lo, hi
+  // Save/restore the registers lo..hi (inclusive) and the frame pointer
+  OPCODE_ENTER,
+  OPCODE_LEAVE,
+
+  // Not available in the source, only made by the optimizer (opt.h)
+  OPCODE_NOP,
+  // dec r; cmp r, 0; jne/jg L  ->  dec_jne L, r / dec_jg L, r
+  OPCODE_DEC_JNE,
+  OPCODE_DEC_JG,
+  // div without the zero check, the divisor is known not to be zero
+  OPCODE_DIV_NC,
+  // Runs a whole block with its registers in host locals (see reg_block).
+  // Only in vm_state.code, operands[0].extra is the index in p->reg_blocks.
+  OPCODE_REG_BLOCK
 } opcode;
 
+#define OPCODE_FIRST_INTERNAL OPCODE_NOP
+
 static const char* opcode_names[] = {
   "<invalid>",
   "mov",
@@ -68,7 +94,14 @@ static const char* opcode_names[] = {
   "push",
   "pop",
   "malloc",
-  "mfree"
+  "mfree",
+  "enter",
+  "leave",
+  "nop",
+  "dec_jne",
+  "dec_jg",
+  "div_nc",
+  "reg_block"
 };
 
 typedef enum operand_type {
@@ -91,7 +124,8 @@ typedef struct operand {
     char* str;
   };
   // XXX
-  // For now we are using this to store the mem_address offset.
+  // For now we are using this to store the mem_address offset,
+  // and the index in program->strings for strings.
   // Later we may want to have a separated struct for this
   // (and for unresolved branch too, maybe.)
   // :operand_struct
@@ -108,8 +142,12 @@ typedef struct operand {
   "memory address"
 };
 
+// instruction.flags, set by the optimizer
+#define INSN_NO_STACK_CHECK (1 << 0) // the stack can't overflow/underflow here (see opt_elide_checks)
+
 typedef struct instruction {
   opcode opcode;
+  int flags;
 
   int num_operands;
   operand* operands; // array of operands. @NOTE: should it be pointers? not sure
@@ -128,6 +166,154 @@ typedef struct resolved_label {
   src_pos name_pos;
 } resolved_label;
 
+// run_options.profile (--profile)
+typedef enum profile_mode {
+  PROFILE_OFF,
+  PROFILE_COUNTS, // times each instruction ran
+  PROFILE_CYCLES, // and the cycles spent on it (rdtsc, or ns elsewhere)
+} profile_mode;
+
+// Knobs for program_run.
+// program_build fills this with the defaults (see run_options_init),
+// so it can be tweaked between program_build and program_run.
+typedef struct run_options {
+  uint64_t heap_size; // in bytes
+  uint64_t stack_size; // in entries (pushed values and return addresses)
+  int opt_level; // 0 = run the program as written (see program_optimize)
+  bool inline_calls; // copy small procedures into their callers (opt_level > 0)
+  bool cache_registers; // run simple blocks with their registers in locals (opt_level > 0)
+  profile_mode profile; // fill program.profile (see profile.h for the report)
+  bool sample; // publish the pc and the calls for the sampling profiler (sample.h)
+  const char* trace; // file to trace the run to (trace.h), NULL = off
+  uint64_t trace_records; // kept in the trace
+  const char* record; // file to record the run to (replay.h), NULL = off
+  uint64_t checkpoint_every; // instructions between the checkpoints of a recording
+  const char* replay; // recording to check the run against, NULL = off
+  uint64_t replay_from; // checkpoint the replay starts from, 0 = the start
+} run_options;
+
+void run_options_init(run_options* opts) {
+  opts->heap_size = GUEST_HEAP_DEFAULT_SIZE;
+  opts->stack_size = GUEST_STACK_DEFAULT_ENTRIES;
+  opts->opt_level = 1;
+  opts->inline_calls = true;
+  opts->cache_registers = true;
+  opts->profile = PROFILE_OFF;
+  opts->sample = false;
+  opts->trace = NULL;
+  opts->trace_records = TRACE_DEFAULT_RECORDS;
+  opts->record = NULL;
+  opts->checkpoint_every = REPLAY_DEFAULT_CHECKPOINT_EVERY;
+  opts->replay = NULL;
+  opts->replay_from = 0;
+}
+
+// String constants, decoded once by program_build.
+// 'data' is also NUL terminated, so it can be printed as is.
+typedef struct string_constant {
+  char* data;
+  int len;
+} string_constant;
+
+// Prints a string constant the way it would be written in the source
+static void print_string_constant(string_constant* str) {
+  printf("'");
+  for (int i = 0; i < str->len; i++) {
+    char c = str->data[i];
+    switch (c) {
+      case '\n': printf("\\n"); break;
+      case '\t': printf("\\t"); break;
+      case '\r': printf("\\r"); break;
+      case '\\': printf("\\\\"); break;
+      default: putchar(c); break;
+    }
+  }
+  printf("'");
+}
+
+// A block of instructions that only do arithmetic on at most
+// REG_BLOCK_MAX_REGS registers (and maybe branch at the end). vm_exec runs
+// it with vm_run_reg_block, which keeps those registers in host locals and
+// writes them back once, when leaving the block. A block that branches to
+// itself loops without leaving.
+#define REG_BLOCK_MAX_REGS 4
+
+// reg_block_op.code is RB_CODE(kind, dst slot, src slot). '_I' kinds take
+// 'imm' instead of a src slot.
+typedef enum reg_block_op_kind {
+  RB_MOV_R, RB_MOV_I,
+  RB_ADD_R, RB_ADD_I,
+  RB_SUB_R, RB_SUB_I,
+  RB_MUL_R, RB_MUL_I,
+  RB_DIV_R, RB_DIV_I, // divisor known not to be zero (div_nc)
+  RB_CMP_R, RB_CMP_I,
+  RB_INC, RB_DEC,
+} reg_block_op_kind;
+
+#define RB_CODE(kind, dst, src) (((kind) << 4) | ((dst) << 2) | (src))
+
+typedef struct reg_block_op {
+  int code;
+  int64_t imm;
+} reg_block_op;
+
+typedef struct reg_block {
+  int start, end; // the instructions it replaces
+  int regs[REG_BLOCK_MAX_REGS]; // register of each slot
+  unsigned load;  // slots read before being written, bit per slot
+  unsigned store; // slots written and live after the block
+  reg_block_op* ops;
+  int num_ops;
+
+  // Last instruction, OPCODE_NOP if the block just falls through to 'end'.
+  // 'target' is where jumps go, 'branch_slot' the register of dec_jne/dec_jg.
+  opcode branch;
+  int target;
+  int branch_slot;
+} reg_block;
+
+// A call that hasn't returned yet, for the call graph
+typedef struct profile_frame {
+  uint32_t proc; // see profile_data.procs
+  uint64_t start_insns;
+  uint64_t start_ns;
+  uint64_t child_insns; // spent in the calls it made
+  uint64_t child_ns;
+} profile_frame;
+
+// Per procedure (see profile_data.procs). Inclusive counts
+// include the procedures it called, a recursive procedure only adds them
+// in its outermost frame.
+typedef struct profile_proc {
+  uint64_t calls;
+  uint64_t incl_insns, excl_insns;
+  uint64_t incl_ns, excl_ns;
+  uint32_t active; // frames on the stack
+} profile_proc;
+
+typedef struct profile_edge {
+  uint32_t caller, callee; // procedures
+  uint64_t calls; // 0 = free slot in profile_data.edges
+} profile_edge;
+
+// Added up over every program_run
+typedef struct profile_data {
+  // By instruction index
+  uint64_t* counts;
+  uint64_t* cycles; // NULL unless PROFILE_CYCLES
+
+  // Call graph, from the calls and rets that ran
+  uint64_t executed; // instructions
+  // 0 is the top level, a procedure entered at instruction i is i + 1
+  profile_proc* procs; // num_instructions + 2
+  profile_frame* frames;
+  int num_frames;
+  int frames_cap;
+  profile_edge* edges; // hash table, edges_cap is a power of 2
+  int num_edges;
+  int edges_cap;
+} profile_data;
+
 typedef struct program { // TODO: not sure how to call this
   instruction* instructions;
   int num_instructions;
@@ -135,8 +321,31 @@ typedef struct program { // TODO: not sure how to call this
   int num_resolved_labels;
   resolved_label* resolved_labels;
 
+  // Every string operand points to one of these (operand.extra is the
+  // index), identical strings share the same constant.
+  string_constant* strings;
+  int num_strings;
+
+  // Index of each instruction (and of the end) in the source, set when the
+  // optimizer removes instructions. NULL = same as the source.
+  // See program_insn_origin.
+  int* insn_origin;
+
+  // Where a 'ret' may go, by instruction (and the end), see
+  // program_mark_return_sites
+  bool* is_return_site;
+
+  // Made by opt_cache_registers, vm_exec runs them in place of the
+  // instructions they cover.
+  reg_block* reg_blocks;
+  int num_reg_blocks;
+
+  // Made by program_run when options.profile is set
+  profile_data* profile;
+
   error_handler* error_handler;
   // TOOD: add flags? FLAG_DEBUGGING, FLAG_PRINT_MSG
+  run_options options;
 } program;
 
 static int count_instructions(top_level_node* n) {
@@ -149,7 +358,7 @@ static int count_instructions(top_level_node* n) {
 
 static opcode get_opcode(char* name) {
   // TODO: better lookup... ?
-  for (int i = 1; i < sizeof(opcode_names) / sizeof(opcode_names[0]); i++) {
+  for (int i = 1; i < OPCODE_FIRST_INTERNAL; i++) {
     if (strcmp(opcode_names[i], name) == 0) {
       return (opcode) i;
     }
@@ -173,6 +382,29 @@ static int token_to_reg_index(token* tok) {
   return (int) c - 'a';
 }
 
+// Decodes the escape sequences of a string literal (\n, \t, \r and \\).
+// Unknown sequences are kept as they are.
+static char* decode_string_literal(const char* str) {
+  if (strchr(str, '\\') == NULL) return (char*) str;
+
+  char* decoded = (char*) malloc(strlen(str) + 1);
+  char* out = decoded;
+  while (*str) {
+    if (str[0] == '\\' && str[1] != '\0') {
+      char c = str[1];
+      switch (c) {
+        case 'n': *out++ = '\n'; str += 2; continue;
+        case 't': *out++ = '\t'; str += 2; continue;
+        case 'r': *out++ = '\r'; str += 2; continue;
+        case '\\': *out++ = '\\'; str += 2; continue;
+      }
+    }
+    *out++ = *str++;
+  }
+  *out = '\0';
+  return decoded;
+}
+
 void convert_operand(opcode opc, node* node, operand* op) {
   if (node->type == NODE_TYPE_OPERAND_SIMPLE) {
     token* tok = ((operand_simple_node* ) node)->token;
@@ -183,7 +415,7 @@ void convert_operand(opcode opc, node* node, operand* op) {
         break;
       case TT_STRING:
         op->type = OPERAND_STR;
-        op->str = tok->s;
+        op->str = decode_string_literal(tok->s);
         break;
       case TT_SYMBOL:
         // If it's a symbol it is either a register or a label
@@ -218,6 +450,7 @@ void convert_instruction_node(instruction_node* n, instruction* ins) {
   opcode opc = get_opcode(n->opcode->s);
 
   ins->opcode = opc;
+  ins->flags = 0;
   ins->operands = NULL;
   ins->num_operands = n->num_operands;
   token_copy_position(&ins->opcode_pos, n->opcode);
@@ -230,6 +463,117 @@ void convert_instruction_node(instruction_node* n, instruction* ins) {
   }
 }
 
+static uint32_t hash_bytes(const char* data, int len) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h = (h ^ (uint8_t) data[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Open addressing table of label names, holds indexes in 'labels' (-1 =
+// empty). Sized for 'num_labels', to be filled with label_table_add.
+static int* label_table_new(int num_labels, int* table_size) {
+  int size = 16;
+  while (size < num_labels * 2) size *= 2;
+  int* table = (int*) malloc(size * sizeof(int));
+  if (!table) {
+    printf("failed to alloc memory for the labels\n");
+    exit(1);
+  }
+  memset(table, -1, size * sizeof(int));
+  *table_size = size;
+  return table;
+}
+
+// Slot of 'name' in the table, or the empty slot where it would go
+static int label_table_slot(int* table, int table_size, resolved_label* labels, const char* name) {
+  uint32_t slot = hash_bytes(name, (int) strlen(name)) & (table_size - 1);
+  while (table[slot] != -1 && strcmp(labels[table[slot]].name, name) != 0) {
+    slot = (slot + 1) & (table_size - 1);
+  }
+  return slot;
+}
+
+// Adds labels[index] unless a label with its name is there already.
+// Returns the index of the one in the table.
+static int label_table_add(int* table, int table_size, resolved_label* labels, int index) {
+  int slot = label_table_slot(table, table_size, labels, labels[index].name);
+  if (table[slot] == -1) table[slot] = index;
+  return table[slot];
+}
+
+// Moves the (already decoded) string operands to p->strings.
+static void build_string_pool(program* p) {
+  int num_str_operands = 0;
+  for (int i = 0; i < p->num_instructions; i++) {
+    instruction* in = &p->instructions[i];
+    for (int j = 0; j < in->num_operands; j++) {
+      num_str_operands += in->operands[j].type == OPERAND_STR;
+    }
+  }
+
+  p->strings = NULL;
+  p->num_strings = 0;
+  if (num_str_operands == 0) return;
+
+  // Open addressing, holds indexes in p->strings (-1 = empty)
+  int table_size = 16;
+  while (table_size < num_str_operands * 2) table_size *= 2;
+  int* table = (int*) malloc(table_size * sizeof(int));
+  memset(table, -1, table_size * sizeof(int));
+
+  string_constant* strings = NULL;
+  for (int i = 0; i < p->num_instructions; i++) {
+    instruction* in = &p->instructions[i];
+    for (int j = 0; j < in->num_operands; j++) {
+      operand* op = &in->operands[j];
+      if (op->type != OPERAND_STR) continue;
+
+      int len = (int) strlen(op->str);
+      uint32_t slot = hash_bytes(op->str, len) & (table_size - 1);
+      while (table[slot] != -1) {
+        string_constant* s = &strings[table[slot]];
+        if (s->len == len && memcmp(s->data, op->str, len) == 0) break;
+        slot = (slot + 1) & (table_size - 1);
+      }
+
+      if (table[slot] == -1) {
+        string_constant s = { .data = op->str, .len = len };
+        table[slot] = sb_count(strings);
+        sb_push(strings, s);
+      }
+
+      op->extra = table[slot];
+      op->str = strings[table[slot]].data;
+    }
+  }
+  free(table);
+
+  p->strings = strings;
+  p->num_strings = sb_count(strings);
+}
+
+// A 'ret' may only go to the instruction after a 'call', or to the end of
+// the program (like a branch there). Anything else, e.g. a value pushed in
+// place of the return address, is an invalid return address, in vm_exec and
+// in gen_c alike. The optimizer marks them again when it moves instructions
+// or changes calls.
+void program_mark_return_sites(program* p) {
+  int n = p->num_instructions;
+  free(p->is_return_site);
+  p->is_return_site = (bool*) calloc(n + 1, sizeof(bool));
+  if (!p->is_return_site) {
+    printf("failed to alloc memory for the return sites\n");
+    exit(1);
+  }
+  for (int i = 0; i < n; i++) {
+    if (p->instructions[i].opcode == OPCODE_CALL) p->is_return_site[i + 1] = true;
+  }
+  p->is_return_site[n] = true;
+}
+
 void program_build(program* p, top_level_node* top_node) {
   int total_instructions = count_instructions(top_node);
 
@@ -242,9 +586,7 @@ void program_build(program* p, top_level_node* top_node) {
     cur_instruction++;
   }
 
-  // @perf
-  // Simple implementation...
-  // Uses a list to map between 'label name' and 'instruction index'.
+  // Maps 'label name' to 'instruction index'
   resolved_label* resolved_labels = (resolved_label*) malloc(
     top_node->num_labels * sizeof(resolved_label));
   int cur_resolved_label = 0;
@@ -266,9 +608,14 @@ void program_build(program* p, top_level_node* top_node) {
 
   assert(cur_instruction == total_instructions);
 
-  // Resolve labels
-  // @PERF
-  // O(n^2) lookup
+  // Resolve labels, a duplicated label resolves to the first one (it's an
+  // error anyway, see check_for_duplicated_labels)
+  int table_size;
+  int* table = label_table_new(cur_resolved_label, &table_size);
+  for (int i = 0; i < cur_resolved_label; i++) {
+    label_table_add(table, table_size, resolved_labels, i);
+  }
+
   for (int i = 0; i < cur_instruction; i++) {
     instruction in = instructions[i];
 
@@ -277,21 +624,33 @@ void program_build(program* p, top_level_node* top_node) {
     }
 
     char* target_label = in.operands[0].str;
-    for (int i = 0; i < top_node->num_labels; i++) {
-      if (strcmp(resolved_labels[i].name, target_label) == 0) {
-        in.operands[0].str = NULL;
+    int slot = label_table_slot(table, table_size, resolved_labels, target_label);
+    if (table[slot] != -1) {
+      in.operands[0].str = NULL;
 
-        in.operands[0].type = OPERAND_BRANCH;
-        in.operands[0].branch_index = resolved_labels[i].instruction_index;
-        break;
-      }
+      in.operands[0].type = OPERAND_BRANCH;
+      in.operands[0].branch_index = resolved_labels[table[slot]].instruction_index;
     }
   }
+  free(table);
 
   p->num_resolved_labels = cur_resolved_label;
   p->resolved_labels = resolved_labels;
   p->instructions = instructions;
   p->num_instructions = cur_instruction;
+  p->insn_origin = NULL;
+  p->is_return_site = NULL;
+  p->reg_blocks = NULL;
+  p->num_reg_blocks = 0;
+  p->profile = NULL;
+  build_string_pool(p);
+  run_options_init(&p->options);
+  program_mark_return_sites(p);
+}
+
+// Index 'insn_index' had before the program was optimized
+int program_insn_origin(program* p, int insn_index) {
+  return p->insn_origin ? p->insn_origin[insn_index] : insn_index;
 }
 
 char* program_get_label_by_index(program* p, int insn_index) {
@@ -321,13 +680,13 @@ static void program_report_errorf(program* p, src_pos* pos, const char* fmt, ...
   program_report_error(p, msg_buf, pos);
 }
 
-static void require_operand_types(
+static bool require_operand_types(
   program* p, instruction* insn, int op_index,
   operand_type types[], int num_types
 ) {
   operand operand = insn->operands[op_index];
   for (int i = 0; i < num_types; i++) {
-    if (operand.type == types[i]) return;
+    if (operand.type == types[i]) return true;
   }
 
   assert(op_index <= 2);
@@ -335,7 +694,7 @@ static void require_operand_types(
 
   #define MSG_BUF_LEN 300
   static char msg_buf[MSG_BUF_LEN];
-  static char* msg_buf_ptr = msg_buf;
+  char* msg_buf_ptr = msg_buf;
 
   msg_buf_ptr += snprintf(msg_buf_ptr, MSG_BUF_LEN, "opcode '%s' requires a ",
     opcode_names[insn->opcode]);
@@ -343,8 +702,9 @@ static void require_operand_types(
   for (int i = 0; i < num_types; i++) {
     msg_buf_ptr += sprintf(msg_buf_ptr, "'%s'", friendly_operand_type_names[types[i]]);
     if (i < num_types - 1) {
-      static const char* separators[] = {", ", " or "};
-      const char* separator = separators[i + 2 > num_types ? 0 : 1];
+      // 'a', a 'b' or a 'c'
+      static const char* separators[] = {", a ", " or a "};
+      const char* separator = separators[i == num_types - 2 ? 1 : 0];
       msg_buf_ptr += sprintf(msg_buf_ptr, "%s", separator);
     }
   }
@@ -355,6 +715,7 @@ static void require_operand_types(
 
   program_report_error(p, msg_buf, &operand.pos);
   #undef MSG_BUF_LEN
+  return false;
 }
 
 static void check_operands(program* p, instruction* insn) {
@@ -398,14 +759,18 @@ static void check_operands(program* p, instruction* insn) {
 
   #define REQUIRE_OPERAND_TYPES(op_index, ...) do {           \
     operand_type types[] = { __VA_ARGS__ };                \
-    require_operand_types(p, insn, op_index, types, sizeof(types) / sizeof(types[0])); \
+    if (!require_operand_types(p, insn, op_index, types,   \
+                               sizeof(types) / sizeof(types[0]))) { \
+      return;                                              \
+    }                                                      \
   } while (0);
 
   switch (opcode) {
     // 'reg, reg'   or   'reg, int'
     case OPCODE_MOV: case OPCODE_ADD: case OPCODE_SUB:
-    case OPCODE_MUL: case OPCODE_DIV: {
+    case OPCODE_MUL: case OPCODE_DIV: case OPCODE_DIV_NC: {
       REQUIRE_NUM_OPERANDS(2);
+      REQUIRE_OPERAND_TYPES(0, OPERAND_REG, OPERAND_MEM_ADDRESS);
       REQUIRE_OPERAND_TYPES(1, OPERAND_REG, OPERAND_INT, OPERAND_MEM_ADDRESS);
       break;
     }
@@ -455,9 +820,24 @@ static void check_operands(program* p, instruction* insn) {
       break;
     }
 
+    case OPCODE_ENTER: case OPCODE_LEAVE: {
+      REQUIRE_NUM_OPERANDS(2);
+      REQUIRE_OPERAND_TYPES(0, OPERAND_REG);
+      REQUIRE_OPERAND_TYPES(1, OPERAND_REG);
+      if (operands[0].reg_index > operands[1].reg_index) {
+        program_report_errorf(p, &operands[1].pos,
+          "invalid register range for opcode '%s', '%c' comes before '%c'",
+          opcode_names[opcode],
+          'a' + operands[1].reg_index, 'a' + operands[0].reg_index);
+        return;
+      }
+      break;
+    }
+
     // Nothing to check I guess
     case OPCODE_MSG:
     case OPCODE_PRINT: break;
+    case OPCODE_NOP: case OPCODE_DEC_JNE: case OPCODE_DEC_JG: break;
     default: assert(0);
   }
 }
@@ -476,19 +856,18 @@ static void check_instructions(program* p) {
 }
 
 static void check_for_duplicated_labels(program *p) {
-  // TODO @perf
+  // The first label that has the name of one before it
+  int table_size;
+  int* table = label_table_new(p->num_resolved_labels, &table_size);
   for (int i = 0; i < p->num_resolved_labels; i++) {
-    resolved_label* l = &p->resolved_labels[i];
-
-    for (int j = i + 1; j < p->num_resolved_labels; j++) {
-      resolved_label* l2 = &p->resolved_labels[j];
-
-      if (strcmp(l->name, l2->name) == 0) {
-        program_report_errorf(p, &l2->name_pos, "duplicated label '%s'.", l2->name);
-        return;
-      }
+    if (label_table_add(table, table_size, p->resolved_labels, i) != i) {
+      resolved_label* l = &p->resolved_labels[i];
+      free(table);
+      program_report_errorf(p, &l->name_pos, "duplicated label '%s'.", l->name);
+      return;
     }
   }
+  free(table);
 }
 
 void xxdisasm_single_insn(program* prg, int insn_index, instruction in, char **ident) {
@@ -507,9 +886,10 @@ void xxdisasm_single_insn(program* prg, int insn_index, instruction in, char **i
     if (op.type == OPERAND_REG) {
       printf(" %c", (char) ('a' + op.reg_index));
     } else if (op.type == OPERAND_INT)   {
-      printf(" %I64d", op.int_value);
+      printf(" %" PRId64, op.int_value);
     } else if (op.type == OPERAND_STR) {
-      printf(" '%s'", op.str);
+      printf(" ");
+      print_string_constant(&prg->strings[op.extra]);
     } else if (op.type == OPERAND_BRANCH) {
       char* label_name = program_get_label_by_index(prg, op.branch_index);
       assert(label_name);
@@ -518,7 +898,7 @@ void xxdisasm_single_insn(program* prg, int insn_index, instruction in, char **i
     } else if (op.type == OPERAND_UNRESOLVED_BRANCH) {
       printf(" <unknown label %s>", op.str);
     } else if (op.type == OPERAND_MEM_ADDRESS) {
-      printf(" %I64i[%c]", op.extra, (char) ('a' + op.reg_index));
+      printf(" %" PRId64 "[%c]", op.extra, (char) ('a' + op.reg_index));
     } else {
       printf(" <unhandled op type %d>", op.type);
     }
@@ -538,34 +918,765 @@ void program_check(program* p) {
 //  mov mem, reg    -> OPCODE_MOV_MR
 // this will eliminate the if's to check operand types...
 
-#define MAX_CALL_STACK 1000
 #define NUM_REGISTERS 26
-#define MAX_MSG 1000
-#define MAX_STACK 500
+#define VM_SAMPLE_MAX_DEPTH 1024
+
+// State of a running program.
+typedef struct vm_state {
+  int64_t registers[NUM_REGISTERS];
+
+  // What vm_exec runs: p->instructions, or a copy with OPCODE_REG_BLOCK at
+  // the start of each of p->reg_blocks
+  instruction* code;
+  operand* reg_block_operands;
+
+  // Index of the instruction being executed. vm_exec only stores it
+  // before instructions that may fault on a stack guard page.
+  uint32_t pc;
+
+  // Only with options.sample, read by the SIGPROF handler in sample.h.
+  // sample_pc is the instruction running (or the reg_block), sample_calls
+  // the targets of the calls not returned from yet, outermost first. Past
+  // VM_SAMPLE_MAX_DEPTH only sample_depth keeps counting.
+  volatile uint32_t sample_pc;
+  volatile uint32_t sample_depth;
+  uint32_t* sample_calls;
+
+  // Only with options.trace: where the records go, and the trace_record.reg
+  // of each instruction
+  trace_ring* trace;
+  uint8_t* trace_dst;
+
+  // Only with options.record or options.replay. vm_exec starts from the
+  // start_* state, which is the checkpoint of options.replay_from if any.
+  replay_log* replay;
+  uint64_t start_insn;
+  uint32_t start_pc;
+  int64_t start_cmp;
+  uint64_t start_stack_len;
+  uint64_t start_frame;
+
+  output_buffer out; // print, flushed to stdout
+  output_buffer msg; // msg, returned by program_run
+
+  guest_heap heap;
+  // Holds both the values pushed by the program and the return addresses
+  guest_stack stack;
+#if GUEST_STACK_GUARD_PAGES
+  guest_stack_trap stack_trap;
+#endif
+} vm_state;
+
+// Reports a runtime error. Flushes what was printed so far first, so
+// the output and the error come out in order.
+static void vm_report_errorf(program* p, vm_state* vm, src_pos* pos, const char* fmt, ...) {
+  static char msg_buf[1024];
 
-char* program_run(program* p) {
-  char* msg = (char*) malloc(MAX_MSG);
-  msg[0] = '\0';
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(msg_buf, 1024, fmt, args);
+  va_end(args);
 
-  int64_t registers[NUM_REGISTERS] = {0};
+  output_flush(&vm->out);
+  program_report_error(p, msg_buf, pos);
+}
+
+// Errors a program can hit while running. The C backend (genc.c) reports
+// the same ones, so the messages live in a table both can use.
+typedef enum runtime_error {
+  RUNTIME_ERROR_DIV_BY_ZERO,
+  RUNTIME_ERROR_INVALID_MEMORY_ACCESS,
+  RUNTIME_ERROR_STACK_OVERFLOW,
+  RUNTIME_ERROR_STACK_UNDERFLOW,
+  RUNTIME_ERROR_CALLSTACK_OVERFLOW,
+  RUNTIME_ERROR_CALLSTACK_UNDERFLOW,
+  RUNTIME_ERROR_INVALID_FREE,
+  RUNTIME_ERROR_INVALID_RETURN,
+  RUNTIME_ERROR_INVALID_FRAME,
+  NUM_RUNTIME_ERRORS
+} runtime_error;
+
+// Formatted with the int64 value that caused the error (if any)
+static const char* runtime_error_formats[NUM_RUNTIME_ERRORS] = {
+  "division by zero occurred while executing this instruction",
+  "invalid memory access while executing this instruction",
+  "stack overflow",
+  "stack underflow",
+  "callstack overflow",
+  "callstack underflow",
+  "invalid address (%" PRId64 ") passed to mfree",
+  "invalid return address %" PRId64 " (unbalanced push/pop?)",
+  "invalid stack frame",
+};
+
+static void vm_report_runtime_error(program* p, vm_state* vm, uint32_t pc, runtime_error error, int64_t value) {
+  vm_report_errorf(p, vm, &p->instructions[pc].opcode_pos, runtime_error_formats[error], value);
+}
+
+// vm->pc tells program_run which instruction hit a guard page. The barrier
+// keeps the compiler from sinking the store below the access that faults.
+#if GUEST_STACK_GUARD_PAGES
+  #define SYNC_PC() do { vm->pc = pc; __asm__ __volatile__("" ::: "memory"); } while (0)
+#else
+  #define SYNC_PC() (vm->pc = pc)
+#endif
+
+// Without guard pages we have to check the stack bounds ourselves
+#if GUEST_STACK_GUARD_PAGES
+  #define CHECK_STACK(cond, error) (void) 0
+#else
+  #define CHECK_STACK(cond, error) \
+    if (!(in.flags & INSN_NO_STACK_CHECK) && (cond)) RUNTIME_ERROR(error, 0)
+#endif
+
+typedef struct reg_block_exit {
+  uint32_t pc;
+  int64_t cmp;
+} reg_block_exit;
+
+// Runs 'b' with its registers in r0..r3. Every op is a case for each slot,
+// so the compiler sees constant slots and never takes their address.
+static reg_block_exit vm_run_reg_block(reg_block* b, int64_t* registers, int64_t cmp) {
+  int64_t r0 = 0, r1 = 0, r2 = 0, r3 = 0;
+  if (b->load & 1) r0 = registers[b->regs[0]];
+  if (b->load & 2) r1 = registers[b->regs[1]];
+  if (b->load & 4) r2 = registers[b->regs[2]];
+  if (b->load & 8) r3 = registers[b->regs[3]];
+
+  #define RB_GET(i) ((i) == 0 ? r0 : (i) == 1 ? r1 : (i) == 2 ? r2 : r3)
+  #define RB_SET(i, v) do {                  \
+    int64_t v__ = (v);                       \
+    if ((i) == 0) r0 = v__;                  \
+    else if ((i) == 1) r1 = v__;             \
+    else if ((i) == 2) r2 = v__;             \
+    else r3 = v__;                           \
+  } while (0)
+
+  // F(d, x, y) with d the dst slot, x its value and y the src slot or imm
+  #define RB_OP_R(kind, d, s, F) \
+    case RB_CODE(kind, d, s): { int64_t x = RB_GET(d), y = RB_GET(s); (void) x; (void) y; F(d, x, y); break; }
+  #define RB_OP_I(kind, d, F) \
+    case RB_CODE(kind, d, 0): { int64_t x = RB_GET(d), y = op->imm; (void) x; (void) y; F(d, x, y); break; }
+  #define RB_FOR_SLOTS_R(kind, F) \
+    RB_OP_R(kind, 0, 0, F) RB_OP_R(kind, 0, 1, F) RB_OP_R(kind, 0, 2, F) RB_OP_R(kind, 0, 3, F) \
+    RB_OP_R(kind, 1, 0, F) RB_OP_R(kind, 1, 1, F) RB_OP_R(kind, 1, 2, F) RB_OP_R(kind, 1, 3, F) \
+    RB_OP_R(kind, 2, 0, F) RB_OP_R(kind, 2, 1, F) RB_OP_R(kind, 2, 2, F) RB_OP_R(kind, 2, 3, F) \
+    RB_OP_R(kind, 3, 0, F) RB_OP_R(kind, 3, 1, F) RB_OP_R(kind, 3, 2, F) RB_OP_R(kind, 3, 3, F)
+  #define RB_FOR_SLOTS_I(kind, F) \
+    RB_OP_I(kind, 0, F) RB_OP_I(kind, 1, F) RB_OP_I(kind, 2, F) RB_OP_I(kind, 3, F)
+
+  #define RB_MOV(d, x, y) RB_SET(d, y)
+  #define RB_ADD(d, x, y) RB_SET(d, x + y)
+  #define RB_SUB(d, x, y) RB_SET(d, x - y)
+  #define RB_MUL(d, x, y) RB_SET(d, x * y)
+  // Same as vm_exec, x / -1 is a wrapping negation
+  #define RB_DIV(d, x, y) RB_SET(d, y == -1 ? (int64_t) (0 - (uint64_t) x) : x / y)
+  #define RB_CMP(d, x, y) cmp = x - y
+  #define RB_INC(d, x, y) RB_SET(d, x + 1)
+  #define RB_DEC(d, x, y) RB_SET(d, x - 1)
+
+  for (;;) {
+    reg_block_op* op = b->ops;
+    reg_block_op* ops_end = b->ops + b->num_ops;
+    for (; op < ops_end; op++) {
+      switch (op->code) {
+        RB_FOR_SLOTS_R(RB_MOV_R, RB_MOV)
+        RB_FOR_SLOTS_I(RB_MOV_I, RB_MOV)
+        RB_FOR_SLOTS_R(RB_ADD_R, RB_ADD)
+        RB_FOR_SLOTS_I(RB_ADD_I, RB_ADD)
+        RB_FOR_SLOTS_R(RB_SUB_R, RB_SUB)
+        RB_FOR_SLOTS_I(RB_SUB_I, RB_SUB)
+        RB_FOR_SLOTS_R(RB_MUL_R, RB_MUL)
+        RB_FOR_SLOTS_I(RB_MUL_I, RB_MUL)
+        RB_FOR_SLOTS_R(RB_DIV_R, RB_DIV)
+        RB_FOR_SLOTS_I(RB_DIV_I, RB_DIV)
+        RB_FOR_SLOTS_R(RB_CMP_R, RB_CMP)
+        RB_FOR_SLOTS_I(RB_CMP_I, RB_CMP)
+        RB_FOR_SLOTS_I(RB_INC, RB_INC)
+        RB_FOR_SLOTS_I(RB_DEC, RB_DEC)
+        default:
+          assert(0 && "should not reach here");
+          break;
+      }
+    }
+
+    bool taken;
+    switch (b->branch) {
+      case OPCODE_JMP: taken = true; break;
+      case OPCODE_JNE: taken = cmp != 0; break;
+      case OPCODE_JE:  taken = cmp == 0; break;
+      case OPCODE_JGE: taken = cmp >= 0; break;
+      case OPCODE_JG:  taken = cmp > 0; break;
+      case OPCODE_JLE: taken = cmp <= 0; break;
+      case OPCODE_JL:  taken = cmp < 0; break;
+      case OPCODE_DEC_JNE: case OPCODE_DEC_JG:
+        switch (b->branch_slot) {
+          case 0: cmp = --r0; break;
+          case 1: cmp = --r1; break;
+          case 2: cmp = --r2; break;
+          default: cmp = --r3; break;
+        }
+        taken = b->branch == OPCODE_DEC_JNE ? cmp != 0 : cmp > 0;
+        break;
+      default: taken = false; break;
+    }
+
+    // The registers stay in r0..r3 while the block loops on itself
+    if (taken && b->target == b->start) continue;
+
+    if (b->store & 1) registers[b->regs[0]] = r0;
+    if (b->store & 2) registers[b->regs[1]] = r1;
+    if (b->store & 4) registers[b->regs[2]] = r2;
+    if (b->store & 8) registers[b->regs[3]] = r3;
+    return (reg_block_exit) { taken ? (uint32_t) b->target : (uint32_t) b->end, cmp };
+  }
+
+  #undef RB_GET
+  #undef RB_SET
+  #undef RB_OP_R
+  #undef RB_OP_I
+  #undef RB_FOR_SLOTS_R
+  #undef RB_FOR_SLOTS_I
+  #undef RB_MOV
+  #undef RB_ADD
+  #undef RB_SUB
+  #undef RB_MUL
+  #undef RB_DIV
+  #undef RB_CMP
+  #undef RB_INC
+  #undef RB_DEC
+}
+
+// Cycle counter for PROFILE_CYCLES
+static inline uint64_t vm_profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return timing_now_ns();
+#endif
+}
+
+static void vm_profile_alloc_failed(void) {
+  printf("failed to alloc memory for the profile\n");
+  exit(1);
+}
+
+static void vm_profile_count_edge(profile_data* prof, uint32_t caller, uint32_t callee) {
+  if (prof->num_edges * 2 >= prof->edges_cap) {
+    // Rehash into twice the room
+    int old_cap = prof->edges_cap;
+    profile_edge* old = prof->edges;
+    prof->edges_cap = old_cap ? old_cap * 2 : 64;
+    prof->edges = (profile_edge*) calloc(prof->edges_cap, sizeof(profile_edge));
+    if (!prof->edges) vm_profile_alloc_failed();
+    prof->num_edges = 0;
+    for (int i = 0; i < old_cap; i++) {
+      if (old[i].calls == 0) continue;
+      uint32_t mask = prof->edges_cap - 1;
+      uint32_t h = (old[i].caller * 31u + old[i].callee) & mask;
+      while (prof->edges[h].calls != 0) h = (h + 1) & mask;
+      prof->edges[h] = old[i];
+      prof->num_edges++;
+    }
+    free(old);
+  }
+
+  uint32_t mask = prof->edges_cap - 1;
+  uint32_t h = (caller * 31u + callee) & mask;
+  while (prof->edges[h].calls != 0 && (prof->edges[h].caller != caller || prof->edges[h].callee != callee)) {
+    h = (h + 1) & mask;
+  }
+  if (prof->edges[h].calls == 0) {
+    prof->edges[h].caller = caller;
+    prof->edges[h].callee = callee;
+    prof->num_edges++;
+  }
+  prof->edges[h].calls++;
+}
+
+// A call to 'proc', or the start of the run for 0
+static void vm_profile_call(profile_data* prof, uint32_t proc) {
+  if (prof->num_frames > 0) {
+    vm_profile_count_edge(prof, prof->frames[prof->num_frames - 1].proc, proc);
+  }
+  if (prof->num_frames == prof->frames_cap) {
+    prof->frames_cap = prof->frames_cap ? prof->frames_cap * 2 : 256;
+    prof->frames = (profile_frame*) realloc(prof->frames, prof->frames_cap * sizeof(profile_frame));
+    if (!prof->frames) vm_profile_alloc_failed();
+  }
+  prof->frames[prof->num_frames++] = (profile_frame) { proc, prof->executed, timing_now_ns(), 0, 0 };
+  prof->procs[proc].calls++;
+  prof->procs[proc].active++;
+}
+
+static void vm_profile_ret(profile_data* prof) {
+  if (prof->num_frames == 0) return;
+  profile_frame f = prof->frames[--prof->num_frames];
+  uint64_t insns = prof->executed - f.start_insns;
+  uint64_t ns = timing_now_ns() - f.start_ns;
+
+  profile_proc* proc = &prof->procs[f.proc];
+  proc->excl_insns += insns - f.child_insns;
+  proc->excl_ns += ns - f.child_ns;
+  if (--proc->active == 0) {
+    proc->incl_insns += insns;
+    proc->incl_ns += ns;
+  }
+  if (prof->num_frames > 0) {
+    prof->frames[prof->num_frames - 1].child_insns += insns;
+    prof->frames[prof->num_frames - 1].child_ns += ns;
+  }
+}
 
-  uint32_t pc = 0;
-  int64_t cmp = 0;
-  uint32_t call_stack_top = 0;
-  uint32_t call_stack[MAX_CALL_STACK] = {0};
+// The run is over, everything still on the stack returns now
+static void vm_profile_end(profile_data* prof) {
+  while (prof->num_frames > 0) vm_profile_ret(prof);
+}
+
+// The VM state in a checkpoint of a recording (see replay.h). In the file
+// it's followed by:
+//   - the first stack_saved entries of the stack: the ones in use, or up
+//     to the frame if it's above them ('leave' reads up to there)
+//   - the pages of the heap that aren't all zeros, each as its offset and
+//     then its REPLAY_HEAP_PAGE bytes, and UINT64_MAX to end them (the
+//     guest can write past heap_top, so it's not enough to save up to it)
+//   - the msg_len bytes of the msg
+// What print wrote is already out, so it isn't saved.
+typedef struct replay_checkpoint {
+  int64_t cmp;
+  int64_t registers[NUM_REGISTERS];
+  uint64_t stack_len;
+  uint64_t stack_saved;
+  uint64_t frame; // entries from the stack base
+  uint64_t heap_top;
+  uint64_t heap_free_lists[GUEST_HEAP_NUM_CLASSES];
+  uint64_t heap_large_free_list;
+  uint64_t msg_len;
+} replay_checkpoint;
+
+#define REPLAY_HEAP_PAGE 4096
+
+static bool replay_page_is_zero(const char* page) {
+  const uint64_t* words = (const uint64_t*) page;
+  uint64_t bits = 0;
+  for (int i = 0; i < REPLAY_HEAP_PAGE / 8; i++) bits |= words[i];
+  return bits == 0;
+}
+
+// Which pages of the heap were touched (vmem_resident), so the ones that
+// weren't aren't read just to see they're zeros. All of them if we can't
+// tell.
+static unsigned char* vm_replay_heap_pages(vm_state* vm) {
+  size_t n = (vm->heap.size + vmem_page_size() - 1) / vmem_page_size();
+  unsigned char* pages = (unsigned char*) malloc(n);
+  if (!pages) {
+    printf("failed to alloc memory for the vm\n");
+    exit(1);
+  }
+  if (!vmem_resident(vm->heap.base, vm->heap.size, pages)) memset(pages, 1, n);
+  return pages;
+}
+
+// Whether the REPLAY_HEAP_PAGE at 'offset' goes in a checkpoint
+static inline bool vm_replay_heap_page_used(vm_state* vm, unsigned char* pages, uint64_t offset) {
+  return pages[offset / vmem_page_size()] && !replay_page_is_zero(vm->heap.base + offset);
+}
+
+static void vm_replay_capture(vm_state* vm, int64_t cmp, uint64_t stack_len, uint64_t frame, replay_checkpoint* c) {
+  memset(c, 0, sizeof(*c));
+  c->cmp = cmp;
+  memcpy(c->registers, vm->registers, sizeof(c->registers));
+  c->stack_len = stack_len;
+  c->stack_saved = stack_len > frame ? stack_len : frame;
+  c->frame = frame;
+  c->heap_top = vm->heap.top;
+  memcpy(c->heap_free_lists, vm->heap.free_lists, sizeof(c->heap_free_lists));
+  c->heap_large_free_list = vm->heap.large_free_list;
+  c->msg_len = vm->msg.len;
+}
 
-  int64_t stack[MAX_STACK] = {0}; // TODO: merge call_stack and stack
-  uint32_t stack_top = 0;
+// Reports the first difference between the run and the recording, or a
+// failure to write it. The log isn't used after that.
+static void vm_replay_stopf(program* p, vm_state* vm, uint64_t insn, uint32_t pc, const char* fmt, ...) {
+  replay_log* log = vm->replay;
+  if (log->stopped) return;
+  log->stopped = true;
+  log->next_stop = UINT64_MAX;
+
+  char what[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(what, sizeof(what), fmt, args);
+  va_end(args);
+
+  output_flush(&vm->out);
+  if (log->recording) {
+    fprintf(stderr, "record: failed to write %s, at instruction #%" PRIu64 ": %s\n", log->path, insn, what);
+  } else if (pc < (uint32_t) p->num_instructions) {
+    fprintf(stderr, "replay: diverged from %s at instruction #%" PRIu64 " (line %d): %s\n",
+      log->path, insn, p->instructions[pc].opcode_pos.line_number, what);
+  } else {
+    fprintf(stderr, "replay: diverged from %s at instruction #%" PRIu64 ": %s\n", log->path, insn, what);
+  }
+}
+
+// Replaying: after reading log->next, vm_exec stops at it
+static uint64_t vm_replay_next(replay_log* log) {
+  replay_read_next(log);
+  log->next_stop = log->stopped || log->next.kind == 0 ? UINT64_MAX : log->next.insn;
+  return log->next_stop;
+}
+
+static bool vm_replay_write_checkpoint(vm_state* vm, replay_entry* e, replay_checkpoint* c) {
+  replay_log* log = vm->replay;
+  if (!replay_write(log, e, sizeof(*e)) || !replay_write(log, c, sizeof(*c)) ||
+      !replay_write(log, vm->stack.base, c->stack_saved * sizeof(int64_t))) {
+    return false;
+  }
+  unsigned char* pages = vm_replay_heap_pages(vm);
+  bool ok = true;
+  for (uint64_t offset = GUEST_HEAP_NULL_SIZE; ok && offset < vm->heap.size; offset += REPLAY_HEAP_PAGE) {
+    if (!vm_replay_heap_page_used(vm, pages, offset)) continue;
+    ok = replay_write(log, &offset, sizeof(offset)) && replay_write(log, vm->heap.base + offset, REPLAY_HEAP_PAGE);
+  }
+  free(pages);
+  if (!ok) return false;
+  uint64_t heap_end = UINT64_MAX;
+  return replay_write(log, &heap_end, sizeof(heap_end)) && replay_write(log, vm->msg.data, c->msg_len);
+}
+
+// What differs between the checkpoint being read and the state in 'c',
+// NULL if nothing
+static const char* vm_replay_check_checkpoint(vm_state* vm, replay_checkpoint* c) {
+  replay_log* log = vm->replay;
+  static char what[128];
+  replay_checkpoint rc;
+  if (!replay_read(log, &rc, sizeof(rc))) return "the recording is truncated";
+
+  if (rc.cmp != c->cmp) {
+    snprintf(what, sizeof(what), "cmp is %" PRId64 ", %" PRId64 " in the recording", c->cmp, rc.cmp);
+    return what;
+  }
+  for (int i = 0; i < NUM_REGISTERS; i++) {
+    if (rc.registers[i] != c->registers[i]) {
+      snprintf(what, sizeof(what), "%c is %" PRId64 ", %" PRId64 " in the recording",
+        (char) ('a' + i), c->registers[i], rc.registers[i]);
+      return what;
+    }
+  }
+  if (rc.stack_len != c->stack_len || rc.frame != c->frame || rc.stack_saved != c->stack_saved ||
+      !replay_read_equal(log, vm->stack.base, c->stack_saved * sizeof(int64_t))) {
+    return "the stack differs";
+  }
+
+  if (rc.heap_top != c->heap_top || rc.heap_large_free_list != c->heap_large_free_list ||
+      memcmp(rc.heap_free_lists, c->heap_free_lists, sizeof(rc.heap_free_lists)) != 0) {
+    return "the heap allocator differs";
+  }
+  uint64_t recorded;
+  if (!replay_read(log, &recorded, sizeof(recorded))) return "the recording is truncated";
+  unsigned char* pages = vm_replay_heap_pages(vm);
+  const char* diff = NULL;
+  for (uint64_t offset = GUEST_HEAP_NULL_SIZE; !diff && offset < vm->heap.size; offset += REPLAY_HEAP_PAGE) {
+    if (offset == recorded) {
+      if (!replay_read_equal(log, vm->heap.base + offset, REPLAY_HEAP_PAGE)) diff = what;
+      else if (!replay_read(log, &recorded, sizeof(recorded))) diff = "the recording is truncated";
+    } else if (vm_replay_heap_page_used(vm, pages, offset)) {
+      diff = what;
+    }
+    if (diff == what) {
+      snprintf(what, sizeof(what), "the heap differs at %" PRIu64 "..%" PRIu64, offset, offset + REPLAY_HEAP_PAGE);
+    }
+  }
+  free(pages);
+  if (diff) return diff;
+  if (recorded != UINT64_MAX) return "the heap differs";
+
+  if (rc.msg_len != c->msg_len || !replay_read_equal(log, vm->msg.data, c->msg_len)) return "the msg differs";
+  return NULL;
+}
+
+// vm_exec stops here before instruction #insn when it's log->next_stop:
+// to write a checkpoint when recording, to check the next entry when
+// replaying. Returns the next stop.
+static uint64_t vm_replay_stop(program* p, vm_state* vm, uint64_t insn, uint32_t pc, int64_t cmp, uint64_t stack_len, uint64_t frame) {
+  replay_log* log = vm->replay;
+  replay_checkpoint c;
+
+  if (log->recording) {
+    vm_replay_capture(vm, cmp, stack_len, frame, &c);
+    replay_entry e = { REPLAY_CHECKPOINT, pc, insn, (int64_t) log->num_checkpoints + 1 };
+    if (!vm_replay_write_checkpoint(vm, &e, &c)) {
+      vm_replay_stopf(p, vm, insn, pc, "%s", strerror(errno));
+      return UINT64_MAX;
+    }
+    log->num_checkpoints++;
+    log->next_stop = insn + log->header.checkpoint_every;
+    return log->next_stop;
+  }
+
+  replay_entry e = log->next;
+  switch (e.kind) {
+    case REPLAY_MALLOC:
+      // vm_replay_malloc takes it from here
+      if (p->instructions[pc].opcode == OPCODE_MALLOC) return UINT64_MAX;
+      vm_replay_stopf(p, vm, insn, pc, "the recording has a malloc here (line %d)",
+        e.pc < (uint32_t) p->num_instructions ? p->instructions[e.pc].opcode_pos.line_number : 0);
+      return UINT64_MAX;
+    case REPLAY_CHECKPOINT: {
+      const char* diff = NULL;
+      char where[64];
+      if (e.pc != pc) {
+        snprintf(where, sizeof(where), "the recording is at line %d",
+          e.pc < (uint32_t) p->num_instructions ? p->instructions[e.pc].opcode_pos.line_number : 0);
+        diff = where;
+      } else {
+        vm_replay_capture(vm, cmp, stack_len, frame, &c);
+        diff = vm_replay_check_checkpoint(vm, &c);
+        if (diff && feof(log->file)) diff = "the recording is truncated";
+      }
+      if (diff) {
+        vm_replay_stopf(p, vm, insn, pc, "checkpoint %" PRId64 ": %s", e.value, diff);
+        return UINT64_MAX;
+      }
+      log->num_checkpoints++;
+      return vm_replay_next(log);
+    }
+    default:
+      vm_replay_stopf(p, vm, insn, pc, "the recording ends here");
+      return UINT64_MAX;
+  }
+}
+
+// 'malloc' at instruction #insn returned 'value'. Returns the next stop.
+static uint64_t vm_replay_malloc(program* p, vm_state* vm, uint64_t insn, uint32_t pc, int64_t value) {
+  replay_log* log = vm->replay;
+  if (log->stopped) return UINT64_MAX;
+
+  if (log->recording) {
+    replay_entry e = { REPLAY_MALLOC, pc, insn, value };
+    if (!replay_write(log, &e, sizeof(e))) {
+      vm_replay_stopf(p, vm, insn, pc, "%s", strerror(errno));
+      return UINT64_MAX;
+    }
+    log->num_events++;
+    return log->next_stop;
+  }
+
+  replay_entry e = log->next;
+  if (e.kind != REPLAY_MALLOC || e.insn != insn) {
+    vm_replay_stopf(p, vm, insn, pc, "the recording has no malloc here");
+    return UINT64_MAX;
+  }
+  if (e.value != value) {
+    vm_replay_stopf(p, vm, insn, pc, "malloc returned %" PRId64 ", %" PRId64 " in the recording", value, e.value);
+    return UINT64_MAX;
+  }
+  log->num_events++;
+  return vm_replay_next(log);
+}
+
+// The run is over after 'insn' instructions (UINT64_MAX if we don't know,
+// it stopped on a stack guard page). Called before reporting runtime
+// errors too, since that may exit.
+static void vm_replay_end(program* p, vm_state* vm, uint64_t insn, uint32_t pc) {
+  replay_log* log = vm->replay;
+  if (log->stopped || log->ended) return;
+  log->ended = true;
+  log->num_insns = insn != UINT64_MAX ? insn - vm->start_insn : UINT64_MAX;
+
+  if (log->recording) {
+    replay_entry e = { REPLAY_END, pc, insn, 0 };
+    if (!replay_write(log, &e, sizeof(e)) || fflush(log->file) != 0) {
+      vm_replay_stopf(p, vm, insn, pc, "%s", strerror(errno));
+    }
+    return;
+  }
+
+  replay_entry e = log->next;
+  if (e.kind != REPLAY_END) {
+    vm_replay_stopf(p, vm, insn, pc, "the run ends here, the recording goes on");
+  } else if (e.insn != insn) {
+    vm_replay_stopf(p, vm, insn, pc, "the run ends here, the recording ends at instruction #%" PRIu64, e.insn);
+  }
+}
+
+// Moves the replay to checkpoint 'number' and loads its state into 'vm',
+// for vm_exec to start from there. NULL if it worked, what's wrong if not.
+static const char* vm_replay_restore(program* p, vm_state* vm, uint64_t number) {
+  replay_log* log = vm->replay;
+  while (log->next.kind == REPLAY_MALLOC || log->next.kind == REPLAY_CHECKPOINT) {
+    replay_entry e = log->next;
+    if (e.kind == REPLAY_MALLOC) {
+      replay_read_next(log);
+      continue;
+    }
+
+    replay_checkpoint c;
+    if (!replay_read(log, &c, sizeof(c))) return "the recording is truncated";
+    if ((uint64_t) e.value != number) {
+      // Skip the stack, the heap and the msg
+      if (fseek(log->file, (long) (c.stack_saved * sizeof(int64_t)), SEEK_CUR) != 0) return "the recording is truncated";
+      uint64_t offset;
+      while (replay_read(log, &offset, sizeof(offset)) && offset != UINT64_MAX) {
+        if (fseek(log->file, REPLAY_HEAP_PAGE, SEEK_CUR) != 0) return "the recording is truncated";
+      }
+      if (fseek(log->file, (long) c.msg_len, SEEK_CUR) != 0) return "the recording is truncated";
+      replay_read_next(log);
+      continue;
+    }
+
+    uint64_t stack_entries = ((char*) vm->stack.limit - (char*) vm->stack.base) / sizeof(int64_t);
+    if (e.pc >= (uint32_t) p->num_instructions || c.stack_saved > stack_entries ||
+        c.stack_len > c.stack_saved || c.frame > c.stack_saved ||
+        c.heap_top < GUEST_HEAP_NULL_SIZE || c.heap_top > vm->heap.size) {
+      return "the checkpoint is corrupt";
+    }
+    memcpy(vm->registers, c.registers, sizeof(c.registers));
+    if (!replay_read(log, vm->stack.base, c.stack_saved * sizeof(int64_t))) return "the recording is truncated";
+
+    uint64_t offset;
+    while (replay_read(log, &offset, sizeof(offset)) && offset != UINT64_MAX) {
+      if (offset < GUEST_HEAP_NULL_SIZE || offset > vm->heap.size - REPLAY_HEAP_PAGE) return "the checkpoint is corrupt";
+      if (!replay_read(log, vm->heap.base + offset, REPLAY_HEAP_PAGE)) return "the recording is truncated";
+    }
+    vm->heap.top = c.heap_top;
+    memcpy(vm->heap.free_lists, c.heap_free_lists, sizeof(c.heap_free_lists));
+    vm->heap.large_free_list = c.heap_large_free_list;
+
+    char buf[4096];
+    for (uint64_t left = c.msg_len; left > 0; ) {
+      size_t n = left < sizeof(buf) ? left : sizeof(buf);
+      if (!replay_read(log, buf, n)) return "the recording is truncated";
+      output_write(&vm->msg, buf, n);
+      left -= n;
+    }
+
+    vm->start_insn = e.insn;
+    vm->start_pc = e.pc;
+    vm->start_cmp = c.cmp;
+    vm->start_stack_len = c.stack_len;
+    vm->start_frame = c.frame;
+    log->from_checkpoint = number;
+    vm_replay_next(log);
+    return NULL;
+  }
+  return "there's no such checkpoint in the recording";
+}
+
+typedef enum vm_exec_mode {
+  VM_EXEC_NORMAL,
+  VM_EXEC_PROFILE, // counts in p->profile
+  VM_EXEC_SAMPLE,  // publishes the pc and the calls (vm->sample_*)
+  VM_EXEC_TRACE,   // writes a record per instruction to vm->trace
+  VM_EXEC_REPLAY,  // records or replays the run (vm->replay)
+} vm_exec_mode;
+
+// The vm being sampled, NULL when the sampling profiler should ignore ticks
+static vm_state* volatile vm_sampling;
+
+// Instantiated once per mode, see vm_exec. 'mode' is a constant in each,
+// so the normal loop has no trace of the profilers.
+static inline __attribute__((always_inline)) void vm_exec_impl(program* p, vm_state* vm, const vm_exec_mode mode) {
+  const bool profiling = mode == VM_EXEC_PROFILE;
+  const bool sampling = mode == VM_EXEC_SAMPLE;
+  const bool tracing = mode == VM_EXEC_TRACE;
+  const bool replaying = mode == VM_EXEC_REPLAY;
+  int64_t* registers = vm->registers;
+  instruction* code = vm->code;
+
+  if (sampling) {
+    vm->sample_depth = 0;
+    vm->sample_pc = 0;
+    vm_sampling = vm;
+  }
+
+  // The top level is a frame too, so it gets its exclusive counts
+  if (profiling) vm_profile_call(p->profile, 0);
+  uint64_t* profile_counts = profiling ? p->profile->counts : NULL;
+  uint64_t* profile_cycles = profiling ? p->profile->cycles : NULL;
+  // The instruction the cycles since 'profile_last' go to
+  uint32_t profile_pc = 0;
+  uint64_t profile_last = profile_cycles ? vm_profile_clock() : 0;
+  string_constant* strings = p->strings;
+
+  uint32_t pc = replaying ? vm->start_pc : 0;
+  int64_t cmp = replaying ? vm->start_cmp : 0;
+
+  trace_record* trace_records = tracing ? vm->trace->records : NULL;
+  const uint64_t trace_mask = tracing ? vm->trace->mask : 0;
+  uint64_t trace_head = tracing ? vm->trace->header->head : 0;
+  // Written, but waiting for the value of its destination
+  trace_record* trace_last = NULL;
+  #define TRACE_SET_VALUE(r) \
+    ((r)->value = (r)->reg == TRACE_REG_CMP ? cmp : (r)->reg == TRACE_REG_NONE ? 0 : registers[(r)->reg])
+
+  // Instructions run, and the one to stop at for vm_replay_stop
+  uint64_t replay_insn = replaying ? vm->start_insn : 0;
+  uint64_t replay_next = replaying ? vm->replay->next_stop : UINT64_MAX;
+
+  int64_t* stack_base = (int64_t*) vm->stack.base;
+  int64_t* stack_top = stack_base + (replaying ? vm->start_stack_len : 0);
+  // Where the registers saved by the last 'enter' end
+  int64_t* frame = stack_base + (replaying ? vm->start_frame : 0);
+#if !GUEST_STACK_GUARD_PAGES
+  int64_t* stack_limit = (int64_t*) vm->stack.limit;
+#endif
+
+  guest_heap* heap = &vm->heap;
+  char* heap_base = heap->base;
+  const uint64_t heap_limit = guest_heap_access_limit(heap);
+
+  #define RUNTIME_ERROR(error, value) do {                   \
+    if (replaying) vm_replay_end(p, vm, replay_insn, pc);    \
+    vm_report_runtime_error(p, vm, pc, error, value);        \
+    goto end;                                                \
+  } while (0)
 
   #define REG(op) (registers[op.reg_index])
+  // Address of a memory operand, e.g. 8[a]. See heap.h
+  #define MEM(op) ({                                                   \
+    uint64_t addr__ = (uint64_t) (REG(op) + op.extra);                 \
+    if (addr__ - GUEST_HEAP_NULL_SIZE > heap_limit) {                  \
+      goto invalid_memory_access;                                      \
+    }                                                                  \
+    (int64_t*) (heap_base + addr__);                                   \
+  })
   #define REG_OR_INT_OR_MEM(op) (op.type == OPERAND_REG  \
     ? REG(op) : op.type == OPERAND_INT \
-    ? op.int_value : *((int64_t*) (REG(op) + op.extra)))
+    ? op.int_value : *MEM(op))
 
   while (pc < p->num_instructions) {
-    instruction in = p->instructions[pc];
+    instruction in = code[pc];
     operand* ops = in.operands;
 
+    if (sampling) vm->sample_pc = pc;
+    if (tracing) {
+      if (trace_last) TRACE_SET_VALUE(trace_last);
+      trace_last = &trace_records[trace_head & trace_mask];
+      trace_last->pc = pc;
+      trace_last->opcode = (uint8_t) in.opcode;
+      trace_last->reg = vm->trace_dst[pc];
+      trace_last->value = 0;
+      __atomic_store_n(&vm->trace->header->head, ++trace_head, __ATOMIC_RELEASE);
+    }
+    if (replaying) {
+      if (replay_insn == replay_next) {
+        replay_next = vm_replay_stop(p, vm, replay_insn, pc, cmp, stack_top - stack_base, frame - stack_base);
+      }
+      replay_insn++;
+    }
+    if (profiling) {
+      p->profile->executed++;
+      profile_counts[pc]++;
+      if (profile_cycles) {
+        uint64_t now = vm_profile_clock();
+        profile_cycles[profile_pc] += now - profile_last;
+        profile_last = now;
+        profile_pc = pc;
+      }
+    }
+
     #define OP0 ops[0]
     #define OP1 ops[1]
 
@@ -573,7 +1684,7 @@ char* program_run(program* p) {
       #define MEMORY_OR_REG_OP(op, rhs) {                    \
         int64_t* target = OP0.type == OPERAND_REG           \
             ? (int64_t*) &REG(OP0) /* register */           \
-            : (int64_t*) (REG(OP0) + OP0.extra); /* memory */ \
+            : MEM(OP0); /* memory */                        \
         *target op rhs;                                      \
         break;                                               \
       }
@@ -584,13 +1695,14 @@ char* program_run(program* p) {
       case OPCODE_SUB: MEMORY_OR_REG_OP(-=, REG_OR_INT_OR_MEM(OP1));
       case OPCODE_MUL: MEMORY_OR_REG_OP(*=, REG_OR_INT_OR_MEM(OP1));
       case OPCODE_DIV: {
-        int d = REG_OR_INT_OR_MEM(OP1);
-        if (d == 0) {
-          program_report_errorf(p, &in.opcode_pos,
-            "division by zero occurred while executing this instruction");
-          goto end;
-        }
-        MEMORY_OR_REG_OP(/=, d);
+        int64_t d = REG_OR_INT_OR_MEM(OP1);
+        if (d == 0) RUNTIME_ERROR(RUNTIME_ERROR_DIV_BY_ZERO, 0);
+        // INT64_MIN / -1 traps on x86, so x / -1 is done as a (wrapping) negation
+        MEMORY_OR_REG_OP(=, d == -1 ? (int64_t) (0 - (uint64_t) *target) : *target / d);
+      }
+      case OPCODE_DIV_NC: {
+        int64_t d = REG_OR_INT_OR_MEM(OP1);
+        MEMORY_OR_REG_OP(=, d == -1 ? (int64_t) (0 - (uint64_t) *target) : *target / d);
       }
 
       #define BRANCH_IF(cond) {   \
@@ -607,22 +1719,36 @@ char* program_run(program* p) {
       case OPCODE_JG:  BRANCH_IF(cmp > 0);
       case OPCODE_JLE: BRANCH_IF(cmp <= 0);
       case OPCODE_JL:  BRANCH_IF(cmp < 0);
+      case OPCODE_DEC_JNE: cmp = --REG(OP1); BRANCH_IF(cmp != 0);
+      case OPCODE_DEC_JG:  cmp = --REG(OP1); BRANCH_IF(cmp > 0);
 
       case OPCODE_CALL: {
-        if (call_stack_top >= MAX_CALL_STACK) {
-          program_report_errorf(p, &in.opcode_pos, "callstack overflow");
-          goto end;
-        }
-        call_stack[call_stack_top++] = pc + 1;
+        SYNC_PC();
+        CHECK_STACK(stack_top >= stack_limit, RUNTIME_ERROR_CALLSTACK_OVERFLOW);
+        *stack_top++ = pc + 1;
         pc = OP0.branch_index;
+        if (profiling) vm_profile_call(p->profile, pc + 1);
+        if (sampling) {
+          // The entry first, a tick in between sees the old depth
+          uint32_t depth = vm->sample_depth;
+          if (depth < VM_SAMPLE_MAX_DEPTH) vm->sample_calls[depth] = pc;
+          __asm__ __volatile__("" ::: "memory");
+          vm->sample_depth = depth + 1;
+        }
         continue;
       }
       case OPCODE_RET: {
-        if (call_stack_top <= 0) {
-          program_report_errorf(p, &in.opcode_pos, "callstack underflow");
-          goto end;
+        SYNC_PC();
+        CHECK_STACK(stack_top <= stack_base, RUNTIME_ERROR_CALLSTACK_UNDERFLOW);
+        int64_t ret_addr = *--stack_top;
+        // The return address shares the stack with pushed values,
+        // an unbalanced push/pop leaves anything in its place.
+        if ((uint64_t) ret_addr > (uint64_t) p->num_instructions || !p->is_return_site[ret_addr]) {
+          RUNTIME_ERROR(RUNTIME_ERROR_INVALID_RETURN, ret_addr);
         }
-        pc = call_stack[--call_stack_top];
+        pc = (uint32_t) ret_addr;
+        if (sampling && vm->sample_depth > 0) vm->sample_depth--;
+        if (profiling && p->profile->num_frames > 1) vm_profile_ret(p->profile);
         continue;
       }
       case OPCODE_CMP: {
@@ -630,68 +1756,72 @@ char* program_run(program* p) {
         break;
       }
       case OPCODE_PUSH: {
-        if (stack_top >= MAX_STACK) {
-          program_report_errorf(p, &in.opcode_pos, "stack overflow");
-          goto end;
-        }
-        stack[stack_top++] = REG(OP0);
+        SYNC_PC();
+        CHECK_STACK(stack_top >= stack_limit, RUNTIME_ERROR_STACK_OVERFLOW);
+        *stack_top++ = REG(OP0);
         break;
       }
       case OPCODE_POP: {
-        if (stack_top <= 0) {
-          program_report_errorf(p, &in.opcode_pos, "stack underflow");
-          goto end;
-        }
-        REG(OP0) = stack[--stack_top];
+        SYNC_PC();
+        CHECK_STACK(stack_top <= stack_base, RUNTIME_ERROR_STACK_UNDERFLOW);
+        REG(OP0) = *--stack_top;
         break;
       }
-      case OPCODE_MSG: {
-        // XXX FIXME
-        // TODO: MAX_MSG
-        // this will write past MAX_MSG...
-        // even when using snprintf
-        char* msg_ptr = msg;
-        for (int i = 0; i < in.num_operands; i++) {
-          operand op = in.operands[i];
-          switch (op.type) {
-            case OPERAND_STR:
-              msg_ptr += sprintf(msg_ptr, "%s", op.str);
-              break;
-            case OPERAND_INT:
-              msg_ptr += sprintf(msg_ptr, "%I64d", op.int_value);
-              break;
-            case OPERAND_REG:
-              msg_ptr += sprintf(msg_ptr, "%I64d", registers[op.reg_index]);
-              break;
-            default:
-              sprintf(msg_ptr, "<unhandled operand type %d>", op.type);
-              break;
-          }
+
+      // The frame is laid out as:
+      //   [saved frame pointer][lo .. hi] <- frame
+      // so 'leave' can drop whatever was pushed after 'enter' and restore
+      // the registers in a single instruction.
+      case OPCODE_ENTER: {
+        SYNC_PC();
+        int n = OP1.reg_index - OP0.reg_index + 1;
+        CHECK_STACK(stack_top + n + 1 > stack_limit, RUNTIME_ERROR_STACK_OVERFLOW);
+        stack_top[0] = frame - stack_base;
+        memcpy(stack_top + 1, &REG(OP0), n * sizeof(int64_t));
+        stack_top += n + 1;
+        frame = stack_top;
+        break;
+      }
+      case OPCODE_LEAVE: {
+        SYNC_PC();
+        int n = OP1.reg_index - OP0.reg_index + 1;
+        stack_top = frame - n - 1;
+        CHECK_STACK(stack_top < stack_base, RUNTIME_ERROR_STACK_UNDERFLOW);
+        memcpy(&REG(OP0), stack_top + 1, n * sizeof(int64_t));
+
+        int64_t saved_frame = stack_top[0];
+        if ((uint64_t) saved_frame > (uint64_t) (stack_top - stack_base)) {
+          RUNTIME_ERROR(RUNTIME_ERROR_INVALID_FRAME, saved_frame);
         }
+        frame = stack_base + saved_frame;
         break;
       }
-
+      case OPCODE_MSG:
+        // msg replaces the previous message
+        vm->msg.len = 0;
+        // fallthrough
       case OPCODE_PRINT: {
+        output_buffer* out = in.opcode == OPCODE_MSG ? &vm->msg : &vm->out;
         for (int i = 0; i < in.num_operands; i++) {
           operand op = in.operands[i];
           switch (op.type) {
-            case OPERAND_STR:
-              // XXX: workaround for printing new lines... @cleanup
-              if (strlen(op.str) == 2 && op.str[0] == '\\' && op.str[1] == 'n') {
-                printf("\n");
-                break;
-              }
-              printf("%s", op.str);
+            case OPERAND_STR: {
+              string_constant str = strings[op.extra];
+              output_write(out, str.data, str.len);
               break;
+            }
             case OPERAND_INT:
-              printf("%I64d", op.int_value);
+              output_write_int(out, op.int_value);
               break;
             case OPERAND_REG:
-              printf("%I64d", registers[op.reg_index]);
+              output_write_int(out, registers[op.reg_index]);
               break;
-            default:
-              printf("<unhandled operand type %d>", op.type);
+            default: {
+              char buf[64];
+              int n = snprintf(buf, sizeof(buf), "<unhandled operand type %d>", op.type);
+              output_write(out, buf, n);
               break;
+            }
           }
         }
         break;
@@ -699,19 +1829,32 @@ char* program_run(program* p) {
 
       case OPCODE_MALLOC: {
         // OP0 = register that holds the size
-        // OP1 = output register to the address
-        registers[OP1.reg_index] = (uint64_t) malloc(registers[OP0.reg_index]);
+        // OP1 = output register to the address (0 if out of memory)
+        registers[OP1.reg_index] = guest_heap_alloc(heap, registers[OP0.reg_index]);
+        if (replaying) replay_next = vm_replay_malloc(p, vm, replay_insn - 1, pc, registers[OP1.reg_index]);
         break;
       }
 
       case OPCODE_MFREE: {
-        free((void*) registers[OP0.reg_index]);
+        if (!guest_heap_free(heap, registers[OP0.reg_index])) {
+          RUNTIME_ERROR(RUNTIME_ERROR_INVALID_FREE, registers[OP0.reg_index]);
+        }
         break;
       }
 
       case OPCODE_END:
         goto end;
 
+      case OPCODE_NOP:
+        break;
+
+      case OPCODE_REG_BLOCK: {
+        reg_block_exit exit = vm_run_reg_block(&p->reg_blocks[OP0.extra], registers, cmp);
+        pc = exit.pc;
+        cmp = exit.cmp;
+        continue;
+      }
+
       default:
         assert(0 && "should not reach here");
         break;
@@ -719,39 +1862,336 @@ char* program_run(program* p) {
 
     pc++;
   }
+  goto end;
+
+  invalid_memory_access: {
+    // TODO: report only the position of the memory operand?
+    if (replaying) vm_replay_end(p, vm, replay_insn, pc);
+    vm_report_runtime_error(p, vm, pc, RUNTIME_ERROR_INVALID_MEMORY_ACCESS, 0);
+  }
 
   end:
+  if (profile_cycles) profile_cycles[profile_pc] += vm_profile_clock() - profile_last;
+  if (profiling) vm_profile_end(p->profile);
+  if (sampling) vm_sampling = NULL;
+  if (tracing && trace_last) TRACE_SET_VALUE(trace_last);
+  if (replaying) vm_replay_end(p, vm, replay_insn, pc);
+  #undef TRACE_SET_VALUE
+  return;
+}
+
+static void vm_exec(program* p, vm_state* vm) {
+  vm_exec_impl(p, vm, VM_EXEC_NORMAL);
+}
+
+static void vm_exec_profiled(program* p, vm_state* vm) {
+  vm_exec_impl(p, vm, VM_EXEC_PROFILE);
+}
+
+static void vm_exec_sampled(program* p, vm_state* vm) {
+  vm_exec_impl(p, vm, VM_EXEC_SAMPLE);
+}
+
+static void vm_exec_traced(program* p, vm_state* vm) {
+  vm_exec_impl(p, vm, VM_EXEC_TRACE);
+}
+
+static void vm_exec_replayed(program* p, vm_state* vm) {
+  vm_exec_impl(p, vm, VM_EXEC_REPLAY);
+}
+
+// trace_record.reg of 'in': the register it writes, if any
+static uint8_t vm_trace_dst(instruction* in) {
+  switch (in->opcode) {
+    case OPCODE_MOV: case OPCODE_ADD: case OPCODE_SUB: case OPCODE_MUL:
+    case OPCODE_DIV: case OPCODE_DIV_NC: case OPCODE_INC: case OPCODE_DEC: case OPCODE_POP:
+      return in->operands[0].type == OPERAND_REG ? (uint8_t) in->operands[0].reg_index : TRACE_REG_NONE;
+    case OPCODE_DEC_JNE: case OPCODE_DEC_JG: case OPCODE_MALLOC:
+      return (uint8_t) in->operands[1].reg_index;
+    case OPCODE_CMP:
+      return TRACE_REG_CMP;
+    default:
+      return TRACE_REG_NONE;
+  }
+}
+
+// Hash of the instructions a trace or a recording refers to, so it's not
+// used with another program (or the same one optimized differently)
+uint64_t program_code_hash(program* p) {
+  uint64_t h = 14695981039346656037ull; // FNV-1a
+  #define TRACE_HASH(x) (h = (h ^ (uint64_t) (x)) * 1099511628211ull)
+  TRACE_HASH(p->num_instructions);
+  for (int i = 0; i < p->num_instructions; i++) {
+    instruction* in = &p->instructions[i];
+    TRACE_HASH(in->opcode);
+    for (int j = 0; j < in->num_operands; j++) {
+      operand* op = &in->operands[j];
+      TRACE_HASH(op->type);
+      if (op->type == OPERAND_REG || op->type == OPERAND_MEM_ADDRESS) TRACE_HASH(op->reg_index);
+      if (op->type == OPERAND_MEM_ADDRESS) TRACE_HASH(op->extra);
+      if (op->type == OPERAND_INT) TRACE_HASH(op->int_value);
+      if (op->type == OPERAND_BRANCH) TRACE_HASH(op->branch_index);
+    }
+  }
+  #undef TRACE_HASH
+  return h;
+}
+
+// The trace of options.trace, created by the first program_run that traces
+static trace_ring vm_trace_ring;
+
+// Unmaps the trace, the next program_run that traces starts a new one
+void program_trace_close(void) {
+  trace_close(&vm_trace_ring);
+}
+
+// The log of options.record or options.replay, of the last program_run
+// that had one. Closed by the next one, main.c reports on it at exit.
+static replay_log vm_replay_log;
+
+// Ends the recording or the replay, if any
+void program_replay_close(void) {
+  replay_close(&vm_replay_log);
+}
+
+// Starts recording or replaying for 'vm'. A recording that can't be
+// created is left out, a replay that can't be done exits.
+static void vm_replay_begin(program* p, vm_state* vm) {
+  run_options* opts = &p->options;
+  replay_log* log = &vm_replay_log;
+  replay_close(log);
+
+  if (opts->record) {
+    replay_header h;
+    memset(&h, 0, sizeof(h));
+    h.program_hash = program_code_hash(p);
+    h.opt_level = opts->opt_level;
+    h.inline_calls = opts->inline_calls;
+    h.heap_size = opts->heap_size;
+    h.stack_size = opts->stack_size;
+    h.checkpoint_every = opts->checkpoint_every;
+    if (!replay_create(log, opts->record, &h)) {
+      fprintf(stderr, "failed to create the recording %s, running without it\n", opts->record);
+      replay_close(log);
+      return;
+    }
+    log->next_stop = opts->checkpoint_every ? opts->checkpoint_every : UINT64_MAX;
+  } else {
+    const char* error = replay_open(log, opts->replay);
+    replay_header* h = &log->header;
+    if (!error && (h->program_hash != program_code_hash(p) ||
+        h->heap_size != opts->heap_size || h->stack_size != opts->stack_size)) {
+      error = "it's of another program, or of a run with other options";
+    }
+    vm->replay = log;
+    if (!error && opts->replay_from) {
+      error = vm_replay_restore(p, vm, opts->replay_from);
+    } else if (!error) {
+      log->next_stop = log->next.kind ? log->next.insn : UINT64_MAX;
+    }
+    if (error) {
+      printf("failed to replay %s: %s\n", opts->replay, error);
+      replay_close(log);
+      exit(1);
+    }
+  }
+  vm->replay = log;
+}
+
+// Sets up the state to run 'p': output buffers, guest heap and stack
+static vm_state* vm_create(program* p) {
+  vm_state* vm = (vm_state*) calloc(1, sizeof(vm_state));
+  if (!vm) {
+    printf("failed to alloc memory for the vm\n");
+    exit(1);
+  }
+  output_init(&vm->out, OUTPUT_BUFFER_SIZE, stdout);
+  output_init(&vm->msg, 256, NULL);
+
+  run_options* opts = &p->options;
+  if (!guest_heap_init(&vm->heap, opts->heap_size)) {
+    printf("failed to alloc %" PRIu64 " bytes for the guest heap\n", opts->heap_size);
+    exit(1);
+  }
+  if (!guest_stack_init(&vm->stack, opts->stack_size, sizeof(int64_t))) {
+    printf("failed to alloc the guest stack\n");
+    exit(1);
+  }
+
+  if (opts->sample) {
+    vm->sample_calls = (uint32_t*) calloc(VM_SAMPLE_MAX_DEPTH, sizeof(uint32_t));
+    if (!vm->sample_calls) {
+      printf("failed to alloc memory for the vm\n");
+      exit(1);
+    }
+  }
+
+  vm->code = p->instructions;
+  // Profiles, traces and recordings see every instruction, so they run
+  // without the reg_blocks
+  if (p->num_reg_blocks > 0 && !p->profile && !opts->trace && !opts->record && !opts->replay) {
+    // The program stays as it is for genc.c, disasm, errors...
+    vm->code = (instruction*) malloc(p->num_instructions * sizeof(instruction));
+    if (!vm->code) {
+      printf("failed to alloc memory for the vm\n");
+      exit(1);
+    }
+    memcpy(vm->code, p->instructions, p->num_instructions * sizeof(instruction));
+    vm->reg_block_operands = (operand*) calloc(p->num_reg_blocks, sizeof(operand));
+    if (!vm->reg_block_operands) {
+      printf("failed to alloc memory for the vm\n");
+      exit(1);
+    }
+    for (int i = 0; i < p->num_reg_blocks; i++) {
+      instruction* in = &vm->code[p->reg_blocks[i].start];
+      vm->reg_block_operands[i].extra = i;
+      in->opcode = OPCODE_REG_BLOCK;
+      in->operands = &vm->reg_block_operands[i];
+      in->num_operands = 1;
+    }
+  }
+  return vm;
+}
+
+// Flushes the output and frees everything but the msg, which is returned
+static char* vm_destroy(vm_state* vm) {
+  output_destroy(&vm->out);
+  char* msg = output_str(&vm->msg); // the caller owns it now
+  if (vm->reg_block_operands) {
+    free(vm->code);
+    free(vm->reg_block_operands);
+  }
+  free(vm->sample_calls);
+  free(vm->trace_dst);
+  guest_stack_destroy(&vm->stack);
+  guest_heap_destroy(&vm->heap);
+  free(vm);
   return msg;
 }
 
-char* interp(char* code) {
+// Zeroed counters for p->profile, kept across runs
+static void program_init_profile(program* p) {
+  if (p->profile) return;
+  profile_data* prof = (profile_data*) calloc(1, sizeof(profile_data));
+  size_t n = p->num_instructions > 0 ? p->num_instructions : 1;
+  if (prof) prof->counts = (uint64_t*) calloc(n, sizeof(uint64_t));
+  if (prof) prof->procs = (profile_proc*) calloc(n + 2, sizeof(profile_proc));
+  if (prof && p->options.profile == PROFILE_CYCLES) prof->cycles = (uint64_t*) calloc(n, sizeof(uint64_t));
+  if (!prof || !prof->counts || !prof->procs || (p->options.profile == PROFILE_CYCLES && !prof->cycles)) {
+    printf("failed to alloc memory for the profile\n");
+    exit(1);
+  }
+  p->profile = prof;
+}
+
+char* program_run(program* p) {
+  if (p->options.profile != PROFILE_OFF) program_init_profile(p);
+  vm_state* vm = vm_create(p);
+  void (*exec)(program*, vm_state*) =
+    p->profile ? vm_exec_profiled : p->options.sample ? vm_exec_sampled : vm_exec;
+
+  if (p->options.trace && !p->profile && !p->options.sample) {
+    if (!vm_trace_ring.header) {
+      if (!trace_create(&vm_trace_ring, p->options.trace, p->options.trace_records)) {
+        fprintf(stderr, "failed to create the trace file %s, running without it\n", p->options.trace);
+        p->options.trace = NULL;
+      } else {
+        vm_trace_ring.header->program_hash = program_code_hash(p);
+        vm_trace_ring.header->opt_level = p->options.opt_level;
+        vm_trace_ring.header->inline_calls = p->options.inline_calls;
+      }
+    }
+    if (vm_trace_ring.header) {
+      vm->trace = &vm_trace_ring;
+      vm->trace_dst = (uint8_t*) malloc(p->num_instructions + 1);
+      if (!vm->trace_dst) {
+        printf("failed to alloc memory for the vm\n");
+        exit(1);
+      }
+      for (int i = 0; i < p->num_instructions; i++) vm->trace_dst[i] = vm_trace_dst(&p->instructions[i]);
+      exec = vm_exec_traced;
+    }
+  }
+
+  if ((p->options.record || p->options.replay) && exec == vm_exec) {
+    vm_replay_begin(p, vm);
+    if (vm->replay) exec = vm_exec_replayed;
+  }
+
+#if GUEST_STACK_GUARD_PAGES
+  // vm_exec doesn't check the stack bounds, a push/call past the end or a
+  // pop/ret from an empty stack faults on a guard page and lands here.
+  guest_stack_trap* trap = &vm->stack_trap;
+  trap->stacks[0] = &vm->stack;
+  trap->num_stacks = 1;
+
+  if (sigsetjmp(trap->jmp, 1) == 0) {
+    guest_stack_trap_begin(trap);
+    exec(p, vm);
+    guest_stack_trap_end(trap);
+  } else {
+    guest_stack_trap_end(trap);
+    vm_sampling = NULL; // vm_exec didn't get to its end
+    if (p->profile) vm_profile_end(p->profile);
+
+    opcode opc = p->instructions[vm->pc].opcode;
+    bool is_call_stack = opc == OPCODE_CALL || opc == OPCODE_RET;
+    runtime_error error = trap->fault == GUEST_STACK_OVERFLOW
+      ? (is_call_stack ? RUNTIME_ERROR_CALLSTACK_OVERFLOW : RUNTIME_ERROR_STACK_OVERFLOW)
+      : (is_call_stack ? RUNTIME_ERROR_CALLSTACK_UNDERFLOW : RUNTIME_ERROR_STACK_UNDERFLOW);
+    if (vm->replay) vm_replay_end(p, vm, UINT64_MAX, vm->pc);
+    vm_report_runtime_error(p, vm, vm->pc, error, 0);
+  }
+#else
+  exec(p, vm);
+#endif
+
+  return vm_destroy(vm);
+}
+
+// Needs everything above (cfg.h includes this file)
+#include "opt.h"
+
+char* interp_with_options(char* code, run_options* opts) {
   PERF_START(interp);
   parser p;
 
-  // PERF_START(parse_tokens);
+  PERF_START(lex);
   parser_init(&p, code);
-  // PERF_STOP(parse_tokens);
+  PERF_STOP(lex);
 
-  // PERF_START(parse_top_level);
+  PERF_START(parse);
   top_level_node* n = parser_parse(&p);
-  // PERF_STOP(parse_top_level);
+  PERF_STOP(parse);
 
   program prog;
   prog.error_handler = p.error_handler;
 
-  // PERF_START(program_build);
+  PERF_START(program_build);
   program_build(&prog, n);
-  // PERF_STOP(program_build);
+  PERF_STOP(program_build);
 
-  // PERF_START(program_check);
+  if (opts) prog.options = *opts;
+
+  PERF_START(program_check);
   program_check(&prog);
-  // PERF_STOP(program_check);
+  PERF_STOP(program_check);
 
-  // PERF_START(program_run);
+  if (prog.options.opt_level > 0) {
+    PERF_START(program_optimize);
+    program_optimize(&prog);
+    PERF_STOP(program_optimize);
+  }
+
+  PERF_START(program_run);
   char* res = program_run(&prog);
-  // PERF_STOP(program_run);
+  PERF_STOP(program_run);
 
   PERF_STOP(interp);
   return res;
 }
+
+char* interp(char* code) {
+  return interp_with_options(code, NULL);
+}
 #endif // __INTERP_H__
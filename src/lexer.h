@@ -7,6 +7,7 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <inttypes.h>
 
 #include "error.h"
 
@@ -175,10 +176,22 @@ char lexer_peek_non_space(lexer* l) {
 }
 
 static token* lex_int(lexer* l) {
-  // XXX TODO better parsing & error reporting
-  int64_t num;
-  int num_length;
-  sscanf(l->code + l->offset, "%I64d%n", &num, &num_length);
+  // XXX TODO better error reporting
+  // Sign and digits (the caller saw them), out of range values saturate
+  const char* start = l->code + l->offset;
+  const char* c = start;
+  bool negative = *c == '-';
+  if (*c == '-' || *c == '+') c++;
+
+  uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : (uint64_t) INT64_MAX;
+  uint64_t value = 0;
+  for (; isdigit(*c); c++) {
+    int digit = *c - '0';
+    value = value > (limit - digit) / 10 ? limit : value * 10 + digit;
+  }
+  int64_t num = negative ? (int64_t) (0 - value) : (int64_t) value;
+
+  int num_length = (int) (c - start);
   l->offset += num_length;
   l->column += num_length;
 
@@ -322,7 +335,7 @@ char* token_value_to_string(token* t) {
       snprintf(token_value_buf, BUF_LEN, "\'%s\'", t->s);
       break;
     case TT_INT:
-      snprintf(token_value_buf, BUF_LEN, "%I64d", t->i);
+      snprintf(token_value_buf, BUF_LEN, "%" PRId64, t->i);
       break;
     case TT_COLON: case TT_COMMA: case TT_BRACKET_OPEN:
     case TT_BRACKET_CLOSE:
@@ -350,7 +363,7 @@ void print_token(token* t) {
       printf(", s='%s', ", t->s);
       break;
     case TT_INT:
-      printf(", i=%I64d, ", t->i);
+      printf(", i=%" PRId64 ", ", t->i);
       break;
     case TT_COLON: case TT_COMMA: case TT_BRACKET_OPEN:
     case TT_BRACKET_CLOSE:
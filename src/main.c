@@ -5,20 +5,257 @@
 #include "lexer.h"
 #include "parser.h"
 #include "interp.h"
+#include "cfg.h"
+#include "profile.h"
+#include "sample.h"
 #include "genc.c"
+#include "aot.c"
 
 void disasm(program* prg);
+void disasm_single_insn(program* prg, int insn_index, instruction in, char **ident);
 void read_file_fully(FILE* fp, char** data, long* data_len);
-void run_from_file(const char* path);
+char* load_file(const char* path);
+void load_program(const char* path, run_options* opts, program* prog);
+void run_from_file(const char* path, run_options* opts, bool aot);
+void emit_c_from_file(const char* path, run_options* opts, const char* out_path);
+void dump_cfg_from_file(const char* path, run_options* opts);
+void dump_ranges_from_file(const char* path, run_options* opts);
+void decode_trace_from_file(const char* path, run_options* opts, const char* trace_path, uint64_t last);
+
+static void print_usage() {
+  printf("Use interp [options] [file]\n");
+  printf("Options:\n");
+  printf("  --heap-size=<size>         size of the guest heap, e.g. 512k, 64m (default: 64m)\n");
+  printf("  --stack-size=<n>           max number of entries in the stack, pushed values\n");
+  printf("                             and return addresses (default: 1m)\n");
+  printf("  -O0, -O1                   don't optimize the program / fold constants, remove\n");
+  printf("                             dead code and inline small procedures (default: -O1)\n");
+  printf("                             -O1 turns tail calls into jumps: a tail recursion\n");
+  printf("                             never overflows the stack\n");
+  printf("  --no-inline                don't copy small procedures into their callers\n");
+  printf("  --no-cache-registers       don't keep the registers of simple blocks in host\n");
+  printf("                             registers while they run\n");
+  printf("  --aot                      compile the program to native code with the system C\n");
+  printf("                             compiler ($CC or cc) and run that. Compiled programs are\n");
+  printf("                             cached in $INTERP_AOT_CACHE (default: ~/.cache/interp-aot)\n");
+  printf("  --emit-c[=<file>]          don't run, translate the program to C (stdout by default).\n");
+  printf("                             Build it with e.g. 'cc -O2 -o prog prog.c'\n");
+  printf("  --dump-cfg                 don't run, print the basic blocks, procedures,\n");
+  printf("                             live registers and loops\n");
+  printf("  --profile[=cycles]         count how many times each instruction runs (and the\n");
+  printf("                             cycles spent on it), print the hot instructions, the\n");
+  printf("                             totals by label, the time and instructions of each\n");
+  printf("                             procedure with and without its calls, the counts of\n");
+  printf("                             each call edge and the annotated source when done\n");
+  printf("  --profile-top=<n>          hot instructions in the --profile report (default: 10)\n");
+  printf("  --sample[=<hz>]            sample the running instruction and the calls (default:\n");
+  printf("                             1000 times a second of CPU time) and write them as\n");
+  printf("                             folded stacks, for flamegraph.pl, when done\n");
+  printf("  --sample-file=<file>       write the --sample stacks to <file> (default: stderr)\n");
+  printf("  --time[=json|csv]          time each phase (lex, parse, program_build...) and\n");
+  printf("                             write the results to stderr when done (default: json)\n");
+  printf("  --time-file=<file>         append the --time results to <file> instead\n");
+  printf("  --counters                 add the hardware counters (cycles, instructions, branch\n");
+  printf("                             and cache misses...) to each --time phase and to the\n");
+  printf("                             --profile report. Linux only, implies --time\n");
+  printf("  --trace=<file>             write a binary record of each instruction run (and\n");
+  printf("                             the value it wrote) to a ring buffer in <file>\n");
+  printf("  --trace-size=<n>           records kept in the --trace ring (default: %d)\n", TRACE_DEFAULT_RECORDS);
+  printf("  --decode-trace=<file>      don't run, print the --trace in <file> of the program\n");
+  printf("                             as disassembly\n");
+  printf("  --trace-last=<n>           only the last <n> records of --decode-trace\n");
+  printf("  --record=<file>            write what malloc returns and a checkpoint of the whole\n");
+  printf("                             state every --checkpoint-every instructions to <file>\n");
+  printf("  --checkpoint-every=<n>     e.g. 10m (default: 100m, 0 = no checkpoints)\n");
+  printf("  --replay=<file>            run the program as --record did (same options) and\n");
+  printf("                             report the first difference from the recording\n");
+  printf("  --from-checkpoint=<n>      start the --replay from its checkpoint <n> (from 1)\n");
+  printf("  --dump-ranges              don't run, print the register ranges and stack depth\n");
+  printf("                             at the start of each block and the checks removed\n");
+}
+
+// Parses things like '4096', '512k', '64M', '1g'
+static bool parse_size(const char* str, uint64_t* out) {
+  char* end;
+  uint64_t value = strtoull(str, &end, 10);
+  if (end == str) return false;
+
+  switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+  }
+  if (*end != '\0') return false;
+
+  *out = value;
+  return true;
+}
+
+// Returns the value of '--name=value' or NULL if 'arg' is not that option
+static const char* option_value(const char* arg, const char* name) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) == 0 && arg[len] == '=') {
+    return arg + len + 1;
+  }
+  return NULL;
+}
+
+// The program --profile reports on, also when it stops with an error
+static program* profiled_program;
+static int profile_top = PROFILE_DEFAULT_TOP;
+static int sample_hz = SAMPLE_DEFAULT_HZ;
+static const char* sample_path = NULL; // NULL = stderr
 
 int main(int argc, const char** argv) {
-  if (argc < 2) {
-    printf("Use interp [file]\n");
+  run_options opts;
+  run_options_init(&opts);
+
+  const char* path = NULL;
+  bool aot = false;
+  bool emit_c = false;
+  bool dump_cfg = false;
+  bool dump_ranges = false;
+  const char* emit_c_path = NULL; // NULL = stdout
+  bool time_phases = false;
+  timing_format time_format = TIMING_JSON;
+  const char* time_path = NULL; // NULL = stderr
+  bool counters = false;
+  const char* decode_trace_path = NULL;
+  uint64_t trace_last = 0; // 0 = all
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value;
+
+    if ((value = option_value(arg, "--heap-size")) != NULL) {
+      if (!parse_size(value, &opts.heap_size)) {
+        printf("invalid heap size '%s'\n", value);
+        return 1;
+      }
+    } else if ((value = option_value(arg, "--stack-size")) != NULL) {
+      if (!parse_size(value, &opts.stack_size)) {
+        printf("invalid stack size '%s'\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "-O0") == 0 || strcmp(arg, "-O1") == 0) {
+      opts.opt_level = arg[2] - '0';
+    } else if (strcmp(arg, "--no-inline") == 0) {
+      opts.inline_calls = false;
+    } else if (strcmp(arg, "--no-cache-registers") == 0) {
+      opts.cache_registers = false;
+    } else if (strcmp(arg, "--profile") == 0) {
+      opts.profile = PROFILE_COUNTS;
+    } else if ((value = option_value(arg, "--profile")) != NULL) {
+      if (strcmp(value, "counts") == 0) {
+        opts.profile = PROFILE_COUNTS;
+      } else if (strcmp(value, "cycles") == 0) {
+        opts.profile = PROFILE_CYCLES;
+      } else {
+        printf("invalid --profile mode '%s', use counts or cycles\n", value);
+        return 1;
+      }
+    } else if ((value = option_value(arg, "--profile-top")) != NULL) {
+      profile_top = atoi(value);
+    } else if (strcmp(arg, "--sample") == 0) {
+      opts.sample = true;
+    } else if ((value = option_value(arg, "--sample")) != NULL) {
+      opts.sample = true;
+      sample_hz = atoi(value);
+    } else if ((value = option_value(arg, "--sample-file")) != NULL) {
+      opts.sample = true;
+      sample_path = value;
+    } else if (strcmp(arg, "--time") == 0) {
+      time_phases = true;
+    } else if ((value = option_value(arg, "--time")) != NULL) {
+      time_phases = true;
+      if (strcmp(value, "json") == 0) {
+        time_format = TIMING_JSON;
+      } else if (strcmp(value, "csv") == 0) {
+        time_format = TIMING_CSV;
+      } else {
+        printf("invalid --time format '%s', use json or csv\n", value);
+        return 1;
+      }
+    } else if ((value = option_value(arg, "--time-file")) != NULL) {
+      time_phases = true;
+      time_path = value;
+    } else if (strcmp(arg, "--counters") == 0) {
+      time_phases = true;
+      counters = true;
+    } else if ((value = option_value(arg, "--trace")) != NULL) {
+      opts.trace = value;
+    } else if ((value = option_value(arg, "--trace-size")) != NULL) {
+      if (!parse_size(value, &opts.trace_records) || opts.trace_records == 0) {
+        printf("invalid trace size '%s'\n", value);
+        return 1;
+      }
+    } else if ((value = option_value(arg, "--decode-trace")) != NULL) {
+      decode_trace_path = value;
+    } else if ((value = option_value(arg, "--trace-last")) != NULL) {
+      trace_last = strtoull(value, NULL, 10);
+    } else if ((value = option_value(arg, "--record")) != NULL) {
+      opts.record = value;
+    } else if ((value = option_value(arg, "--checkpoint-every")) != NULL) {
+      if (!parse_size(value, &opts.checkpoint_every)) {
+        printf("invalid checkpoint interval '%s'\n", value);
+        return 1;
+      }
+    } else if ((value = option_value(arg, "--replay")) != NULL) {
+      opts.replay = value;
+    } else if ((value = option_value(arg, "--from-checkpoint")) != NULL) {
+      opts.replay_from = strtoull(value, NULL, 10);
+    } else if (strcmp(arg, "--aot") == 0) {
+      aot = true;
+    } else if (strcmp(arg, "--dump-cfg") == 0) {
+      dump_cfg = true;
+    } else if (strcmp(arg, "--dump-ranges") == 0) {
+      dump_ranges = true;
+    } else if (strcmp(arg, "--emit-c") == 0) {
+      emit_c = true;
+    } else if ((value = option_value(arg, "--emit-c")) != NULL) {
+      emit_c = true;
+      emit_c_path = value;
+    } else if (arg[0] == '-' && arg[1] == '-') {
+      printf("unknown option '%s'\n", arg);
+      print_usage();
+      return 1;
+    } else {
+      path = arg;
+    }
+  }
+
+  if (path == NULL) {
+    print_usage();
+    return 1;
+  }
+  if ((opts.record || opts.replay) && (opts.profile != PROFILE_OFF || opts.sample || opts.trace)) {
+    printf("--record and --replay can't be used with --profile, --sample or --trace\n");
+    return 1;
+  }
+  if (opts.record && opts.replay) {
+    printf("--record and --replay can't be used together\n");
+    return 1;
+  }
+  if (opts.replay_from && !opts.replay) {
+    printf("--from-checkpoint needs --replay\n");
     return 1;
   }
 
-  run_from_file(argv[1]);
-  // alloc_spy_report();
+  // Labeled with the program, to tell the runs of a batch apart
+  if (time_phases) timing_enable(time_format, time_path, path);
+  if (counters) timing_enable_counters();
+
+  if (decode_trace_path) {
+    decode_trace_from_file(path, &opts, decode_trace_path, trace_last);
+  } else if (dump_cfg) {
+    dump_cfg_from_file(path, &opts);
+  } else if (dump_ranges) {
+    dump_ranges_from_file(path, &opts);
+  } else if (emit_c) {
+    emit_c_from_file(path, &opts, emit_c_path);
+  } else {
+    run_from_file(path, &opts, aot);
+  }
   return 0;
 }
 
@@ -44,7 +281,7 @@ void read_file_fully(FILE* fp, char** data, long* data_len) {
   *data_len = flen;
 }
 
-void run_from_file(const char* path) {
+char* load_file(const char* path) {
   FILE* fp = fopen(path, "rb");
   if (!fp) {
     printf("failed to open file %s\n", path);
@@ -54,64 +291,257 @@ void run_from_file(const char* path) {
   long data_len = 0;
   char* data = NULL;
   read_file_fully(fp, &data, &data_len);
+  return data;
+}
 
-  if (0) {
-    PERF_START(gen_c);
+// Parses, builds, checks and optimizes the program (errors exit, see error.h)
+void load_program(const char* path, run_options* opts, program* prog) {
+  char* data = load_file(path);
 
-    parser p;
+  parser p;
+  PERF_START(lex);
+  parser_init(&p, data);
+  PERF_STOP(lex);
 
-    parser_init(&p, data);
+  PERF_START(parse);
+  top_level_node* n = parser_parse(&p);
+  PERF_STOP(parse);
 
-    top_level_node* n = parser_parse(&p);
+  prog->error_handler = p.error_handler;
+  PERF_START(program_build);
+  program_build(prog, n);
+  PERF_STOP(program_build);
 
-    program prog;
-    prog.error_handler = p.error_handler;
+  prog->options = *opts;
+  PERF_START(program_check);
+  program_check(prog);
+  PERF_STOP(program_check);
 
-    program_build(&prog, n);
-    program_check(&prog);
+  if (opts->opt_level > 0) {
+    PERF_START(program_optimize);
+    program_optimize(prog);
+    PERF_STOP(program_optimize);
+  }
+}
 
-    // XXX TEMP REPLACE .asm with .c
-    char* gen_c_out_path = strdup(path);
-    size_t len = strlen(gen_c_out_path);
-    gen_c_out_path[len - 3] = 'c';
-    gen_c_out_path[len - 2] = '\0';
+static void profile_report_at_exit(void) {
+  fflush(stdout);
+  profile_report(profiled_program, profile_top);
+}
 
-    FILE* gen_outfp = fopen(gen_c_out_path, "w");
-    gen_c(&prog, gen_outfp);
-    fclose(gen_outfp);
-    PERF_STOP(gen_c);
+static void sample_report_at_exit(void) {
+  sample_stop();
+  fflush(stdout);
+
+  FILE* out = stderr;
+  if (sample_path) {
+    out = fopen(sample_path, "w");
+    if (!out) {
+      printf("failed to open file %s\n", sample_path);
+      return;
+    }
   }
+  sample_write_folded(profiled_program, out);
+  if (out != stderr) {
+    fclose(out);
+    fprintf(stderr, "%" PRIu64 " samples written to %s", samples.num_samples, sample_path);
+    if (samples.dropped) fprintf(stderr, " (%" PRIu64 " dropped, too many)", samples.dropped);
+    fprintf(stderr, "\n");
+  }
+}
 
-  char* result = interp(data);
+// Runs the --replay with the options the recording was made with
+static void replay_options(run_options* opts) {
+  replay_log log;
+  const char* error = replay_open(&log, opts->replay);
+  if (error) {
+    printf("failed to replay %s: %s\n", opts->replay, error);
+    exit(1);
+  }
+  opts->opt_level = log.header.opt_level;
+  opts->inline_calls = log.header.inline_calls != 0;
+  opts->heap_size = log.header.heap_size;
+  opts->stack_size = log.header.stack_size;
+  replay_close(&log);
+}
+
+// Also when the program stops with an error (the log has the end of the
+// run by then, see vm_replay_end)
+static void replay_report_at_exit(void) {
+  replay_log* log = &vm_replay_log;
+  fflush(stdout);
+  if (!log->file || log->stopped) {
+    program_replay_close();
+    return;
+  }
+  fprintf(stderr, "%s: ", log->recording ? "record" : "replay");
+  // Not known after a stack overflow
+  if (log->num_insns != UINT64_MAX) fprintf(stderr, "%" PRIu64 " instructions, ", log->num_insns);
+  if (log->from_checkpoint) fprintf(stderr, "from checkpoint %" PRIu64 ", ", log->from_checkpoint);
+  fprintf(stderr, "%" PRIu64 " mallocs and %" PRIu64 " checkpoints %s %s\n", log->num_events, log->num_checkpoints,
+    log->recording ? "written to" : "match", log->path);
+  program_replay_close();
+}
+
+void run_from_file(const char* path, run_options* opts, bool aot) {
+  char* result;
+  if (opts->sample && opts->profile == PROFILE_OFF) {
+    if (aot) fprintf(stderr, "--sample: running in the interpreter\n");
+    static program prog;
+    load_program(path, opts, &prog);
+    profiled_program = &prog;
+    if (!sample_start(sample_hz)) {
+      fprintf(stderr, "--sample: failed to start the timer\n");
+      exit(1);
+    }
+    atexit(sample_report_at_exit);
+    PERF_START(program_run);
+    result = program_run(&prog);
+    PERF_STOP(program_run);
+  } else if (opts->profile != PROFILE_OFF) {
+    if (aot) fprintf(stderr, "--profile: running in the interpreter\n");
+    static program prog;
+    load_program(path, opts, &prog);
+    profiled_program = &prog;
+    atexit(profile_report_at_exit);
+    PERF_START(program_run);
+    result = program_run(&prog);
+    PERF_STOP(program_run);
+  } else if (opts->record || opts->replay) {
+    if (aot) fprintf(stderr, "--%s: running in the interpreter\n", opts->record ? "record" : "replay");
+    if (opts->replay) replay_options(opts);
+    atexit(replay_report_at_exit);
+    result = interp_with_options(load_file(path), opts);
+  } else if (aot && !opts->trace) {
+    PERF_START(interp);
+    program prog;
+    load_program(path, opts, &prog);
+    result = program_run_aot(&prog);
+    PERF_STOP(interp);
+  } else {
+    if (aot) fprintf(stderr, "--trace: running in the interpreter\n");
+    result = interp_with_options(load_file(path), opts);
+  }
   printf("Result: '%s'\n", result);
 }
 
+void emit_c_from_file(const char* path, run_options* opts, const char* out_path) {
+  program prog;
+  load_program(path, opts, &prog);
+
+  FILE* out = stdout;
+  if (out_path) {
+    out = fopen(out_path, "w");
+    if (!out) {
+      printf("failed to open file %s\n", out_path);
+      exit(2);
+    }
+  }
+
+  gen_c(&prog, out);
+
+  if (out != stdout) fclose(out);
+}
+
+void dump_cfg_from_file(const char* path, run_options* opts) {
+  program prog;
+  load_program(path, opts, &prog);
+
+  cfg g;
+  cfg_build(&g, &prog);
+  cfg_compute_liveness(&g);
+  cfg_find_loops(&g);
+  cfg_dump(&g, stdout);
+  cfg_destroy(&g);
+}
+
+void dump_ranges_from_file(const char* path, run_options* opts) {
+  program prog;
+  load_program(path, opts, &prog);
+  opt_dump_ranges(&prog, stdout);
+}
+
+// Prints the records of 'trace_path', written by a run of the program in
+// 'path', as disassembly with the values the instructions wrote
+void decode_trace_from_file(const char* path, run_options* opts, const char* trace_path, uint64_t last) {
+  trace_ring ring;
+  const char* error = trace_open(&ring, trace_path);
+  if (error) {
+    printf("failed to read the trace %s: %s\n", trace_path, error);
+    exit(1);
+  }
+
+  // Built the way the traced run built it
+  opts->opt_level = ring.header->opt_level;
+  opts->inline_calls = ring.header->inline_calls != 0;
+  program prog;
+  load_program(path, opts, &prog);
+  if (program_code_hash(&prog) != ring.header->program_hash) {
+    printf("the trace %s is of another program\n", trace_path);
+    exit(1);
+  }
+
+  uint64_t max = last ? last : ring.header->capacity;
+  trace_record* records = (trace_record*) malloc(max * sizeof(trace_record));
+  if (!records) {
+    printf("failed to alloc memory for the trace\n");
+    exit(1);
+  }
+  uint64_t first;
+  uint64_t n = trace_read(&ring, records, max, &first);
+  printf("; %" PRIu64 " instructions traced, from #%" PRIu64 "\n", first + n, first);
+
+  char* ident = "  ";
+  for (uint64_t i = 0; i < n; i++) {
+    trace_record* r = &records[i];
+    if (r->pc >= (uint32_t) prog.num_instructions || r->opcode != prog.instructions[r->pc].opcode) {
+      printf("; #%" PRIu64 ": corrupt record\n", first + i);
+      continue;
+    }
+    disasm_single_insn(&prog, r->pc, prog.instructions[r->pc], &ident);
+    if (r->reg == TRACE_REG_CMP) {
+      printf("    ; #%" PRIu64 " cmp = %" PRId64 "\n", first + i, r->value);
+    } else if (r->reg != TRACE_REG_NONE) {
+      printf("    ; #%" PRIu64 " %c = %" PRId64 "\n", first + i, (char) ('a' + r->reg), r->value);
+    } else {
+      printf("    ; #%" PRIu64 "\n", first + i);
+    }
+  }
+  free(records);
+  trace_close(&ring);
+}
+
 void disasm_single_insn(program* prg, int insn_index, instruction in, char **ident) {
   // @perf
   int i = insn_index;
+  // Numbered as in the source, even if the optimizer removed instructions
+  int src_index = program_insn_origin(prg, i);
   char* label_name = program_get_label_by_index(prg, i);
   if (label_name) {
-    printf("%03d| %s:\n", i, label_name);
+    printf("%03d| %s:\n", src_index, label_name);
     *ident = "  ";
   }
 
-  printf("%03d| %s%s", i, *ident, opcode_names[in.opcode]);
+  printf("%03d| %s%s", src_index, *ident, opcode_names[in.opcode]);
 
   for (int j = 0; j < in.num_operands; j++) {
     operand op = in.operands[j];
     if (op.type == OPERAND_REG) {
       printf(" %c", (char) ('a' + op.reg_index));
     } else if (op.type == OPERAND_INT)   {
-      printf(" %I64d", op.int_value);
+      printf(" %" PRId64, op.int_value);
     } else if (op.type == OPERAND_STR) {
-      printf(" '%s'", op.str);
+      printf(" ");
+      print_string_constant(&prg->strings[op.extra]);
     } else if (op.type == OPERAND_BRANCH) {
+      // The optimizer may branch to the middle of what was a label
       char* label_name = program_get_label_by_index(prg, op.branch_index);
-      assert(label_name);
-
-      printf(" %d  (%s)", op.branch_index, label_name);
+      printf(" %d", program_insn_origin(prg, op.branch_index));
+      if (label_name) printf("  (%s)", label_name);
     } else if (op.type == OPERAND_UNRESOLVED_BRANCH) {
       printf(" <unknown label %s>", op.str);
+    } else if (op.type == OPERAND_MEM_ADDRESS) {
+      printf(" %" PRId64 "[%c]", op.extra, (char) ('a' + op.reg_index));
     } else {
       printf("<unhandled op type %d>", op.type);
     }
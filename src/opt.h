@@ -0,0 +1,1672 @@
+#ifndef __OPT_H__
+#define __OPT_H__
+
+// Optimizations on a checked program, run between program_check and
+// program_run (see interp_with_options). They never change what a program
+// prints or which error it stops with: instructions keep their position in
+// the source, an instruction that may fault is never folded away. Except
+// for two cases:
+//
+// - Turning tail calls into jumps (opt_tail_calls) takes them off the
+//   stack, so a tail recursion that used to stop with a callstack overflow
+//   runs on instead, until it's done or forever (codes/stack_overflow.asm).
+//   Calls whose callee could see the missing return address (it pops what
+//   it didn't push) are left as they are.
+// - A return address is the index of an instruction, and the optimizer
+//   renumbers them. A program that pops one and uses it as a number, or
+//   pushes a number and returns to it, sees other numbers or another
+//   invalid return address.
+//
+// -O0 runs the program as written.
+//
+// Instructions are rewritten in place, removed ones become OPCODE_NOP so the
+// branch targets and labels stay valid. Like genc.c we assume 'ret' only
+// goes back to the instruction after a 'call'.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "interp.h"
+#include "cfg.h"
+
+static void opt_make_nop(instruction* in) {
+  in->opcode = OPCODE_NOP;
+  in->num_operands = 0;
+}
+
+static void opt_make_int(operand* op, int64_t value) {
+  op->type = OPERAND_INT;
+  op->int_value = value;
+  op->extra = 0;
+}
+
+// Arithmetic with the interpreter semantics (wraps around).
+// Returns false if it can't be folded (the division would fault).
+static bool opt_eval(opcode opc, int64_t x, int64_t y, int64_t* result) {
+  uint64_t ux = (uint64_t) x, uy = (uint64_t) y;
+  switch (opc) {
+    case OPCODE_ADD: *result = (int64_t) (ux + uy); return true;
+    case OPCODE_SUB: case OPCODE_CMP: *result = (int64_t) (ux - uy); return true;
+    case OPCODE_MUL: *result = (int64_t) (ux * uy); return true;
+    case OPCODE_DIV:
+      if (y == 0) return false;
+      *result = y == -1 ? (int64_t) (0 - ux) : x / y;
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool opt_branch_taken(opcode opc, int64_t cmp) {
+  switch (opc) {
+    case OPCODE_JMP: return true;
+    case OPCODE_JNE: return cmp != 0;
+    case OPCODE_JE:  return cmp == 0;
+    case OPCODE_JGE: return cmp >= 0;
+    case OPCODE_JG:  return cmp > 0;
+    case OPCODE_JLE: return cmp <= 0;
+    case OPCODE_JL:  return cmp < 0;
+    default: assert(0); return false;
+  }
+}
+
+// What we know about the registers at some point of a block
+typedef struct opt_consts {
+  reg_set known; // registers and the cmp flag (CFG_FLAGS_BIT)
+  int64_t regs[NUM_REGISTERS];
+  int64_t cmp;
+} opt_consts;
+
+#define OPT_IS_KNOWN(c, reg) (((c)->known & (1u << (reg))) != 0)
+
+static void opt_set_reg(opt_consts* c, int reg, int64_t value) {
+  c->known |= 1u << reg;
+  c->regs[reg] = value;
+}
+
+// Replaces a register operand by its value, if known
+static void opt_propagate(opt_consts* c, operand* op) {
+  if (op->type == OPERAND_REG && OPT_IS_KNOWN(c, op->reg_index)) {
+    opt_make_int(op, c->regs[op->reg_index]);
+  }
+}
+
+static void opt_fold_instruction(opt_consts* c, instruction* in) {
+  operand* ops = in->operands;
+  opcode opc = in->opcode;
+
+  switch (opc) {
+    case OPCODE_MOV:
+      opt_propagate(c, &ops[1]);
+      if (ops[0].type != OPERAND_REG) break;
+      if (ops[1].type == OPERAND_INT) {
+        opt_set_reg(c, ops[0].reg_index, ops[1].int_value);
+      } else {
+        c->known &= ~(1u << ops[0].reg_index);
+      }
+      break;
+
+    case OPCODE_ADD: case OPCODE_SUB: case OPCODE_MUL: case OPCODE_DIV: {
+      opt_propagate(c, &ops[1]);
+      if (ops[0].type != OPERAND_REG) break;
+      int dst = ops[0].reg_index;
+
+      if (ops[1].type == OPERAND_INT) {
+        int64_t y = ops[1].int_value, result;
+        if (OPT_IS_KNOWN(c, dst) && opt_eval(opc, c->regs[dst], y, &result)) {
+          in->opcode = OPCODE_MOV;
+          opt_make_int(&ops[1], result);
+          opt_set_reg(c, dst, result);
+          break;
+        }
+        // x + 0, x - 0, x * 1, x / 1
+        bool is_identity = ((opc == OPCODE_ADD || opc == OPCODE_SUB) && y == 0)
+          || ((opc == OPCODE_MUL || opc == OPCODE_DIV) && y == 1);
+        if (is_identity) {
+          opt_make_nop(in);
+          break;
+        }
+        if (opc == OPCODE_MUL && y == 0) {
+          in->opcode = OPCODE_MOV;
+          opt_set_reg(c, dst, 0);
+          break;
+        }
+      }
+      c->known &= ~(1u << dst);
+      break;
+    }
+
+    case OPCODE_INC: case OPCODE_DEC: {
+      int dst = ops[0].reg_index;
+      if (OPT_IS_KNOWN(c, dst)) {
+        int64_t result;
+        opt_eval(opc == OPCODE_INC ? OPCODE_ADD : OPCODE_SUB, c->regs[dst], 1, &result);
+        in->opcode = OPCODE_MOV;
+        in->num_operands = 2;
+        // inc/dec have a single operand, the constant gets a copy of its position
+        in->operands = (operand*) realloc(in->operands, 2 * sizeof(operand));
+        ops = in->operands;
+        ops[1] = ops[0];
+        opt_make_int(&ops[1], result);
+        opt_set_reg(c, dst, result);
+      }
+      break;
+    }
+
+    case OPCODE_CMP:
+      opt_propagate(c, &ops[0]);
+      opt_propagate(c, &ops[1]);
+      if (ops[0].type == OPERAND_INT && ops[1].type == OPERAND_INT) {
+        opt_eval(OPCODE_CMP, ops[0].int_value, ops[1].int_value, &c->cmp);
+        c->known |= CFG_FLAGS_BIT;
+      } else {
+        c->known &= ~CFG_FLAGS_BIT;
+      }
+      break;
+
+    case OPCODE_JNE: case OPCODE_JE: case OPCODE_JGE:
+    case OPCODE_JG: case OPCODE_JLE: case OPCODE_JL:
+      if (c->known & CFG_FLAGS_BIT) {
+        if (opt_branch_taken(opc, c->cmp)) in->opcode = OPCODE_JMP;
+        else opt_make_nop(in);
+      }
+      break;
+
+    case OPCODE_PRINT: case OPCODE_MSG:
+      for (int i = 0; i < in->num_operands; i++) {
+        opt_propagate(c, &ops[i]);
+      }
+      break;
+
+    case OPCODE_CALL:
+      // The callee can change anything
+      c->known = 0;
+      break;
+
+    default: {
+      // Forget whatever it writes
+      reg_set use, def;
+      cfg_insn_use_def(in, &use, &def);
+      c->known &= ~def;
+      break;
+    }
+  }
+}
+
+// Constant propagation and folding inside each basic block. A block with a
+// single predecessor that comes before it starts with what was known at the
+// end of that one (e.g. the fall through of a conditional jump).
+// Registers start at zero, so the entry block starts with all of them known
+// (unless something jumps or calls back to it). Calls are not edges of the
+// cfg, so a block that is called starts with nothing known.
+void opt_fold_constants(program* p) {
+  cfg g;
+  cfg_build(&g, p);
+
+  opt_consts* block_out = (opt_consts*) malloc(g.num_blocks * sizeof(opt_consts));
+  bool* is_called = (bool*) calloc(g.num_blocks, sizeof(bool));
+  if (!block_out || !is_called) {
+    printf("failed to alloc memory for the optimizer\n");
+    exit(1);
+  }
+  for (int b = 0; b < g.num_blocks; b++) {
+    if (g.blocks[b].callee_block != -1) is_called[g.blocks[b].callee_block] = true;
+  }
+
+  for (int b = 0; b < g.num_blocks; b++) {
+    basic_block* block = &g.blocks[b];
+    opt_consts* c = &block_out[b];
+    memset(c, 0, sizeof(*c));
+    if (is_called[b]) {
+      // Whatever the caller had
+    } else if (block->start == 0 && block->num_preds == 0) {
+      c->known = CFG_ALL_REGS | CFG_FLAGS_BIT;
+    } else if (block->num_preds == 1 && block->preds[0] < b) {
+      *c = block_out[block->preds[0]];
+    }
+
+    for (int i = block->start; i < block->end; i++) {
+      opt_fold_instruction(c, &p->instructions[i]);
+    }
+  }
+
+  free(block_out);
+  free(is_called);
+  cfg_destroy(&g);
+}
+
+// Instructions that only write a register (or the cmp flag) and can't fail
+static bool opt_only_writes_registers(instruction* in) {
+  operand* ops = in->operands;
+  switch (in->opcode) {
+    case OPCODE_MOV: case OPCODE_ADD: case OPCODE_SUB: case OPCODE_MUL:
+      return ops[0].type == OPERAND_REG && ops[1].type != OPERAND_MEM_ADDRESS;
+    case OPCODE_DIV:
+      return ops[0].type == OPERAND_REG && ops[1].type == OPERAND_INT && ops[1].int_value != 0;
+    case OPCODE_DIV_NC:
+      return ops[0].type == OPERAND_REG && ops[1].type != OPERAND_MEM_ADDRESS;
+    case OPCODE_INC: case OPCODE_DEC: case OPCODE_CMP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Turns writes nobody reads into nops. Returns true if anything changed.
+static bool opt_remove_dead_writes(program* p) {
+  cfg g;
+  cfg_build(&g, p);
+  cfg_compute_liveness(&g);
+
+  bool changed = false;
+  for (int b = 0; b < g.num_blocks; b++) {
+    basic_block* block = &g.blocks[b];
+    reg_set live = block->live_out;
+
+    for (int i = block->end - 1; i >= block->start; i--) {
+      instruction* in = &p->instructions[i];
+      reg_set use, def;
+      cfg_insn_use_def(in, &use, &def);
+
+      if (opt_only_writes_registers(in) && (def & live) == 0) {
+        opt_make_nop(in);
+        changed = true;
+        continue;
+      }
+      live = (live & ~def) | use;
+    }
+  }
+
+  cfg_destroy(&g);
+  return changed;
+}
+
+// Blocks reachable from the entry, following branches and calls
+static bool* opt_reachable_blocks(cfg* g) {
+  bool* reachable = (bool*) cfg_alloc(g->num_blocks * sizeof(bool));
+  if (g->num_blocks == 0) return reachable;
+
+  int* worklist = (int*) cfg_alloc(g->num_blocks * sizeof(int));
+  int n = 0;
+  reachable[0] = true;
+  worklist[n++] = 0;
+
+  while (n > 0) {
+    basic_block* b = &g->blocks[worklist[--n]];
+    for (int i = 0; i <= b->num_succs; i++) {
+      // The callee is the last "successor"
+      int s = i < b->num_succs ? b->succs[i] : b->callee_block;
+      if (s != -1 && !reachable[s]) {
+        reachable[s] = true;
+        worklist[n++] = s;
+      }
+    }
+  }
+
+  free(worklist);
+  return reachable;
+}
+
+// Removes unreachable blocks, nops and jumps to the next instruction, then
+// renumbers the branches. Labels nothing branches to or calls are dropped,
+// so the blocks around them can be merged by the other passes.
+// p->insn_origin keeps the index each instruction had in the source.
+static void opt_compact(program* p) {
+  int n = p->num_instructions;
+  instruction* insns = p->instructions;
+
+  cfg g;
+  cfg_build(&g, p);
+  bool* reachable = opt_reachable_blocks(&g);
+
+  bool* keep = (bool*) cfg_alloc((n + 1) * sizeof(bool));
+  for (int i = 0; i < n; i++) {
+    keep[i] = reachable[g.block_of[i]] && insns[i].opcode != OPCODE_NOP;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!keep[i] || insns[i].opcode != OPCODE_JMP) continue;
+    // Only removed instructions in between
+    int next = i + 1;
+    while (next < n && !keep[next]) next++;
+    int target = insns[i].operands[0].branch_index;
+    if (target > i && target <= next) keep[i] = false;
+  }
+  free(reachable);
+  cfg_destroy(&g);
+
+  // Branches to a removed instruction go to the next one kept
+  int* new_index = (int*) cfg_alloc((n + 1) * sizeof(int));
+  bool* is_target = (bool*) cfg_alloc((n + 1) * sizeof(bool));
+  int new_n = 0;
+  for (int i = 0; i < n; i++) {
+    new_index[i] = new_n;
+    if (!keep[i]) continue;
+    new_n++;
+    if (cfg_is_branch(insns[i].opcode) || insns[i].opcode == OPCODE_CALL) {
+      is_target[insns[i].operands[0].branch_index] = true;
+    }
+  }
+  new_index[n] = new_n;
+
+  int* origin = (int*) cfg_alloc((new_n + 1) * sizeof(int));
+  for (int i = 0; i < n; i++) {
+    if (!keep[i]) {
+      free(insns[i].operands);
+      continue;
+    }
+    instruction* in = &insns[new_index[i]];
+    *in = insns[i];
+    if (cfg_is_branch(in->opcode) || in->opcode == OPCODE_CALL) {
+      in->operands[0].branch_index = new_index[in->operands[0].branch_index];
+    }
+    origin[new_index[i]] = program_insn_origin(p, i);
+  }
+  origin[new_n] = program_insn_origin(p, n);
+
+  int num_labels = 0;
+  for (int i = 0; i < p->num_resolved_labels; i++) {
+    resolved_label l = p->resolved_labels[i];
+    if (!is_target[l.instruction_index]) continue;
+    l.instruction_index = new_index[l.instruction_index];
+    p->resolved_labels[num_labels++] = l;
+  }
+  p->num_resolved_labels = num_labels;
+
+  free(p->insn_origin);
+  p->insn_origin = origin;
+  p->num_instructions = new_n;
+  if (new_n > 0) {
+    instruction* shrunk = (instruction*) realloc(insns, new_n * sizeof(instruction));
+    if (shrunk) p->instructions = shrunk;
+  }
+  program_mark_return_sites(p);
+
+  free(keep);
+  free(new_index);
+  free(is_target);
+}
+
+#define OPT_MAX_DEAD_WRITE_PASSES 4
+
+// Dead register writes, unreachable code and labels
+void opt_remove_dead_code(program* p) {
+  // Removing a write may make the ones feeding it dead
+  for (int i = 0; i < OPT_MAX_DEAD_WRITE_PASSES; i++) {
+    if (!opt_remove_dead_writes(p)) break;
+  }
+  opt_compact(p);
+}
+
+#define OPT_INLINE_MAX_SIZE 16 // instructions, without the ret
+
+// Whether the stack is balanced in every path through 'proc': nothing popped
+// that the procedure didn't push (e.g. the return address) and nothing left
+// behind when it returns. 'depth' and 'worklist' have room for every block.
+static bool opt_stack_is_balanced(cfg* g, int proc, int* depth, int* worklist) {
+  program* p = g->prog;
+  for (int b = 0; b < g->num_blocks; b++) depth[b] = -1;
+
+  int n = 0;
+  int entry = g->procs[proc].entry_block;
+  depth[entry] = 0;
+  worklist[n++] = entry;
+
+  while (n > 0) {
+    basic_block* block = &g->blocks[worklist[--n]];
+    int d = depth[block - g->blocks];
+
+    for (int i = block->start; i < block->end; i++) {
+      instruction* in = &p->instructions[i];
+      int frame_size = 0;
+      if (in->opcode == OPCODE_ENTER || in->opcode == OPCODE_LEAVE) {
+        frame_size = in->operands[1].reg_index - in->operands[0].reg_index + 2;
+      }
+      switch (in->opcode) {
+        case OPCODE_PUSH:  d++; break;
+        case OPCODE_POP:   if (--d < 0) return false; break;
+        case OPCODE_ENTER: d += frame_size; break;
+        case OPCODE_LEAVE: if ((d -= frame_size) < 0) return false; break;
+        case OPCODE_RET:   if (d != 0) return false; break;
+        default: break;
+      }
+    }
+
+    for (int i = 0; i < block->num_succs; i++) {
+      int s = block->succs[i];
+      if (depth[s] == -1) {
+        depth[s] = d;
+        worklist[n++] = s;
+      } else if (depth[s] != d) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Small procedures that don't call anything, return from a single place and
+// whose blocks can be copied as they are (no jumps to other procedures).
+// Returns the size of the copy (with the ret), or 0.
+static int opt_inline_size(cfg* g, int proc, int* depth, int* worklist) {
+  program* p = g->prog;
+  if (proc == 0 || g->procs[proc].num_callees > 0) return 0;
+
+  int size = 0, num_rets = 0;
+  for (int b = 0; b < g->num_blocks; b++) {
+    basic_block* block = &g->blocks[b];
+    if (block->proc != proc) continue;
+    // Copied in program order, so callers have to land on the first block
+    if (b < g->procs[proc].entry_block) return 0;
+
+    instruction* last = &p->instructions[block->end - 1];
+    bool ends_flow = last->opcode == OPCODE_JMP
+      || last->opcode == OPCODE_RET
+      || last->opcode == OPCODE_END;
+    // Falls off the end of the program or branches there
+    if (!ends_flow && block->end == p->num_instructions) return 0;
+    if (cfg_is_branch(last->opcode) && g->block_of[last->operands[0].branch_index] == -1) return 0;
+
+    for (int i = 0; i < block->num_succs; i++) {
+      if (g->blocks[block->succs[i]].proc != proc) return 0;
+    }
+    num_rets += last->opcode == OPCODE_RET;
+    size += block->end - block->start;
+  }
+
+  if (num_rets != 1 || size - 1 > OPT_INLINE_MAX_SIZE) return 0;
+  if (!opt_stack_is_balanced(g, proc, depth, worklist)) return 0;
+  return size;
+}
+
+static void opt_copy_instruction(instruction* to, instruction* from) {
+  *to = *from;
+  if (from->num_operands > 0) {
+    to->operands = (operand*) malloc(from->num_operands * sizeof(operand));
+    if (!to->operands) {
+      printf("failed to alloc memory for the optimizer\n");
+      exit(1);
+    }
+    memcpy(to->operands, from->operands, from->num_operands * sizeof(operand));
+  }
+}
+
+// Replaces calls to small leaf procedures with a copy of their body, the
+// ret becomes a jump to the instruction after the call. The procedures are
+// left in place, opt_remove_dead_code drops them if nothing calls them anymore.
+//
+// The copies don't take a stack entry for the return address, so a program
+// close to the stack size limit may overflow later than it would without it.
+void opt_inline_calls(program* p) {
+  int n = p->num_instructions;
+  instruction* insns = p->instructions;
+
+  cfg g;
+  cfg_build(&g, p);
+
+  int* depth = (int*) cfg_alloc(g.num_blocks * sizeof(int));
+  int* worklist = (int*) cfg_alloc(g.num_blocks * sizeof(int));
+  int* inline_size = (int*) cfg_alloc(g.num_procs * sizeof(int));
+  for (int i = 0; i < g.num_procs; i++) {
+    inline_size[i] = opt_inline_size(&g, i, depth, worklist);
+  }
+
+  int* proc_at = (int*) cfg_alloc(g.num_blocks * sizeof(int));
+  for (int b = 0; b < g.num_blocks; b++) proc_at[b] = -1;
+  for (int i = 0; i < g.num_procs; i++) proc_at[g.procs[i].entry_block] = i;
+
+  // Size of what replaces each instruction, and where it goes
+  int* new_index = (int*) cfg_alloc((n + 1) * sizeof(int));
+  int* callee = (int*) cfg_alloc(n * sizeof(int));
+  int budget = n / 2 + 64;
+  int new_n = 0;
+  for (int i = 0; i < n; i++) {
+    new_index[i] = new_n;
+    callee[i] = -1;
+    if (insns[i].opcode == OPCODE_CALL) {
+      int b = g.block_of[insns[i].operands[0].branch_index];
+      int proc = b == -1 ? -1 : proc_at[b];
+      int size = proc == -1 ? 0 : inline_size[proc];
+      if (size > 0 && size - 1 <= budget) {
+        callee[i] = proc;
+        budget -= size - 1;
+        new_n += size;
+        continue;
+      }
+    }
+    new_n++;
+  }
+  new_index[n] = new_n;
+
+  if (new_n == n) {
+    free(depth); free(worklist); free(inline_size); free(proc_at); free(new_index); free(callee);
+    cfg_destroy(&g);
+    return;
+  }
+
+  // Instructions of each procedure to copy (its blocks in program order)
+  // and the position of every instruction inside its copy
+  int* body_offset = (int*) cfg_alloc(n * sizeof(int));
+  int** body = (int**) cfg_alloc(g.num_procs * sizeof(int*));
+  for (int proc = 1; proc < g.num_procs; proc++) {
+    if (inline_size[proc] == 0) continue;
+    body[proc] = (int*) cfg_alloc(inline_size[proc] * sizeof(int));
+    int k = 0;
+    for (int b = 0; b < g.num_blocks; b++) {
+      basic_block* block = &g.blocks[b];
+      if (block->proc != proc) continue;
+      for (int i = block->start; i < block->end; i++) {
+        body_offset[i] = k;
+        body[proc][k++] = i;
+      }
+    }
+  }
+
+  instruction* out = (instruction*) malloc(new_n * sizeof(instruction));
+  int* origin = (int*) cfg_alloc((new_n + 1) * sizeof(int));
+  if (!out) {
+    printf("failed to alloc memory for the optimizer\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < n; i++) {
+    int at = new_index[i];
+    int proc = callee[i];
+
+    if (proc == -1) {
+      out[at] = insns[i];
+      if (cfg_is_branch(out[at].opcode) || out[at].opcode == OPCODE_CALL) {
+        out[at].operands[0].branch_index = new_index[out[at].operands[0].branch_index];
+      }
+      origin[at] = program_insn_origin(p, i);
+      continue;
+    }
+
+    for (int j = 0; j < inline_size[proc]; j++) {
+      int from = body[proc][j];
+      instruction* in = &out[at + j];
+      opt_copy_instruction(in, &insns[from]);
+      origin[at + j] = program_insn_origin(p, from);
+
+      if (cfg_is_branch(in->opcode)) {
+        in->operands[0].branch_index = at + body_offset[in->operands[0].branch_index];
+      } else if (in->opcode == OPCODE_RET) {
+        in->opcode = OPCODE_JMP;
+        in->num_operands = 1;
+        in->operands = (operand*) malloc(sizeof(operand));
+        if (!in->operands) {
+          printf("failed to alloc memory for the optimizer\n");
+          exit(1);
+        }
+        memset(in->operands, 0, sizeof(operand));
+        in->operands[0].type = OPERAND_BRANCH;
+        in->operands[0].branch_index = new_index[i + 1];
+        in->operands[0].pos = insns[from].opcode_pos;
+      }
+    }
+    // Not needed anymore, the copies have their own
+    free(insns[i].operands);
+  }
+  origin[new_n] = program_insn_origin(p, n);
+
+  for (int i = 0; i < p->num_resolved_labels; i++) {
+    resolved_label* l = &p->resolved_labels[i];
+    l->instruction_index = new_index[l->instruction_index];
+  }
+
+  free(p->instructions);
+  free(p->insn_origin);
+  p->instructions = out;
+  p->insn_origin = origin;
+  p->num_instructions = new_n;
+  program_mark_return_sites(p);
+
+  for (int proc = 0; proc < g.num_procs; proc++) free(body[proc]);
+  free(body);
+  free(body_offset);
+  free(depth); free(worklist); free(inline_size); free(proc_at); free(new_index); free(callee);
+  cfg_destroy(&g);
+}
+
+#define OPT_MAX_JUMPS_TO_RET 8
+
+// Which procedures keep to their own stack entries (opt_stack_is_balanced),
+// for opt_tail_calls
+typedef struct opt_balance {
+  cfg* g;
+  int* proc_at; // procedure by entry block, -1 if none starts there
+  int8_t* balanced; // by procedure, -1 = not known yet
+  int* visited; // by block, the walk that saw it last
+  int walk;
+  int* stack; // blocks to visit
+  int* depth; // for opt_stack_is_balanced
+  int* worklist;
+} opt_balance;
+
+static bool opt_proc_is_balanced(opt_balance* b, int proc) {
+  if (b->balanced[proc] == -1) {
+    b->balanced[proc] = opt_stack_is_balanced(b->g, proc, b->depth, b->worklist);
+  }
+  return b->balanced[proc];
+}
+
+// Whether a call to 'entry' only touches the stack entries it pushes:
+// the procedure and everything it calls, directly or not, is balanced.
+static bool opt_callee_is_balanced(opt_balance* b, int entry) {
+  cfg* g = b->g;
+  int n = 0;
+  b->walk++;
+  b->visited[entry] = b->walk;
+  b->stack[n++] = entry;
+
+  while (n > 0) {
+    int x = b->stack[--n];
+    if (b->proc_at[x] != -1 && !opt_proc_is_balanced(b, b->proc_at[x])) return false;
+
+    basic_block* block = &g->blocks[x];
+    int next[3] = { -1, -1, block->callee_block };
+    for (int i = 0; i < block->num_succs; i++) next[i] = block->succs[i];
+    for (int i = 0; i < 3; i++) {
+      if (next[i] == -1 || b->visited[next[i]] == b->walk) continue;
+      b->visited[next[i]] = b->walk;
+      b->stack[n++] = next[i];
+    }
+  }
+  return true;
+}
+
+// 'call L' that returns straight to a ret becomes 'jmp L': L then returns
+// to our caller. Tail recursive procedures run in constant stack space,
+// and don't stop with a callstack overflow anymore (see the top of the file).
+//
+// L then runs without its return address on the stack, right on top of our
+// own. That's only the same when we have nothing else pushed at the call
+// and L (or anything it calls) never pops what it didn't push, so both the
+// caller and the callee have to be balanced. Not in the program entry, its
+// ret has nothing to return to.
+void opt_tail_calls(program* p) {
+  instruction* insns = p->instructions;
+  int n = p->num_instructions;
+
+  cfg g;
+  cfg_build(&g, p);
+
+  opt_balance b;
+  b.g = &g;
+  b.proc_at = (int*) cfg_alloc(g.num_blocks * sizeof(int));
+  b.balanced = (int8_t*) cfg_alloc(g.num_procs * sizeof(int8_t));
+  b.visited = (int*) cfg_alloc(g.num_blocks * sizeof(int));
+  b.walk = 0;
+  b.stack = (int*) cfg_alloc(g.num_blocks * sizeof(int));
+  b.depth = (int*) cfg_alloc(g.num_blocks * sizeof(int));
+  b.worklist = (int*) cfg_alloc(g.num_blocks * sizeof(int));
+  for (int i = 0; i < g.num_blocks; i++) b.proc_at[i] = -1;
+  for (int i = 0; i < g.num_procs; i++) {
+    b.proc_at[g.procs[i].entry_block] = i;
+    b.balanced[i] = -1;
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (insns[i].opcode != OPCODE_CALL) continue;
+
+    // The ret may be behind a few jumps
+    int next = i + 1;
+    for (int jumps = 0; next < n && insns[next].opcode == OPCODE_JMP && jumps < OPT_MAX_JUMPS_TO_RET; jumps++) {
+      next = insns[next].operands[0].branch_index;
+    }
+    if (next >= n || insns[next].opcode != OPCODE_RET) continue;
+
+    basic_block* block = &g.blocks[g.block_of[i]];
+    if (block->proc <= 0 || !opt_proc_is_balanced(&b, block->proc)) continue;
+    if (block->callee_block != -1 && !opt_callee_is_balanced(&b, block->callee_block)) continue;
+    insns[i].opcode = OPCODE_JMP;
+  }
+  program_mark_return_sites(p);
+
+  free(b.proc_at); free(b.balanced); free(b.visited); free(b.stack); free(b.depth); free(b.worklist);
+  cfg_destroy(&g);
+}
+
+// Inserts 'count' instructions before 'at' (they take over their operands).
+// Branches to 'at' or after are moved along, so the new instructions only
+// run when coming from 'at - 1'. 'origin' is the source index of each one.
+static void opt_insert(program* p, int at, instruction* insns, const int* origin, int count) {
+  int n = p->num_instructions;
+  instruction* out = (instruction*) malloc((n + count) * sizeof(instruction));
+  int* new_origin = (int*) malloc((n + count + 1) * sizeof(int));
+  if (!out || !new_origin) {
+    printf("failed to alloc memory for the optimizer\n");
+    exit(1);
+  }
+
+  for (int i = 0; i <= n; i++) {
+    int to = i < at ? i : i + count;
+    if (i < n) {
+      out[to] = p->instructions[i];
+      if (cfg_is_branch(out[to].opcode) || out[to].opcode == OPCODE_CALL) {
+        int* target = &out[to].operands[0].branch_index;
+        if (*target >= at) *target += count;
+      }
+    }
+    new_origin[to] = program_insn_origin(p, i);
+  }
+  for (int i = 0; i < count; i++) {
+    out[at + i] = insns[i];
+    new_origin[at + i] = origin[i];
+  }
+  for (int i = 0; i < p->num_resolved_labels; i++) {
+    resolved_label* l = &p->resolved_labels[i];
+    if (l->instruction_index >= at) l->instruction_index += count;
+  }
+
+  free(p->instructions);
+  free(p->insn_origin);
+  p->instructions = out;
+  p->insn_origin = new_origin;
+  p->num_instructions = n + count;
+  program_mark_return_sites(p);
+}
+
+// Number of instructions in 'l' that write 'reg' (a reg_set bit)
+static int opt_count_defs(cfg* g, loop* l, reg_set reg) {
+  int count = 0;
+  for (int j = 0; j < l->num_blocks; j++) {
+    basic_block* block = &g->blocks[l->blocks[j]];
+    for (int i = block->start; i < block->end; i++) {
+      reg_set use, def;
+      cfg_insn_use_def(&g->prog->instructions[i], &use, &def);
+      count += (def & reg) != 0;
+    }
+  }
+  return count;
+}
+
+// Moves a 'mov r, const' (or a register the loop doesn't change) out of the
+// loop when it's in the header, is the only write to r in the loop and
+// nothing before it in the header reads r. The header runs before any exit,
+// so r has the same value everywhere in and after the loop.
+static bool opt_hoist_invariant_mov(cfg* g, loop* l) {
+  program* p = g->prog;
+  basic_block* header = &g->blocks[l->header];
+
+  reg_set used_before = 0;
+  for (int i = header->start; i < header->end; i++) {
+    instruction* in = &p->instructions[i];
+    reg_set use, def;
+    cfg_insn_use_def(in, &use, &def);
+
+    if (in->opcode == OPCODE_MOV && in->operands[0].type == OPERAND_REG
+        && in->operands[1].type != OPERAND_MEM_ADDRESS) {
+      reg_set dst = def;
+      bool invariant = in->operands[1].type == OPERAND_INT || opt_count_defs(g, l, use) == 0;
+      if (invariant && (use & dst) == 0 && (used_before & dst) == 0 && opt_count_defs(g, l, dst) == 1) {
+        instruction copy;
+        opt_copy_instruction(&copy, in);
+        int origin = program_insn_origin(p, i);
+        opt_make_nop(in);
+        opt_insert(p, header->start, &copy, &origin, 1);
+        return true;
+      }
+    }
+    used_before |= use;
+  }
+  return false;
+}
+
+// The only write to 'reg' in the loop if it's 'inc/dec reg' or 'add/sub reg, const'
+static bool opt_find_induction_step(cfg* g, loop* l, int reg, int* at, int64_t* step) {
+  program* p = g->prog;
+  if (opt_count_defs(g, l, 1u << reg) != 1) return false;
+
+  for (int j = 0; j < l->num_blocks; j++) {
+    basic_block* block = &g->blocks[l->blocks[j]];
+    for (int i = block->start; i < block->end; i++) {
+      instruction* in = &p->instructions[i];
+      if (in->num_operands == 0 || in->operands[0].type != OPERAND_REG) continue;
+      if (in->operands[0].reg_index != reg) continue;
+
+      switch (in->opcode) {
+        case OPCODE_INC: *step = 1; break;
+        case OPCODE_DEC: *step = -1; break;
+        case OPCODE_ADD: case OPCODE_SUB:
+          if (in->operands[1].type != OPERAND_INT) return false;
+          *step = in->operands[1].int_value;
+          if (in->opcode == OPCODE_SUB) *step = (int64_t) (0 - (uint64_t) *step);
+          break;
+        default:
+          // e.g. 'mov i, x' or 'pop i', not an induction variable
+          continue;
+      }
+      *at = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// 'mov t, i; mul t, K' where i changes by a constant step once per
+// iteration becomes a running 't = i * K': computed once before the loop,
+// and 'add t, step * K' when i changes. t can only be read between the mul
+// and the update of i (where both agree) and not after the loop.
+static bool opt_reduce_strength(cfg* g, loop* l) {
+  program* p = g->prog;
+
+  for (int j = 0; j < l->num_blocks; j++) {
+    basic_block* block = &g->blocks[l->blocks[j]];
+    for (int k = block->start; k + 1 < block->end; k++) {
+      instruction* mov = &p->instructions[k];
+      instruction* mul = &p->instructions[k + 1];
+      if (mov->opcode != OPCODE_MOV || mul->opcode != OPCODE_MUL) continue;
+      if (mov->operands[0].type != OPERAND_REG || mov->operands[1].type != OPERAND_REG) continue;
+      if (mul->operands[0].type != OPERAND_REG || mul->operands[1].type != OPERAND_INT) continue;
+
+      int t = mov->operands[0].reg_index, iv = mov->operands[1].reg_index;
+      if (t == iv || mul->operands[0].reg_index != t) continue;
+
+      int update;
+      int64_t step;
+      if (!opt_find_induction_step(g, l, iv, &update, &step)) continue;
+      if (update <= k + 1 || update >= block->end) continue;
+      if (opt_count_defs(g, l, 1u << t) != 2) continue;
+
+      // Reads of t
+      bool ok = true;
+      for (int b = 0; b < l->num_blocks && ok; b++) {
+        basic_block* x = &g->blocks[l->blocks[b]];
+        for (int i = x->start; i < x->end && ok; i++) {
+          reg_set use, def;
+          cfg_insn_use_def(&p->instructions[i], &use, &def);
+          bool between = x == block && i > k + 1 && i < update;
+          if ((use & (1u << t)) && !between && i != k + 1) ok = false;
+        }
+        for (int s = 0; s < x->num_succs && ok; s++) {
+          int succ = x->succs[s];
+          if (!l->contains[succ] && (g->blocks[succ].live_in & (1u << t))) ok = false;
+        }
+      }
+      if (!ok) continue;
+
+      int64_t k_value = mul->operands[1].int_value;
+      int mov_origin = program_insn_origin(p, k), mul_origin = program_insn_origin(p, k + 1);
+
+      instruction init[2];
+      opt_copy_instruction(&init[0], mov);
+      opt_copy_instruction(&init[1], mul);
+      int init_origin[2] = { mov_origin, mul_origin };
+
+      instruction add;
+      opt_copy_instruction(&add, mul);
+      add.opcode = OPCODE_ADD;
+      add.operands[1].int_value = (int64_t) ((uint64_t) step * (uint64_t) k_value);
+
+      opt_make_nop(mov);
+      opt_make_nop(mul);
+
+      // The add goes right before the update (nothing reads t there), which
+      // keeps e.g. 'dec i; cmp i, 0; jne' together for opt_fuse_counted_loops.
+      // The later position first, so the other one doesn't move. The update
+      // is before the header when the loop is tested at the bottom.
+      int header_start = g->blocks[l->header].start;
+      if (update > header_start) {
+        opt_insert(p, update, &add, &mul_origin, 1);
+        opt_insert(p, header_start, init, init_origin, 2);
+      } else {
+        opt_insert(p, header_start, init, init_origin, 2);
+        opt_insert(p, update, &add, &mul_origin, 1);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// 'dec r; cmp r, 0; jne/jg L' in a single block becomes 'dec_jne/dec_jg L, r'
+static void opt_fuse_counted_loops(program* p) {
+  cfg g;
+  cfg_build(&g, p);
+
+  for (int i = 0; i + 2 < p->num_instructions; i++) {
+    instruction* dec = &p->instructions[i];
+    instruction* cmp = &p->instructions[i + 1];
+    instruction* jcc = &p->instructions[i + 2];
+
+    if (dec->opcode != OPCODE_DEC || cmp->opcode != OPCODE_CMP) continue;
+    if (jcc->opcode != OPCODE_JNE && jcc->opcode != OPCODE_JG) continue;
+    if (g.block_of[i] != g.block_of[i + 2]) continue;
+    int reg = dec->operands[0].reg_index;
+    if (cmp->operands[0].type != OPERAND_REG || cmp->operands[0].reg_index != reg) continue;
+    if (cmp->operands[1].type != OPERAND_INT || cmp->operands[1].int_value != 0) continue;
+
+    operand* ops = (operand*) malloc(2 * sizeof(operand));
+    if (!ops) {
+      printf("failed to alloc memory for the optimizer\n");
+      exit(1);
+    }
+    ops[0] = jcc->operands[0];
+    ops[1] = dec->operands[0];
+    free(dec->operands);
+    dec->operands = ops;
+    dec->num_operands = 2;
+    dec->opcode = jcc->opcode == OPCODE_JNE ? OPCODE_DEC_JNE : OPCODE_DEC_JG;
+    opt_make_nop(cmp);
+    opt_make_nop(jcc);
+  }
+
+  cfg_destroy(&g);
+}
+
+#define OPT_MAX_LOOP_CHANGES 64
+
+// Invariant movs, strength reduction and counted loops. The loops have to
+// be entered from a single place (their preheader) and can't call anything.
+void opt_loops(program* p) {
+  for (int changes = 0; changes < OPT_MAX_LOOP_CHANGES; changes++) {
+    cfg g;
+    cfg_build(&g, p);
+    cfg_compute_liveness(&g);
+    cfg_find_loops(&g);
+
+    bool changed = false;
+    for (int i = 0; i < g.num_loops && !changed; i++) {
+      loop* l = &g.loops[i];
+      if (l->preheader == -1 || l->has_calls) continue;
+      changed = opt_hoist_invariant_mov(&g, l) || opt_reduce_strength(&g, l);
+    }
+    cfg_destroy(&g);
+    if (!changed) break;
+  }
+
+  opt_fuse_counted_loops(p);
+}
+
+// Range analysis
+//
+// Abstract interpretation over the whole program: an interval for every
+// register and for the stack depth (pushed values and return addresses) at
+// the start of each block. Branches after 'cmp r, const' narrow r on each
+// edge. After a call, the registers the callee may write are unknown, and
+// since a ret goes back to "any return site", a return site gets the depth
+// of any ret.
+//
+// Intervals that keep growing in a loop are widened (after
+// OPT_RANGE_WIDEN_AFTER changes) to the next constant the program compares
+// with, or to the whole range. That's usually the bound of the loop.
+
+typedef struct opt_range {
+  int64_t lo, hi;
+} opt_range;
+
+#define OPT_RANGE_ALL ((opt_range) { INT64_MIN, INT64_MAX })
+#define OPT_RANGE_WIDEN_AFTER 3
+
+typedef struct opt_range_state {
+  bool reached;
+  opt_range regs[NUM_REGISTERS];
+  opt_range depth;  // hi = INT64_MAX when unknown
+  int cmp_reg;      // the cmp flag is 'cmp_reg - cmp_value', -1 if unknown
+  int64_t cmp_value;
+} opt_range_state;
+
+static opt_range opt_range_const(int64_t value) {
+  return (opt_range) { value, value };
+}
+
+static bool opt_range_contains(opt_range r, int64_t value) {
+  return r.lo <= value && value <= r.hi;
+}
+
+static opt_range opt_range_add(opt_range a, opt_range b) {
+  opt_range r;
+  if (__builtin_add_overflow(a.lo, b.lo, &r.lo) || __builtin_add_overflow(a.hi, b.hi, &r.hi)) {
+    return OPT_RANGE_ALL;
+  }
+  return r;
+}
+
+static opt_range opt_range_sub(opt_range a, opt_range b) {
+  opt_range r;
+  if (__builtin_sub_overflow(a.lo, b.hi, &r.lo) || __builtin_sub_overflow(a.hi, b.lo, &r.hi)) {
+    return OPT_RANGE_ALL;
+  }
+  return r;
+}
+
+static opt_range opt_range_mul(opt_range a, opt_range b) {
+  int64_t products[4];
+  if (__builtin_mul_overflow(a.lo, b.lo, &products[0]) ||
+      __builtin_mul_overflow(a.lo, b.hi, &products[1]) ||
+      __builtin_mul_overflow(a.hi, b.lo, &products[2]) ||
+      __builtin_mul_overflow(a.hi, b.hi, &products[3])) {
+    return OPT_RANGE_ALL;
+  }
+  opt_range r = { products[0], products[0] };
+  for (int i = 1; i < 4; i++) {
+    if (products[i] < r.lo) r.lo = products[i];
+    if (products[i] > r.hi) r.hi = products[i];
+  }
+  return r;
+}
+
+static opt_range opt_range_value(opt_range_state* s, operand* op) {
+  switch (op->type) {
+    case OPERAND_INT: return opt_range_const(op->int_value);
+    case OPERAND_REG: return s->regs[op->reg_index];
+    default: return OPT_RANGE_ALL;
+  }
+}
+
+static void opt_range_set(opt_range_state* s, int reg, opt_range value) {
+  s->regs[reg] = value;
+  if (s->cmp_reg == reg) s->cmp_reg = -1;
+}
+
+static void opt_range_push(opt_range_state* s, int64_t n) {
+  opt_range depth = opt_range_add(s->depth, opt_range_const(n));
+  s->depth = depth.lo == INT64_MIN ? (opt_range) { 0, INT64_MAX } : depth;
+}
+
+static void opt_range_pop(opt_range_state* s, int64_t n) {
+  // Popping from an empty stack is an error, so below that nothing runs
+  s->depth.lo = s->depth.lo > n ? s->depth.lo - n : 0;
+  if (s->depth.hi != INT64_MAX) s->depth.hi = s->depth.hi > n ? s->depth.hi - n : 0;
+}
+
+static void opt_range_transfer(opt_range_state* s, instruction* in) {
+  operand* ops = in->operands;
+  reg_set use, def;
+
+  switch (in->opcode) {
+    case OPCODE_MOV:
+      if (ops[0].type == OPERAND_REG) opt_range_set(s, ops[0].reg_index, opt_range_value(s, &ops[1]));
+      return;
+    case OPCODE_ADD: case OPCODE_SUB: case OPCODE_MUL: case OPCODE_INC: case OPCODE_DEC: {
+      if (ops[0].type != OPERAND_REG) return;
+      int r = ops[0].reg_index;
+      opt_range x = s->regs[r];
+      opt_range y = in->num_operands > 1 ? opt_range_value(s, &ops[1]) : opt_range_const(1);
+      opt_range result =
+        in->opcode == OPCODE_ADD || in->opcode == OPCODE_INC ? opt_range_add(x, y) :
+        in->opcode == OPCODE_MUL ? opt_range_mul(x, y) : opt_range_sub(x, y);
+      opt_range_set(s, r, result);
+      return;
+    }
+    case OPCODE_CMP: {
+      s->cmp_reg = -1;
+      opt_range y = opt_range_value(s, &ops[1]);
+      if (ops[0].type == OPERAND_REG && y.lo == y.hi) {
+        s->cmp_reg = ops[0].reg_index;
+        s->cmp_value = y.lo;
+      }
+      return;
+    }
+    case OPCODE_DEC_JNE: case OPCODE_DEC_JG: {
+      int r = ops[1].reg_index;
+      opt_range_set(s, r, opt_range_sub(s->regs[r], opt_range_const(1)));
+      s->cmp_reg = r;
+      s->cmp_value = 0;
+      return;
+    }
+    case OPCODE_CALL:
+      // What the callee writes is handled by opt_analyze_ranges
+      s->cmp_reg = -1;
+      return;
+    case OPCODE_PUSH: opt_range_push(s, 1); return;
+    case OPCODE_POP:
+      opt_range_pop(s, 1);
+      opt_range_set(s, ops[0].reg_index, OPT_RANGE_ALL);
+      return;
+    case OPCODE_RET: opt_range_pop(s, 1); return;
+    case OPCODE_ENTER:
+      opt_range_push(s, ops[1].reg_index - ops[0].reg_index + 2);
+      return;
+    case OPCODE_LEAVE:
+      // Goes back to the frame pointer, whatever was pushed since the enter
+      s->depth = (opt_range) { 0, INT64_MAX };
+      break;
+    default:
+      break;
+  }
+
+  cfg_insn_use_def(in, &use, &def);
+  for (int r = 0; r < NUM_REGISTERS; r++) {
+    if (def & (1u << r)) opt_range_set(s, r, OPT_RANGE_ALL);
+  }
+  if (def & CFG_FLAGS_BIT) s->cmp_reg = -1;
+}
+
+// Narrows the register compared by the last cmp, for the edge where the
+// branch 'opc' is taken (or not). Returns false if the edge can't be taken.
+static bool opt_range_narrow(opt_range_state* s, opcode opc, bool taken) {
+  if (s->cmp_reg == -1) return true;
+  opt_range* r = &s->regs[s->cmp_reg];
+  int64_t k = s->cmp_value;
+
+  // The flag is 'r - k' (wrapping), only comparable with k if it can't wrap
+  int64_t ignored;
+  bool exact = !__builtin_sub_overflow(r->lo, k, &ignored) && !__builtin_sub_overflow(r->hi, k, &ignored);
+
+  enum { EQ, NE, GT, GE, LT, LE } cond;
+  switch (opc) {
+    case OPCODE_JE: cond = taken ? EQ : NE; break;
+    case OPCODE_JNE: case OPCODE_DEC_JNE: cond = taken ? NE : EQ; break;
+    case OPCODE_JG: case OPCODE_DEC_JG: cond = taken ? GT : LE; break;
+    case OPCODE_JGE: cond = taken ? GE : LT; break;
+    case OPCODE_JL: cond = taken ? LT : GE; break;
+    case OPCODE_JLE: cond = taken ? LE : GT; break;
+    default: return true;
+  }
+
+  switch (cond) {
+    case EQ:
+      if (!opt_range_contains(*r, k)) return false;
+      *r = opt_range_const(k);
+      break;
+    case NE:
+      if (r->lo == k && r->hi == k) return false;
+      if (r->lo == k) r->lo++;
+      else if (r->hi == k) r->hi--;
+      break;
+    case GT: if (exact && k != INT64_MAX && r->lo <= k) r->lo = k + 1; break;
+    case GE: if (exact && r->lo < k) r->lo = k; break;
+    case LT: if (exact && k != INT64_MIN && r->hi >= k) r->hi = k - 1; break;
+    case LE: if (exact && r->hi > k) r->hi = k; break;
+  }
+  return r->lo <= r->hi;
+}
+
+typedef struct opt_range_analysis {
+  cfg* g;
+  opt_range_state* in; // by block
+  int* num_changes;
+  int* worklist;
+  bool* in_worklist;
+  int worklist_len;
+  opt_range ret_depth; // after any ret, lo > hi if none seen yet
+  reg_set* clobbers;   // by block, registers written from there until the ret
+  int64_t* thresholds; // sorted, where widened intervals stop
+  int num_thresholds;
+} opt_range_analysis;
+
+static void opt_range_enqueue(opt_range_analysis* a, int b) {
+  if (!a->in_worklist[b]) {
+    a->in_worklist[b] = true;
+    a->worklist[a->worklist_len++] = b;
+  }
+}
+
+static opt_range opt_range_join(opt_range x, opt_range y) {
+  return (opt_range) { x.lo < y.lo ? x.lo : y.lo, x.hi > y.hi ? x.hi : y.hi };
+}
+
+// Joins 'y' into 'x', moving the bounds that grew to the next threshold
+static opt_range opt_range_widen(opt_range_analysis* a, opt_range x, opt_range y) {
+  opt_range r = opt_range_join(x, y);
+  if (r.lo < x.lo) {
+    int64_t lo = INT64_MIN;
+    for (int i = 0; i < a->num_thresholds && a->thresholds[i] <= r.lo; i++) lo = a->thresholds[i];
+    r.lo = lo;
+  }
+  if (r.hi > x.hi) {
+    int64_t hi = INT64_MAX;
+    for (int i = a->num_thresholds - 1; i >= 0 && a->thresholds[i] >= r.hi; i--) hi = a->thresholds[i];
+    r.hi = hi;
+  }
+  return r;
+}
+
+static bool opt_range_state_equals(opt_range_state* x, opt_range_state* y) {
+  for (int r = 0; r < NUM_REGISTERS; r++) {
+    if (x->regs[r].lo != y->regs[r].lo || x->regs[r].hi != y->regs[r].hi) return false;
+  }
+  return x->depth.lo == y->depth.lo && x->depth.hi == y->depth.hi
+    && x->cmp_reg == y->cmp_reg && (x->cmp_reg == -1 || x->cmp_value == y->cmp_value);
+}
+
+static void opt_range_flow(opt_range_analysis* a, int b, opt_range_state* s) {
+  opt_range_state* in = &a->in[b];
+  if (!in->reached) {
+    *in = *s;
+    in->reached = true;
+    opt_range_enqueue(a, b);
+    return;
+  }
+
+  bool widen = a->num_changes[b] >= OPT_RANGE_WIDEN_AFTER;
+  opt_range_state joined = *in;
+  for (int r = 0; r < NUM_REGISTERS; r++) {
+    joined.regs[r] = widen ? opt_range_widen(a, in->regs[r], s->regs[r]) : opt_range_join(in->regs[r], s->regs[r]);
+  }
+  joined.depth = opt_range_join(in->depth, s->depth);
+  if (widen && joined.depth.hi > in->depth.hi) joined.depth.hi = INT64_MAX;
+  if (in->cmp_reg != s->cmp_reg || in->cmp_value != s->cmp_value) joined.cmp_reg = -1;
+
+  if (!opt_range_state_equals(&joined, in)) {
+    *in = joined;
+    a->num_changes[b]++;
+    opt_range_enqueue(a, b);
+  }
+}
+
+// Registers each block may write before returning, following calls
+static reg_set* opt_range_clobbers(cfg* g) {
+  program* p = g->prog;
+  reg_set* clobbers = (reg_set*) cfg_alloc(g->num_blocks * sizeof(reg_set));
+  reg_set* defs = (reg_set*) cfg_alloc(g->num_blocks * sizeof(reg_set));
+  for (int b = 0; b < g->num_blocks; b++) {
+    for (int i = g->blocks[b].start; i < g->blocks[b].end; i++) {
+      reg_set use, def;
+      cfg_insn_use_def(&p->instructions[i], &use, &def);
+      defs[b] |= def;
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int b = g->num_blocks - 1; b >= 0; b--) {
+      basic_block* block = &g->blocks[b];
+      reg_set set = defs[b];
+      if (block->callee_block != -1) set |= clobbers[block->callee_block];
+      for (int i = 0; i < block->num_succs; i++) set |= clobbers[block->succs[i]];
+      if (set != clobbers[b]) {
+        clobbers[b] = set;
+        changed = true;
+      }
+    }
+  }
+
+  free(defs);
+  return clobbers;
+}
+
+static int opt_compare_int64(const void* x, const void* y) {
+  int64_t a = *(const int64_t*) x, b = *(const int64_t*) y;
+  return a < b ? -1 : a > b;
+}
+
+// The constants compared with (and their neighbours), sorted
+static int64_t* opt_range_thresholds(program* p, int* count) {
+  int64_t* thresholds = (int64_t*) cfg_alloc((3 * p->num_instructions + 1) * sizeof(int64_t));
+  int n = 0;
+  thresholds[n++] = 0;
+  for (int i = 0; i < p->num_instructions; i++) {
+    instruction* in = &p->instructions[i];
+    if (in->opcode != OPCODE_CMP || in->operands[1].type != OPERAND_INT) continue;
+    int64_t k = in->operands[1].int_value;
+    thresholds[n++] = k;
+    if (k != INT64_MIN) thresholds[n++] = k - 1;
+    if (k != INT64_MAX) thresholds[n++] = k + 1;
+  }
+  qsort(thresholds, n, sizeof(int64_t), opt_compare_int64);
+  *count = n;
+  return thresholds;
+}
+
+// In-state of every block (reached = false for the ones that never run)
+static opt_range_state* opt_analyze_ranges(cfg* g) {
+  program* p = g->prog;
+  int nb = g->num_blocks;
+
+  opt_range_analysis a;
+  memset(&a, 0, sizeof(a));
+  a.g = g;
+  a.in = (opt_range_state*) cfg_alloc(nb * sizeof(opt_range_state));
+  a.num_changes = (int*) cfg_alloc(nb * sizeof(int));
+  a.worklist = (int*) cfg_alloc(nb * sizeof(int));
+  a.in_worklist = (bool*) cfg_alloc(nb * sizeof(bool));
+  a.ret_depth = (opt_range) { 1, 0 };
+  a.clobbers = opt_range_clobbers(g);
+  a.thresholds = opt_range_thresholds(p, &a.num_thresholds);
+  if (nb == 0) goto done;
+
+  // Registers start at zero, the stack empty
+  opt_range_state entry;
+  memset(&entry, 0, sizeof(entry));
+  entry.cmp_reg = -1;
+  opt_range_flow(&a, 0, &entry);
+
+  while (a.worklist_len > 0) {
+    int b = a.worklist[--a.worklist_len];
+    a.in_worklist[b] = false;
+    basic_block* block = &g->blocks[b];
+
+    opt_range_state s = a.in[b];
+    for (int i = block->start; i < block->end - 1; i++) {
+      opt_range_transfer(&s, &p->instructions[i]);
+    }
+    instruction* last = &p->instructions[block->end - 1];
+    int next = block->end < p->num_instructions ? g->block_of[block->end] : -1;
+
+    if (cfg_is_branch(last->opcode)) {
+      opt_range_transfer(&s, last);
+      int target = g->block_of[last->operands[0].branch_index];
+      opt_range_state taken = s, not_taken = s;
+      if (target != -1 && opt_range_narrow(&taken, last->opcode, true)) {
+        opt_range_flow(&a, target, &taken);
+      }
+      if (last->opcode != OPCODE_JMP && next != -1 && opt_range_narrow(&not_taken, last->opcode, false)) {
+        opt_range_flow(&a, next, &not_taken);
+      }
+    } else if (last->opcode == OPCODE_CALL) {
+      opt_range_state callee = s;
+      opt_range_push(&callee, 1);
+      if (block->callee_block != -1) opt_range_flow(&a, block->callee_block, &callee);
+
+      opt_range_transfer(&s, last);
+      reg_set clobbers = block->callee_block != -1 ? a.clobbers[block->callee_block] : ~(reg_set) 0;
+      for (int r = 0; r < NUM_REGISTERS; r++) {
+        if (clobbers & (1u << r)) s.regs[r] = OPT_RANGE_ALL;
+      }
+      if (next != -1 && a.ret_depth.lo <= a.ret_depth.hi) {
+        s.depth = a.ret_depth;
+        opt_range_flow(&a, next, &s);
+      }
+    } else if (last->opcode == OPCODE_RET) {
+      opt_range_transfer(&s, last);
+      opt_range old = a.ret_depth;
+      a.ret_depth = old.lo > old.hi ? s.depth : opt_range_join(old, s.depth);
+      if (old.lo != a.ret_depth.lo || old.hi != a.ret_depth.hi) {
+        // Every call that was reached gets the new depth
+        for (int c = 0; c < nb; c++) {
+          if (a.in[c].reached && g->blocks[c].callee_block != -1) opt_range_enqueue(&a, c);
+        }
+      }
+    } else if (last->opcode != OPCODE_END) {
+      opt_range_transfer(&s, last);
+      if (next != -1) opt_range_flow(&a, next, &s);
+    }
+  }
+
+done:
+  free(a.clobbers);
+  free(a.thresholds);
+  free(a.num_changes);
+  free(a.worklist);
+  free(a.in_worklist);
+  return a.in;
+}
+
+// Whether instruction 'in' can run without its checks, given the state before it
+static bool opt_div_is_safe(opt_range_state* s, instruction* in) {
+  return in->opcode == OPCODE_DIV && !opt_range_contains(opt_range_value(s, &in->operands[1]), 0)
+    && in->operands[1].type != OPERAND_MEM_ADDRESS;
+}
+
+static bool opt_stack_is_safe(opt_range_state* s, instruction* in, uint64_t stack_size) {
+  uint64_t hi = (uint64_t) s->depth.hi;
+  switch (in->opcode) {
+    case OPCODE_PUSH: case OPCODE_CALL:
+      return s->depth.hi != INT64_MAX && hi + 1 <= stack_size;
+    case OPCODE_ENTER:
+      return s->depth.hi != INT64_MAX
+        && hi + (uint64_t) (in->operands[1].reg_index - in->operands[0].reg_index + 2) <= stack_size;
+    case OPCODE_POP: case OPCODE_RET:
+      return s->depth.lo >= 1;
+    default:
+      return false;
+  }
+}
+
+// Divisions that can't be by zero become div_nc, stack operations that
+// can't go out of bounds get INSN_NO_STACK_CHECK.
+void opt_elide_checks(program* p) {
+  cfg g;
+  cfg_build(&g, p);
+  opt_range_state* states = opt_analyze_ranges(&g);
+
+  for (int b = 0; b < g.num_blocks; b++) {
+    opt_range_state s = states[b];
+    if (!s.reached) continue;
+    for (int i = g.blocks[b].start; i < g.blocks[b].end; i++) {
+      instruction* in = &p->instructions[i];
+      if (opt_div_is_safe(&s, in)) in->opcode = OPCODE_DIV_NC;
+      if (opt_stack_is_safe(&s, in, p->options.stack_size)) in->flags |= INSN_NO_STACK_CHECK;
+      opt_range_transfer(&s, in);
+    }
+  }
+
+  free(states);
+  cfg_destroy(&g);
+}
+
+static void opt_dump_range(FILE* out, opt_range r) {
+  if (r.lo == r.hi) fprintf(out, "%" PRId64, r.lo);
+  else if (r.lo == INT64_MIN) fprintf(out, "..%" PRId64, r.hi);
+  else if (r.hi == INT64_MAX) fprintf(out, "%" PRId64 "..", r.lo);
+  else fprintf(out, "%" PRId64 "..%" PRId64, r.lo, r.hi);
+}
+
+// --dump-ranges: what opt_analyze_ranges knows at the start of each block,
+// and the checks opt_elide_checks removed
+void opt_dump_ranges(program* p, FILE* out) {
+  cfg g;
+  cfg_build(&g, p);
+  opt_range_state* states = opt_analyze_ranges(&g);
+
+  for (int b = 0; b < g.num_blocks; b++) {
+    basic_block* block = &g.blocks[b];
+    opt_range_state* s = &states[b];
+    fprintf(out, "B%d [%d, %d)", b, block->start, block->end);
+    if (!s->reached) {
+      fprintf(out, " never runs\n");
+      continue;
+    }
+
+    fprintf(out, " stack depth ");
+    if (s->depth.hi == INT64_MAX) fprintf(out, "%" PRId64 "..", s->depth.lo);
+    else opt_dump_range(out, s->depth);
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+      opt_range range = s->regs[r];
+      if (range.lo == INT64_MIN && range.hi == INT64_MAX) continue;
+      fprintf(out, " %c=", 'a' + r);
+      opt_dump_range(out, range);
+    }
+    fprintf(out, "\n");
+
+    for (int i = block->start; i < block->end; i++) {
+      instruction* in = &p->instructions[i];
+      if (in->opcode == OPCODE_DIV_NC) {
+        fprintf(out, "  %d: div without the zero check (line %d)\n", i, in->opcode_pos.line_number);
+      }
+      if (in->flags & INSN_NO_STACK_CHECK) {
+        fprintf(out, "  %d: %s without the stack check (line %d)\n", i, opcode_names[in->opcode], in->opcode_pos.line_number);
+      }
+    }
+  }
+
+  free(states);
+  cfg_destroy(&g);
+}
+
+// Register caching
+//
+// Runs of arithmetic on at most REG_BLOCK_MAX_REGS registers become
+// reg_blocks (see vm_run_reg_block). Liveness tells which registers have to
+// be written back when the block is left.
+
+static bool opt_is_reg_or_int(operand* op) {
+  return op->type == OPERAND_REG || op->type == OPERAND_INT;
+}
+
+// Whether 'in' can be a reg_block_op (or the branch at the end of one)
+static bool opt_is_cacheable(instruction* in) {
+  operand* ops = in->operands;
+  switch (in->opcode) {
+    case OPCODE_NOP:
+      return true;
+    case OPCODE_MOV: case OPCODE_ADD: case OPCODE_SUB: case OPCODE_MUL: case OPCODE_DIV_NC:
+    case OPCODE_CMP:
+      return ops[0].type == OPERAND_REG && opt_is_reg_or_int(&ops[1]);
+    case OPCODE_INC: case OPCODE_DEC:
+      return ops[0].type == OPERAND_REG;
+    default:
+      return cfg_is_branch(in->opcode);
+  }
+}
+
+// Slot of 'reg' in 'b', adding it if there's room. -1 if there's not.
+static int opt_reg_block_slot(reg_block* b, int* num_regs, int reg) {
+  for (int i = 0; i < *num_regs; i++) {
+    if (b->regs[i] == reg) return i;
+  }
+  if (*num_regs == REG_BLOCK_MAX_REGS) return -1;
+  b->regs[*num_regs] = reg;
+  return (*num_regs)++;
+}
+
+// Turns instructions [start, end) into 'b', stopping before the first one
+// that needs a fifth register. Returns where it stopped.
+static int opt_make_reg_block(program* p, int start, int end, reg_block* b) {
+  int num_regs = 0;
+  unsigned written = 0;
+  memset(b, 0, sizeof(*b));
+  b->start = start;
+  b->branch = OPCODE_NOP;
+  b->ops = (reg_block_op*) cfg_alloc((end - start) * sizeof(reg_block_op));
+
+  int i;
+  for (i = start; i < end; i++) {
+    instruction* in = &p->instructions[i];
+    operand* ops = in->operands;
+    if (in->opcode == OPCODE_NOP) continue;
+
+    // Both slots first, so a failed instruction leaves 'b' as it was
+    int saved_num_regs = num_regs;
+    int reg = cfg_is_branch(in->opcode) ? (in->num_operands > 1 ? ops[1].reg_index : -1) : ops[0].reg_index;
+    int dst = reg == -1 ? 0 : opt_reg_block_slot(b, &num_regs, reg);
+    bool src_is_reg = in->num_operands > 1 && ops[1].type == OPERAND_REG && !cfg_is_branch(in->opcode);
+    int src = src_is_reg ? opt_reg_block_slot(b, &num_regs, ops[1].reg_index) : 0;
+    if (dst == -1 || src == -1) {
+      num_regs = saved_num_regs;
+      break;
+    }
+
+    // Read before written: loaded when entering the block
+    unsigned reads = 0;
+    if (src_is_reg) reads |= 1u << src;
+    if (reg != -1 && in->opcode != OPCODE_MOV) reads |= 1u << dst;
+    b->load |= reads & ~written;
+    if (reg != -1 && in->opcode != OPCODE_CMP) written |= 1u << dst;
+
+    if (cfg_is_branch(in->opcode)) {
+      b->branch = in->opcode;
+      b->target = ops[0].branch_index;
+      b->branch_slot = dst;
+      i++;
+      break;
+    }
+
+    reg_block_op_kind kind;
+    switch (in->opcode) {
+      case OPCODE_MOV: kind = RB_MOV_R; break;
+      case OPCODE_ADD: kind = RB_ADD_R; break;
+      case OPCODE_SUB: kind = RB_SUB_R; break;
+      case OPCODE_MUL: kind = RB_MUL_R; break;
+      case OPCODE_DIV_NC: kind = RB_DIV_R; break;
+      case OPCODE_CMP: kind = RB_CMP_R; break;
+      case OPCODE_INC: kind = RB_INC; break;
+      default: kind = RB_DEC; break;
+    }
+    reg_block_op* op = &b->ops[b->num_ops++];
+    if (in->num_operands > 1 && !src_is_reg) {
+      kind++; // the '_I' variant
+      op->imm = ops[1].int_value;
+    }
+    op->code = RB_CODE(kind, dst, src);
+  }
+
+  b->end = i;
+  b->store = written; // opt_cache_registers drops the dead ones
+  for (int r = num_regs; r < REG_BLOCK_MAX_REGS; r++) b->regs[r] = 0;
+  return i;
+}
+
+void opt_cache_registers(program* p) {
+  free(p->reg_blocks);
+  p->reg_blocks = NULL;
+  p->num_reg_blocks = 0;
+
+  cfg g;
+  cfg_build(&g, p);
+  cfg_compute_liveness(&g);
+
+  // Registers live after each instruction
+  reg_set* live_after = (reg_set*) cfg_alloc((p->num_instructions + 1) * sizeof(reg_set));
+  for (int b = 0; b < g.num_blocks; b++) {
+    reg_set live = g.blocks[b].live_out;
+    for (int i = g.blocks[b].end - 1; i >= g.blocks[b].start; i--) {
+      reg_set use, def;
+      live_after[i] = live;
+      cfg_insn_use_def(&p->instructions[i], &use, &def);
+      live = use | (live & ~def);
+    }
+  }
+
+  int capacity = 0;
+  for (int b = 0; b < g.num_blocks; b++) {
+    basic_block* block = &g.blocks[b];
+    if (block->proc == -1) continue;
+
+    int i = block->start;
+    while (i < block->end) {
+      if (!opt_is_cacheable(&p->instructions[i])) {
+        i++;
+        continue;
+      }
+      int run_end = i;
+      while (run_end < block->end && opt_is_cacheable(&p->instructions[run_end])) run_end++;
+
+      reg_block rb;
+      int next = opt_make_reg_block(p, i, run_end, &rb);
+      // One instruction is not worth the loads and stores, unless it loops
+      bool loops = rb.branch != OPCODE_NOP && rb.target == rb.start;
+      if (rb.num_ops + (rb.branch != OPCODE_NOP) < 2 && !loops) {
+        free(rb.ops);
+        i = next > i ? next : i + 1;
+        continue;
+      }
+
+      unsigned store = 0;
+      for (int s = 0; s < REG_BLOCK_MAX_REGS; s++) {
+        if ((rb.store & (1u << s)) && (live_after[rb.end - 1] & (1u << rb.regs[s]))) store |= 1u << s;
+      }
+      rb.store = store;
+
+      if (p->num_reg_blocks == capacity) {
+        capacity = capacity ? capacity * 2 : 16;
+        p->reg_blocks = (reg_block*) realloc(p->reg_blocks, capacity * sizeof(reg_block));
+        if (!p->reg_blocks) {
+          printf("failed to alloc memory for the register blocks\n");
+          exit(1);
+        }
+      }
+      p->reg_blocks[p->num_reg_blocks++] = rb;
+      i = next;
+    }
+  }
+
+  free(live_after);
+  cfg_destroy(&g);
+}
+
+void program_optimize(program* p) {
+  opt_fold_constants(p);
+  opt_remove_dead_code(p);
+
+  if (p->options.inline_calls) {
+    opt_inline_calls(p);
+    // The arguments are often constants
+    opt_fold_constants(p);
+    opt_remove_dead_code(p);
+  }
+
+  // After inlining, calls to small procedures are better off copied
+  opt_tail_calls(p);
+  opt_loops(p);
+  // Drops the nops and the rets nothing reaches anymore
+  opt_compact(p);
+  opt_elide_checks(p);
+  // Last, it works on the final instructions
+  if (p->options.cache_registers) opt_cache_registers(p);
+}
+
+#endif // __OPT_H__
@@ -0,0 +1,124 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+// Output buffer used by 'print' and 'msg'.
+//
+// Appends are bounds checked. When the buffer is full it is either flushed
+// to 'flush_to' (print, stdout) or grown (msg, which has to stay in memory).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef struct output_buffer {
+  char* data;
+  size_t len;
+  size_t cap;
+  FILE* flush_to; // NULL = grow instead of flushing
+} output_buffer;
+
+void output_init(output_buffer* out, size_t cap, FILE* flush_to) {
+  out->data = (char*) malloc(cap);
+  out->len = 0;
+  out->cap = cap;
+  out->flush_to = flush_to;
+  if (!out->data) {
+    printf("failed to alloc memory for the output buffer\n");
+    exit(1);
+  }
+}
+
+void output_flush(output_buffer* out) {
+  if (out->flush_to && out->len > 0) {
+    fwrite(out->data, 1, out->len, out->flush_to);
+    fflush(out->flush_to);
+  }
+  out->len = 0;
+}
+
+void output_destroy(output_buffer* out) {
+  output_flush(out);
+  free(out->data);
+  out->data = NULL;
+}
+
+// Slow path of output_write: makes room for 'len' more bytes
+static void output_make_room(output_buffer* out, size_t len) {
+  if (out->flush_to) {
+    output_flush(out);
+    return;
+  }
+
+  size_t new_cap = out->cap * 2;
+  while (new_cap < out->len + len) new_cap *= 2;
+
+  char* data = (char*) realloc(out->data, new_cap);
+  if (!data) {
+    printf("failed to alloc memory for the output buffer\n");
+    exit(1);
+  }
+  out->data = data;
+  out->cap = new_cap;
+}
+
+static inline void output_write(output_buffer* out, const char* data, size_t len) {
+  if (out->cap - out->len < len) {
+    output_make_room(out, len);
+
+    // Too big even for an empty buffer, don't bother copying it.
+    if (out->flush_to && len > out->cap) {
+      fwrite(data, 1, len, out->flush_to);
+      return;
+    }
+  }
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+}
+
+static const char output_digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+// Formats two digits at a time, from right to left
+static inline void output_write_int(output_buffer* out, int64_t value) {
+  char buf[24];
+  char* end = buf + sizeof(buf);
+  char* p = end;
+
+  uint64_t v = value < 0 ? -(uint64_t) value : (uint64_t) value;
+  while (v >= 100) {
+    uint64_t q = v / 100;
+    p -= 2;
+    memcpy(p, &output_digit_pairs[(v - q * 100) * 2], 2);
+    v = q;
+  }
+  if (v >= 10) {
+    p -= 2;
+    memcpy(p, &output_digit_pairs[v * 2], 2);
+  } else {
+    *--p = (char) ('0' + v);
+  }
+  if (value < 0) *--p = '-';
+
+  output_write(out, p, end - p);
+}
+
+// Returns the contents as a NUL terminated string.
+static char* output_str(output_buffer* out) {
+  output_write(out, "", 1);
+  out->len--;
+  return out->data;
+}
+
+#endif // __OUTPUT_H__
@@ -9,21 +9,25 @@
   #include <windows.h>
 #endif
 
-#ifdef INC_WINDOWS
-  #define PERF_START(name) \
-    LARGE_INTEGER t1__##name, t2__##name, frequency__##name; \
-    double took__##name; \
-    QueryPerformanceFrequency(&frequency__##name);  \
-    QueryPerformanceCounter(&t1__##name); \
+// Before anything that allocates (it does nothing without -DALLOC_SPY)
+#include "alloc_spy.h"
+#include "timing.h"
 
+// Adds the time until PERF_STOP(name) to the phase 'name' when --time is on,
+// and the hardware counters with --counters. With ALLOC_SPY the allocations
+// in between are counted for the phase too.
+#define PERF_START(name) \
+  ALLOC_SPY_PHASE_BEGIN(#name); \
+  perfctr_values perf_counters__##name = perfctr_read(); \
+  uint64_t perf_start__##name = timing.enabled ? timing_now_ns() : 0
 
-  #define PERF_STOP(name) \
-    QueryPerformanceCounter(&t2__##name); \
-    took__##name = (float) (t2__##name.QuadPart - t1__##name.QuadPart) / frequency__##name.QuadPart;  \
-    printf("%s: %lfms (%lfs)\n", #name, (took__##name * 1000.0), took__##name);
-#else
-  #define PERF_START(name) /*name*/
-  #define PERF_STOP(name) /*name*/
-#endif
+#define PERF_STOP(name) do { \
+    ALLOC_SPY_PHASE_END(#name); \
+    if (timing.enabled) { \
+      uint64_t perf_ns__ = timing_now_ns() - perf_start__##name; \
+      perfctr_values perf_diff__ = perfctr_diff(perfctr_read(), perf_counters__##name); \
+      timing_add(#name, perf_ns__, timing.counters ? &perf_diff__ : NULL); \
+    } \
+  } while (0)
 
 #endif
\ No newline at end of file
@@ -0,0 +1,174 @@
+#ifndef __PERFCTR_H__
+#define __PERFCTR_H__
+
+// Hardware performance counters (--counters), Linux only.
+//
+// Each counter is opened on its own with perf_event_open, for this thread
+// and user space only (so perf_event_paranoid up to 2 allows it). Those
+// the CPU, the VM or the kernel don't have are left out: perfctr_open says
+// which ones are missing and the reports leave them out. Elsewhere, or
+// when none can be opened, it's as if --counters wasn't given.
+//
+// Reading is one read() per counter, only done when they're open. When the
+// kernel multiplexes them (more counters than the PMU has) the values are
+// scaled by the time each one was actually counting.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+  #include <errno.h>
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+typedef enum perfctr_kind {
+  PERFCTR_CYCLES,
+  PERFCTR_INSTRUCTIONS,
+  PERFCTR_BRANCHES,
+  PERFCTR_BRANCH_MISSES,
+  PERFCTR_CACHE_REFERENCES,
+  PERFCTR_CACHE_MISSES,
+  PERFCTR_PAGE_FAULTS,
+  PERFCTR_NUM,
+} perfctr_kind;
+
+static const char* perfctr_names[] = {
+  "cycles",
+  "instructions",
+  "branches",
+  "branch_misses",
+  "cache_references",
+  "cache_misses",
+  "page_faults",
+};
+
+typedef struct perfctr_values {
+  uint64_t v[PERFCTR_NUM];
+} perfctr_values;
+
+typedef struct perfctr_state {
+  bool open; // at least one counter is
+  int fds[PERFCTR_NUM]; // -1 = not available
+} perfctr_state;
+
+static perfctr_state perfctr = { false, { -1, -1, -1, -1, -1, -1, -1 } };
+
+static inline bool perfctr_has(perfctr_kind kind) {
+  return perfctr.fds[kind] >= 0;
+}
+
+#ifdef __linux__
+
+// Opens the counters, false if none of them can be. What's missing is
+// reported on stderr.
+bool perfctr_open(void) {
+  static const struct { uint32_t type; uint64_t config; } events[] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+  };
+  if (perfctr.open) return true;
+
+  int first_error = 0;
+  int num_missing = 0;
+  for (int i = 0; i < PERFCTR_NUM; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[i].type;
+    attr.config = events[i].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    perfctr.fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perfctr.fds[i] < 0) {
+      if (!first_error) first_error = errno;
+      num_missing++;
+    } else {
+      perfctr.open = true;
+    }
+  }
+
+  if (num_missing) {
+    fprintf(stderr, "counters: %s", perfctr.open ? "not available:" : "none available");
+    for (int i = 0; perfctr.open && i < PERFCTR_NUM; i++) {
+      if (!perfctr_has((perfctr_kind) i)) fprintf(stderr, " %s", perfctr_names[i]);
+    }
+    fprintf(stderr, " (perf_event_open: %s%s)\n", strerror(first_error),
+      first_error == EACCES || first_error == EPERM ? ", see /proc/sys/kernel/perf_event_paranoid" : "");
+  }
+  return perfctr.open;
+}
+
+// The counts since perfctr_open, 0 for those that aren't open
+static perfctr_values perfctr_read(void) {
+  perfctr_values values;
+  memset(&values, 0, sizeof(values));
+  if (!perfctr.open) return values;
+
+  for (int i = 0; i < PERFCTR_NUM; i++) {
+    uint64_t data[3]; // value, time enabled, time running
+    if (perfctr.fds[i] < 0 || read(perfctr.fds[i], data, sizeof(data)) != sizeof(data)) continue;
+    values.v[i] = data[2] > 0 && data[2] < data[1]
+      ? (uint64_t) ((double) data[0] * data[1] / data[2])
+      : data[0];
+  }
+  return values;
+}
+
+#else
+
+bool perfctr_open(void) {
+  fprintf(stderr, "counters: not supported on this platform\n");
+  return false;
+}
+
+static perfctr_values perfctr_read(void) {
+  perfctr_values values;
+  memset(&values, 0, sizeof(values));
+  return values;
+}
+
+#endif // __linux__
+
+// to - from, for each counter
+static inline perfctr_values perfctr_diff(perfctr_values to, perfctr_values from) {
+  for (int i = 0; i < PERFCTR_NUM; i++) to.v[i] -= from.v[i];
+  return to;
+}
+
+static inline void perfctr_add(perfctr_values* to, perfctr_values values) {
+  for (int i = 0; i < PERFCTR_NUM; i++) to->v[i] += values.v[i];
+}
+
+// e.g. "IPC 2.31, branch misses 0.42%, cache misses 1.20%, 12 page faults",
+// what isn't available is left out
+void perfctr_print_summary(FILE* out, perfctr_values* values) {
+  const char* sep = "";
+  if (perfctr_has(PERFCTR_CYCLES) && perfctr_has(PERFCTR_INSTRUCTIONS) && values->v[PERFCTR_CYCLES]) {
+    fprintf(out, "IPC %.2f", (double) values->v[PERFCTR_INSTRUCTIONS] / values->v[PERFCTR_CYCLES]);
+    sep = ", ";
+  }
+  if (perfctr_has(PERFCTR_BRANCHES) && perfctr_has(PERFCTR_BRANCH_MISSES) && values->v[PERFCTR_BRANCHES]) {
+    fprintf(out, "%sbranch misses %.2f%%", sep, 100.0 * values->v[PERFCTR_BRANCH_MISSES] / values->v[PERFCTR_BRANCHES]);
+    sep = ", ";
+  }
+  if (perfctr_has(PERFCTR_CACHE_REFERENCES) && perfctr_has(PERFCTR_CACHE_MISSES) && values->v[PERFCTR_CACHE_REFERENCES]) {
+    fprintf(out, "%scache misses %.2f%%", sep, 100.0 * values->v[PERFCTR_CACHE_MISSES] / values->v[PERFCTR_CACHE_REFERENCES]);
+    sep = ", ";
+  }
+  if (perfctr_has(PERFCTR_PAGE_FAULTS)) {
+    fprintf(out, "%s%llu page faults", sep, (unsigned long long) values->v[PERFCTR_PAGE_FAULTS]);
+  }
+}
+
+#endif // __PERFCTR_H__
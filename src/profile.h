@@ -0,0 +1,237 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+// Report of what program_run counted with --profile (see profile_data).
+//
+// Views of the same counts: the hottest instructions with their source
+// location, totals per label (an instruction belongs to the last label
+// before it), the call graph per procedure (a procedure is the label a call
+// went to) and the whole source with the counts of each line.
+//
+// The counts are per instruction of the program that ran, so with -O1 an
+// inlined procedure shows up on the lines of the procedure, and loops the
+// optimizer rewrote on the lines they came from. -O0 profiles the program
+// as written.
+
+#include "interp.h"
+
+#define PROFILE_DEFAULT_TOP 10
+
+typedef struct profile_entry {
+  int index; // instruction, label or line
+  uint64_t count;
+  uint64_t cycles;
+} profile_entry;
+
+static int profile_compare_entries(const void* a, const void* b) {
+  const profile_entry* x = (const profile_entry*) a;
+  const profile_entry* y = (const profile_entry*) b;
+  // Hottest first, by cycles when we have them
+  uint64_t kx = x->cycles ? x->cycles : x->count;
+  uint64_t ky = y->cycles ? y->cycles : y->count;
+  if (kx != ky) return kx < ky ? 1 : -1;
+  return x->index - y->index;
+}
+
+static void profile_print_counts(uint64_t count, uint64_t cycles, uint64_t total, bool has_cycles) {
+  printf("%12" PRIu64 " %6.2f%%", count, total ? 100.0 * count / total : 0.0);
+  if (has_cycles) printf(" %14" PRIu64, cycles);
+}
+
+static int profile_compare_labels(const void* a, const void* b) {
+  return ((const resolved_label*) a)->instruction_index - ((const resolved_label*) b)->instruction_index;
+}
+
+static int profile_compare_procs(const void* a, const void* b) {
+  const profile_proc* x = (const profile_proc*) a;
+  const profile_proc* y = (const profile_proc*) b;
+  if (x->incl_insns != y->incl_insns) return x->incl_insns < y->incl_insns ? 1 : -1;
+  return x->excl_insns < y->excl_insns ? 1 : x->excl_insns > y->excl_insns ? -1 : 0;
+}
+
+static int profile_compare_edges(const void* a, const void* b) {
+  const profile_edge* x = (const profile_edge*) a;
+  const profile_edge* y = (const profile_edge*) b;
+  if (x->calls != y->calls) return x->calls < y->calls ? 1 : -1;
+  if (x->caller != y->caller) return x->caller < y->caller ? -1 : 1;
+  return x->callee < y->callee ? -1 : x->callee > y->callee ? 1 : 0;
+}
+
+// Name of the procedure 'proc' (see profile_data.procs)
+static const char* profile_proc_name(program* p, uint32_t proc, char* buf, size_t size) {
+  if (proc == 0) return "(top level)";
+  const char* name = program_get_label_by_index(p, (int) proc - 1);
+  if (name) return name;
+  snprintf(buf, size, "insn_%u", proc - 1);
+  return buf;
+}
+
+static void profile_report_calls(program* p, profile_data* prof) {
+  int n = p->num_instructions;
+
+  // Copied out to be sorted, the index goes in 'active'
+  profile_proc* procs = (profile_proc*) malloc((n + 2) * sizeof(profile_proc));
+  profile_edge* edges = (profile_edge*) malloc((prof->num_edges + 1) * sizeof(profile_edge));
+  if (!procs || !edges) {
+    printf("failed to alloc memory for the profile report\n");
+    exit(1);
+  }
+  int num_procs = 0;
+  for (int i = 0; i <= n + 1; i++) {
+    if (prof->procs[i].calls == 0) continue;
+    procs[num_procs] = prof->procs[i];
+    procs[num_procs++].active = i;
+  }
+  qsort(procs, num_procs, sizeof(profile_proc), profile_compare_procs);
+
+  char buf[32];
+  printf("\nProcedures:\n");
+  printf("%10s %12s %12s %10s %10s\n", "calls", "incl", "excl", "incl ms", "excl ms");
+  for (int i = 0; i < num_procs; i++) {
+    profile_proc* proc = &procs[i];
+    printf("%10" PRIu64 " %12" PRIu64 " %12" PRIu64 " %10.3f %10.3f  %s\n",
+      proc->calls, proc->incl_insns, proc->excl_insns, proc->incl_ns / 1e6, proc->excl_ns / 1e6,
+      profile_proc_name(p, proc->active, buf, sizeof(buf)));
+  }
+
+  int num_edges = 0;
+  for (int i = 0; i < prof->edges_cap; i++) {
+    if (prof->edges[i].calls != 0) edges[num_edges++] = prof->edges[i];
+  }
+  qsort(edges, num_edges, sizeof(profile_edge), profile_compare_edges);
+
+  printf("\nCalls:\n");
+  printf("%10s\n", "count");
+  for (int i = 0; i < num_edges; i++) {
+    char callee_buf[32];
+    printf("%10" PRIu64 "  %s -> %s\n", edges[i].calls,
+      profile_proc_name(p, edges[i].caller, buf, sizeof(buf)),
+      profile_proc_name(p, edges[i].callee, callee_buf, sizeof(callee_buf)));
+  }
+
+  free(edges);
+  free(procs);
+}
+
+// Prints the report to stdout, 'top' hot instructions first
+void profile_report(program* p, int top) {
+  profile_data* prof = p->profile;
+  if (!prof) return;
+
+  int n = p->num_instructions;
+  bool has_cycles = prof->cycles != NULL;
+  const char* src = p->error_handler ? p->error_handler->src_code : NULL;
+
+  uint64_t total = 0, total_cycles = 0;
+  for (int i = 0; i < n; i++) {
+    total += prof->counts[i];
+    if (has_cycles) total_cycles += prof->cycles[i];
+  }
+
+  printf("\nProfile: %" PRIu64 " instructions executed", total);
+  if (has_cycles) printf(", %" PRIu64 " cycles", total_cycles);
+  printf("\n");
+
+  // Of the host, from --counters
+  timing_phase* run = timing.counters ? timing_find("program_run") : NULL;
+  if (run) {
+    printf("Counters: ");
+    perfctr_print_summary(stdout, &run->counters);
+    printf("\n");
+  }
+
+  // Hot instructions
+  profile_entry* entries = (profile_entry*) malloc((n + 1) * sizeof(profile_entry));
+  if (!entries) {
+    printf("failed to alloc memory for the profile report\n");
+    exit(1);
+  }
+  int num_entries = 0;
+  for (int i = 0; i < n; i++) {
+    if (prof->counts[i] == 0) continue;
+    entries[num_entries++] = (profile_entry) { i, prof->counts[i], has_cycles ? prof->cycles[i] : 0 };
+  }
+  qsort(entries, num_entries, sizeof(profile_entry), profile_compare_entries);
+
+  printf("\nHot instructions:\n");
+  printf("%12s %7s%s\n", "count", "%", has_cycles ? "         cycles" : "");
+  for (int i = 0; i < num_entries && i < top; i++) {
+    instruction* in = &p->instructions[entries[i].index];
+    profile_print_counts(entries[i].count, entries[i].cycles, total, has_cycles);
+    printf("  line %d: %s\n", in->opcode_pos.line_number, opcode_names[in->opcode]);
+    if (src) print_location(src, &in->opcode_pos);
+  }
+
+  // Per label, in program order
+  int num_labels = p->num_resolved_labels;
+  resolved_label* labels = (resolved_label*) malloc((num_labels + 1) * sizeof(resolved_label));
+  if (!labels) {
+    printf("failed to alloc memory for the profile report\n");
+    exit(1);
+  }
+  memcpy(labels, p->resolved_labels, num_labels * sizeof(resolved_label));
+  qsort(labels, num_labels, sizeof(resolved_label), profile_compare_labels);
+
+  printf("\nBy label:\n");
+  printf("%12s %7s%s\n", "count", "%", has_cycles ? "         cycles" : "");
+  int label = -1; // before the first one
+  for (int i = 0; i <= n; i++) {
+    bool next_label = label + 1 < num_labels && labels[label + 1].instruction_index == i;
+    if (i < n && !next_label) continue;
+
+    // The region [from, i) is over
+    int from = label == -1 ? 0 : labels[label].instruction_index;
+    uint64_t count = 0, cycles = 0;
+    for (int j = from; j < i; j++) {
+      count += prof->counts[j];
+      if (has_cycles) cycles += prof->cycles[j];
+    }
+    if (count > 0 || label != -1) {
+      profile_print_counts(count, cycles, total, has_cycles);
+      printf("  %s\n", label == -1 ? "(before any label)" : labels[label].name);
+    }
+
+    // Labels on the same instruction share it, the last one gets the count
+    while (label + 1 < num_labels && labels[label + 1].instruction_index == i) label++;
+    if (i == n) break;
+  }
+  free(labels);
+
+  profile_report_calls(p, prof);
+
+  // Annotated source
+  if (src) {
+    int num_lines = 1;
+    for (const char* c = src; *c; c++) {
+      if (*c == '\n') num_lines++;
+    }
+    profile_entry* lines = (profile_entry*) calloc(num_lines + 1, sizeof(profile_entry));
+    if (!lines) {
+      printf("failed to alloc memory for the profile report\n");
+      exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+      int line = p->instructions[i].opcode_pos.line_number;
+      if (line < 1 || line > num_lines) continue;
+      lines[line].count += prof->counts[i];
+      if (has_cycles) lines[line].cycles += prof->cycles[i];
+    }
+
+    printf("\nSource:\n");
+    for (int line = 1; line <= num_lines; line++) {
+      int start, end;
+      if (!get_line_range(src, line, &start, &end)) break;
+      if (lines[line].count > 0) {
+        profile_print_counts(lines[line].count, lines[line].cycles, total, has_cycles);
+      } else {
+        printf("%20s%s", "", has_cycles ? "               " : "");
+      }
+      printf(" %4d| %.*s\n", line, end - start, src + start);
+    }
+    free(lines);
+  }
+
+  free(entries);
+}
+
+#endif // __PROFILE_H__
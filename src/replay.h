@@ -0,0 +1,156 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+// Recording of a run, to replay it (--record, --replay).
+//
+// A run only depends on the program and the options it was built and run
+// with, plus what it gets from outside the VM. For now that's just what
+// malloc returns: offsets into the guest heap (see heap.h), so they don't
+// change from run to run either, but they're what a change in the heap
+// would show first. An input opcode would be logged the same way, and
+// replayed from the log instead of checked against it.
+//
+// A recording is a replay_header and then replay_entries, in the order
+// they happened, each with the number of the instruction it belongs to
+// (from 0):
+//
+//   REPLAY_MALLOC      what a malloc returned
+//   REPLAY_CHECKPOINT  every header.checkpoint_every instructions, the whole
+//                      VM state before that instruction (replay_checkpoint
+//                      in interp.h)
+//   REPLAY_END         the number of instructions run
+//
+// A replay checks each of them against the run and reports the first
+// difference. It can also start at a checkpoint (--from-checkpoint),
+// to get to the part of a long run that matters without running all of
+// it again.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define REPLAY_MAGIC "ASMRPLAY"
+#define REPLAY_VERSION 1
+#define REPLAY_DEFAULT_CHECKPOINT_EVERY 100000000ull
+
+typedef struct replay_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t program_hash; // program_code_hash
+  // What the program was built and run with, to do it the same way
+  int32_t opt_level;
+  int32_t inline_calls;
+  uint64_t heap_size;
+  uint64_t stack_size;
+  uint64_t checkpoint_every;
+} replay_header;
+
+typedef enum replay_entry_kind {
+  REPLAY_MALLOC = 1,
+  REPLAY_CHECKPOINT,
+  REPLAY_END,
+} replay_entry_kind;
+
+typedef struct replay_entry {
+  uint32_t kind;
+  uint32_t pc;
+  uint64_t insn; // UINT64_MAX in a REPLAY_END after a stack fault
+  int64_t value; // the malloc result, the checkpoint number (from 1)
+} replay_entry;
+
+typedef struct replay_log {
+  FILE* file;
+  const char* path;
+  bool recording; // or replaying
+  replay_header header;
+
+  // Replaying: the entry read ahead (kind 0 when there are no more)
+  replay_entry next;
+  // The instruction vm_exec stops at next for the log (see vm_replay_stop)
+  uint64_t next_stop;
+  // Set at the first difference (or write error), nothing else is checked
+  // or written after it
+  bool stopped;
+  bool ended; // the run is over
+
+  uint64_t from_checkpoint; // replaying, 0 = from the start
+
+  // Written or matched
+  uint64_t num_events;
+  uint64_t num_checkpoints;
+  uint64_t num_insns;
+} replay_log;
+
+// Creates (or truncates) 'path' and writes 'header' to it
+bool replay_create(replay_log* log, const char* path, replay_header* header) {
+  memset(log, 0, sizeof(*log));
+  log->file = fopen(path, "wb");
+  if (!log->file) return false;
+  log->path = path;
+  log->recording = true;
+  log->header = *header;
+  memcpy(log->header.magic, REPLAY_MAGIC, sizeof(log->header.magic));
+  log->header.version = REPLAY_VERSION;
+  return fwrite(&log->header, sizeof(log->header), 1, log->file) == 1;
+}
+
+// Reads the next entry into log->next
+static void replay_read_next(replay_log* log) {
+  if (fread(&log->next, sizeof(log->next), 1, log->file) != 1) {
+    memset(&log->next, 0, sizeof(log->next));
+  }
+}
+
+// Opens a recording to replay it. NULL if it worked, what's wrong if not.
+const char* replay_open(replay_log* log, const char* path) {
+  memset(log, 0, sizeof(*log));
+  log->file = fopen(path, "rb");
+  if (!log->file) return "can't open the file";
+  log->path = path;
+
+  const char* error = NULL;
+  replay_header* h = &log->header;
+  if (fread(h, sizeof(*h), 1, log->file) != 1 || memcmp(h->magic, REPLAY_MAGIC, sizeof(h->magic)) != 0) {
+    error = "not a recording";
+  } else if (h->version != REPLAY_VERSION) {
+    error = "unsupported recording version";
+  }
+  if (error) {
+    fclose(log->file);
+    log->file = NULL;
+    return error;
+  }
+  replay_read_next(log);
+  return NULL;
+}
+
+void replay_close(replay_log* log) {
+  if (log->file) fclose(log->file);
+  log->file = NULL;
+}
+
+static inline bool replay_write(replay_log* log, const void* data, size_t size) {
+  return size == 0 || fwrite(data, size, 1, log->file) == 1;
+}
+
+static inline bool replay_read(replay_log* log, void* data, size_t size) {
+  return size == 0 || fread(data, size, 1, log->file) == 1;
+}
+
+// Compares the next 'size' bytes of the recording with 'data'
+static bool replay_read_equal(replay_log* log, const void* data, size_t size) {
+  char buf[64 * 1024];
+  const char* d = (const char*) data;
+  while (size > 0) {
+    size_t n = size < sizeof(buf) ? size : sizeof(buf);
+    if (!replay_read(log, buf, n) || memcmp(buf, d, n) != 0) return false;
+    d += n;
+    size -= n;
+  }
+  return true;
+}
+
+#endif // __REPLAY_H__
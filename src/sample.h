@@ -0,0 +1,194 @@
+#ifndef __SAMPLE_H__
+#define __SAMPLE_H__
+
+// Sampling profiler (--sample).
+//
+// A SIGPROF timer (setitimer, process CPU time) ticks 'hz' times a second.
+// The handler only copies the pc and the calls of vm_sampling (published
+// by vm_exec_sampled, see vm_state.sample_pc) to a buffer allocated up
+// front, so the run goes at full speed between ticks. Ticks outside of
+// vm_exec (parsing, optimizing...) are ignored.
+//
+// sample_write_folded turns the samples into folded stacks, the input of
+// flamegraph.pl and friends, one line per distinct stack:
+//
+//   main;proc_gcd;loop 42
+//
+// Frames are named by the label they were called at. The last one is the
+// label the pc was under, when it's not the procedure's own label.
+
+#include "interp.h"
+
+#ifndef INC_WINDOWS
+  #include <signal.h>
+  #include <sys/time.h>
+#endif
+
+#define SAMPLE_DEFAULT_HZ 1000
+// Each sample takes [pc, depth, calls...], 16MB of them
+#define SAMPLE_BUFFER_WORDS (1 << 22)
+
+typedef struct sample_buffer {
+  uint32_t* words;
+  size_t len;
+  size_t cap;
+  uint64_t num_samples;
+  uint64_t dropped; // the buffer was full
+} sample_buffer;
+
+static sample_buffer samples;
+
+#ifndef INC_WINDOWS
+
+static void sample_on_tick(int sig) {
+  (void) sig;
+  vm_state* vm = vm_sampling;
+  if (!vm) return;
+
+  uint32_t depth = vm->sample_depth;
+  uint32_t recorded = depth < VM_SAMPLE_MAX_DEPTH ? depth : VM_SAMPLE_MAX_DEPTH;
+  if (samples.len + 2 + recorded > samples.cap) {
+    samples.dropped++;
+    return;
+  }
+
+  uint32_t* out = samples.words + samples.len;
+  out[0] = vm->sample_pc;
+  out[1] = depth;
+  for (uint32_t i = 0; i < recorded; i++) out[2 + i] = vm->sample_calls[i];
+  samples.len += 2 + recorded;
+  samples.num_samples++;
+}
+
+// Starts ticking, returns false if the timer can't be set up
+bool sample_start(int hz) {
+  if (hz <= 0 || hz > 1000000) return false;
+
+  if (!samples.words) {
+    samples.words = (uint32_t*) malloc(SAMPLE_BUFFER_WORDS * sizeof(uint32_t));
+    if (!samples.words) {
+      printf("failed to alloc memory for the samples\n");
+      exit(1);
+    }
+    samples.cap = SAMPLE_BUFFER_WORDS;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sample_on_tick;
+  sa.sa_flags = SA_RESTART; // the program's writes to stdout go on
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGPROF, &sa, NULL) != 0) return false;
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+void sample_stop(void) {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+}
+
+#else
+
+bool sample_start(int hz) {
+  (void) hz;
+  return false;
+}
+
+void sample_stop(void) {
+}
+
+#endif // INC_WINDOWS
+
+static int sample_compare_strings(const void* a, const void* b) {
+  return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+// Appends ';name' (or 'name' at the start) to the stack being built
+static void sample_append_frame(char** stack, size_t* len, size_t* cap, const char* name) {
+  size_t name_len = strlen(name);
+  if (*len + name_len + 2 > *cap) {
+    *cap = (*len + name_len + 2) * 2;
+    *stack = (char*) realloc(*stack, *cap);
+    if (!*stack) {
+      printf("failed to alloc memory for the samples\n");
+      exit(1);
+    }
+  }
+  if (*len > 0) (*stack)[(*len)++] = ';';
+  memcpy(*stack + *len, name, name_len + 1);
+  *len += name_len;
+}
+
+// Writes the samples taken so far as folded stacks, sorted
+void sample_write_folded(program* p, FILE* out) {
+  int n = p->num_instructions;
+
+  // Label at each instruction, and the last one at or before it
+  char** label_at = (char**) calloc(n + 1, sizeof(char*));
+  char** region = (char**) calloc(n + 1, sizeof(char*));
+  char** stacks = (char**) malloc((samples.num_samples + 1) * sizeof(char*));
+  if (!label_at || !region || !stacks) {
+    printf("failed to alloc memory for the samples\n");
+    exit(1);
+  }
+  for (int i = 0; i < p->num_resolved_labels; i++) {
+    resolved_label* l = &p->resolved_labels[i];
+    if (l->instruction_index <= n) label_at[l->instruction_index] = l->name;
+  }
+  for (int i = 0; i <= n; i++) {
+    region[i] = label_at[i] ? label_at[i] : i > 0 ? region[i - 1] : NULL;
+  }
+
+  // Each sample as a string, then sorted so equal stacks are together
+  int num_stacks = 0;
+  size_t pos = 0;
+  while (pos < samples.len) {
+    uint32_t pc = samples.words[pos];
+    uint32_t depth = samples.words[pos + 1];
+    uint32_t recorded = depth < VM_SAMPLE_MAX_DEPTH ? depth : VM_SAMPLE_MAX_DEPTH;
+    uint32_t* calls = samples.words + pos + 2;
+    pos += 2 + recorded;
+
+    char* stack = NULL;
+    size_t len = 0, cap = 0;
+    sample_append_frame(&stack, &len, &cap, "main");
+    const char* frame = NULL;
+    for (uint32_t i = 0; i < recorded; i++) {
+      char unnamed[32];
+      frame = calls[i] <= (uint32_t) n ? label_at[calls[i]] : NULL;
+      if (!frame) {
+        snprintf(unnamed, sizeof(unnamed), "insn_%u", calls[i]);
+        frame = unnamed;
+      }
+      sample_append_frame(&stack, &len, &cap, frame);
+      if (frame == unnamed) frame = NULL;
+    }
+    if (depth > recorded) sample_append_frame(&stack, &len, &cap, "[deeper]");
+
+    const char* leaf = pc <= (uint32_t) n ? region[pc] : NULL;
+    if (leaf && leaf != frame) sample_append_frame(&stack, &len, &cap, leaf);
+    stacks[num_stacks++] = stack;
+  }
+  qsort(stacks, num_stacks, sizeof(char*), sample_compare_strings);
+
+  for (int i = 0; i < num_stacks;) {
+    int j = i;
+    while (j < num_stacks && strcmp(stacks[i], stacks[j]) == 0) j++;
+    fprintf(out, "%s %d\n", stacks[i], j - i);
+    i = j;
+  }
+
+  for (int i = 0; i < num_stacks; i++) free(stacks[i]);
+  free(stacks);
+  free(region);
+  free(label_at);
+}
+
+#endif // __SAMPLE_H__
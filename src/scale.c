@@ -0,0 +1,387 @@
+// Front-end scalability harness (build-scale.cmd).
+//
+// Generates programs of growing size (see gen_program: labels, instructions
+// per label, branch density, string/immediate mix and comments are all
+// configurable) and measures how long the lexer, the parser, program_build
+// and program_check take on each, and the peak RSS. Each size runs in its
+// own process so the peak is its own.
+//
+// The labels double from --from to --to. For each phase we fit t = c * n^k
+// (least squares over log t, log n) on the sizes where it took long enough
+// to be measured, and a k above --max-exponent (default: 1.3) is reported
+// as super-linear, with exit code 1.
+//
+// --emit[=<file>] only writes the program for --labels, to try it with the
+// interpreter.
+
+#include "pch.h"
+
+#include "lexer.h"
+#include "parser.h"
+#include "interp.h"
+
+#include <math.h>
+#ifndef INC_WINDOWS
+  #include <sys/resource.h>
+  #include <sys/wait.h>
+  #include <unistd.h>
+#endif
+
+#define SCALE_DEFAULT_FROM 1000
+#define SCALE_DEFAULT_TO 64000
+#define SCALE_DEFAULT_MAX_EXPONENT 1.3
+// Below this a phase is mostly noise, it's left out of the fit
+#define SCALE_MIN_FIT_NS 2000000
+
+typedef struct gen_options {
+  int labels;
+  int insns; // per label
+  int branches; // % of the instructions
+  int strings; // % of the other instructions that print a string instead of using an immediate
+  int comments; // % of the lines with a comment
+  uint32_t seed;
+} gen_options;
+
+static void gen_options_init(gen_options* opts) {
+  opts->labels = SCALE_DEFAULT_FROM;
+  opts->insns = 8;
+  opts->branches = 15;
+  opts->strings = 10;
+  opts->comments = 20;
+  opts->seed = 1;
+}
+
+typedef enum scale_phase {
+  SCALE_LEX,
+  SCALE_PARSE,
+  SCALE_BUILD,
+  SCALE_CHECK,
+  SCALE_NUM_PHASES,
+} scale_phase;
+
+static const char* scale_phase_names[] = { "lex", "parse", "program_build", "program_check" };
+
+typedef struct scale_result {
+  uint64_t ns[SCALE_NUM_PHASES];
+  uint64_t peak_rss; // in KB, 0 if unknown
+  int errors; // reported by the front-end, the generator is wrong if any
+} scale_result;
+
+static char* scale_appendf(char* str, size_t* len, size_t* cap, const char* fmt, ...) {
+  va_list args;
+  for (;;) {
+    va_start(args, fmt);
+    int n = vsnprintf(str ? str + *len : NULL, str ? *cap - *len : 0, fmt, args);
+    va_end(args);
+    if (str && *len + n < *cap) {
+      *len += n;
+      return str;
+    }
+    *cap = (*cap + n + 1) * 2;
+    str = (char*) realloc(str, *cap);
+    if (!str) {
+      printf("failed to alloc memory for the program\n");
+      exit(1);
+    }
+  }
+}
+
+// xorshift32, the same seed gives the same program everywhere
+static uint32_t gen_random(uint32_t* state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static bool gen_chance(uint32_t* state, int percent) {
+  return (int) (gen_random(state) % 100) < percent;
+}
+
+// A program that passes program_check. It isn't meant to be run, branches
+// go to random labels.
+char* gen_program(gen_options* opts) {
+  static const char* branches[] = { "jmp", "jne", "je", "jge", "jg", "jle", "jl" };
+  static const char* ops[] = { "mov", "add", "sub", "mul", "cmp" };
+  static const char* words[] = { "alpha", "beta", "gamma", "delta", "epsilon", "zeta" };
+
+  uint32_t rng = opts->seed ? opts->seed : 1;
+  char* s = NULL;
+  size_t len = 0, cap = 0;
+
+  s = scale_appendf(s, &len, &cap, "; generated: %d labels, %d instructions each\n", opts->labels, opts->insns);
+  for (int i = 0; i < opts->labels; i++) {
+    if (gen_chance(&rng, opts->comments)) {
+      s = scale_appendf(s, &len, &cap, "\n; %s block %d\n", words[gen_random(&rng) % 6], i);
+    }
+    s = scale_appendf(s, &len, &cap, "label_%d:\n", i);
+
+    for (int j = 0; j < opts->insns; j++) {
+      char reg = 'a' + gen_random(&rng) % 26;
+      if (gen_chance(&rng, opts->branches)) {
+        int target = gen_random(&rng) % opts->labels;
+        s = scale_appendf(s, &len, &cap, "  %s label_%d", branches[gen_random(&rng) % 7], target);
+      } else if (gen_chance(&rng, opts->strings)) {
+        s = scale_appendf(s, &len, &cap, "  %s '%s %d = ', %c",
+          gen_random(&rng) % 2 ? "msg" : "print", words[gen_random(&rng) % 6], j, reg);
+      } else if (gen_random(&rng) % 4 == 0) {
+        s = scale_appendf(s, &len, &cap, "  %s %c", gen_random(&rng) % 2 ? "inc" : "dec", reg);
+      } else {
+        const char* op = ops[gen_random(&rng) % 5];
+        if (gen_random(&rng) % 2) {
+          s = scale_appendf(s, &len, &cap, "  %s %c, %d", op, reg, (int) (gen_random(&rng) % 2000) - 1000);
+        } else {
+          s = scale_appendf(s, &len, &cap, "  %s %c, %c", op, reg, 'a' + gen_random(&rng) % 26);
+        }
+      }
+      if (gen_chance(&rng, opts->comments)) {
+        s = scale_appendf(s, &len, &cap, "    ; %s", words[gen_random(&rng) % 6]);
+      }
+      s = scale_appendf(s, &len, &cap, "\n");
+    }
+  }
+  s = scale_appendf(s, &len, &cap, "  end\n");
+  return s;
+}
+
+static int scale_errors;
+
+static void scale_on_error(error_handler* err_handler, char* msg, src_pos* pos) {
+  (void) err_handler;
+  if (scale_errors++ == 0) {
+    printf("error in the generated program: %s (line: %d)\n", msg, pos ? pos->line_number : 0);
+  }
+}
+
+static void scale_measure(const char* code, scale_result* result) {
+  memset(result, 0, sizeof(*result));
+  scale_errors = 0;
+
+  // The lexer reports its errors with the default handler, there shouldn't
+  // be any
+  parser p;
+  uint64_t start = timing_now_ns();
+  parser_init(&p, code);
+  result->ns[SCALE_LEX] = timing_now_ns() - start;
+  p.error_handler->handler_fn = scale_on_error;
+
+  start = timing_now_ns();
+  top_level_node* n = parser_parse(&p);
+  result->ns[SCALE_PARSE] = timing_now_ns() - start;
+
+  program prog;
+  prog.error_handler = p.error_handler;
+  if (!scale_errors) {
+    start = timing_now_ns();
+    program_build(&prog, n);
+    result->ns[SCALE_BUILD] = timing_now_ns() - start;
+
+    start = timing_now_ns();
+    program_check(&prog);
+    result->ns[SCALE_CHECK] = timing_now_ns() - start;
+  }
+  result->errors = scale_errors;
+
+#ifndef INC_WINDOWS
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) result->peak_rss = (uint64_t) usage.ru_maxrss;
+#endif
+}
+
+// Measures 'code' in a child process, so the peak RSS is its own
+static bool scale_measure_apart(const char* code, scale_result* result) {
+#ifndef INC_WINDOWS
+  int fds[2];
+  if (pipe(fds) != 0) return false;
+  fflush(stdout);
+
+  pid_t pid = fork();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    close(fds[0]);
+    scale_result r;
+    scale_measure(code, &r);
+    bool ok = write(fds[1], &r, sizeof(r)) == sizeof(r);
+    fflush(stdout);
+    _exit(ok ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bool ok = read(fds[0], result, sizeof(*result)) == sizeof(*result);
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  return ok;
+#else
+  scale_measure(code, result);
+  return true;
+#endif
+}
+
+// Exponent k of y = c * x^k, least squares over the logs
+static double scale_fit_exponent(double* x, double* y, int n) {
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (int i = 0; i < n; i++) {
+    double lx = log(x[i]), ly = log(y[i]);
+    sx += lx;
+    sy += ly;
+    sxx += lx * lx;
+    sxy += lx * ly;
+  }
+  return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+static void print_usage() {
+  printf("usage: scale [options]\n");
+  printf("options:\n");
+  printf("  --from=<n>              labels of the smallest program (default: %d)\n", SCALE_DEFAULT_FROM);
+  printf("  --to=<n>                labels of the largest program (default: %d)\n", SCALE_DEFAULT_TO);
+  printf("  --max-exponent=<k>      growth above n^k is super-linear (default: %g)\n", SCALE_DEFAULT_MAX_EXPONENT);
+  printf("  --emit[=<file>]         only write the program with --labels labels\n");
+  printf("program:\n");
+  printf("  --labels=<n>            labels (default: %d)\n", SCALE_DEFAULT_FROM);
+  printf("  --insns=<n>             instructions per label (default: 8)\n");
+  printf("  --branches=<percent>    instructions that are branches (default: 15)\n");
+  printf("  --strings=<percent>     other instructions that print a string (default: 10)\n");
+  printf("  --comments=<percent>    lines with a comment (default: 20)\n");
+  printf("  --seed=<n>              random seed (default: 1)\n");
+}
+
+static const char* option_value(const char* arg, const char* name) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) == 0 && arg[len] == '=') return arg + len + 1;
+  return NULL;
+}
+
+int main(int argc, const char** argv) {
+  gen_options gen;
+  gen_options_init(&gen);
+  int from = SCALE_DEFAULT_FROM;
+  int to = SCALE_DEFAULT_TO;
+  double max_exponent = SCALE_DEFAULT_MAX_EXPONENT;
+  bool emit = false;
+  const char* emit_path = NULL; // NULL = stdout
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value;
+
+    if ((value = option_value(arg, "--from")) != NULL) {
+      from = atoi(value);
+    } else if ((value = option_value(arg, "--to")) != NULL) {
+      to = atoi(value);
+    } else if ((value = option_value(arg, "--max-exponent")) != NULL) {
+      max_exponent = atof(value);
+    } else if (strcmp(arg, "--emit") == 0) {
+      emit = true;
+    } else if ((value = option_value(arg, "--emit")) != NULL) {
+      emit = true;
+      emit_path = value;
+    } else if ((value = option_value(arg, "--labels")) != NULL) {
+      gen.labels = atoi(value);
+    } else if ((value = option_value(arg, "--insns")) != NULL) {
+      gen.insns = atoi(value);
+    } else if ((value = option_value(arg, "--branches")) != NULL) {
+      gen.branches = atoi(value);
+    } else if ((value = option_value(arg, "--strings")) != NULL) {
+      gen.strings = atoi(value);
+    } else if ((value = option_value(arg, "--comments")) != NULL) {
+      gen.comments = atoi(value);
+    } else if ((value = option_value(arg, "--seed")) != NULL) {
+      gen.seed = (uint32_t) strtoul(value, NULL, 10);
+    } else {
+      printf("unknown option '%s'\n", arg);
+      print_usage();
+      return 1;
+    }
+  }
+
+  if (gen.labels < 1 || gen.insns < 1 || from < 1 || to < from) {
+    print_usage();
+    return 1;
+  }
+
+  if (emit) {
+    FILE* out = emit_path ? fopen(emit_path, "wb") : stdout;
+    if (!out) {
+      printf("failed to open file %s\n", emit_path);
+      return 2;
+    }
+    char* code = gen_program(&gen);
+    fputs(code, out);
+    if (out != stdout) fclose(out);
+    free(code);
+    return 0;
+  }
+
+  // What the process takes with (almost) no program, so the peak RSS of
+  // the sizes can be compared
+  scale_result empty;
+  if (!scale_measure_apart("  end\n", &empty)) {
+    printf("failed to measure\n");
+    return 1;
+  }
+
+  int max_sizes = 1;
+  for (int labels = from; labels < to; labels *= 2) max_sizes++;
+  double* sizes = (double*) malloc(max_sizes * sizeof(double));
+  double* values = (double*) malloc(max_sizes * sizeof(double));
+  scale_result* results = (scale_result*) malloc(max_sizes * sizeof(scale_result));
+  if (!sizes || !values || !results) {
+    printf("failed to alloc memory for the results\n");
+    return 1;
+  }
+
+  printf("%9s %10s %10s", "labels", "insns", "KB");
+  for (int ph = 0; ph < SCALE_NUM_PHASES; ph++) printf(" %14s", scale_phase_names[ph]);
+  printf(" %12s\n", "peak RSS KB");
+
+  int num_sizes = 0;
+  for (int labels = from; num_sizes < max_sizes; labels = labels * 2 > to ? to : labels * 2) {
+    gen.labels = labels;
+    char* code = gen_program(&gen);
+    scale_result* r = &results[num_sizes];
+    if (!scale_measure_apart(code, r) || r->errors) {
+      printf("failed to measure %d labels\n", labels);
+      return 1;
+    }
+
+    printf("%9d %10d %10zu", labels, labels * gen.insns, strlen(code) / 1024);
+    for (int ph = 0; ph < SCALE_NUM_PHASES; ph++) printf(" %11.3f ms", r->ns[ph] / 1e6);
+    printf(" %12" PRIu64 "\n", r->peak_rss);
+    sizes[num_sizes++] = labels;
+    free(code);
+    if (labels == to) break;
+  }
+
+  // Growth of each phase, and of the memory on top of 'empty'
+  bool super_linear = false;
+  printf("\ngrowth:\n");
+  for (int ph = 0; ph <= SCALE_NUM_PHASES; ph++) {
+    bool is_rss = ph == SCALE_NUM_PHASES;
+    double* x = (double*) malloc(num_sizes * sizeof(double));
+    int n = 0;
+    for (int i = 0; i < num_sizes; i++) {
+      double y = is_rss
+        ? (double) results[i].peak_rss - (double) empty.peak_rss
+        : (double) results[i].ns[ph];
+      if (is_rss ? y <= 1024 : y < SCALE_MIN_FIT_NS) continue;
+      x[n] = sizes[i];
+      values[n++] = y;
+    }
+
+    const char* name = is_rss ? "peak RSS" : scale_phase_names[ph];
+    if (n < 3) {
+      printf("  %-14s too fast to tell\n", name);
+    } else {
+      double k = scale_fit_exponent(x, values, n);
+      bool bad = k > max_exponent;
+      super_linear |= bad;
+      printf("  %-14s n^%.2f%s\n", name, k, bad ? "  SUPER-LINEAR" : "");
+    }
+    free(x);
+  }
+
+  return super_linear ? 1 : 0;
+}
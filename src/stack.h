@@ -0,0 +1,166 @@
+#ifndef __STACK_H__
+#define __STACK_H__
+
+// Guest stacks.
+//
+// A stack is a region with an inaccessible page on each side:
+//
+//   [ guard ][ slot 0, slot 1 ... slot n-1 ][ guard ]
+//
+// The slots end exactly where the upper guard starts, so pushing one entry
+// too many or popping from an empty stack touches a guard page and faults.
+// That means push/pop/call/ret don't need to check the bounds themselves,
+// program_run catches the fault (see guest_stack_trap) and turns it into the
+// usual "stack overflow"/"stack underflow" errors.
+//
+// On windows we don't handle the fault, so the bounds are still checked
+// explicitly (GUEST_STACK_GUARD_PAGES is 0).
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vmem.h"
+
+#ifdef INC_WINDOWS
+  #define GUEST_STACK_GUARD_PAGES 0
+#else
+  #define GUEST_STACK_GUARD_PAGES 1
+  #include <signal.h>
+  #include <setjmp.h>
+#endif
+
+#define GUEST_STACK_DEFAULT_ENTRIES (1024 * 1024)
+
+typedef struct guest_stack {
+  char* region; // including the guard pages
+  size_t region_size;
+
+  void* base;   // first slot
+  void* limit;  // one past the last slot
+} guest_stack;
+
+typedef enum guest_stack_fault {
+  GUEST_STACK_NO_FAULT,
+  GUEST_STACK_OVERFLOW,
+  GUEST_STACK_UNDERFLOW
+} guest_stack_fault;
+
+// The stack holds at least 'num_entries' entries of 'entry_size' bytes.
+bool guest_stack_init(guest_stack* s, size_t num_entries, size_t entry_size) {
+  size_t guard = vmem_page_size();
+  size_t size = vmem_round_to_page(num_entries * entry_size);
+  if (size == 0) size = guard;
+
+  // The slots have to end right before the upper guard, so
+  // the first slot may not be at the start of its page.
+  size_t used = (size / entry_size) * entry_size;
+
+  s->region_size = size + 2 * guard;
+  s->region = (char*) vmem_alloc(s->region_size);
+  if (s->region == NULL) return false;
+
+  if (!vmem_protect_none(s->region, guard) ||
+      !vmem_protect_none(s->region + guard + size, guard)) {
+    vmem_free(s->region, s->region_size);
+    s->region = NULL;
+    return false;
+  }
+
+  s->limit = s->region + guard + size;
+  s->base = (char*) s->limit - used;
+  return true;
+}
+
+void guest_stack_destroy(guest_stack* s) {
+  vmem_free(s->region, s->region_size);
+  s->region = NULL;
+}
+
+static guest_stack_fault guest_stack_classify_fault(guest_stack* s, void* addr) {
+  char* a = (char*) addr;
+  size_t guard = vmem_page_size();
+  if (s->region == NULL) return GUEST_STACK_NO_FAULT;
+  if (a >= s->region && a < s->region + guard) {
+    return GUEST_STACK_UNDERFLOW;
+  }
+  if (a >= s->region + s->region_size - guard && a < s->region + s->region_size) {
+    return GUEST_STACK_OVERFLOW;
+  }
+  return GUEST_STACK_NO_FAULT;
+}
+
+#if GUEST_STACK_GUARD_PAGES
+
+#define GUEST_STACK_TRAP_MAX_STACKS 2
+
+// Catches faults on the guard pages of the given stacks.
+// Usage:
+//
+//   guest_stack_trap trap = { .stacks = {&s0, &s1}, .num_stacks = 2 };
+//   if (sigsetjmp(trap.jmp, 1) == 0) {
+//     guest_stack_trap_begin(&trap);
+//     ... code that may fault ...
+//   } else {
+//     // trap.fault_stack and trap.fault tell what happened
+//   }
+//   guest_stack_trap_end(&trap);
+//
+// Any other fault is left alone (the process crashes as usual).
+typedef struct guest_stack_trap {
+  guest_stack* stacks[GUEST_STACK_TRAP_MAX_STACKS];
+  int num_stacks;
+  sigjmp_buf jmp;
+
+  // Set when a fault is caught
+  int fault_stack; // index in 'stacks'
+  guest_stack_fault fault;
+
+  struct sigaction old_segv;
+  struct sigaction old_bus;
+} guest_stack_trap;
+
+static guest_stack_trap* volatile active_stack_trap = NULL;
+
+static void guest_stack_fault_handler(int sig, siginfo_t* info, void* ucontext) {
+  (void) ucontext;
+  guest_stack_trap* trap = active_stack_trap;
+
+  if (trap != NULL) {
+    for (int i = 0; i < trap->num_stacks; i++) {
+      guest_stack_fault fault = guest_stack_classify_fault(trap->stacks[i], info->si_addr);
+      if (fault != GUEST_STACK_NO_FAULT) {
+        trap->fault_stack = i;
+        trap->fault = fault;
+        siglongjmp(trap->jmp, 1);
+      }
+    }
+  }
+
+  // Not ours. Restore the default action and let the instruction fault again.
+  signal(sig, SIG_DFL);
+}
+
+void guest_stack_trap_begin(guest_stack_trap* trap) {
+  trap->fault = GUEST_STACK_NO_FAULT;
+  trap->fault_stack = -1;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = guest_stack_fault_handler;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+
+  active_stack_trap = trap;
+  sigaction(SIGSEGV, &sa, &trap->old_segv);
+  sigaction(SIGBUS, &sa, &trap->old_bus);
+}
+
+void guest_stack_trap_end(guest_stack_trap* trap) {
+  sigaction(SIGSEGV, &trap->old_segv, NULL);
+  sigaction(SIGBUS, &trap->old_bus, NULL);
+  active_stack_trap = NULL;
+}
+
+#endif // GUEST_STACK_GUARD_PAGES
+
+#endif // __STACK_H__
@@ -6,6 +6,10 @@
 #include "lexer.h"
 #include "parser.h"
 #include "interp.h"
+#include "cfg.h"
+#include "sample.h"
+#include "genc.c"
+#include "aot.c"
 
 // TODO: free memory?
 // TODO: add more error tests
@@ -243,6 +247,20 @@ DEF_TEST(lexer_int_token)
 
 END_TEST
 
+DEF_TEST(lexer_int_limits)
+  lexer l;
+  lexer_init(&l, "+7 9223372036854775807 -9223372036854775808 99999999999999999999 -99999999999999999999");
+  const int64_t expected[] = { 7, INT64_MAX, INT64_MIN, INT64_MAX, INT64_MIN };
+
+  for (int i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+    token* t = lexer_next_token(&l);
+    ASSERT_NOT_NULL(t);
+    ASSERT_EQI(t->type, TT_INT);
+    ASSERT(t->i == expected[i]);
+  }
+  ASSERT_EQI(l.offset, 86);
+END_TEST
+
 DEF_TEST(lexer_str_token)
   lexer l;
   lexer_init(&l, "'(5+1)/2 = ' '' 'foo'");
@@ -640,6 +658,8 @@ DEF_TEST(interp_errors)
     "jne",
     "ret 123",
     "cmp",
+    "enter c, a",
+    "foo:\n  end\nbar:\n  end\nbaz:\n  end\nbar:\n  end\nfoo:\n  end\n",
   };
   const char* test_errors[] = {
     "opcode 'mov' requires a 'register' or a 'memory address' as its first operand, but got a 'integer'",
@@ -648,13 +668,15 @@ DEF_TEST(interp_errors)
     "invalid register",
     "opcode 'cmp' requires a 'register' or a 'integer' as its first operand, but got a 'string'",
     "opcode 'jne' requires a 'label' as its first operand, but got a 'integer'",
-    "opcode 'sub' requires a 'register' or a 'integer' as its second operand, but got a 'string'",
+    "opcode 'sub' requires a 'register', a 'integer' or a 'memory address' as its second operand, but got a 'string'",
     "incorrect number of operands for opcode 'mov'. Required: 2, got: 0",
     "incorrect number of operands for opcode 'mov'. Required: 2, got: 1",
     "incorrect number of operands for opcode 'inc'. Required: 1, got: 4",
     "incorrect number of operands for opcode 'jne'. Required: 1, got: 0",
     "incorrect number of operands for opcode 'ret'. Required: 0, got: 1",
     "incorrect number of operands for opcode 'cmp'. Required: 2, got: 0",
+    "invalid register range for opcode 'enter', 'a' comes before 'c'",
+    "duplicated label 'bar'.",
   };
   ASSERT_EQI(ARR_LEN(test_codes), ARR_LEN(test_errors));
 
@@ -750,6 +772,1200 @@ DEF_TEST(interp_run)
   }
 END_TEST
 
+DEF_TEST(interp_heap)
+  program p;
+  program_init_and_build(&p,
+    "mov a, 16\n"
+    "malloc a, b\n"
+    "mov [b], 40\n"
+    "mov 8[b], 2\n"
+    "mov c, [b]\n"
+    "add c, 8[b]\n"
+    "mfree b\n"
+    "malloc a, d\n"   // same size class, should reuse b
+    "cmp c, 42\n"
+    "jne fail\n"
+    "cmp d, b\n"
+    "jne fail\n"
+    "msg 'ok'\n"
+    "end\n"
+    "fail:\n"
+    "  msg 'fail'\n"
+  );
+  program_check(&p);
+  ASSERT_EQS(program_run(&p), "ok");
+END_TEST
+
+DEF_TEST(interp_heap_errors)
+  const char* test_codes[] = {
+    "mov a, 0\n mov [a], 1",
+    "mov b, -8\n mov a, 8[b]",
+    "mov a, 100\n mfree a",
+    "mov a, 8\n malloc a, b\n mfree b\n mfree b",
+  };
+  const char* test_errors[] = {
+    "invalid memory access while executing this instruction",
+    "invalid memory access while executing this instruction",
+    "invalid address (100) passed to mfree",
+    "invalid address (4112) passed to mfree",
+  };
+  ASSERT_EQI(ARR_LEN(test_codes), ARR_LEN(test_errors));
+
+  for (int i = 0; i < ARR_LEN(test_codes); i++) {
+    src_pos out_pos;
+    char* out_msg = NULL;
+
+    void** data = malloc(sizeof(void*) * 2);
+    data[0] = &out_msg;
+    data[1] = &out_pos;
+
+    error_handler x = {
+      .handler_fn = test_error_handler,
+      .handler_data = data
+    };
+
+    program p;
+    program_init_and_build(&p, test_codes[i]);
+    p.error_handler = &x;
+    program_check(&p);
+    ASSERT_NULL(out_msg);
+
+    program_run(&p);
+    ASSERT_NOT_NULL(out_msg);
+    ASSERT_EQS(out_msg, (char*) test_errors[i]);
+    ASSERT_EQI(out_pos.line_number, 2 + (i == 3) * 2);
+    free(data);
+  }
+END_TEST
+
+DEF_TEST(interp_stack_errors)
+  const char* test_codes[] = {
+    "loop:\n push a\n jmp loop",
+    "mov a, 1\n pop a",
+    "f:\n call f",
+    "mov a, 1\n ret",
+    "mov a, 1\n leave a, b",
+  };
+  const char* test_errors[] = {
+    "stack overflow",
+    "stack underflow",
+    "callstack overflow",
+    "callstack underflow",
+    "stack underflow",
+  };
+  ASSERT_EQI(ARR_LEN(test_codes), ARR_LEN(test_errors));
+
+  for (int i = 0; i < ARR_LEN(test_codes); i++) {
+    src_pos out_pos;
+    char* out_msg = NULL;
+
+    void** data = malloc(sizeof(void*) * 2);
+    data[0] = &out_msg;
+    data[1] = &out_pos;
+
+    error_handler x = {
+      .handler_fn = test_error_handler,
+      .handler_data = data
+    };
+
+    program p;
+    program_init_and_build(&p, test_codes[i]);
+    p.error_handler = &x;
+    p.options.stack_size = 10;
+    program_check(&p);
+    program_run(&p);
+
+    ASSERT_NOT_NULL(out_msg);
+    ASSERT_EQS(out_msg, (char*) test_errors[i]);
+    ASSERT_EQI(out_pos.line_number, 2);
+    free(data);
+  }
+END_TEST
+
+DEF_TEST(interp_deep_recursion)
+  program p;
+  program_init_and_build(&p,
+    "mov a, 200000\n"
+    "call down\n"
+    "msg 'ok'\n"
+    "end\n"
+    "down:\n"
+    "  push a\n"
+    "  dec a\n"
+    "  cmp a, 0\n"
+    "  je down_end\n"
+    "  call down\n"
+    "down_end:\n"
+    "  pop a\n"
+    "  ret\n"
+  );
+  program_check(&p);
+  ASSERT_EQS(program_run(&p), "ok");
+END_TEST
+
+DEF_TEST(interp_enter_leave)
+  program p;
+  program_init_and_build(&p,
+    "mov a, 1\n"
+    "mov b, 2\n"
+    "mov c, 3\n"
+    "call f\n"
+    "cmp a, 1\n jne fail\n"
+    "cmp b, 2\n jne fail\n"
+    "cmp c, 3\n jne fail\n"
+    "cmp d, 4\n jne fail\n"
+    "msg 'ok'\n"
+    "end\n"
+    "fail:\n"
+    "  msg 'fail'\n"
+    "  end\n"
+    "f:\n"
+    "  enter a, c\n"
+    "  mov a, 10\n"
+    "  mov b, 20\n"
+    "  call g\n"
+    "  push a\n"        // dropped by leave
+    "  push b\n"
+    "  leave a, c\n"
+    "  ret\n"
+    "g:\n"
+    "  enter b, c\n"
+    "  mov c, 30\n"
+    "  mov d, 4\n"
+    "  leave b, c\n"
+    "  ret\n"
+  );
+  program_check(&p);
+  ASSERT_EQS(program_run(&p), "ok");
+END_TEST
+
+DEF_TEST(interp_msg)
+  ASSERT_EQS(interp("msg 'a\\tb\\nc\\\\n\\q'"), "a\tb\nc\\n\\q");
+  ASSERT_EQS(interp("mov a, -9223372036854775807\n dec a\n msg a, ' ', 0, ' ', 1234567"),
+             "-9223372036854775808 0 1234567");
+
+  // Used to overflow a fixed 1000 bytes buffer
+  static char code[8192];
+  static char expected[8192];
+  char* code_ptr = code + sprintf(code, "msg 0");
+  char* expected_ptr = expected + sprintf(expected, "0");
+  for (int i = 0; i < 500; i++) {
+    code_ptr += sprintf(code_ptr, ", 'ab', %d", i);
+    expected_ptr += sprintf(expected_ptr, "ab%d", i);
+  }
+  // Too long for ASSERT_EQS to print
+  ASSERT(strcmp(interp(code), expected) == 0);
+END_TEST
+
+DEF_TEST(interp_string_pool)
+  program p;
+  program_init_and_build(&p,
+    "print 'a\\n', 1, 'b'\n"
+    "msg 'b', 'a\\n', ''\n"
+  );
+  program_check(&p);
+
+  ASSERT_EQI(p.num_strings, 3);
+  ASSERT_EQS(p.strings[0].data, "a\n");
+  ASSERT_EQI(p.strings[0].len, 2);
+  ASSERT_EQI(p.strings[2].len, 0);
+
+  instruction* in = p.instructions;
+  ASSERT_EQI(in[0].operands[0].extra, 0);
+  ASSERT_EQI(in[0].operands[2].extra, 1);
+  ASSERT_EQI(in[1].operands[0].extra, 1);
+  ASSERT_EQI(in[1].operands[1].extra, 0);
+  ASSERT_EQI(in[1].operands[2].extra, 2);
+END_TEST
+
+// Compiles the output of gen_c with the system compiler and checks that
+// it computes the same msg as the interpreter.
+DEF_TEST(interp_gen_c)
+#ifndef INC_WINDOWS
+  program p;
+  program_init_and_build(&p,
+    "  mov a, 24\n"
+    "  malloc a, b\n"
+    "  mov [b], 10\n"
+    "  mov 8[b], 0\n"
+    "loop:\n"
+    "  mov c, [b]\n"
+    "  call fact\n"
+    "  add 8[b], c\n"
+    "  sub [b], 1\n"
+    "  mov c, [b]\n"
+    "  cmp c, 0\n"
+    "  jg loop\n"
+    "  mov d, 8[b]\n"
+    "  mfree b\n"
+    "  mov e, -9223372036854775807\n"
+    "  sub e, 1\n"
+    "  mov f, -1\n"
+    "  div e, f\n"
+    "  push d\n"
+    "  pop g\n"
+    "  msg 'sum=', g, ' e=', e, ' \\'\n"
+    "  end\n"
+    "fact:\n"
+    "  enter d, e\n"
+    "  mov d, c\n"
+    "  mov c, 1\n"
+    "fact_loop:\n"
+    "  mul c, d\n"
+    "  dec d\n"
+    "  cmp d, 1\n"
+    "  jg fact_loop\n"
+    "  leave d, e\n"
+    "  ret\n"
+  );
+  program_check(&p);
+  char* expected = program_run(&p);
+  ASSERT_EQS(expected, "sum=4037913 e=-9223372036854775808 \\");
+
+  char dir[] = "/tmp/genc_test_XXXXXX";
+  ASSERT_NOT_NULL(mkdtemp(dir));
+  char cmd[256];
+
+  snprintf(cmd, sizeof(cmd), "%s/prog.c", dir);
+  FILE* out = fopen(cmd, "w");
+  ASSERT_NOT_NULL(out);
+  gen_c(&p, out);
+  fclose(out);
+
+  snprintf(cmd, sizeof(cmd), "cc -Wall -Wextra -Werror -o %s/prog %s/prog.c", dir, dir);
+  ASSERT_EQI(system(cmd), 0);
+
+  snprintf(cmd, sizeof(cmd), "%s/prog", dir);
+  FILE* prog_out = popen(cmd, "r");
+  ASSERT_NOT_NULL(prog_out);
+  char result[256] = {0};
+  fread(result, 1, sizeof(result) - 1, prog_out);
+  ASSERT_EQI(pclose(prog_out), 0);
+
+  char expected_result[256];
+  snprintf(expected_result, sizeof(expected_result), "Result: '%s'\n", expected);
+  ASSERT_EQS(result, expected_result);
+
+  snprintf(cmd, sizeof(cmd), "rm -r %s", dir);
+  system(cmd);
+#endif
+END_TEST
+
+DEF_TEST(interp_aot)
+#ifndef INC_WINDOWS
+  char dir[] = "/tmp/aot_test_XXXXXX";
+  ASSERT_NOT_NULL(mkdtemp(dir));
+  setenv("INTERP_AOT_CACHE", dir, 1);
+
+  program p;
+  program_init_and_build(&p,
+    "  mov a, 0\n"
+    "  mov b, 100000\n"
+    "loop:\n"
+    "  add a, b\n"
+    "  dec b\n"
+    "  cmp b, 0\n"
+    "  jg loop\n"
+    "  msg 'sum=', a\n"
+  );
+  program_check(&p);
+
+  // Compiled on the first run, loaded from the cache on the second one
+  ASSERT_EQS(program_run_aot(&p), "sum=5000050000");
+  ASSERT_EQS(program_run_aot(&p), "sum=5000050000");
+
+  char cmd[256];
+  snprintf(cmd, sizeof(cmd), "test $(ls %s/*.so | wc -l) -eq 1", dir);
+  ASSERT_EQI(system(cmd), 0);
+
+  // A ret only goes after a call (or to the end), in both and at any level
+  for (int run = 0; run < 4; run++) {
+    src_pos out_pos;
+    char* out_msg = NULL;
+    void* data[] = { &out_msg, &out_pos };
+    error_handler x = {
+      .handler_fn = test_error_handler,
+      .handler_data = data
+    };
+    program_init_and_build(&p,
+      "  mov a, 4\n"
+      "  push a\n"
+      "  ret\n"
+      "  msg 'skipped'\n"
+      "  msg 'landed'\n"
+      "  end\n"
+    );
+    p.error_handler = &x;
+    program_check(&p);
+    if (run & 1) program_optimize(&p);
+    if (run & 2) program_run_aot(&p);
+    else program_run(&p);
+    ASSERT_NOT_NULL(out_msg);
+    ASSERT_EQS(out_msg, "invalid return address 4 (unbalanced push/pop?)");
+    ASSERT_EQI(out_pos.line_number, 3);
+  }
+
+  snprintf(cmd, sizeof(cmd), "rm -r %s", dir);
+  system(cmd);
+  unsetenv("INTERP_AOT_CACHE");
+#endif
+END_TEST
+
+DEF_TEST(interp_timing)
+  // Without timing_enable, so nothing is written at exit
+  timing.enabled = true;
+  timing_reset();
+  ASSERT_EQS(interp("mov a, 1\n msg a"), "1");
+  timing.enabled = false;
+
+  const char* phases[] = { "lex", "parse", "program_build", "program_check", "program_optimize", "program_run", "interp" };
+  ASSERT_EQI(timing.num_phases, ARR_LEN(phases));
+  for (int i = 0; i < ARR_LEN(phases); i++) {
+    ASSERT(strcmp(timing.phases[i].name, phases[i]) == 0);
+    ASSERT_EQI(timing.phases[i].count, 1);
+  }
+
+  char buf[1024];
+  FILE* out = fmemopen(buf, sizeof(buf), "w");
+  timing_write(out, TIMING_CSV, "a \"b\"", true);
+  fclose(out);
+  const char* expected = "label,phase,ns,count\n\"a \"\"b\"\"\",lex,";
+  ASSERT(strncmp(buf, expected, strlen(expected)) == 0);
+  timing_reset();
+END_TEST
+
+DEF_TEST(interp_timing_counters)
+  // As if only the cycles counter could be opened
+  perfctr_state saved = perfctr;
+  perfctr.fds[PERFCTR_CYCLES] = 0;
+  timing.counters = true;
+
+  perfctr_values values = { { 0 } };
+  values.v[PERFCTR_CYCLES] = 1000;
+  values.v[PERFCTR_INSTRUCTIONS] = 3000;
+  timing_add("run", 10, &values);
+  timing_add("run", 10, &values);
+
+  char buf[1024];
+  FILE* out = fmemopen(buf, sizeof(buf), "w");
+  timing_write(out, TIMING_JSON, "x", true);
+  timing_write(out, TIMING_CSV, "x", true);
+  fclose(out);
+  ASSERT(strcmp(buf,
+    "{\"label\":\"x\",\"phases\":[{\"name\":\"run\",\"ns\":20,\"count\":2,\"cycles\":2000}]}\n"
+    "label,phase,ns,count,cycles,instructions,branches,branch_misses,cache_references,cache_misses,page_faults\n"
+    "\"x\",run,20,2,2000,,,,,,\n") == 0);
+
+  timing.counters = false;
+  perfctr = saved;
+  timing_reset();
+END_TEST
+
+DEF_TEST(interp_profile)
+  program p;
+  program_init_and_build(&p,
+    "  mov a, 3\n"
+    "loop:\n"
+    "  dec a\n"
+    "  cmp a, 0\n"
+    "  jne loop\n"
+    "  msg a\n"
+  );
+  p.options.profile = PROFILE_CYCLES;
+  program_check(&p);
+  ASSERT_EQS(program_run(&p), "0");
+
+  ASSERT_NOT_NULL(p.profile);
+  ASSERT_NOT_NULL(p.profile->cycles);
+  const uint64_t expected[] = { 1, 3, 3, 3, 1 };
+  for (int i = 0; i < ARR_LEN(expected); i++) {
+    ASSERT_EQI(p.profile->counts[i], expected[i]);
+  }
+
+  // Added up over runs
+  program_run(&p);
+  ASSERT_EQI(p.profile->counts[1], 6);
+END_TEST
+
+DEF_TEST(interp_profile_calls)
+  program p;
+  program_init_and_build(&p,
+    "  call f\n"       // 0
+    "  end\n"          // 1
+    "f:\n"
+    "  call g\n"       // 2
+    "  call g\n"       // 3
+    "  ret\n"          // 4
+    "g:\n"
+    "  inc a\n"        // 5
+    "  ret\n"          // 6
+  );
+  p.options.profile = PROFILE_COUNTS;
+  program_check(&p);
+  program_run(&p);
+
+  profile_data* prof = p.profile;
+  ASSERT_EQI(prof->executed, 9);
+  ASSERT_EQI(prof->num_frames, 0);
+
+  profile_proc* top = &prof->procs[0];
+  profile_proc* f = &prof->procs[2 + 1];
+  profile_proc* g = &prof->procs[5 + 1];
+  ASSERT_EQI(top->calls, 1);
+  ASSERT_EQI(top->incl_insns, 9);
+  ASSERT_EQI(top->excl_insns, 2);
+  ASSERT_EQI(f->calls, 1);
+  ASSERT_EQI(f->incl_insns, 7);
+  ASSERT_EQI(f->excl_insns, 3);
+  ASSERT_EQI(g->calls, 2);
+  ASSERT_EQI(g->incl_insns, 4);
+  ASSERT_EQI(g->excl_insns, 4);
+
+  ASSERT_EQI(prof->num_edges, 2);
+  for (int i = 0; i < prof->edges_cap; i++) {
+    profile_edge* e = &prof->edges[i];
+    if (e->calls == 0) continue;
+    if (e->caller == 0) {
+      ASSERT(e->callee == 3 && e->calls == 1);
+    } else {
+      ASSERT(e->caller == 3 && e->callee == 6 && e->calls == 2);
+    }
+  }
+END_TEST
+
+DEF_TEST(interp_profile_recursive)
+  program p;
+  program_init_and_build(&p,
+    "  mov a, 3\n"     // 0
+    "  call r\n"       // 1
+    "  end\n"          // 2
+    "r:\n"
+    "  dec a\n"        // 3
+    "  cmp a, 0\n"     // 4
+    "  jle done\n"     // 5
+    "  call r\n"       // 6
+    "done:\n"
+    "  ret\n"          // 7
+  );
+  p.options.profile = PROFILE_COUNTS;
+  program_check(&p);
+  program_run(&p);
+
+  // The outer call covers the inner ones, they aren't counted again
+  profile_proc* r = &p.profile->procs[3 + 1];
+  ASSERT_EQI(r->calls, 3);
+  ASSERT_EQI(r->incl_insns, 14);
+  ASSERT_EQI(r->excl_insns, 14);
+  ASSERT_EQI(p.profile->procs[0].incl_insns, 17);
+END_TEST
+
+DEF_TEST(interp_sample_folded)
+  program p;
+  program_init_and_build(&p,
+    "  call f\n"       // 0
+    "  end\n"          // 1
+    "f:\n"
+    "  call g\n"       // 2
+    "  ret\n"          // 3
+    "g:\n"
+    "  inc a\n"        // 4
+    "inner:\n"
+    "  ret\n"          // 5
+  );
+  program_check(&p);
+
+  // [pc, depth, calls...] as the SIGPROF handler writes them
+  uint32_t words[] = {
+    4, 2, 2, 4,
+    5, 2, 2, 4,
+    4, 2, 2, 4,
+    3, 1, 2,
+    1, 0,
+  };
+  samples.words = words;
+  samples.len = ARR_LEN(words);
+  samples.num_samples = 5;
+
+  char buf[512];
+  FILE* out = fmemopen(buf, sizeof(buf), "w");
+  sample_write_folded(&p, out);
+  fclose(out);
+  ASSERT_EQS(buf,
+    "main 1\n"
+    "main;f 1\n"
+    "main;f;g 2\n"
+    "main;f;g;inner 1\n");
+
+  memset(&samples, 0, sizeof(samples));
+END_TEST
+
+DEF_TEST(interp_trace)
+  program p;
+  program_init_and_build(&p,
+    "  mov a, 5\n"     // 0
+    "loop:\n"
+    "  dec a\n"        // 1
+    "  cmp a, 0\n"     // 2
+    "  jg loop\n"      // 3
+    "  end\n"          // 4
+  );
+  char path[] = "/tmp/interp_traceXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(fd >= 0);
+  close(fd);
+  p.options.opt_level = 0;
+  p.options.trace = path;
+  p.options.trace_records = 6; // 8, 17 instructions go around it twice
+  program_check(&p);
+  program_run(&p);
+  program_trace_close();
+
+  trace_ring ring;
+  ASSERT(trace_open(&ring, path) == NULL);
+  ASSERT_EQI((int) ring.header->capacity, 8);
+  ASSERT_EQI((int) ring.header->head, 17);
+  ASSERT(ring.header->program_hash == program_code_hash(&p));
+
+  trace_record records[8];
+  uint64_t first;
+  ASSERT_EQI((int) trace_read(&ring, records, 0, &first), 8);
+  ASSERT_EQI((int) first, 9);
+  // #9 is the jg of the 3rd time around, then a goes 2 -> 1
+  int pcs[] = { 1, 2, 3, 1, 2, 3, 4 };
+  for (int i = 0; i < 7; i++) ASSERT_EQI((int) records[i + 1].pc, pcs[i]);
+  ASSERT_EQI((int) records[0].opcode, OPCODE_JG);
+  ASSERT_EQI((int) records[1].reg, 0);
+  ASSERT_EQI((int) records[1].value, 1);
+  ASSERT_EQI((int) records[2].reg, TRACE_REG_CMP);
+  ASSERT(records[2].value > 0);
+  ASSERT_EQI((int) records[4].value, 0);
+  ASSERT_EQI((int) records[7].opcode, OPCODE_END);
+  ASSERT_EQI((int) records[7].reg, TRACE_REG_NONE);
+
+  ASSERT_EQI((int) trace_read(&ring, records, 2, &first), 2);
+  ASSERT_EQI((int) first, 15);
+  trace_close(&ring);
+  unlink(path);
+END_TEST
+
+DEF_TEST(interp_record_replay)
+  const char* code =
+    "  mov c, 0\n"
+    "  mov a, 16\n"
+    "loop:\n"
+    "  malloc a, b\n"
+    "  mov [b], c\n"
+    "  push b\n"
+    "  inc c\n"
+    "  cmp c, 10\n"
+    "  jl loop\n"
+    "sum:\n"
+    "  pop b\n"
+    "  add d, [b]\n"
+    "  mfree b\n"
+    "  dec c\n"
+    "  cmp c, 0\n"
+    "  jne sum\n"
+    "  msg 'sum ', d\n";
+  char path[] = "/tmp/interp_replayXXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(fd >= 0);
+  close(fd);
+
+  program p;
+  program_init_and_build(&p, code);
+  p.options.record = path;
+  p.options.checkpoint_every = 7;
+  program_check(&p);
+  ASSERT_EQS(program_run(&p), "sum 45");
+  ASSERT(!vm_replay_log.stopped);
+  uint64_t num_insns = vm_replay_log.num_insns;
+  ASSERT_EQI((int) vm_replay_log.num_events, 10);
+  ASSERT_EQI((int) vm_replay_log.num_checkpoints, (int) ((num_insns - 1) / 7));
+  program_replay_close();
+
+  // The whole run, and then from a checkpoint in the middle of each loop
+  uint64_t from[] = { 0, 3, 15 };
+  for (int i = 0; i < ARR_LEN(from); i++) {
+    program_init_and_build(&p, code);
+    p.options.replay = path;
+    p.options.replay_from = from[i];
+    program_check(&p);
+    ASSERT_EQS(program_run(&p), "sum 45");
+    ASSERT(!vm_replay_log.stopped);
+    ASSERT_EQI((int) vm_replay_log.num_insns, (int) (num_insns - from[i] * 7));
+    program_replay_close();
+  }
+
+  // A heap that allocates somewhere else shows in the malloc results
+  program_init_and_build(&p, code);
+  p.options.replay = path;
+  program_check(&p);
+  vm_state* vm = vm_create(&p);
+  vm_replay_begin(&p, vm);
+  vm->heap.top += 32;
+  vm_exec_replayed(&p, vm);
+  ASSERT(vm_replay_log.stopped);
+  ASSERT_EQI((int) vm_replay_log.num_events, 0);
+  free(vm_destroy(vm));
+  program_replay_close();
+  unlink(path);
+END_TEST
+
+DEF_TEST(cfg_blocks)
+  program p;
+  program_init_and_build(&p,
+    "  mov a, 3\n"      // B0
+    "loop:\n"
+    "  dec a\n"         // B1
+    "  cmp a, 0\n"
+    "  jg loop\n"
+    "  call f\n"        // B2
+    "  print a\n"       // B3
+    "  end\n"
+    "f:\n"
+    "  mov b, 1\n"      // B4
+    "  ret\n"
+  );
+  program_check(&p);
+
+  cfg g;
+  cfg_build(&g, &p);
+  ASSERT_EQI(g.num_blocks, 5);
+  ASSERT_EQI(g.blocks[1].start, 1);
+  ASSERT_EQI(g.blocks[1].end, 4);
+  ASSERT_EQI(g.block_of[3], 1);
+
+  // loop: back edge and fall through
+  ASSERT_EQI(g.blocks[1].num_succs, 2);
+  ASSERT_EQI(g.blocks[1].succs[0], 1);
+  ASSERT_EQI(g.blocks[1].succs[1], 2);
+  ASSERT_EQI(g.blocks[1].num_preds, 2);
+
+  // The call falls through to the return site, end and ret have no successors
+  ASSERT_EQI(g.blocks[2].num_succs, 1);
+  ASSERT_EQI(g.blocks[2].succs[0], 3);
+  ASSERT_EQI(g.blocks[2].callee_block, 4);
+  ASSERT_EQI(g.blocks[3].num_succs, 0);
+  ASSERT_EQI(g.blocks[4].num_succs, 0);
+  ASSERT_EQI(g.blocks[4].num_preds, 0);
+
+  ASSERT_EQI(g.num_procs, 2);
+  ASSERT_EQI(g.procs[0].num_callees, 1);
+  ASSERT_EQI(g.procs[0].callees[0], 1);
+  ASSERT_EQS((char*) g.procs[1].name, "f");
+  ASSERT_EQI(g.blocks[3].proc, 0);
+  ASSERT_EQI(g.blocks[4].proc, 1);
+  cfg_destroy(&g);
+END_TEST
+
+DEF_TEST(cfg_liveness)
+  program p;
+  program_init_and_build(&p,
+    "  mov a, 1\n"      // B0
+    "  mov b, 2\n"
+    "  mov c, 5\n"      // dead, overwritten before any read
+    "  call f\n"
+    "  mov c, 3\n"      // B1
+    "  add c, d\n"
+    "  print c\n"
+    "  end\n"
+    "f:\n"
+    "  mov d, a\n"      // B2
+    "  cmp b, 0\n"
+    "  je skip\n"
+    "  inc d\n"         // B3
+    "skip:\n"
+    "  ret\n"           // B4
+  );
+  program_check(&p);
+
+  cfg g;
+  cfg_build(&g, &p);
+  cfg_compute_liveness(&g);
+  ASSERT_EQI(g.num_blocks, 5);
+
+  #define REGS(str) ({ reg_set set = 0; for (const char* c = str; *c; c++) set |= 1u << (*c - 'a'); set; })
+  // Before the call: what f reads, and what's read after it since calls
+  // are not assumed to write anything
+  ASSERT_EQI(g.blocks[0].live_out, REGS("abd"));
+  ASSERT_EQI(g.blocks[0].live_in, REGS("d"));
+  ASSERT_EQI(g.blocks[1].live_in, REGS("d"));
+  ASSERT_EQI(g.blocks[2].live_in, REGS("ab"));
+  ASSERT_EQI(g.blocks[2].live_out, REGS("d"));
+  ASSERT_EQI(g.blocks[3].live_in, REGS("d"));
+  // ret goes back to B1
+  ASSERT_EQI(g.blocks[4].live_out, REGS("d"));
+  #undef REGS
+  cfg_destroy(&g);
+END_TEST
+
+void cfg_suite() {
+  SUITE_INIT(cfg)
+    ADD_TEST(cfg_blocks);
+    ADD_TEST(cfg_liveness);
+  SUITE_RUN
+}
+
+DEF_TEST(opt_fold_constants)
+  const char* code =
+    "  mov a, 6\n"
+    "  mul a, 7\n"      // mov a, 42
+    "  add b, a\n"      // mov b, 42 (registers start at zero)
+    "  inc b\n"         // mov b, 43
+    "  add c, 1\n"      // mov c, 1
+    "  cmp a, 42\n"
+    "  jne skip\n"      // never taken: nop
+    "  cmp b, 43\n"
+    "  je done\n"       // always taken: jmp
+    "skip:\n"
+    "  mov a, 1\n"
+    "done:\n"
+    "  add a, 0\n"      // nop
+    "  msg a, ' ', b\n"
+    "  end\n";
+
+  program p;
+  program_init_and_build(&p, code);
+  program_check(&p);
+  opt_fold_constants(&p);
+
+  instruction* in = p.instructions;
+  ASSERT_EQI(in[1].opcode, OPCODE_MOV);
+  ASSERT_EQI(in[1].operands[1].int_value, 42);
+  ASSERT_EQI(in[2].opcode, OPCODE_MOV);
+  ASSERT_EQI(in[2].operands[1].int_value, 42);
+  ASSERT_EQI(in[3].opcode, OPCODE_MOV);
+  ASSERT_EQI(in[3].num_operands, 2);
+  ASSERT_EQI(in[3].operands[1].int_value, 43);
+  ASSERT_EQI(in[4].opcode, OPCODE_MOV);
+  ASSERT_EQI(in[4].operands[1].int_value, 1);
+  ASSERT_EQI(in[6].opcode, OPCODE_NOP);
+  ASSERT_EQI(in[8].opcode, OPCODE_JMP);
+  // 'done' has two predecessors, nothing is known there
+  ASSERT_EQI(in[10].opcode, OPCODE_NOP);
+  ASSERT_EQI(in[11].operands[0].type, OPERAND_REG);
+
+  ASSERT_EQS(program_run(&p), "42 43");
+  ASSERT_EQS(interp((char*) code), "42 43");
+
+  // Blocks that are also called start with nothing known: not the zeros of
+  // the entry, not what their other predecessor had
+  const char* called_codes[] = {
+    "start:\n"
+    "  msg a\n"
+    "  inc a\n"
+    "  cmp a, 3\n"
+    "  jge done\n"
+    "  call start\n"
+    "done:\n"
+    "  end\n",
+
+    "  mov a, 1\n"
+    "f:\n"
+    "  msg a\n"
+    "  inc b\n"
+    "  cmp b, 2\n"
+    "  jge done\n"
+    "  mov a, 2\n"
+    "  call f\n"
+    "done:\n"
+    "  end\n",
+  };
+  const char* called_results[] = { "2", "2" };
+  for (int i = 0; i < ARR_LEN(called_codes); i++) {
+    // -O0, -O1 and -O1 --no-inline
+    for (int level = 0; level < 3; level++) {
+      program_init_and_build(&p, called_codes[i]);
+      p.options.opt_level = level > 0;
+      p.options.inline_calls = level == 1;
+      // Folded wrong they would recurse until the stack runs out
+      p.options.stack_size = 100;
+      program_check(&p);
+      if (p.options.opt_level > 0) program_optimize(&p);
+      ASSERT_EQS(program_run(&p), (char*) called_results[i]);
+    }
+  }
+END_TEST
+
+DEF_TEST(opt_keeps_errors)
+  const char* test_codes[] = {
+    "mov a, 5\n div a, 0",
+    "mov a, 5\n mov b, 0\n div a, b",
+    "mov a, 1\n sub a, 1\n div b, a\n jmp x\n x: mov a, 2\n div a, b",
+  };
+  const int test_lines[] = { 2, 3, 3 };
+  ASSERT_EQI(ARR_LEN(test_codes), ARR_LEN(test_lines));
+
+  for (int i = 0; i < ARR_LEN(test_codes); i++) {
+    src_pos out_pos;
+    char* out_msg = NULL;
+
+    void** data = malloc(sizeof(void*) * 2);
+    data[0] = &out_msg;
+    data[1] = &out_pos;
+
+    error_handler x = {
+      .handler_fn = test_error_handler,
+      .handler_data = data
+    };
+
+    program p;
+    program_init_and_build(&p, test_codes[i]);
+    p.error_handler = &x;
+    program_check(&p);
+    program_optimize(&p);
+    program_run(&p);
+
+    ASSERT_NOT_NULL(out_msg);
+    ASSERT_EQS(out_msg, "division by zero occurred while executing this instruction");
+    ASSERT_EQI(out_pos.line_number, test_lines[i]);
+    free(data);
+  }
+END_TEST
+
+DEF_TEST(opt_dead_code)
+  const char* code =
+    "  mov a, [b]\n"    // may fail, kept
+    "  mov c, 1\n"      // overwritten before being read
+    "  jmp start\n"
+    "  print 'unreachable'\n"
+    "unused:\n"
+    "  end\n"
+    "start:\n"
+    "  mov c, 2\n"
+    "  call f\n"
+    "  jmp done\n"      // to the next instruction
+    "done:\n"
+    "  end\n"
+    "f:\n"
+    "  mul c, d\n"
+    "  msg c\n"
+    "  ret\n";
+
+  program p;
+  program_init_and_build(&p, code);
+  program_check(&p);
+  opt_remove_dead_code(&p);
+
+  const opcode expected[] = {
+    OPCODE_MOV, OPCODE_MOV, OPCODE_CALL, OPCODE_END, OPCODE_MUL, OPCODE_MSG, OPCODE_RET
+  };
+  const int expected_origin[] = { 0, 5, 6, 8, 9, 10, 11, 12 };
+  ASSERT_EQI(p.num_instructions, ARR_LEN(expected));
+  for (int i = 0; i < ARR_LEN(expected); i++) {
+    ASSERT_EQI(p.instructions[i].opcode, expected[i]);
+  }
+  for (int i = 0; i <= p.num_instructions; i++) {
+    ASSERT_EQI(program_insn_origin(&p, i), expected_origin[i]);
+  }
+  ASSERT_EQI(p.instructions[1].operands[1].int_value, 2);
+  ASSERT_EQI(p.instructions[2].operands[0].branch_index, 4);
+
+  // Only the called label is left
+  ASSERT_EQI(p.num_resolved_labels, 1);
+  ASSERT_EQS(p.resolved_labels[0].name, "f");
+  ASSERT_EQI(p.resolved_labels[0].instruction_index, 4);
+END_TEST
+
+DEF_TEST(opt_inline_calls)
+  const char* code =
+    "  mov a, 3\n"
+    "  call double\n"   // inlined
+    "  call double\n"   // inlined
+    "  call rec\n"      // recursive
+    "  call swap\n"     // pops what the caller pushed
+    "  msg a, ' ', b\n"
+    "  end\n"
+    "double:\n"
+    "  cmp a, 100\n"
+    "  jg double_end\n"
+    "  add a, a\n"
+    "double_end:\n"
+    "  ret\n"
+    "rec:\n"
+    "  dec a\n"
+    "  cmp a, 10\n"
+    "  jle rec_end\n"
+    "  call rec\n"
+    "rec_end:\n"
+    "  ret\n"
+    "swap:\n"
+    "  pop c\n"
+    "  push c\n"
+    "  mov b, 1\n"
+    "  ret\n";
+
+  for (int inline_calls = 0; inline_calls <= 1; inline_calls++) {
+    program p;
+    program_init_and_build(&p, code);
+    program_check(&p);
+    p.options.inline_calls = inline_calls;
+    program_optimize(&p);
+
+    int num_calls = 0;
+    for (int i = 0; i < p.num_instructions; i++) {
+      num_calls += p.instructions[i].opcode == OPCODE_CALL;
+    }
+    // The recursive call in 'rec' is a tail call
+    int expected_calls = inline_calls ? 2 : 4;
+    ASSERT_EQI(num_calls, expected_calls);
+    ASSERT_EQS(program_run(&p), "10 1");
+  }
+END_TEST
+
+DEF_TEST(opt_tail_calls)
+  const char* code =
+    "  mov a, 100000\n"
+    "  call count\n"
+    "  msg a\n"
+    "  end\n"
+    "count:\n"
+    "  dec a\n"
+    "  cmp a, 0\n"
+    "  je count_end\n"
+    "  call count\n"   // ret behind a jmp
+    "  jmp count_end\n"
+    "count_end:\n"
+    "  ret\n";
+
+  program p;
+  program_init_and_build(&p, code);
+  program_check(&p);
+  p.options.stack_size = 10;
+  program_optimize(&p);
+  ASSERT_EQS(program_run(&p), "0");
+
+  // As written (-O0) it runs out of stack
+  src_pos out_pos;
+  char* out_msg = NULL;
+  void* data[] = { &out_msg, &out_pos };
+  error_handler x = {
+    .handler_fn = test_error_handler,
+    .handler_data = data
+  };
+  program_init_and_build(&p, code);
+  p.error_handler = &x;
+  p.options.stack_size = 10;
+  program_check(&p);
+  program_run(&p);
+  ASSERT_NOT_NULL(out_msg);
+  ASSERT_EQS(out_msg, "callstack overflow");
+  ASSERT_EQI(out_pos.line_number, 9);
+
+  // g pops f's push and its own return address, it would see f's return
+  // address in its place: not a tail call
+  const char* unbalanced_code =
+    "  mov a, 1\n"
+    "  mov b, 6\n"
+    "  call f\n"
+    "  msg 'a=', a, ' b=', b\n"
+    "  end\n"
+    "f:\n"
+    "  push a\n"
+    "  call g\n"
+    "  ret\n"
+    "g:\n"
+    "  pop b\n"
+    "  pop c\n"
+    "  push b\n"
+    "  inc a\n"
+    "  ret\n";
+  for (int inline_calls = 0; inline_calls <= 1; inline_calls++) {
+    program_init_and_build(&p, unbalanced_code);
+    program_check(&p);
+    ASSERT_EQS(program_run(&p), "a=2 b=7");
+
+    program_init_and_build(&p, unbalanced_code);
+    program_check(&p);
+    p.options.inline_calls = inline_calls;
+    program_optimize(&p);
+    int num_calls = 0;
+    for (int i = 0; i < p.num_instructions; i++) num_calls += p.instructions[i].opcode == OPCODE_CALL;
+    ASSERT_EQI(num_calls, 2);
+    ASSERT_EQS(program_run(&p), "a=2 b=7");
+  }
+END_TEST
+
+DEF_TEST(opt_loops)
+  const char* code =
+    "  mov a, 5\n"
+    "  mov s, 0\n"
+    "loop:\n"
+    "  mov k, 3\n"      // invariant
+    "  mov t, a\n"      // t = a * 7, every iteration
+    "  mul t, 7\n"
+    "  add s, t\n"
+    "  add s, k\n"
+    "  dec a\n"
+    "  cmp a, 0\n"
+    "  jne loop\n"
+    "  msg s\n"
+    "  end\n";
+
+  program p;
+  program_init_and_build(&p, code);
+  program_check(&p);
+
+  cfg g;
+  cfg_build(&g, &p);
+  cfg_find_loops(&g);
+  ASSERT_EQI(g.num_loops, 1);
+  ASSERT_EQI(g.loops[0].header, 1);
+  ASSERT_EQI(g.loops[0].num_blocks, 1);
+  ASSERT_EQI(g.loops[0].preheader, 0);
+  ASSERT_EQI(g.idom[1], 0);
+  cfg_destroy(&g);
+
+  opt_loops(&p);
+  opt_compact(&p);
+
+  // mov a, 5; mov s, 0; mov t, a; mul t, 7; mov k, 3
+  // loop: add s, t; add s, k; add t, -7; dec_jne loop, a; msg s; end
+  int num_muls = 0, loop_start = -1, mov_k = -1;
+  for (int i = 0; i < p.num_instructions; i++) {
+    instruction* in = &p.instructions[i];
+    if (in->opcode == OPCODE_MUL) num_muls++;
+    if (in->opcode == OPCODE_DEC_JNE) loop_start = in->operands[0].branch_index;
+    if (in->opcode == OPCODE_MOV && in->operands[0].reg_index == 'k' - 'a') mov_k = i;
+  }
+  ASSERT_EQI(num_muls, 1);
+  ASSERT(loop_start != -1);
+  ASSERT(mov_k != -1 && mov_k < loop_start);
+  ASSERT_EQS(program_run(&p), "120");
+
+  // Tested at the bottom: the header comes after the body, the update of i
+  // is before it
+  const char* bottom_code =
+    "  mov i, 5\n"
+    "  jmp pre\n"
+    "body:\n"
+    "  mov t, i\n"
+    "  mul t, 3\n"
+    "  add s, t\n"
+    "  dec i\n"
+    "  jmp cond\n"
+    "pre:\n"
+    "  mov s, 0\n"
+    "cond:\n"
+    "  cmp i, 0\n"
+    "  jg body\n"
+    "  msg s\n"
+    "  end\n";
+
+  program_init_and_build(&p, bottom_code);
+  program_check(&p);
+  ASSERT_EQS(program_run(&p), "45");
+
+  program_init_and_build(&p, bottom_code);
+  program_check(&p);
+  opt_loops(&p);
+  opt_compact(&p);
+  num_muls = 0;
+  for (int i = 0; i < p.num_instructions; i++) num_muls += p.instructions[i].opcode == OPCODE_MUL;
+  ASSERT_EQI(num_muls, 1);
+  ASSERT_EQS(program_run(&p), "45");
+  ASSERT_EQS(interp((char*) bottom_code), "45");
+END_TEST
+
+DEF_TEST(opt_elide_checks)
+  const char* code =
+    "  mov a, 10\n"
+    "  mov s, 0\n"
+    "loop:\n"
+    "  mov t, 100\n"
+    "  div t, a\n"     // a is 1..10 here
+    "  add s, t\n"
+    "  push a\n"       // at most one entry deep
+    "  call f\n"
+    "  pop b\n"
+    "  dec a\n"
+    "  cmp a, 0\n"
+    "  jne loop\n"
+    "  div s, b\n"     // b came from a pop, could be anything
+    "  msg s\n"
+    "  end\n"
+    "f:\n"
+    "  ret\n";
+
+  program p;
+  program_init_and_build(&p, code);
+  p.options.inline_calls = false;
+  program_check(&p);
+  opt_elide_checks(&p);
+
+  instruction* ins = p.instructions;
+  ASSERT_EQI(ins[3].opcode, OPCODE_DIV_NC);
+  ASSERT_EQI(ins[11].opcode, OPCODE_DIV);
+  for (int i = 5; i <= 7; i++) ASSERT(ins[i].flags & INSN_NO_STACK_CHECK);
+  ASSERT(ins[14].flags & INSN_NO_STACK_CHECK);
+  ASSERT_EQS(program_run(&p), "291");
+
+  // A stack of one entry has room for the push, not for the call after it
+  program_init_and_build(&p, code);
+  p.options.stack_size = 1;
+  program_check(&p);
+  opt_elide_checks(&p);
+  ins = p.instructions;
+  ASSERT(ins[5].flags & INSN_NO_STACK_CHECK);
+  ASSERT(!(ins[6].flags & INSN_NO_STACK_CHECK));
+END_TEST
+
+DEF_TEST(opt_cache_registers)
+  const char* code =
+    "  mov a, 100\n"
+    "  mov s, 0\n"
+    "loop:\n"
+    "  add s, a\n"
+    "  mov t, a\n"     // t is dead after the loop
+    "  mul t, 3\n"
+    "  sub s, t\n"
+    "  dec a\n"
+    "  cmp a, 0\n"
+    "  jne loop\n"
+    "  msg s\n"
+    "  mov a, 1\n"     // needs a fifth register, split in two blocks
+    "  mov b, 2\n"
+    "  mov c, 3\n"
+    "  mov d, 4\n"
+    "  mov e, 5\n"
+    "  msg a, b, c, d, e\n"
+    "  end\n";
+
+  program p;
+  program_init_and_build(&p, code);
+  program_check(&p);
+  opt_cache_registers(&p);
+
+  ASSERT_EQI(p.num_reg_blocks, 3);
+  reg_block* loop = &p.reg_blocks[1];
+  ASSERT_EQI(loop->start, 2);
+  ASSERT_EQI(loop->end, 9);
+  ASSERT_EQI(loop->target, 2);
+  ASSERT_EQI(loop->branch, OPCODE_JNE);
+  // s and a are read first, t is only written
+  ASSERT_EQI(loop->regs[0], 's' - 'a');
+  ASSERT_EQI(loop->regs[1], 0);
+  ASSERT_EQI(loop->regs[2], 't' - 'a');
+  ASSERT_EQI(loop->load, 3);
+  ASSERT_EQI(loop->store, 3);
+  ASSERT_EQI(p.reg_blocks[2].end - p.reg_blocks[2].start, 4);
+  ASSERT_EQS(program_run(&p), "12345");
+END_TEST
+
+void opt_suite() {
+  SUITE_INIT(opt)
+    ADD_TEST(opt_fold_constants);
+    ADD_TEST(opt_dead_code);
+    ADD_TEST(opt_inline_calls);
+    ADD_TEST(opt_tail_calls);
+    ADD_TEST(opt_loops);
+    ADD_TEST(opt_keeps_errors);
+    ADD_TEST(opt_elide_checks);
+    ADD_TEST(opt_cache_registers);
+  SUITE_RUN
+}
+
 void interp_suite() {
   SUITE_INIT(interp)
     //REPORT_ONLY_FAILS();
@@ -757,6 +1973,23 @@ void interp_suite() {
     ADD_TEST(interp_run);
     ADD_TEST(interp_test_branch_insns);
     ADD_TEST(interp_errors);
+    ADD_TEST(interp_heap);
+    ADD_TEST(interp_heap_errors);
+    ADD_TEST(interp_stack_errors);
+    ADD_TEST(interp_deep_recursion);
+    ADD_TEST(interp_enter_leave);
+    ADD_TEST(interp_msg);
+    ADD_TEST(interp_string_pool);
+    ADD_TEST(interp_gen_c);
+    ADD_TEST(interp_aot);
+    ADD_TEST(interp_timing);
+    ADD_TEST(interp_timing_counters);
+    ADD_TEST(interp_profile);
+    ADD_TEST(interp_profile_calls);
+    ADD_TEST(interp_profile_recursive);
+    ADD_TEST(interp_sample_folded);
+    ADD_TEST(interp_trace);
+    ADD_TEST(interp_record_replay);
   SUITE_RUN
 }
 
@@ -766,6 +1999,7 @@ void lexer_suite(){
     ADD_TEST(lexer_eof);
     ADD_TEST(lexer_peek_next);
     ADD_TEST(lexer_int_token);
+    ADD_TEST(lexer_int_limits);
     ADD_TEST(lexer_str_token);
     ADD_TEST(lexer_misc_token);
     ADD_TEST(lexer_multiple);
@@ -791,6 +2025,8 @@ void run_tests() {
   lexer_suite();
   parser_suite();
   interp_suite();
+  cfg_suite();
+  opt_suite();
 }
 
 int main(void) {
@@ -0,0 +1,202 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+// Phase timing (--time).
+//
+// PERF_START(name)/PERF_STOP(name) (see pch.h) add the time between them to
+// the phase 'name'. Nothing is measured unless timing.enabled is set, then
+// it's a clock read on each side: clock_gettime(CLOCK_MONOTONIC), or
+// QueryPerformanceCounter on Windows.
+//
+// The totals are written in one go, as JSON (one object per line) or CSV
+// (one row per phase), so the results of a batch of runs can be appended
+// to the same file and aggregated later.
+//
+// With timing.counters set (see perfctr.h) each phase also adds up the
+// hardware counters, a read() per counter on each side.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef INC_WINDOWS
+  #include <windows.h>
+#else
+  #include <time.h>
+#endif
+
+#include "perfctr.h"
+
+#define TIMING_MAX_PHASES 32
+
+typedef enum timing_format {
+  TIMING_JSON,
+  TIMING_CSV,
+} timing_format;
+
+typedef struct timing_phase {
+  const char* name;
+  uint64_t ns;    // total
+  uint64_t count; // times it ran
+  perfctr_values counters; // total, if timing.counters
+} timing_phase;
+
+typedef struct timing_state {
+  bool enabled;
+  bool counters; // perfctr_open worked
+  timing_phase phases[TIMING_MAX_PHASES]; // in the order they first ran
+  int num_phases;
+
+  // Where timing_enable sends the results when the program exits
+  timing_format format;
+  const char* path; // NULL = stderr
+  const char* label; // e.g. the program being run, NULL for none
+} timing_state;
+
+static timing_state timing;
+
+static inline uint64_t timing_now_ns(void) {
+#ifdef INC_WINDOWS
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER now;
+  if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&now);
+  return (uint64_t) ((double) now.QuadPart * 1e9 / (double) frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+// The phase 'name', NULL if it didn't run
+static timing_phase* timing_find(const char* name) {
+  for (int i = 0; i < timing.num_phases; i++) {
+    if (strcmp(timing.phases[i].name, name) == 0) return &timing.phases[i];
+  }
+  return NULL;
+}
+
+// 'counters' is NULL unless timing.counters
+static void timing_add(const char* name, uint64_t ns, const perfctr_values* counters) {
+  timing_phase* phase = timing_find(name);
+  if (!phase) {
+    if (timing.num_phases == TIMING_MAX_PHASES) return;
+    phase = &timing.phases[timing.num_phases++];
+    phase->name = name;
+    phase->ns = 0;
+    phase->count = 0;
+    memset(&phase->counters, 0, sizeof(phase->counters));
+  }
+  phase->ns += ns;
+  phase->count++;
+  if (counters) perfctr_add(&phase->counters, *counters);
+}
+
+void timing_reset(void) {
+  timing.num_phases = 0;
+}
+
+static void timing_write_json_string(FILE* out, const char* str) {
+  fputc('"', out);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\') fputc('\\', out);
+    if ((unsigned char) *str < 0x20) fprintf(out, "\\u%04x", *str);
+    else fputc(*str, out);
+  }
+  fputc('"', out);
+}
+
+static void timing_write_csv_string(FILE* out, const char* str) {
+  fputc('"', out);
+  for (; *str; str++) {
+    if (*str == '"') fputc('"', out);
+    fputc(*str, out);
+  }
+  fputc('"', out);
+}
+
+// JSON:  {"label":"fib.asm","phases":[{"name":"lex","ns":1200,"count":1},...]}
+// CSV:   label,phase,ns,count (the header only if 'header' is set)
+//
+// With counters, the JSON phases get e.g. "cycles":123 for each available
+// counter and the CSV a column for each counter, empty if not available.
+void timing_write(FILE* out, timing_format format, const char* label, bool header) {
+  if (!label) label = "";
+
+  if (format == TIMING_JSON) {
+    fprintf(out, "{\"label\":");
+    timing_write_json_string(out, label);
+    fprintf(out, ",\"phases\":[");
+    for (int i = 0; i < timing.num_phases; i++) {
+      timing_phase* phase = &timing.phases[i];
+      fprintf(out, "%s{\"name\":\"%s\",\"ns\":%llu,\"count\":%llu", i ? "," : "",
+        phase->name, (unsigned long long) phase->ns, (unsigned long long) phase->count);
+      for (int c = 0; timing.counters && c < PERFCTR_NUM; c++) {
+        if (!perfctr_has((perfctr_kind) c)) continue;
+        fprintf(out, ",\"%s\":%llu", perfctr_names[c], (unsigned long long) phase->counters.v[c]);
+      }
+      fprintf(out, "}");
+    }
+    fprintf(out, "]}\n");
+  } else {
+    if (header) {
+      fprintf(out, "label,phase,ns,count");
+      for (int c = 0; timing.counters && c < PERFCTR_NUM; c++) fprintf(out, ",%s", perfctr_names[c]);
+      fprintf(out, "\n");
+    }
+    for (int i = 0; i < timing.num_phases; i++) {
+      timing_phase* phase = &timing.phases[i];
+      timing_write_csv_string(out, label);
+      fprintf(out, ",%s,%llu,%llu",
+        phase->name, (unsigned long long) phase->ns, (unsigned long long) phase->count);
+      for (int c = 0; timing.counters && c < PERFCTR_NUM; c++) {
+        if (perfctr_has((perfctr_kind) c)) {
+          fprintf(out, ",%llu", (unsigned long long) phase->counters.v[c]);
+        } else {
+          fprintf(out, ",");
+        }
+      }
+      fprintf(out, "\n");
+    }
+  }
+}
+
+static void timing_write_at_exit(void) {
+  if (!timing.path) {
+    fflush(stdout); // after what the program printed
+    timing_write(stderr, timing.format, timing.label, true);
+    return;
+  }
+
+  FILE* out = fopen(timing.path, "ab");
+  if (!out) {
+    fprintf(stderr, "failed to open file %s\n", timing.path);
+    return;
+  }
+  // Appending to a batch: the CSV header goes only at the top
+  fseek(out, 0, SEEK_END);
+  bool is_empty = ftell(out) == 0;
+  timing_write(out, timing.format, timing.label, is_empty);
+  fclose(out);
+}
+
+// Starts measuring, the results are written to 'path' (appended, NULL for
+// stderr) when the process exits, also when it exits with an error.
+void timing_enable(timing_format format, const char* path, const char* label) {
+  if (!timing.enabled) atexit(timing_write_at_exit);
+  timing.enabled = true;
+  timing.format = format;
+  timing.path = path;
+  timing.label = label;
+}
+
+// Adds the hardware counters to the phases, if they can be opened
+void timing_enable_counters(void) {
+  timing.counters = perfctr_open();
+}
+
+
+#endif // __TIMING_H__
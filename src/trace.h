@@ -0,0 +1,184 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Binary execution trace (--trace).
+//
+// A file mapped with mmap: a trace_header and then a ring of 'capacity'
+// trace_records, one per instruction executed: its index, its opcode and
+// the value its destination register got (or the comparison, for cmp).
+// Only the last 'capacity' instructions are kept. header.head counts the
+// records ever written, so the newest one is at (head - 1) % capacity.
+//
+// There's one writer (vm_exec_traced), and since the mapping is shared the
+// file is complete even if the process dies: the record is written and then
+// head is stored (release). A reader loads head (acquire), copies what it
+// wants and loads head again, what was overwritten in between is dropped.
+// The value of the newest record is only set when the next one starts (or
+// the run ends), so after a crash it's 0.
+//
+// The records are decoded against the program they came from (see
+// program_code_hash and --decode-trace in main.c).
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef INC_WINDOWS
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+#define TRACE_MAGIC "ASMTRACE"
+#define TRACE_VERSION 1
+#define TRACE_DEFAULT_RECORDS (1 << 20) // 16MB
+
+// trace_record.reg when it isn't a register
+#define TRACE_REG_CMP 0xfe  // value is the comparison
+#define TRACE_REG_NONE 0xff // no value
+
+typedef struct trace_record {
+  uint32_t pc;
+  uint8_t opcode;
+  uint8_t reg;
+  uint16_t reserved;
+  int64_t value;
+} trace_record;
+
+typedef struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  uint64_t capacity; // records, a power of 2
+  uint64_t head; // records written
+  uint64_t program_hash;
+  // What the program was optimized with, to rebuild the same instructions
+  int32_t opt_level;
+  int32_t inline_calls;
+  uint8_t reserved[16];
+} trace_header;
+
+typedef struct trace_ring {
+  trace_header* header;
+  trace_record* records;
+  uint64_t mask; // capacity - 1
+  size_t map_size;
+} trace_ring;
+
+#ifndef INC_WINDOWS
+
+static bool trace_map(trace_ring* ring, int fd, size_t size, bool writable) {
+  void* map = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+  ring->header = (trace_header*) map;
+  ring->records = (trace_record*) (ring->header + 1);
+  ring->map_size = size;
+  return true;
+}
+
+void trace_close(trace_ring* ring) {
+  if (ring->header) munmap(ring->header, ring->map_size);
+  ring->header = NULL;
+  ring->records = NULL;
+}
+
+// Creates (or truncates) 'path' for 'capacity' records, rounded up to a
+// power of 2
+bool trace_create(trace_ring* ring, const char* path, uint64_t capacity) {
+  uint64_t cap = 1;
+  while (cap < capacity) cap *= 2;
+  size_t size = sizeof(trace_header) + cap * sizeof(trace_record);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  if (ftruncate(fd, (off_t) size) != 0) {
+    close(fd);
+    return false;
+  }
+  if (!trace_map(ring, fd, size, true)) return false;
+
+  trace_header* h = ring->header;
+  memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+  h->version = TRACE_VERSION;
+  h->record_size = sizeof(trace_record);
+  h->capacity = cap;
+  h->head = 0;
+  ring->mask = cap - 1;
+  return true;
+}
+
+// Maps an existing trace to read it. NULL if it worked, what's wrong if not.
+const char* trace_open(trace_ring* ring, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return "can't open the file";
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size < (off_t) sizeof(trace_header)) {
+    close(fd);
+    return "not a trace";
+  }
+  if (!trace_map(ring, fd, (size_t) size, false)) return "can't map the file";
+
+  trace_header* h = ring->header;
+  const char* error = NULL;
+  if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0) {
+    error = "not a trace";
+  } else if (h->version != TRACE_VERSION || h->record_size != sizeof(trace_record)) {
+    error = "unsupported trace version";
+  } else if (h->capacity == 0 || (h->capacity & (h->capacity - 1)) != 0 ||
+      sizeof(trace_header) + h->capacity * sizeof(trace_record) > (uint64_t) size) {
+    error = "truncated trace";
+  }
+  if (error) {
+    trace_close(ring);
+    return error;
+  }
+  ring->mask = h->capacity - 1;
+  return NULL;
+}
+
+#else
+
+bool trace_create(trace_ring* ring, const char* path, uint64_t capacity) {
+  (void) ring; (void) path; (void) capacity;
+  return false;
+}
+
+const char* trace_open(trace_ring* ring, const char* path) {
+  (void) ring; (void) path;
+  return "not supported on this platform";
+}
+
+void trace_close(trace_ring* ring) {
+  (void) ring;
+}
+
+#endif // INC_WINDOWS
+
+// Copies the newest records, up to 'max' (0 = all there are), oldest first.
+// Returns how many, '*first' is the number of the first one (from 0 at the
+// start of the trace).
+uint64_t trace_read(trace_ring* ring, trace_record* out, uint64_t max, uint64_t* first) {
+  uint64_t cap = ring->header->capacity;
+  uint64_t head = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+  uint64_t n = head < cap ? head : cap;
+  if (max && max < n) n = max;
+  uint64_t from = head - n;
+
+  for (uint64_t i = 0; i < n; i++) out[i] = ring->records[(from + i) & ring->mask];
+
+  // The writer may have gone around meanwhile, and be writing record 'now'
+  uint64_t now = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+  uint64_t lost = 0;
+  if (now != head) {
+    uint64_t oldest_intact = now + 1 > cap ? now + 1 - cap : 0;
+    lost = oldest_intact > from ? oldest_intact - from : 0;
+    if (lost > n) lost = n;
+  }
+  if (lost) memmove(out, out + lost, (n - lost) * sizeof(trace_record));
+  *first = from + lost;
+  return n - lost;
+}
+
+#endif // __TRACE_H__
@@ -0,0 +1,84 @@
+#ifndef __VMEM_H__
+#define __VMEM_H__
+
+// Thin wrapper around the OS virtual memory API.
+// Used to get big zeroed regions for the guest (heap, stacks) that can be
+// released all at once, without going through malloc.
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "pch.h"
+
+#ifndef INC_WINDOWS
+  #include <sys/mman.h>
+  #include <unistd.h>
+#endif
+
+static size_t vmem_page_size() {
+  static size_t page_size = 0;
+  if (page_size == 0) {
+#ifdef INC_WINDOWS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    page_size = info.dwPageSize;
+#else
+    page_size = (size_t) sysconf(_SC_PAGESIZE);
+#endif
+  }
+  return page_size;
+}
+
+static size_t vmem_round_to_page(size_t size) {
+  size_t page = vmem_page_size();
+  return (size + page - 1) & ~(page - 1);
+}
+
+// Returns a zeroed, read/write region of 'size' bytes or NULL.
+// On linux the pages are only backed by memory when they are touched.
+static void* vmem_alloc(size_t size) {
+#ifdef INC_WINDOWS
+  return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return mem == MAP_FAILED ? NULL : mem;
+#endif
+}
+
+static void vmem_free(void* mem, size_t size) {
+  if (!mem) return;
+#ifdef INC_WINDOWS
+  (void) size;
+  VirtualFree(mem, 0, MEM_RELEASE);
+#else
+  munmap(mem, size);
+#endif
+}
+
+// Makes the pages in the range inaccessible, any access will fault.
+static bool vmem_protect_none(void* addr, size_t size) {
+#ifdef INC_WINDOWS
+  DWORD old;
+  return VirtualProtect(addr, size, PAGE_NOACCESS, &old) != 0;
+#else
+  return mprotect(addr, size, PROT_NONE) == 0;
+#endif
+}
+
+// Sets vec[i] to whether page i of the range is backed by memory (pages
+// that were never touched aren't), without touching them. Returns false
+// if it can't tell.
+static bool vmem_resident(void* addr, size_t size, unsigned char* vec) {
+#ifdef INC_WINDOWS
+  (void) addr; (void) size; (void) vec;
+  return false;
+#else
+  if (mincore(addr, size, vec) != 0) return false;
+  size_t n = (size + vmem_page_size() - 1) / vmem_page_size();
+  for (size_t i = 0; i < n; i++) vec[i] &= 1;
+  return true;
+#endif
+}
+
+#endif // __VMEM_H__